@@ -0,0 +1,1317 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Benchmark of the stack using two IpStack instances connected with an in-memory
+// Ethernet link (see mem_iface.h). The stacks run either in the same event loop or
+// each in its own event loop and thread. The benchmark reports bulk TCP throughput,
+// TCP request/response latency percentiles, TCP connection setup rate and UDP
+// packet rate. The link can emulate delay, loss, duplication, reordering and a
+// rate-limited bottleneck in both directions (see netem_link.h).
+//
+// With --shm=1 (Linux only), the server stack instead runs in a child process
+// and the stacks are connected through a shared memory ring link (see
+// ShmRingDeviceLinux), with link_slots slots in each direction. The link is not
+// emulated and the options of the in-memory link do not apply.
+//
+// With --loopback=1, the client and the server instead use the same IP stack and
+// communicate over 127.0.0.1 through an IpLoopbackIface, with the default
+// loopback MTU. The options of the link do not apply.
+//
+// Parameters are given as --name=value arguments, see the Config structure.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+
+#if defined(__linux__)
+#include <csignal>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#endif
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/HostedPlatformImpl.h>
+#include <aipstack/event_loop/EventLoop.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/ip/IpLoopbackIface.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/udp/IpUdpProto.h>
+#include <aipstack/eth/EthIpIface.h>
+
+#if defined(__linux__)
+#include <aipstack/shm/linux/ShmRingDeviceLinux.h>
+#endif
+
+#include "mem_iface.h"
+#include "netem_link.h"
+#if defined(__linux__)
+#include "host_iface.h"
+#endif
+
+// CONFIGURATION
+
+using IndexService = AIpStack::AvlTreeIndexService;
+
+using MyIpStackService = AIpStack::IpStackService<
+    AIpStack::IpStackOptions::HeaderBeforeIp::Is<AIpStack::EthHeader::Size>,
+    AIpStack::IpStackOptions::PathMtuCacheService::Is<
+        AIpStack::IpPathMtuCacheService<
+            AIpStack::IpPathMtuCacheOptions::NumMtuEntries::Is<16>,
+            AIpStack::IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    AIpStack::IpStackOptions::ReassemblyService::Is<
+        AIpStack::IpReassemblyService<
+            AIpStack::IpReassemblyOptions::MaxReassEntrys::Is<16>,
+            AIpStack::IpReassemblyOptions::MaxReassSize::Is<60000>
+        >
+    >,
+    AIpStack::IpStackOptions::RxCoalesceFlows::Is<8>
+>;
+
+// Maximum number of TCP PCBs in each stack, this limits --conns.
+static int const NumTcpPcbs = 1024;
+
+using ProtocolServicesList = AIpStack::MakeTypeList<
+    AIpStack::IpTcpProtoService<
+        AIpStack::IpTcpProtoOptions::NumTcpPcbs::Is<NumTcpPcbs>,
+        AIpStack::IpTcpProtoOptions::PcbIndexService::Is<IndexService>
+    >,
+    AIpStack::IpUdpProtoService<
+        AIpStack::IpUdpProtoOptions::UdpIndexService::Is<IndexService>
+    >
+>;
+
+using MyEthIpIfaceService = AIpStack::EthIpIfaceService<
+    AIpStack::EthIpIfaceOptions::NumArpEntries::Is<4>,
+    AIpStack::EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    AIpStack::EthIpIfaceOptions::HeaderBeforeEth::Is<0>,
+    AIpStack::EthIpIfaceOptions::TimersStructureService::Is<
+        AIpStack::LinkedHeapService
+    >
+>;
+
+static AIpStack::Ip4Addr const ClientIpAddr = AIpStack::Ip4Addr::FromBytes(10, 0, 0, 1);
+static AIpStack::Ip4Addr const ServerIpAddr = AIpStack::Ip4Addr::FromBytes(10, 0, 0, 2);
+static uint8_t const PrefixLength = 24;
+static AIpStack::Ip4Addr const LoopbackIpAddr = AIpStack::Ip4Addr::FromBytes(127, 0, 0, 1);
+static AIpStack::MacAddr const ClientMacAddr =
+    AIpStack::MacAddr::Make(0x02, 0x00, 0x00, 0x00, 0x00, 0x01);
+static AIpStack::MacAddr const ServerMacAddr =
+    AIpStack::MacAddr::Make(0x02, 0x00, 0x00, 0x00, 0x00, 0x02);
+
+static uint16_t const SinkPort = 5001;
+static uint16_t const EchoPort = 5002;
+static uint16_t const UdpServerPort = 5003;
+static uint16_t const UdpClientPort = 5004;
+
+// CONFIGURATION - END
+
+using PlatformImpl = AIpStack::HostedPlatformImpl;
+using PlatformRef = AIpStack::PlatformRef<PlatformImpl>;
+using Platform = AIpStack::PlatformFacade<PlatformImpl>;
+
+class IpStackArg : public MyIpStackService::template Compose<
+    PlatformImpl, ProtocolServicesList> {};
+using MyIpStack = AIpStack::IpStack<IpStackArg>;
+
+using MyLoopbackIface = AIpStack::IpLoopbackIface<IpStackArg>;
+
+// Enough for the TCP send buffers with maximum-size packets.
+static std::size_t const LoopbackRingSize = 4 * (MyLoopbackIface::RingOverhead + 65535);
+
+using MyMemIface = AIpStackExamples::MemIface<
+    IpStackArg, MyEthIpIfaceService, AIpStackExamples::NetemLink>;
+
+#if defined(__linux__)
+using MyShmIface = AIpStackExamples::HostIface<
+    IpStackArg, MyEthIpIfaceService, AIpStack::ShmRingDeviceLinux>;
+#endif
+
+using TcpArg = MyIpStack::GetProtoArg<AIpStack::TcpApi>;
+using TcpListener = AIpStack::TcpListener<TcpArg>;
+using TcpConnection = AIpStack::TcpConnection<TcpArg>;
+
+using UdpArg = MyIpStack::GetProtoArg<AIpStack::UdpApi>;
+using UdpApi = AIpStack::UdpApi<UdpArg>;
+using UdpListener = AIpStack::UdpListener<UdpArg>;
+
+using Clock = std::chrono::steady_clock;
+
+struct Config {
+    bool threads = false;        // run the two stacks in separate threads
+    bool shm = false;            // run the server in a process linked by shared memory
+    bool loopback = false;       // run the client and server in one stack over loopback
+    std::size_t mtu = 1500;      // IP MTU of the link (MSS is 40 less)
+    std::size_t link_slots = 256; // frames queued in each direction of the link
+    std::size_t buf = 65536;     // TCP send/receive buffer size
+    std::uint64_t bulk_bytes = 256 * 1024 * 1024; // bytes sent in the bulk test
+    int bulk_conns = 1;          // parallel connections in the bulk test
+    int rr_count = 20000;        // request/response transactions
+    std::size_t rr_size = 64;    // request and response size
+    int setup_count = 5000;      // connections made in the setup test
+    int setup_conns = 16;        // parallel connections in the setup test
+    int udp_count = 500000;      // datagrams sent in the UDP test
+    std::size_t udp_size = 64;   // UDP payload size
+    std::size_t udp_batch = 0;   // datagrams per sendUdpIp4Batch call (0=no batching)
+    std::size_t udp_gso = 0;     // datagrams per sendUdpIp4Segmented call (0=no GSO)
+    bool rx_batch = false;       // receive frames in batches (TCP receive coalescing)
+    bool chksum_offload = false; // TCP/UDP transmit checksum offload on the link
+    std::size_t tx_queue = 0;    // size of the transmit queue in front of the link (0=none)
+    int timeout = 300;           // overall timeout in seconds
+    // Link emulation, applied in each direction (see NetemParams).
+    std::uint64_t seed = 1;
+    std::uint64_t delay_us = 0;
+    std::uint64_t jitter_us = 0;
+    int delay_dist = 0;          // 0=uniform, 1=normal, 2=pareto
+    double loss = 0.0;
+    double loss_enter_bad = 0.0;
+    double loss_exit_bad = 1.0;
+    double loss_in_bad = 1.0;
+    double duplicate = 0.0;
+    double reorder = 0.0;
+    std::uint64_t rate_kbps = 0;
+    std::size_t queue_limit = 100;
+    // Addresses used by the client, not parsed (both are 127.0.0.1 for loopback).
+    AIpStack::Ip4Addr client_addr = ClientIpAddr;
+    AIpStack::Ip4Addr server_addr = ServerIpAddr;
+};
+
+static bool parseArg (char const *arg, Config &cfg)
+{
+    char const *eq = std::strchr(arg, '=');
+    if (std::strncmp(arg, "--", 2) != 0 || eq == nullptr) {
+        return false;
+    }
+    std::string name(arg + 2, eq);
+    char const *val_str = eq + 1;
+    char *end;
+    double dval = std::strtod(val_str, &end);
+    if (*val_str == '\0' || *end != '\0' || dval < 0.0) {
+        return false;
+    }
+    auto val = static_cast<unsigned long long>(dval);
+    
+    if (name == "threads") {
+        cfg.threads = (val != 0);
+    } else if (name == "shm") {
+        cfg.shm = (val != 0);
+    } else if (name == "loopback") {
+        cfg.loopback = (val != 0);
+    } else if (name == "mtu") {
+        cfg.mtu = std::size_t(val);
+    } else if (name == "link-slots") {
+        cfg.link_slots = std::size_t(val);
+    } else if (name == "buf") {
+        cfg.buf = std::size_t(val);
+    } else if (name == "bulk-bytes") {
+        cfg.bulk_bytes = val;
+    } else if (name == "bulk-conns") {
+        cfg.bulk_conns = int(val);
+    } else if (name == "rr-count") {
+        cfg.rr_count = int(val);
+    } else if (name == "rr-size") {
+        cfg.rr_size = std::size_t(val);
+    } else if (name == "setup-count") {
+        cfg.setup_count = int(val);
+    } else if (name == "setup-conns") {
+        cfg.setup_conns = int(val);
+    } else if (name == "udp-count") {
+        cfg.udp_count = int(val);
+    } else if (name == "udp-size") {
+        cfg.udp_size = std::size_t(val);
+    } else if (name == "udp-batch") {
+        cfg.udp_batch = std::size_t(val);
+    } else if (name == "udp-gso") {
+        cfg.udp_gso = std::size_t(val);
+    } else if (name == "rx-batch") {
+        cfg.rx_batch = (val != 0);
+    } else if (name == "chksum-offload") {
+        cfg.chksum_offload = (val != 0);
+    } else if (name == "tx-queue") {
+        cfg.tx_queue = std::size_t(val);
+    } else if (name == "timeout") {
+        cfg.timeout = int(val);
+    } else if (name == "seed") {
+        cfg.seed = val;
+    } else if (name == "delay-us") {
+        cfg.delay_us = val;
+    } else if (name == "jitter-us") {
+        cfg.jitter_us = val;
+    } else if (name == "delay-dist") {
+        cfg.delay_dist = int(val);
+    } else if (name == "loss") {
+        cfg.loss = dval;
+    } else if (name == "loss-enter-bad") {
+        cfg.loss_enter_bad = dval;
+    } else if (name == "loss-exit-bad") {
+        cfg.loss_exit_bad = dval;
+    } else if (name == "loss-in-bad") {
+        cfg.loss_in_bad = dval;
+    } else if (name == "duplicate") {
+        cfg.duplicate = dval;
+    } else if (name == "reorder") {
+        cfg.reorder = dval;
+    } else if (name == "rate-kbps") {
+        cfg.rate_kbps = val;
+    } else if (name == "queue-limit") {
+        cfg.queue_limit = std::size_t(val);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static double secondsSince (Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Base class for benchmark connections. The owner keeps connections in a map and
+// they destroy themselves by removing themselves from the map.
+class BenchConnection :
+    protected TcpConnection,
+    private AIpStack::NonCopyable<BenchConnection>
+{
+public:
+    using ConnectionMap =
+        std::unordered_map<BenchConnection *, std::unique_ptr<BenchConnection>>;
+
+    BenchConnection (ConnectionMap *map, std::size_t buf_size) :
+        m_map(map),
+        m_buf_size(buf_size),
+        m_rx_buf(new char[buf_size]),
+        m_tx_buf(new char[buf_size]),
+        m_rx_node{m_rx_buf.get(), buf_size, &m_rx_node},
+        m_tx_node{m_tx_buf.get(), buf_size, &m_tx_node}
+    {
+        std::memset(m_tx_buf.get(), 'x', buf_size);
+    }
+
+    virtual ~BenchConnection () {}
+
+    static void add (ConnectionMap *map, std::unique_ptr<BenchConnection> con)
+    {
+        BenchConnection *ptr = &*con;
+        map->insert(std::make_pair(ptr, std::move(con)));
+    }
+
+protected:
+    // Set up ring buffers after the connection has been started or accepted. If
+    // shared is true, the receive ring is also used for sending.
+    void setupBuffers (bool shared = false)
+    {
+        TcpConnection::setProportionalWindowUpdateThreshold(m_buf_size, 8);
+        TcpConnection::setRecvBuf({&m_rx_node, 0, m_buf_size});
+        TcpConnection::setSendBuf({shared ? &m_rx_node : &m_tx_node, 0, 0});
+    }
+
+    void destroy ()
+    {
+        TcpConnection::reset();
+        std::size_t removed = m_map->erase(this);
+        AIPSTACK_ASSERT(removed == 1)
+        (void)removed;
+    }
+
+    void connectionAborted () override
+    {
+        return destroy();
+    }
+
+    std::size_t bufSize () const
+    {
+        return m_buf_size;
+    }
+
+private:
+    ConnectionMap *m_map;
+    std::size_t m_buf_size;
+    std::unique_ptr<char[]> m_rx_buf;
+    std::unique_ptr<char[]> m_tx_buf;
+    AIpStack::IpBufNode m_rx_node;
+    AIpStack::IpBufNode m_tx_node;
+};
+
+// The server side, running on one stack. It accepts connections on the sink port
+// (received data is discarded) and on the echo port (received data is sent back),
+// and counts UDP datagrams, replying with the count to an end marker.
+class BenchServer :
+    private AIpStack::NonCopyable<BenchServer>
+{
+public:
+    BenchServer (MyIpStack *stack, Config const &cfg) :
+        m_stack(stack),
+        m_cfg(cfg),
+        m_sink_listener(AIPSTACK_BIND_MEMBER_TN(&BenchServer::sinkEstablished, this)),
+        m_echo_listener(AIPSTACK_BIND_MEMBER_TN(&BenchServer::echoEstablished, this)),
+        m_udp_listener(AIPSTACK_BIND_MEMBER_TN(&BenchServer::udpReceived, this)),
+        m_udp_count(0)
+    {
+        startListening(m_sink_listener, SinkPort);
+        startListening(m_echo_listener, EchoPort);
+
+        AIpStack::UdpListenParams<UdpArg> udp_params;
+        udp_params.port = UdpServerPort;
+        m_udp_listener.startListening(udp(), udp_params);
+    }
+
+private:
+    class ServerConnection : public BenchConnection
+    {
+    public:
+        ServerConnection (ConnectionMap *map, std::size_t buf_size,
+                          TcpListener &listener, bool echo) :
+            BenchConnection(map, buf_size),
+            m_echo(echo)
+        {
+            if (TcpConnection::acceptConnection(listener) != AIpStack::IpErr::SUCCESS) {
+                throw std::runtime_error("acceptConnection failed");
+            }
+            // Like the echo client in the example application, the echo server uses
+            // the same ring buffer for receiving and sending.
+            setupBuffers(m_echo);
+        }
+
+    private:
+        void dataReceived (std::size_t amount) override final
+        {
+            if (amount == 0) {
+                TcpConnection::closeSending();
+            }
+            else if (m_echo) {
+                TcpConnection::extendSendBuf(amount);
+                TcpConnection::sendPush();
+            }
+            else {
+                TcpConnection::extendRecvBuf(amount);
+            }
+        }
+
+        void dataSent (std::size_t amount) override final
+        {
+            if (amount == 0) {
+                if (TcpConnection::wasEndReceived()) {
+                    return destroy();
+                }
+            }
+            else if (m_echo) {
+                TcpConnection::extendRecvBuf(amount);
+            }
+        }
+
+    private:
+        bool m_echo;
+    };
+
+    AIpStack::TcpApi<TcpArg> & tcp () const
+    {
+        return m_stack->template getProtoApi<AIpStack::TcpApi>();
+    }
+
+    UdpApi & udp () const
+    {
+        return m_stack->template getProtoApi<AIpStack::UdpApi>();
+    }
+
+    void startListening (TcpListener &listener, uint16_t port)
+    {
+        if (!listener.startListening(tcp(), {
+            /*addr=*/ AIpStack::Ip4Addr::ZeroAddr(),
+            /*port=*/ port,
+            /*max_pcbs=*/ NumTcpPcbs
+        })) {
+            throw std::runtime_error("BenchServer: startListening failed.");
+        }
+        listener.setInitialReceiveWindow(m_cfg.buf);
+    }
+
+    void sinkEstablished ()
+    {
+        BenchConnection::add(&m_connections, std::make_unique<ServerConnection>(
+            &m_connections, m_cfg.buf, m_sink_listener, false));
+    }
+
+    void echoEstablished ()
+    {
+        BenchConnection::add(&m_connections, std::make_unique<ServerConnection>(
+            &m_connections, m_cfg.buf, m_echo_listener, true));
+    }
+
+    AIpStack::UdpRecvResult udpReceived (
+        AIpStack::IpRxInfoIp4<IpStackArg> const &ip_info,
+        AIpStack::UdpRxInfo<UdpArg> const &udp_info, AIpStack::IpBufRef udp_data)
+    {
+        if (udp_data.tot_len == 0 || udp_data.getChunkPtr()[0] != 'E') {
+            m_udp_count++;
+            return AIpStack::UdpRecvResult::AcceptStop;
+        }
+
+        // End marker, reply with the number of datagrams received. The client
+        // retransmits the end marker until it gets a reply.
+        char buf[UdpApi::HeaderBeforeUdpData + 4];
+        AIpStack::WriteBinaryInt<std::uint32_t, AIpStack::BinaryBigEndian>(
+            m_udp_count, buf + UdpApi::HeaderBeforeUdpData);
+        AIpStack::IpBufNode node{buf, sizeof(buf), nullptr};
+        AIpStack::IpBufRef data{&node, UdpApi::HeaderBeforeUdpData, 4};
+
+        udp().sendUdpIp4Packet({ip_info.dst_addr, ip_info.src_addr},
+            {UdpServerPort, udp_info.src_port}, data, ip_info.iface, nullptr,
+            AIpStack::IpSendFlags());
+
+        return AIpStack::UdpRecvResult::AcceptStop;
+    }
+
+private:
+    MyIpStack *m_stack;
+    Config const &m_cfg;
+    TcpListener m_sink_listener;
+    TcpListener m_echo_listener;
+    UdpListener m_udp_listener;
+    std::uint32_t m_udp_count;
+    BenchConnection::ConnectionMap m_connections;
+};
+
+// The client side, running on the other stack. It runs the tests one after another
+// and calls the done handler at the end.
+class BenchClient :
+    private AIpStack::NonCopyable<BenchClient>
+{
+public:
+    using DoneHandler = AIpStack::Function<void()>;
+
+    BenchClient (MyIpStack *stack, AIpStack::EventLoop &loop, Config const &cfg,
+                 DoneHandler done_handler) :
+        m_stack(stack),
+        m_cfg(cfg),
+        m_done_handler(done_handler),
+        m_udp_listener(AIPSTACK_BIND_MEMBER_TN(&BenchClient::udpReceived, this)),
+        m_udp_timer(loop, AIPSTACK_BIND_MEMBER_TN(&BenchClient::udpTimerHandler, this)),
+        m_start_timer(loop, AIPSTACK_BIND_MEMBER_TN(&BenchClient::startBulk, this)),
+        m_udp_retry(*this),
+        m_udp_buf(UdpApi::HeaderBeforeUdpData + cfg.udp_size)
+    {
+        AIpStack::UdpListenParams<UdpArg> udp_params;
+        udp_params.port = UdpClientPort;
+        m_udp_listener.startListening(udp(), udp_params);
+
+        // Start the tests from the event loop.
+        m_start_timer.setAfter(AIpStack::EventLoopDuration::zero());
+    }
+
+private:
+    static constexpr std::chrono::milliseconds UdpEndRetryInterval{100};
+    static constexpr std::chrono::milliseconds UdpFullRetryInterval{10};
+
+    // Resumes sending datagrams when the link queue has space again.
+    class UdpRetryRequest final : public AIpStack::IpSendRetryRequest
+    {
+    public:
+        explicit UdpRetryRequest (BenchClient &client) : m_client(client) {}
+
+    private:
+        void retrySending () override
+        {
+            m_client.m_udp_timer.setAfter(AIpStack::EventLoopDuration::zero());
+        }
+
+        BenchClient &m_client;
+    };
+
+    enum class ConnType {Bulk, Rr, Setup};
+
+    class ClientConnection : public BenchConnection
+    {
+    public:
+        ClientConnection (BenchClient *client, ConnType type, uint16_t port,
+                          std::uint64_t bulk_bytes = 0) :
+            BenchConnection(&client->m_connections, client->m_cfg.buf),
+            m_client(client),
+            m_type(type),
+            m_bulk_remaining(bulk_bytes),
+            m_rr_received(0)
+        {
+            AIpStack::TcpStartConnectionArgs<TcpArg> args;
+            args.addr = client->m_cfg.server_addr;
+            args.port = port;
+            args.rcv_wnd = bufSize();
+            if (TcpConnection::startConnection(client->tcp(), args) !=
+                AIpStack::IpErr::SUCCESS)
+            {
+                throw std::runtime_error("startConnection failed");
+            }
+            setupBuffers();
+
+            if (m_type == ConnType::Bulk) {
+                queueBulkData(bufSize());
+            }
+            else if (m_type == ConnType::Rr) {
+                sendRequest();
+            }
+        }
+
+    private:
+        void connectionEstablished () override final
+        {
+            if (m_type == ConnType::Setup) {
+                TcpConnection::closeSending();
+            }
+        }
+
+        void connectionAborted () override final
+        {
+            std::fprintf(stderr, "Benchmark connection aborted unexpectedly.\n");
+            std::abort();
+        }
+
+        void dataReceived (std::size_t amount) override final
+        {
+            if (amount == 0) {
+                return checkFinished();
+            }
+
+            TcpConnection::extendRecvBuf(amount);
+
+            if (m_type == ConnType::Rr) {
+                m_rr_received += amount;
+                if (m_rr_received == m_client->m_cfg.rr_size) {
+                    m_rr_received = 0;
+                    if (m_client->rrResponseReceived()) {
+                        sendRequest();
+                    } else {
+                        TcpConnection::closeSending();
+                    }
+                }
+            }
+        }
+
+        void dataSent (std::size_t amount) override final
+        {
+            if (amount == 0) {
+                return checkFinished();
+            }
+
+            if (m_type == ConnType::Bulk) {
+                queueBulkData(amount);
+            }
+        }
+
+        void queueBulkData (std::size_t space)
+        {
+            if (m_bulk_remaining == 0) {
+                return;
+            }
+            std::size_t amount = std::size_t(std::min<std::uint64_t>(space,
+                                                                     m_bulk_remaining));
+            m_bulk_remaining -= amount;
+            TcpConnection::extendSendBuf(amount);
+            if (m_bulk_remaining == 0) {
+                TcpConnection::closeSending();
+            }
+        }
+
+        void sendRequest ()
+        {
+            m_client->m_rr_start = Clock::now();
+            TcpConnection::extendSendBuf(m_client->m_cfg.rr_size);
+            TcpConnection::sendPush();
+        }
+
+        // The connection is finished when both directions are closed.
+        void checkFinished ()
+        {
+            if (TcpConnection::wasEndSent() && TcpConnection::wasEndReceived()) {
+                BenchClient *client = m_client;
+                ConnType type = m_type;
+                destroy();
+                return client->connectionFinished(type);
+            }
+        }
+
+    private:
+        BenchClient *m_client;
+        ConnType m_type;
+        std::uint64_t m_bulk_remaining;
+        std::size_t m_rr_received;
+    };
+
+    AIpStack::TcpApi<TcpArg> & tcp () const
+    {
+        return m_stack->template getProtoApi<AIpStack::TcpApi>();
+    }
+
+    UdpApi & udp () const
+    {
+        return m_stack->template getProtoApi<AIpStack::UdpApi>();
+    }
+
+    void startConnection (ConnType type, uint16_t port, std::uint64_t bulk_bytes = 0)
+    {
+        BenchConnection::add(&m_connections,
+            std::make_unique<ClientConnection>(this, type, port, bulk_bytes));
+    }
+
+    void connectionFinished (ConnType type)
+    {
+        m_conns_finished++;
+
+        switch (type) {
+            case ConnType::Bulk: {
+                if (m_conns_finished == m_cfg.bulk_conns) {
+                    reportBulk();
+                    startRr();
+                }
+            } break;
+
+            case ConnType::Rr: {
+                reportRr();
+                startSetup();
+            } break;
+
+            case ConnType::Setup: {
+                if (m_conns_started < m_cfg.setup_count) {
+                    m_conns_started++;
+                    startConnection(ConnType::Setup, SinkPort);
+                }
+                else if (m_conns_finished == m_cfg.setup_count) {
+                    reportSetup();
+                    startUdp();
+                }
+            } break;
+
+            default:
+                AIPSTACK_ASSERT(false);
+        }
+    }
+
+    void startBulk ()
+    {
+        m_conns_finished = 0;
+        m_phase_start = Clock::now();
+        std::uint64_t per_conn = m_cfg.bulk_bytes / std::uint64_t(m_cfg.bulk_conns);
+        for (int i = 0; i < m_cfg.bulk_conns; i++) {
+            startConnection(ConnType::Bulk, SinkPort, per_conn);
+        }
+    }
+
+    void reportBulk ()
+    {
+        double secs = secondsSince(m_phase_start);
+        std::uint64_t per_conn = m_cfg.bulk_bytes / std::uint64_t(m_cfg.bulk_conns);
+        double bytes = double(per_conn * std::uint64_t(m_cfg.bulk_conns));
+        std::printf("tcp_bulk: conns=%d bytes=%.0f time=%.3fs throughput=%.1fMbit/s\n",
+                    m_cfg.bulk_conns, bytes, secs, bytes * 8.0 / secs / 1e6);
+    }
+
+    void startRr ()
+    {
+        m_conns_finished = 0;
+        m_rr_latencies.clear();
+        m_rr_latencies.reserve(std::size_t(m_cfg.rr_count));
+        m_phase_start = Clock::now();
+        startConnection(ConnType::Rr, EchoPort);
+    }
+
+    // Returns whether another request should be sent.
+    bool rrResponseReceived ()
+    {
+        m_rr_latencies.push_back(
+            std::chrono::duration<double, std::micro>(Clock::now() - m_rr_start).count());
+        return m_rr_latencies.size() < std::size_t(m_cfg.rr_count);
+    }
+
+    void reportRr ()
+    {
+        double secs = secondsSince(m_phase_start);
+        std::vector<double> &lat = m_rr_latencies;
+        std::sort(lat.begin(), lat.end());
+        auto pct = [&](double p) {
+            if (lat.empty()) {
+                return 0.0;
+            }
+            std::size_t idx = std::size_t(p / 100.0 * double(lat.size() - 1) + 0.5);
+            return lat[idx];
+        };
+        std::printf("tcp_rr: count=%zu size=%zu rate=%.0f/s p50=%.1fus p90=%.1fus "
+                    "p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+                    lat.size(), m_cfg.rr_size, double(lat.size()) / secs,
+                    pct(50), pct(90), pct(99), pct(99.9), pct(100));
+    }
+
+    void startSetup ()
+    {
+        m_conns_finished = 0;
+        m_conns_started = 0;
+        m_phase_start = Clock::now();
+        int initial = std::min(m_cfg.setup_conns, m_cfg.setup_count);
+        for (int i = 0; i < initial; i++) {
+            m_conns_started++;
+            startConnection(ConnType::Setup, SinkPort);
+        }
+        if (initial == 0) {
+            reportSetup();
+            startUdp();
+        }
+    }
+
+    void reportSetup ()
+    {
+        double secs = secondsSince(m_phase_start);
+        std::printf("tcp_setup: count=%d conns=%d time=%.3fs rate=%.0fconn/s\n",
+                    m_cfg.setup_count, m_cfg.setup_conns, secs,
+                    double(m_cfg.setup_count) / secs);
+    }
+
+    void startUdp ()
+    {
+        m_udp_sent = 0;
+        m_udp_end_sent = false;
+        m_phase_start = Clock::now();
+        m_udp_timer.setAfter(AIpStack::EventLoopDuration::zero());
+    }
+
+    // Send a burst of datagrams then yield to the event loop, so that the other
+    // side can run when both stacks share the event loop. After all datagrams,
+    // send the end marker, repeating it in case it is lost.
+    void udpTimerHandler ()
+    {
+        m_udp_retry.reset();
+
+        if (m_udp_end_sent) {
+            sendUdp(true);
+            m_udp_timer.setAfter(UdpEndRetryInterval);
+            return;
+        }
+
+        std::size_t per_call = (m_cfg.udp_gso > 0) ? m_cfg.udp_gso : m_cfg.udp_batch;
+
+        if (per_call > 0 && m_udp_sent < m_cfg.udp_count) {
+            std::size_t burst = 0;
+            while (burst < m_cfg.link_slots && m_udp_sent < m_cfg.udp_count) {
+                std::size_t count = std::min({per_call, m_cfg.link_slots - burst,
+                                              std::size_t(m_cfg.udp_count - m_udp_sent)});
+                std::size_t sent = (m_cfg.udp_gso > 0) ?
+                    sendUdpSegmented(count) : sendUdpBatch(count);
+                burst += sent;
+                if (sent < count) {
+                    // The link queue is full, retry later.
+                    break;
+                }
+            }
+            scheduleUdp();
+            return;
+        }
+
+        for (std::size_t i = 0; i < m_cfg.link_slots; i++) {
+            if (m_udp_sent == m_cfg.udp_count) {
+                if (sendUdp(true)) {
+                    m_udp_end_sent = true;
+                    m_udp_timer.setAfter(UdpEndRetryInterval);
+                    return;
+                }
+                break;
+            }
+
+            if (!sendUdp(false)) {
+                // Most likely the link queue is full, retry later.
+                break;
+            }
+            m_udp_sent++;
+        }
+
+        scheduleUdp();
+    }
+
+    // Continue sending from the event loop. If the link queue was full, wait
+    // for the retry notification, with a timeout in case it does not come.
+    void scheduleUdp ()
+    {
+        if (m_udp_retry.isActive()) {
+            m_udp_timer.setAfter(UdpFullRetryInterval);
+        } else {
+            m_udp_timer.setAfter(AIpStack::EventLoopDuration::zero());
+        }
+    }
+
+    bool sendUdp (bool end)
+    {
+        m_udp_buf[UdpApi::HeaderBeforeUdpData] = end ? 'E' : 'D';
+        std::size_t len = end ? 1 : m_cfg.udp_size;
+        AIpStack::IpBufNode node{m_udp_buf.data(), m_udp_buf.size(), nullptr};
+        AIpStack::IpBufRef data{&node, UdpApi::HeaderBeforeUdpData, len};
+
+        AIpStack::IpErr err = udp().sendUdpIp4Packet(
+            {m_cfg.client_addr, m_cfg.server_addr}, {UdpClientPort, UdpServerPort},
+            data, nullptr, &m_udp_retry, AIpStack::IpSendFlags());
+        return err == AIpStack::IpErr::SUCCESS;
+    }
+
+    // Send count datagrams with one sendUdpIp4Batch call. The payload does not
+    // need header space so all entries share the data after the headers.
+    std::size_t sendUdpBatch (std::size_t count)
+    {
+        m_udp_buf[UdpApi::HeaderBeforeUdpData] = 'D';
+        AIpStack::IpBufNode node{m_udp_buf.data() + UdpApi::HeaderBeforeUdpData,
+                                 m_cfg.udp_size, nullptr};
+
+        m_udp_batch.resize(count);
+        for (auto &entry : m_udp_batch) {
+            entry.remote_addr = m_cfg.server_addr;
+            entry.dst_port = UdpServerPort;
+            entry.data = AIpStack::IpBufRef{&node, 0, m_cfg.udp_size};
+        }
+
+        // Stops at the first datagram for which the link queue is full.
+        std::size_t sent = udp().sendUdpIp4Batch(m_cfg.client_addr, UdpClientPort,
+            m_udp_batch.data(), count, &m_udp_retry, AIpStack::IpSendFlags());
+        m_udp_sent += int(sent);
+        return sent;
+    }
+
+    // Send count datagrams with one sendUdpIp4Segmented call, from a buffer
+    // holding count payloads back to back.
+    std::size_t sendUdpSegmented (std::size_t count)
+    {
+        std::size_t len = count * m_cfg.udp_size;
+        if (m_udp_gso_buf.size() < len) {
+            m_udp_gso_buf.resize(len, 'D');
+        }
+        AIpStack::IpBufNode node{m_udp_gso_buf.data(), len, nullptr};
+
+        std::size_t sent_len;
+        udp().sendUdpIp4Segmented({m_cfg.client_addr, m_cfg.server_addr},
+            {UdpClientPort, UdpServerPort}, AIpStack::IpBufRef{&node, 0, len},
+            m_cfg.udp_size, &m_udp_retry, AIpStack::IpSendFlags(), sent_len);
+
+        std::size_t sent = sent_len / m_cfg.udp_size;
+        m_udp_sent += int(sent);
+        return sent;
+    }
+
+    AIpStack::UdpRecvResult udpReceived (
+        AIpStack::IpRxInfoIp4<IpStackArg> const &, AIpStack::UdpRxInfo<UdpArg> const &,
+        AIpStack::IpBufRef udp_data)
+    {
+        if (udp_data.tot_len != 4 || !m_udp_end_sent) {
+            return AIpStack::UdpRecvResult::Reject;
+        }
+
+        char buf[4];
+        udp_data.takeBytes(4, buf);
+        std::uint32_t received =
+            AIpStack::ReadBinaryInt<std::uint32_t, AIpStack::BinaryBigEndian>(buf);
+
+        double secs = secondsSince(m_phase_start);
+        std::printf("udp: sent=%d received=%lu size=%zu time=%.3fs pps=%.0f "
+                    "throughput=%.1fMbit/s\n",
+                    m_udp_sent, static_cast<unsigned long>(received), m_cfg.udp_size,
+                    secs, double(received) / secs,
+                    double(received) * double(m_cfg.udp_size) * 8.0 / secs / 1e6);
+        
+        m_udp_end_sent = false;
+        m_udp_timer.unset();
+        m_udp_retry.reset();
+        m_done_handler();
+        return AIpStack::UdpRecvResult::AcceptStop;
+    }
+
+private:
+    MyIpStack *m_stack;
+    Config const &m_cfg;
+    DoneHandler m_done_handler;
+    UdpListener m_udp_listener;
+    AIpStack::EventLoopTimer m_udp_timer;
+    AIpStack::EventLoopTimer m_start_timer;
+    UdpRetryRequest m_udp_retry;
+    BenchConnection::ConnectionMap m_connections;
+    Clock::time_point m_phase_start;
+    Clock::time_point m_rr_start;
+    std::vector<double> m_rr_latencies;
+    std::vector<char> m_udp_buf;
+    std::vector<AIpStack::UdpTxBatchEntry<UdpArg>> m_udp_batch;
+    std::vector<char> m_udp_gso_buf;
+    int m_conns_started = 0;
+    int m_conns_finished = 0;
+    int m_udp_sent = 0;
+    bool m_udp_end_sent = false;
+};
+
+constexpr std::chrono::milliseconds BenchClient::UdpEndRetryInterval;
+constexpr std::chrono::milliseconds BenchClient::UdpFullRetryInterval;
+
+// One side of the benchmark: an IP stack with a memory interface, sending through
+// a link emulator.
+struct BenchNode {
+    BenchNode (Platform platform, AIpStackExamples::NetemParams const &netem_params,
+               AIpStackExamples::MemLink *tx_link, AIpStackExamples::MemLink *rx_link,
+               AIpStack::MacAddr const &mac_addr, AIpStack::Ip4Addr addr,
+               bool chksum_offload, std::size_t tx_queue) :
+        stack(platform),
+        netem(platform.ref().platformImpl()->getEventLoop(), tx_link, netem_params),
+        iface(platform, &stack, &netem, rx_link, mac_addr, chksum_offload, tx_queue)
+    {
+        iface.iface().setIp4Addr(AIpStack::IpIfaceIp4AddrSetting(PrefixLength, addr));
+    }
+
+    MyIpStack stack;
+    AIpStackExamples::NetemLink netem;
+    MyMemIface iface;
+};
+
+#if defined(__linux__)
+
+// One side of the benchmark with --shm=1: an IP stack attached to the shared
+// memory link.
+struct ShmBenchNode {
+    ShmBenchNode (Platform platform, std::string const &link_name,
+                  AIpStack::ShmRingDeviceLinuxParams const &shm_params,
+                  AIpStack::MacAddr const &mac_addr, AIpStack::Ip4Addr addr) :
+        stack(platform),
+        iface(platform, &stack, link_name, mac_addr, shm_params)
+    {
+        iface.iface().setIp4Addr(AIpStack::IpIfaceIp4AddrSetting(PrefixLength, addr));
+    }
+
+    MyIpStack stack;
+    MyShmIface iface;
+};
+
+// Run the benchmark with the server in a child process. The client is
+// started once the link is up, and the server is killed at the end.
+static int runShm (Config const &cfg)
+{
+    std::string link_name = "aipstack_bench." + std::to_string(::getpid());
+
+    AIpStack::ShmRingDeviceLinuxParams shm_params;
+    shm_params.ring_size = std::uint32_t(cfg.link_slots);
+    shm_params.mtu = cfg.mtu;
+    // The peer is our own server or client.
+    shm_params.trust_rx_chksum = true;
+
+    std::fflush(stdout);
+    pid_t server_pid = ::fork();
+    if (server_pid < 0) {
+        std::fprintf(stderr, "fork failed.\n");
+        return 1;
+    }
+
+    if (server_pid == 0) {
+        ::prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+        AIpStack::EventLoop loop;
+        PlatformImpl platform_impl{loop};
+        Platform platform{PlatformRef{&platform_impl}};
+
+        ShmBenchNode node(platform, link_name, shm_params, ServerMacAddr, ServerIpAddr);
+        BenchServer server(&node.stack, cfg);
+
+        loop.run();
+        std::_Exit(0);
+    }
+
+    AIpStack::EventLoop loop;
+    PlatformImpl platform_impl{loop};
+    Platform platform{PlatformRef{&platform_impl}};
+
+    auto node = std::make_unique<ShmBenchNode>(
+        platform, link_name, shm_params, ClientMacAddr, ClientIpAddr);
+
+    // State used by the timer and completion handlers (these can only capture a
+    // single pointer).
+    struct RunState {
+        Config const *cfg;
+        AIpStack::EventLoop *loop;
+        ShmBenchNode *node;
+        AIpStack::EventLoopTimer *start_timer;
+        std::unique_ptr<BenchClient> client;
+        bool completed;
+    } state{&cfg, &loop, &*node, nullptr, nullptr, false};
+
+    AIpStack::EventLoopTimer start_timer(loop, [&state] {
+        if (!state.node->iface.device().isConnected()) {
+            state.start_timer->setAfter(std::chrono::milliseconds(1));
+            return;
+        }
+        state.client = std::make_unique<BenchClient>(&state.node->stack, *state.loop,
+        *state.cfg, [&state] {
+            state.completed = true;
+            state.loop->stop();
+        });
+    });
+    state.start_timer = &start_timer;
+    start_timer.setAfter(std::chrono::milliseconds(1));
+
+    AIpStack::EventLoopTimer timeout_timer(loop, [&state] {
+        std::fprintf(stderr, "Benchmark timed out.\n");
+        state.loop->stop();
+    });
+    timeout_timer.setAfter(std::chrono::seconds(cfg.timeout));
+
+    loop.run();
+
+    ::kill(server_pid, SIGKILL);
+    ::waitpid(server_pid, nullptr, 0);
+
+    return state.completed ? 0 : 1;
+}
+
+#endif
+
+// Run the benchmark with the client and the server in one stack, connected
+// through the loopback interface.
+static int runLoopback (Config const &cfg)
+{
+    AIpStack::EventLoop loop;
+    PlatformImpl platform_impl{loop};
+    Platform platform{PlatformRef{&platform_impl}};
+
+    MyIpStack stack(platform);
+
+    std::vector<char> ring_buf(LoopbackRingSize);
+    AIpStack::IpLoopbackIfaceParams lo_params;
+    lo_params.ring_buf = ring_buf.data();
+    lo_params.ring_size = ring_buf.size();
+    MyLoopbackIface lo_iface(&stack, lo_params);
+
+    BenchServer server(&stack, cfg);
+
+    // State used by the completion and timeout handlers (these can only capture
+    // a single pointer).
+    struct RunState {
+        AIpStack::EventLoop *loop;
+        bool completed;
+    } state{&loop, false};
+
+    BenchClient client(&stack, loop, cfg, [&state] {
+        state.completed = true;
+        state.loop->stop();
+    });
+
+    AIpStack::EventLoopTimer timeout_timer(loop, [&state] {
+        std::fprintf(stderr, "Benchmark timed out.\n");
+        state.loop->stop();
+    });
+    timeout_timer.setAfter(std::chrono::seconds(cfg.timeout));
+
+    loop.run();
+
+    return state.completed ? 0 : 1;
+}
+
+static void printNetemStats (char const *name, AIpStackExamples::NetemStats const &st)
+{
+    std::printf("netem %s: in=%llu out=%llu lost_random=%llu lost_burst=%llu "
+                "dropped_queue=%llu dropped_output=%llu duplicated=%llu "
+                "reordered=%llu\n", name,
+                static_cast<unsigned long long>(st.frames_in),
+                static_cast<unsigned long long>(st.frames_out),
+                static_cast<unsigned long long>(st.lost_random),
+                static_cast<unsigned long long>(st.lost_burst),
+                static_cast<unsigned long long>(st.dropped_queue),
+                static_cast<unsigned long long>(st.dropped_output),
+                static_cast<unsigned long long>(st.duplicated),
+                static_cast<unsigned long long>(st.reordered));
+}
+
+int main (int argc, char *argv[])
+{
+    Config cfg;
+    for (int i = 1; i < argc; i++) {
+        if (!parseArg(argv[i], cfg)) {
+            std::fprintf(stderr, "Invalid argument: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (cfg.mtu < MyIpStack::MinMTU || cfg.mtu > 65535 || cfg.link_slots == 0 ||
+        cfg.buf == 0 || cfg.bulk_conns <= 0 || cfg.bulk_conns > NumTcpPcbs ||
+        cfg.rr_count <= 0 || cfg.rr_size == 0 || cfg.rr_size > cfg.buf ||
+        cfg.setup_conns <= 0 || cfg.setup_conns > NumTcpPcbs ||
+        cfg.udp_size == 0 || cfg.udp_size > cfg.mtu - 28 || cfg.delay_dist > 2 ||
+        cfg.queue_limit == 0 ||
+        (cfg.tx_queue > 0 && cfg.tx_queue < 2 * (AIpStack::EthHeader::Size + cfg.mtu)))
+    {
+        std::fprintf(stderr, "Invalid configuration.\n");
+        return 1;
+    }
+
+    if (cfg.loopback) {
+        if (cfg.shm || cfg.threads) {
+            std::fprintf(stderr, "Invalid configuration for loopback.\n");
+            return 1;
+        }
+
+        cfg.client_addr = LoopbackIpAddr;
+        cfg.server_addr = LoopbackIpAddr;
+
+        std::printf("config: loopback=1 mtu=%zu buf=%zu\n",
+                    AIpStack::IpLoopbackIfaceParams().ip_mtu, cfg.buf);
+
+        return runLoopback(cfg);
+    }
+
+    if (cfg.shm) {
+#if defined(__linux__)
+        if ((cfg.link_slots & (cfg.link_slots - 1)) != 0 || cfg.link_slots < 2 ||
+            cfg.link_slots > (std::size_t(1) << 20) ||
+            cfg.chksum_offload || cfg.tx_queue > 0)
+        {
+            std::fprintf(stderr, "Invalid configuration for shm.\n");
+            return 1;
+        }
+
+        std::printf("config: shm=1 mtu=%zu mss=%zu link_slots=%zu buf=%zu\n",
+                    cfg.mtu, cfg.mtu - 40, cfg.link_slots, cfg.buf);
+
+        return runShm(cfg);
+#else
+        std::fprintf(stderr, "shm is only supported on Linux.\n");
+        return 1;
+#endif
+    }
+
+    std::printf("config: threads=%d mtu=%zu mss=%zu link_slots=%zu buf=%zu "
+                "rx_batch=%d chksum_offload=%d\n", int(cfg.threads), cfg.mtu,
+                cfg.mtu - 40, cfg.link_slots, cfg.buf, int(cfg.rx_batch),
+                int(cfg.chksum_offload));
+
+    // The two directions of the link.
+    std::size_t frame_size = AIpStack::EthHeader::Size + cfg.mtu;
+    AIpStackExamples::MemLink link_c2s(frame_size, cfg.link_slots);
+    AIpStackExamples::MemLink link_s2c(frame_size, cfg.link_slots);
+
+    // The event loops, the server uses the client's unless running in threads.
+    AIpStack::EventLoop client_loop;
+    std::unique_ptr<AIpStack::EventLoop> server_loop_own;
+    if (cfg.threads) {
+        server_loop_own = std::make_unique<AIpStack::EventLoop>();
+    }
+    AIpStack::EventLoop &server_loop = cfg.threads ? *server_loop_own : client_loop;
+
+    PlatformImpl client_platform_impl{client_loop};
+    PlatformImpl server_platform_impl{server_loop};
+    Platform client_platform{PlatformRef{&client_platform_impl}};
+    Platform server_platform{PlatformRef{&server_platform_impl}};
+
+    AIpStackExamples::NetemParams netem_params;
+    netem_params.seed = cfg.seed;
+    netem_params.delay = std::chrono::microseconds(cfg.delay_us);
+    netem_params.jitter = std::chrono::microseconds(cfg.jitter_us);
+    netem_params.delay_dist = AIpStackExamples::NetemDelayDist(cfg.delay_dist);
+    netem_params.loss = cfg.loss;
+    netem_params.loss_enter_bad = cfg.loss_enter_bad;
+    netem_params.loss_exit_bad = cfg.loss_exit_bad;
+    netem_params.loss_in_bad = cfg.loss_in_bad;
+    netem_params.duplicate = cfg.duplicate;
+    netem_params.reorder = cfg.reorder;
+    netem_params.rate_bps = cfg.rate_kbps * 1000;
+    netem_params.burst_bytes = frame_size;
+    netem_params.queue_limit = cfg.queue_limit;
+
+    auto client_node = std::make_unique<BenchNode>(client_platform, netem_params,
+        &link_c2s, &link_s2c, ClientMacAddr, ClientIpAddr, cfg.chksum_offload,
+        cfg.tx_queue);
+    netem_params.seed++;
+    auto server_node = std::make_unique<BenchNode>(server_platform, netem_params,
+        &link_s2c, &link_c2s, ServerMacAddr, ServerIpAddr, cfg.chksum_offload,
+        cfg.tx_queue);
+
+    client_node->iface.setRxBatch(cfg.rx_batch);
+    server_node->iface.setRxBatch(cfg.rx_batch);
+
+    auto server = std::make_unique<BenchServer>(&server_node->stack, cfg);
+
+    // Stop the server loop via an async signal since it may run in another thread.
+    AIpStack::EventLoopAsyncSignal server_stop(server_loop, [&server_loop] {
+        server_loop.stop();
+    });
+
+    // State used by the completion and timeout handlers (these can only capture
+    // a single pointer).
+    struct StopState {
+        AIpStack::EventLoop *client_loop;
+        AIpStack::EventLoopAsyncSignal *server_stop;
+        bool completed;
+    } stop_state{&client_loop, &server_stop, false};
+
+    auto client = std::make_unique<BenchClient>(&client_node->stack, client_loop, cfg,
+    [&stop_state] {
+        stop_state.completed = true;
+        stop_state.client_loop->stop();
+        stop_state.server_stop->signal();
+    });
+
+    AIpStack::EventLoopTimer timeout_timer(client_loop, [&stop_state] {
+        std::fprintf(stderr, "Benchmark timed out.\n");
+        stop_state.client_loop->stop();
+        stop_state.server_stop->signal();
+    });
+    timeout_timer.setAfter(std::chrono::seconds(cfg.timeout));
+
+    std::thread server_thread;
+    if (cfg.threads) {
+        server_thread = std::thread([&server_loop] { server_loop.run(); });
+    }
+
+    client_loop.run();
+
+    if (server_thread.joinable()) {
+        server_thread.join();
+    }
+
+    printNetemStats("c2s", client_node->netem.getStats());
+    printNetemStats("s2c", server_node->netem.getStats());
+    if (cfg.tx_queue > 0) {
+        std::printf("tx_queue: c2s_limit=%zu s2c_limit=%zu\n",
+                    client_node->iface.getTxQueue()->getLimit(),
+                    server_node->iface.getTxQueue()->getLimit());
+    }
+
+    return stop_state.completed ? 0 : 1;
+}
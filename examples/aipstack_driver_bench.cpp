@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Packet rate benchmark of the Linux device drivers (needs root). UDP datagrams
+// are sent from host threads using many source ports to UDP sinks in the
+// stacks, and the rate of datagrams received by the stacks is reported, in
+// total and per queue.
+//
+// With --driver=tap (the default), a TAP device is opened with the given number
+// of queues (IFF_MULTI_QUEUE), each served by its own thread with an event loop
+// and IpStack, and the kernel spreads the flows across the queues. The program
+// assigns an address to the host side of the device. Run it with increasing
+// --queues to see how the rate scales.
+//
+// With --driver=packet (PacketRingDeviceLinux) or --driver=xdp (XdpDeviceLinux),
+// a single stack is attached to the interface given by --ifname, normally one
+// end of a veth pair whose other end has the host address:
+//   ip link add vh type veth peer name vs
+//   ip addr add 192.168.96.1/24 dev vh
+//   ip link set vh up && ip link set vs up
+//   aipstack_driver_bench --driver=xdp --ifname=vs --trust-rx-chksum=1
+// The host sends through the veth with partial UDP checksums, so with XDP the
+// received checksums must be trusted (--trust-rx-chksum=1) for the datagrams
+// to be accepted.
+//
+// Parameters are given as --name=value arguments, see the Config structure.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/if.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/platform_specific/FileDescriptorWrapper.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/HostedPlatformImpl.h>
+#include <aipstack/event_loop/EventLoop.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/udp/IpUdpProto.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/tap/TapDevice.h>
+#include <aipstack/packet/linux/PacketRingDeviceLinux.h>
+#include <aipstack/xdp/linux/XdpDeviceLinux.h>
+
+#include "tap_iface.h"
+#include "host_iface.h"
+
+// CONFIGURATION
+
+using IndexService = AIpStack::AvlTreeIndexService;
+
+using MyIpStackService = AIpStack::IpStackService<
+    AIpStack::IpStackOptions::HeaderBeforeIp::Is<AIpStack::EthHeader::Size>,
+    AIpStack::IpStackOptions::PathMtuCacheService::Is<
+        AIpStack::IpPathMtuCacheService<
+            AIpStack::IpPathMtuCacheOptions::NumMtuEntries::Is<16>,
+            AIpStack::IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    AIpStack::IpStackOptions::ReassemblyService::Is<
+        AIpStack::IpReassemblyService<
+            AIpStack::IpReassemblyOptions::MaxReassEntrys::Is<16>,
+            AIpStack::IpReassemblyOptions::MaxReassSize::Is<60000>
+        >
+    >
+>;
+
+using ProtocolServicesList = AIpStack::MakeTypeList<
+    AIpStack::IpUdpProtoService<
+        AIpStack::IpUdpProtoOptions::UdpIndexService::Is<IndexService>
+    >
+>;
+
+using MyEthIpIfaceService = AIpStack::EthIpIfaceService<
+    AIpStack::EthIpIfaceOptions::NumArpEntries::Is<4>,
+    AIpStack::EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    AIpStack::EthIpIfaceOptions::HeaderBeforeEth::Is<0>,
+    AIpStack::EthIpIfaceOptions::TimersStructureService::Is<
+        AIpStack::LinkedHeapService
+    >
+>;
+
+// All queues share the address of the stack.
+static AIpStack::Ip4Addr const HostIpAddr = AIpStack::Ip4Addr::FromBytes(192, 168, 96, 1);
+static AIpStack::Ip4Addr const StackIpAddr = AIpStack::Ip4Addr::FromBytes(192, 168, 96, 2);
+static uint8_t const PrefixLength = 24;
+static AIpStack::MacAddr const StackMacAddr =
+    AIpStack::MacAddr::Make(0x02, 0x00, 0x00, 0x00, 0x00, 0x60);
+
+static uint16_t const UdpSinkPort = 5003;
+
+// CONFIGURATION - END
+
+using PlatformImpl = AIpStack::HostedPlatformImpl;
+using PlatformRef = AIpStack::PlatformRef<PlatformImpl>;
+using Platform = AIpStack::PlatformFacade<PlatformImpl>;
+
+class IpStackArg : public MyIpStackService::template Compose<
+    PlatformImpl, ProtocolServicesList> {};
+using MyIpStack = AIpStack::IpStack<IpStackArg>;
+
+using MyTapIface = AIpStackExamples::TapIface<IpStackArg, MyEthIpIfaceService>;
+using MyPacketRingIface = AIpStackExamples::HostIface<
+    IpStackArg, MyEthIpIfaceService, AIpStack::PacketRingDeviceLinux>;
+using MyXdpIface = AIpStackExamples::HostIface<
+    IpStackArg, MyEthIpIfaceService, AIpStack::XdpDeviceLinux>;
+
+using UdpArg = MyIpStack::GetProtoArg<AIpStack::UdpApi>;
+using UdpListener = AIpStack::UdpListener<UdpArg>;
+
+using Clock = std::chrono::steady_clock;
+
+struct Config {
+    std::string driver = "tap";  // tap, packet or xdp
+    std::string ifname;          // interface for the packet and xdp drivers
+    int queues = 1;              // number of TAP queues (stack threads)
+    int senders = 4;             // number of host sender threads
+    int flows = 64;              // number of host UDP sockets (source ports)
+    std::size_t size = 18;       // UDP payload size
+    int warmup = 1;              // seconds before measuring
+    int duration = 5;            // seconds of measurement
+    bool offload = false;        // use virtio-net headers (see TapDeviceLinux)
+    std::size_t rx_pool = 0;     // TAP receive buffers per queue (0=no pool)
+    bool trust_rx_chksum = false; // trust checksums of frames received with XDP
+};
+
+static bool parseArg (char const *arg, Config &cfg)
+{
+    char const *eq = std::strchr(arg, '=');
+    if (std::strncmp(arg, "--", 2) != 0 || eq == nullptr) {
+        return false;
+    }
+    std::string name(arg + 2, eq);
+    char const *val_str = eq + 1;
+    
+    if (name == "driver") {
+        cfg.driver = val_str;
+        return true;
+    } else if (name == "ifname") {
+        cfg.ifname = val_str;
+        return true;
+    }
+    
+    char *end;
+    unsigned long long val = std::strtoull(val_str, &end, 10);
+    if (*val_str == '\0' || *end != '\0') {
+        return false;
+    }
+    
+    if (name == "queues") {
+        cfg.queues = int(val);
+    } else if (name == "senders") {
+        cfg.senders = int(val);
+    } else if (name == "flows") {
+        cfg.flows = int(val);
+    } else if (name == "size") {
+        cfg.size = std::size_t(val);
+    } else if (name == "warmup") {
+        cfg.warmup = int(val);
+    } else if (name == "duration") {
+        cfg.duration = int(val);
+    } else if (name == "offload") {
+        cfg.offload = (val != 0);
+    } else if (name == "rx-pool") {
+        cfg.rx_pool = std::size_t(val);
+    } else if (name == "trust-rx-chksum") {
+        cfg.trust_rx_chksum = (val != 0);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// One queue of the device with its own event loop, stack and UDP sink. The
+// counter is written only by the queue's thread.
+struct QueueNodeBase {
+    QueueNodeBase () :
+        platform_impl(loop),
+        stack(platform()),
+        udp_listener(AIPSTACK_BIND_MEMBER_TN(&QueueNodeBase::udpReceived, this)),
+        stop_signal(loop, AIPSTACK_BIND_MEMBER_TN(&QueueNodeBase::stopSignalHandler, this)),
+        received(0)
+    {
+        AIpStack::UdpListenParams<UdpArg> udp_params;
+        udp_params.port = UdpSinkPort;
+        udp_listener.startListening(stack.getProtoApi<AIpStack::UdpApi>(), udp_params);
+    }
+    
+    virtual ~QueueNodeBase () {}
+    
+    Platform platform ()
+    {
+        return Platform{PlatformRef{&platform_impl}};
+    }
+    
+    AIpStack::UdpRecvResult udpReceived (
+        AIpStack::IpRxInfoIp4<IpStackArg> const &,
+        AIpStack::UdpRxInfo<UdpArg> const &, AIpStack::IpBufRef)
+    {
+        received.store(received.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+        return AIpStack::UdpRecvResult::AcceptStop;
+    }
+    
+    void stopSignalHandler ()
+    {
+        loop.stop();
+    }
+    
+    AIpStack::EventLoop loop;
+    PlatformImpl platform_impl;
+    MyIpStack stack;
+    UdpListener udp_listener;
+    AIpStack::EventLoopAsyncSignal stop_signal;
+    std::atomic<std::uint64_t> received;
+};
+
+// The interface arguments after the platform and stack are forwarded.
+template <typename Iface>
+struct QueueNode : public QueueNodeBase {
+    template <typename... IfaceArgs>
+    QueueNode (IfaceArgs &&... iface_args) :
+        iface(platform(), &stack, std::forward<IfaceArgs>(iface_args)...)
+    {
+        iface.iface().setIp4Addr(AIpStack::IpIfaceIp4AddrSetting(PrefixLength, StackIpAddr));
+    }
+    
+    Iface iface;
+};
+
+static struct in_addr toInAddr (AIpStack::Ip4Addr addr)
+{
+    std::uint8_t bytes[4] = {
+        addr.getByte<0>(), addr.getByte<1>(), addr.getByte<2>(), addr.getByte<3>()};
+    struct in_addr in_addr;
+    std::memcpy(&in_addr.s_addr, bytes, sizeof(bytes));
+    return in_addr;
+}
+
+// Assign the host address to the device and bring it up.
+static void configureHost (std::string const &devname)
+{
+    AIpStack::FileDescriptorWrapper sock{::socket(AF_INET, SOCK_DGRAM, 0)};
+    if (!sock) {
+        throw std::runtime_error("socket(AF_INET, SOCK_DGRAM) failed.");
+    }
+    
+    struct ifreq ifr;
+    std::memset(&ifr, 0, sizeof(ifr));
+    std::snprintf(ifr.ifr_name, IFNAMSIZ, "%s", devname.c_str());
+    
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    
+    addr.sin_addr = toInAddr(HostIpAddr);
+    std::memcpy(&ifr.ifr_addr, &addr, sizeof(addr));
+    if (::ioctl(*sock, SIOCSIFADDR, &ifr) < 0) {
+        throw std::runtime_error("ioctl(SIOCSIFADDR) failed.");
+    }
+    
+    addr.sin_addr = toInAddr(AIpStack::Ip4Addr::PrefixMask(PrefixLength));
+    std::memcpy(&ifr.ifr_netmask, &addr, sizeof(addr));
+    if (::ioctl(*sock, SIOCSIFNETMASK, &ifr) < 0) {
+        throw std::runtime_error("ioctl(SIOCSIFNETMASK) failed.");
+    }
+    
+    if (::ioctl(*sock, SIOCGIFFLAGS, &ifr) < 0) {
+        throw std::runtime_error("ioctl(SIOCGIFFLAGS) failed.");
+    }
+    ifr.ifr_flags |= IFF_UP;
+    if (::ioctl(*sock, SIOCSIFFLAGS, &ifr) < 0) {
+        throw std::runtime_error("ioctl(SIOCSIFFLAGS) failed.");
+    }
+}
+
+// Host sender thread: sends datagrams round-robin over its sockets until stopped.
+static void senderThread (std::vector<int> const &socks, std::size_t size,
+                          std::atomic<bool> const &stop, std::atomic<std::uint64_t> &sent)
+{
+    std::vector<char> payload(size, 'x');
+    std::uint64_t count = 0;
+    
+    while (!stop.load(std::memory_order_relaxed)) {
+        for (int fd : socks) {
+            if (::send(fd, payload.data(), payload.size(), MSG_DONTWAIT) >= 0) {
+                count++;
+            }
+        }
+    }
+    
+    sent.fetch_add(count);
+}
+
+static std::uint64_t totalReceived (std::vector<std::unique_ptr<QueueNodeBase>> const &nodes,
+                                    std::vector<std::uint64_t> &per_queue)
+{
+    std::uint64_t total = 0;
+    per_queue.clear();
+    for (auto const &node : nodes) {
+        per_queue.push_back(node->received.load(std::memory_order_relaxed));
+        total += per_queue.back();
+    }
+    return total;
+}
+
+int main (int argc, char *argv[])
+{
+    Config cfg;
+    for (int i = 1; i < argc; i++) {
+        if (!parseArg(argv[i], cfg)) {
+            std::fprintf(stderr, "Invalid argument: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    
+    bool tap = (cfg.driver == "tap");
+    if ((!tap && cfg.driver != "packet" && cfg.driver != "xdp") ||
+        (!tap && (cfg.ifname.empty() || cfg.queues != 1)) ||
+        cfg.queues <= 0 || cfg.senders <= 0 || cfg.flows < cfg.senders ||
+        cfg.size == 0 || cfg.size > 1472 || cfg.duration <= 0)
+    {
+        std::fprintf(stderr, "Invalid configuration.\n");
+        return 1;
+    }
+    
+    AIpStack::TapDeviceQueueGroup group;
+    std::vector<std::unique_ptr<QueueNodeBase>> nodes;
+    std::string devname;
+    
+    if (tap) {
+        // Create the queues, the first one creates the device.
+        for (int i = 0; i < cfg.queues; i++) {
+            nodes.push_back(std::make_unique<QueueNode<MyTapIface>>(
+                "", StackMacAddr, cfg.offload, &group, cfg.rx_pool));
+        }
+        
+        devname = group.getDeviceName();
+        configureHost(devname);
+    }
+    else if (cfg.driver == "packet") {
+        nodes.push_back(std::make_unique<QueueNode<MyPacketRingIface>>(
+            cfg.ifname, StackMacAddr));
+        devname = cfg.ifname;
+    }
+    else {
+        AIpStack::XdpDeviceLinuxParams xdp_params;
+        xdp_params.trust_rx_chksum = cfg.trust_rx_chksum;
+        auto node = std::make_unique<QueueNode<MyXdpIface>>(
+            cfg.ifname, StackMacAddr, xdp_params);
+        std::printf("xdp: zero_copy=%d\n", int(node->iface.device().isZeroCopy()));
+        nodes.push_back(std::move(node));
+        devname = cfg.ifname;
+    }
+    
+    std::printf("config: driver=%s device=%s queues=%d senders=%d flows=%d size=%zu "
+                "offload=%d rx_pool=%zu\n", cfg.driver.c_str(), devname.c_str(),
+                cfg.queues, cfg.senders, cfg.flows, cfg.size, int(cfg.offload),
+                cfg.rx_pool);
+    
+    std::vector<std::thread> queue_threads;
+    for (auto &node : nodes) {
+        QueueNodeBase *node_ptr = node.get();
+        queue_threads.emplace_back([node_ptr] { node_ptr->loop.run(); });
+    }
+    
+    // Host sockets, each connected from its own source port.
+    struct sockaddr_in dst_addr;
+    std::memset(&dst_addr, 0, sizeof(dst_addr));
+    dst_addr.sin_family = AF_INET;
+    dst_addr.sin_port = htons(UdpSinkPort);
+    dst_addr.sin_addr = toInAddr(StackIpAddr);
+    
+    std::vector<AIpStack::FileDescriptorWrapper> socks;
+    std::vector<std::vector<int>> sender_socks(std::size_t(cfg.senders));
+    for (int i = 0; i < cfg.flows; i++) {
+        AIpStack::FileDescriptorWrapper sock{::socket(AF_INET, SOCK_DGRAM, 0)};
+        if (!sock || ::connect(*sock, reinterpret_cast<struct sockaddr *>(&dst_addr),
+                               sizeof(dst_addr)) < 0)
+        {
+            std::fprintf(stderr, "Failed to create host socket.\n");
+            return 1;
+        }
+        sender_socks[std::size_t(i % cfg.senders)].push_back(*sock);
+        socks.push_back(std::move(sock));
+    }
+    
+    std::atomic<bool> stop_senders{false};
+    std::atomic<std::uint64_t> sent{0};
+    std::vector<std::thread> sender_threads;
+    for (auto const &thread_socks : sender_socks) {
+        sender_threads.emplace_back(senderThread, std::cref(thread_socks), cfg.size,
+                                    std::cref(stop_senders), std::ref(sent));
+    }
+    
+    // Measure the receive rate after the warmup (which includes ARP resolution).
+    std::this_thread::sleep_for(std::chrono::seconds(cfg.warmup));
+    
+    std::vector<std::uint64_t> start_counts;
+    std::uint64_t start_total = totalReceived(nodes, start_counts);
+    Clock::time_point start_time = Clock::now();
+    
+    std::this_thread::sleep_for(std::chrono::seconds(cfg.duration));
+    
+    std::vector<std::uint64_t> end_counts;
+    std::uint64_t end_total = totalReceived(nodes, end_counts);
+    double secs = std::chrono::duration<double>(Clock::now() - start_time).count();
+    
+    stop_senders = true;
+    for (auto &thread : sender_threads) {
+        thread.join();
+    }
+    for (auto &node : nodes) {
+        node->stop_signal.signal();
+    }
+    for (auto &thread : queue_threads) {
+        thread.join();
+    }
+    
+    for (std::size_t i = 0; i < nodes.size(); i++) {
+        std::printf("queue %zu: received_pps=%.0f\n", i,
+                    double(end_counts[i] - start_counts[i]) / secs);
+    }
+    std::printf("total: received_pps=%.0f sent_datagrams=%llu\n",
+                double(end_total - start_total) / secs,
+                static_cast<unsigned long long>(sent.load()));
+    
+    return 0;
+}
@@ -49,6 +49,11 @@
 #include <aipstack/utils/IpAddrFormat.h>
 
 #include "tap_iface.h"
+#if defined(__linux__)
+#include <aipstack/packet/linux/PacketRingDeviceLinux.h>
+#include <aipstack/xdp/linux/XdpDeviceLinux.h>
+#include "host_iface.h"
+#endif
 #include "example_app.h"
 
 // CONFIGURATION
@@ -63,6 +68,10 @@ static AIpStack::Ip4Addr const DeviceGatewayAddr =
 static AIpStack::MacAddr const DeviceMacAddr =
     AIpStack::MacAddr::Make(0x8e, 0x86, 0x90, 0x97, 0x65, 0xd5);
 
+// Use virtio-net headers on the TAP device for checksum and TSO offload
+// (Linux only).
+static bool const DeviceUseOffload = false;
+
 // Index data structure to use for various things.
 using IndexService = AIpStack::AvlTreeIndexService; // AVL tree
 //using IndexService = AIpStack::MruListIndexService; // Linked list
@@ -81,6 +90,7 @@ using MyIpStackService = AIpStack::IpStackService<
     AIpStack::IpStackOptions::ReassemblyService::Is<
         AIpStack::IpReassemblyService<
             AIpStack::IpReassemblyOptions::MaxReassEntrys::Is<16>,
+            AIpStack::IpReassemblyOptions::MaxReassEntrysPerSource::Is<4>,
             AIpStack::IpReassemblyOptions::MaxReassSize::Is<60000>
         >
     >
@@ -139,6 +149,15 @@ using MyIpStack = AIpStack::IpStack<IpStackArg>;
 // Instantiate the TapIface.
 using MyTapIface = AIpStackExamples::TapIface<IpStackArg, MyEthIpIfaceService>;
 
+#if defined(__linux__)
+// Instantiate the HostIface with the AF_PACKET and AF_XDP drivers, used for a
+// device "packet:<interface>", "xdp:<interface>" or "xdp-veth:<interface>".
+using MyPacketRingIface = AIpStackExamples::HostIface<
+    IpStackArg, MyEthIpIfaceService, AIpStack::PacketRingDeviceLinux>;
+using MyXdpIface = AIpStackExamples::HostIface<
+    IpStackArg, MyEthIpIfaceService, AIpStack::XdpDeviceLinux>;
+#endif
+
 // Instantiate the IpDhcpClient.
 class DhcpClientArg : public MyDhcpClientService::template Compose<
     PlatformImpl, IpStackArg> {};
@@ -209,13 +228,45 @@ int main (int argc, char *argv[])
     // Construct the IP stack.
     auto stack = std::make_unique<MyIpStack>(platform);
     
-    // Construct the TAP interface.
-    std::unique_ptr<MyTapIface> iface;
+    // Construct the TAP interface, or on Linux attach to an existing interface
+    // if the device is given as "packet:<interface>" or "xdp:<interface>". With
+    // "xdp-veth:<interface>", the interface must be a veth or another local link
+    // whose peer is trusted, and the checksums of received frames are not
+    // verified (the local host sends with partial checksums).
+    std::unique_ptr<MyTapIface> tap_iface;
+#if defined(__linux__)
+    std::unique_ptr<MyPacketRingIface> packet_iface;
+    std::unique_ptr<MyXdpIface> xdp_iface;
+#endif
+    AIpStack::IpIface<IpStackArg> *iface;
     try {
-        iface = std::make_unique<MyTapIface>(platform, &*stack, device_id, DeviceMacAddr);
+#if defined(__linux__)
+        if (device_id.compare(0, 7, "packet:") == 0) {
+            packet_iface = std::make_unique<MyPacketRingIface>(
+                platform, &*stack, device_id.substr(7), DeviceMacAddr);
+            iface = &packet_iface->iface();
+        }
+        else if (device_id.compare(0, 4, "xdp:") == 0 ||
+                 device_id.compare(0, 9, "xdp-veth:") == 0)
+        {
+            bool veth = (device_id[3] == '-');
+            AIpStack::XdpDeviceLinuxParams xdp_params;
+            xdp_params.trust_rx_chksum = veth;
+            xdp_iface = std::make_unique<MyXdpIface>(
+                platform, &*stack, device_id.substr(veth ? 9 : 4), DeviceMacAddr,
+                xdp_params);
+            iface = &xdp_iface->iface();
+        }
+        else
+#endif
+        {
+            tap_iface = std::make_unique<MyTapIface>(
+                platform, &*stack, device_id, DeviceMacAddr, DeviceUseOffload);
+            iface = &tap_iface->iface();
+        }
     }
     catch (std::runtime_error const &ex) {
-        std::fprintf(stderr, "Error initializing TAP interface: %s\n",
+        std::fprintf(stderr, "Error initializing interface: %s\n",
                      ex.what());
         return 1;
     }
@@ -226,15 +277,15 @@ int main (int argc, char *argv[])
         // Construct the DHCP client.
         AIpStack::IpDhcpClientInitOptions dhcp_opts;
         dhcp_client = std::make_unique<MyDhcpClient>(
-            platform, &*stack, &iface->iface(), dhcp_opts,
+            platform, &*stack, iface, dhcp_opts,
             [&dhcp_client](AIpStack::IpDhcpClientEvent event_type) {
                 dhcpClientCallback(dhcp_client, event_type);
             });
     } else {
         // Assign static IP configuration.
-        iface->iface().setIp4Addr(
+        iface->setIp4Addr(
             AIpStack::IpIfaceIp4AddrSetting(DevicePrefixLength, DeviceIpAddr));
-        iface->iface().setIp4Gateway(
+        iface->setIp4Gateway(
             AIpStack::IpIfaceIp4GatewaySetting(DeviceGatewayAddr));
     }
     
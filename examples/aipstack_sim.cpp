@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Simulation of TCP bulk transfers between pairs of IP stacks in simulated time
+// (see SimPlatformImpl). All stacks share one simulated platform and run in a
+// single thread; each pair is connected with a rate-limited link with a fixed
+// delay (see sim_link.h). Simulated time advances directly to the next timer, so
+// long runs take only as much real time as the processing itself, and results are
+// the same for every run with the same parameters.
+//
+// Parameters are given as --name=value arguments, see the Config structure.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/SimPlatformImpl.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/udp/IpUdpProto.h>
+#include <aipstack/eth/EthIpIface.h>
+
+#include "sim_link.h"
+
+// CONFIGURATION
+
+using IndexService = AIpStack::AvlTreeIndexService;
+
+using MyIpStackService = AIpStack::IpStackService<
+    AIpStack::IpStackOptions::HeaderBeforeIp::Is<AIpStack::EthHeader::Size>,
+    AIpStack::IpStackOptions::PathMtuCacheService::Is<
+        AIpStack::IpPathMtuCacheService<
+            AIpStack::IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            AIpStack::IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    AIpStack::IpStackOptions::ReassemblyService::Is<
+        AIpStack::IpReassemblyService<
+            AIpStack::IpReassemblyOptions::MaxReassEntrys::Is<4>,
+            AIpStack::IpReassemblyOptions::MaxReassSize::Is<60000>,
+            AIpStack::IpReassemblyOptions::ChainFragments::Is<true>
+        >
+    >
+>;
+
+using ProtocolServicesList = AIpStack::MakeTypeList<
+    AIpStack::IpTcpProtoService<
+        AIpStack::IpTcpProtoOptions::NumTcpPcbs::Is<16>,
+        AIpStack::IpTcpProtoOptions::PcbIndexService::Is<IndexService>,
+        AIpStack::IpTcpProtoOptions::PmtuProbing::Is<true>,
+        AIpStack::IpTcpProtoOptions::SegmentationOffload::Is<true>
+    >,
+    AIpStack::IpUdpProtoService<
+        AIpStack::IpUdpProtoOptions::UdpIndexService::Is<IndexService>
+    >
+>;
+
+using MyEthIpIfaceService = AIpStack::EthIpIfaceService<
+    AIpStack::EthIpIfaceOptions::NumArpEntries::Is<4>,
+    AIpStack::EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    AIpStack::EthIpIfaceOptions::HeaderBeforeEth::Is<0>,
+    AIpStack::EthIpIfaceOptions::TimersStructureService::Is<
+        AIpStack::LinkedHeapService
+    >
+>;
+
+// Each pair has its own link, so all pairs use the same addresses.
+static AIpStack::Ip4Addr const ClientIpAddr = AIpStack::Ip4Addr::FromBytes(10, 0, 0, 1);
+static AIpStack::Ip4Addr const ServerIpAddr = AIpStack::Ip4Addr::FromBytes(10, 0, 0, 2);
+static uint8_t const PrefixLength = 24;
+static AIpStack::MacAddr const ClientMacAddr =
+    AIpStack::MacAddr::Make(0x02, 0x00, 0x00, 0x00, 0x00, 0x01);
+static AIpStack::MacAddr const ServerMacAddr =
+    AIpStack::MacAddr::Make(0x02, 0x00, 0x00, 0x00, 0x00, 0x02);
+
+static uint16_t const SinkPort = 5001;
+
+// CONFIGURATION - END
+
+using PlatformImpl = AIpStack::SimPlatformImpl;
+using PlatformRef = AIpStack::PlatformRef<PlatformImpl>;
+using Platform = AIpStack::PlatformFacade<PlatformImpl>;
+
+class IpStackArg : public MyIpStackService::template Compose<
+    PlatformImpl, ProtocolServicesList> {};
+using MyIpStack = AIpStack::IpStack<IpStackArg>;
+
+using MySimIface = AIpStackExamples::SimIface<IpStackArg, MyEthIpIfaceService>;
+
+using TcpArg = MyIpStack::GetProtoArg<AIpStack::TcpApi>;
+using TcpListener = AIpStack::TcpListener<TcpArg>;
+using TcpConnection = AIpStack::TcpConnection<TcpArg>;
+
+using Clock = std::chrono::steady_clock;
+
+struct Config {
+    int pairs = 4;               // number of client/server stack pairs
+    std::size_t mtu = 1500;      // IP MTU of the links
+    std::size_t path_mtu = 0;    // larger packets are silently dropped (0=disabled)
+    std::size_t buf = 65536;     // TCP send/receive buffer size
+    std::uint64_t rate_kbps = 100000; // link rate in each direction (0=unlimited)
+    std::uint64_t delay_us = 10000;   // one-way link delay
+    std::size_t queue_bytes = 150000; // link transmit queue limit
+    std::uint64_t duration = 600;     // simulated duration in seconds
+};
+
+static bool parseArg (char const *arg, Config &cfg)
+{
+    char const *eq = std::strchr(arg, '=');
+    if (std::strncmp(arg, "--", 2) != 0 || eq == nullptr) {
+        return false;
+    }
+    std::string name(arg + 2, eq);
+    char const *val_str = eq + 1;
+    char *end;
+    double dval = std::strtod(val_str, &end);
+    if (*val_str == '\0' || *end != '\0' || dval < 0.0) {
+        return false;
+    }
+    auto val = static_cast<unsigned long long>(dval);
+
+    if (name == "pairs") {
+        cfg.pairs = int(val);
+    } else if (name == "mtu") {
+        cfg.mtu = std::size_t(val);
+    } else if (name == "path-mtu") {
+        cfg.path_mtu = std::size_t(val);
+    } else if (name == "buf") {
+        cfg.buf = std::size_t(val);
+    } else if (name == "rate-kbps") {
+        cfg.rate_kbps = val;
+    } else if (name == "delay-us") {
+        cfg.delay_us = val;
+    } else if (name == "queue-bytes") {
+        cfg.queue_bytes = std::size_t(val);
+    } else if (name == "duration") {
+        cfg.duration = val;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// A TCP connection using a single ring buffer. As a sender, it keeps the send
+// buffer full of data; as a receiver, it discards and counts received data.
+class BulkConnection :
+    private TcpConnection,
+    private AIpStack::NonCopyable<BulkConnection>
+{
+public:
+    BulkConnection (std::size_t buf_size) :
+        m_buf_size(buf_size),
+        m_buf(new char[buf_size]),
+        m_node{m_buf.get(), buf_size, &m_node},
+        m_received(0)
+    {
+        std::memset(m_buf.get(), 'x', buf_size);
+    }
+
+    void startSource (MyIpStack *stack)
+    {
+        AIpStack::TcpStartConnectionArgs<TcpArg> args;
+        args.addr = ServerIpAddr;
+        args.port = SinkPort;
+        args.rcv_wnd = m_buf_size;
+        if (TcpConnection::startConnection(
+            stack->template getProtoApi<AIpStack::TcpApi>(), args) !=
+            AIpStack::IpErr::SUCCESS)
+        {
+            throw std::runtime_error("startConnection failed");
+        }
+        TcpConnection::setRecvBuf({&m_node, 0, m_buf_size});
+        TcpConnection::setSendBuf({&m_node, 0, 0});
+        TcpConnection::extendSendBuf(m_buf_size);
+    }
+
+    void startSink (TcpListener &listener)
+    {
+        if (TcpConnection::acceptConnection(listener) != AIpStack::IpErr::SUCCESS) {
+            throw std::runtime_error("acceptConnection failed");
+        }
+        TcpConnection::setProportionalWindowUpdateThreshold(m_buf_size, 8);
+        TcpConnection::setRecvBuf({&m_node, 0, m_buf_size});
+    }
+
+    std::uint64_t getReceived () const
+    {
+        return m_received;
+    }
+
+private:
+    void connectionAborted () override final
+    {
+        std::fprintf(stderr, "Simulation connection aborted unexpectedly.\n");
+        std::abort();
+    }
+
+    void dataReceived (std::size_t amount) override final
+    {
+        if (amount > 0) {
+            m_received += amount;
+            TcpConnection::extendRecvBuf(amount);
+        }
+    }
+
+    void dataSent (std::size_t amount) override final
+    {
+        if (amount > 0) {
+            TcpConnection::extendSendBuf(amount);
+        }
+    }
+
+private:
+    std::size_t m_buf_size;
+    std::unique_ptr<char[]> m_buf;
+    AIpStack::IpBufNode m_node;
+    std::uint64_t m_received;
+};
+
+// A client stack and a server stack connected with a pair of links, with one bulk
+// TCP connection from the client to the server.
+class SimPair :
+    private AIpStack::NonCopyable<SimPair>
+{
+public:
+    SimPair (Platform platform, Config const &cfg) :
+        m_cfg(cfg),
+        m_link_c2s(platform, AIpStack::EthHeader::Size + cfg.mtu,
+                   cfg.rate_kbps * 1000, cfg.delay_us, cfg.queue_bytes),
+        m_link_s2c(platform, AIpStack::EthHeader::Size + cfg.mtu,
+                   cfg.rate_kbps * 1000, cfg.delay_us, cfg.queue_bytes),
+        m_client_stack(platform),
+        m_server_stack(platform),
+        m_client_iface(platform, &m_client_stack, &m_link_c2s, &m_link_s2c,
+                       ClientMacAddr),
+        m_server_iface(platform, &m_server_stack, &m_link_s2c, &m_link_c2s,
+                       ServerMacAddr),
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&SimPair::listenerEstablished, this)),
+        m_source(cfg.buf)
+    {
+        if (cfg.path_mtu != 0) {
+            m_link_c2s.setBlackHoleSize(AIpStack::EthHeader::Size + cfg.path_mtu);
+            m_link_s2c.setBlackHoleSize(AIpStack::EthHeader::Size + cfg.path_mtu);
+        }
+
+        m_client_iface.iface().setIp4Addr(
+            AIpStack::IpIfaceIp4AddrSetting(PrefixLength, ClientIpAddr));
+        m_server_iface.iface().setIp4Addr(
+            AIpStack::IpIfaceIp4AddrSetting(PrefixLength, ServerIpAddr));
+
+        if (!m_listener.startListening(
+            m_server_stack.template getProtoApi<AIpStack::TcpApi>(), {
+                /*addr=*/ AIpStack::Ip4Addr::ZeroAddr(),
+                /*port=*/ SinkPort,
+                /*max_pcbs=*/ 1
+            }))
+        {
+            throw std::runtime_error("SimPair: startListening failed.");
+        }
+        m_listener.setInitialReceiveWindow(cfg.buf);
+
+        m_source.startSource(&m_client_stack);
+    }
+
+    std::uint64_t getReceived () const
+    {
+        return m_sink ? m_sink->getReceived() : 0;
+    }
+
+    std::uint64_t getLinkDrops () const
+    {
+        return m_link_c2s.getFramesDropped() + m_link_s2c.getFramesDropped();
+    }
+
+    AIpStack::IpStackStats getClientStats () const
+    {
+        return m_client_stack.getStats();
+    }
+
+private:
+    void listenerEstablished ()
+    {
+        if (!m_sink) {
+            m_sink = std::make_unique<BulkConnection>(m_cfg.buf);
+            m_sink->startSink(m_listener);
+        }
+    }
+
+private:
+    Config const &m_cfg;
+    AIpStackExamples::SimLink m_link_c2s;
+    AIpStackExamples::SimLink m_link_s2c;
+    MyIpStack m_client_stack;
+    MyIpStack m_server_stack;
+    MySimIface m_client_iface;
+    MySimIface m_server_iface;
+    TcpListener m_listener;
+    BulkConnection m_source;
+    std::unique_ptr<BulkConnection> m_sink;
+};
+
+int main (int argc, char *argv[])
+{
+    Config cfg;
+    for (int i = 1; i < argc; i++) {
+        if (!parseArg(argv[i], cfg)) {
+            std::fprintf(stderr, "Invalid argument: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (cfg.pairs <= 0 || cfg.mtu < MyIpStack::MinMTU || cfg.mtu > 65535 ||
+        (cfg.path_mtu != 0 && cfg.path_mtu < MyIpStack::MinMTU) ||
+        cfg.buf == 0 || cfg.duration == 0)
+    {
+        std::fprintf(stderr, "Invalid configuration.\n");
+        return 1;
+    }
+
+    PlatformImpl sim;
+    Platform platform{PlatformRef{&sim}};
+
+    std::vector<std::unique_ptr<SimPair>> pairs;
+    for (int i = 0; i < cfg.pairs; i++) {
+        pairs.push_back(std::make_unique<SimPair>(platform, cfg));
+    }
+
+    Clock::time_point start = Clock::now();
+    sim.runFor(cfg.duration * 1000000);
+    double wall_secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::uint64_t total = 0;
+    for (int i = 0; i < cfg.pairs; i++) {
+        std::uint64_t received = pairs[std::size_t(i)]->getReceived();
+        std::printf("pair %d: received=%llu link_drops=%llu\n", i,
+                    static_cast<unsigned long long>(received),
+                    static_cast<unsigned long long>(
+                        pairs[std::size_t(i)]->getLinkDrops()));
+        if (cfg.path_mtu != 0) {
+            AIpStack::IpStackStats stats = pairs[std::size_t(i)]->getClientStats();
+            std::printf("pair %d: pmtu_probes=%llu pmtu_probe_acks=%llu "
+                        "pmtu_black_holes=%llu\n", i,
+                        static_cast<unsigned long long>(stats.tcp_pmtu_probes.get()),
+                        static_cast<unsigned long long>(stats.tcp_pmtu_probe_acks.get()),
+                        static_cast<unsigned long long>(stats.tcp_pmtu_black_holes.get()));
+        }
+        total += received;
+    }
+
+    double sim_secs = double(cfg.duration);
+    std::printf("total: received=%llu goodput=%.3f Mbit/s (simulated)\n",
+                static_cast<unsigned long long>(total), total * 8.0 / sim_secs / 1e6);
+    std::printf("simulated %.0f s in %.3f s (%.0fx), %llu events\n",
+                sim_secs, wall_secs, sim_secs / wall_secs,
+                static_cast<unsigned long long>(sim.getNumDispatched()));
+
+    // Destroy the pairs while the platform still exists.
+    pairs.clear();
+
+    return 0;
+}
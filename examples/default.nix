@@ -56,23 +56,21 @@ let
         compilerMatch = "clang";
     };
     
-    aipstackExampleFunc =
-        { stdenv }:
+    aipstackProgramFunc =
+        { stdenv, name, sources, progDefines ? defines, progOptFlags ? optFlags }:
         stdenv.mkDerivation rec {
-            name = "aipstack_example";
+            inherit name;
             buildCommand = ''
                 mkdir -p $out/bin
                 cd ${aipstackSrc}
                 (
                     set -x
-                    c++ ${stdFlags} -I src ${defines} -pthread ${optFlags} \
+                    c++ ${stdFlags} -I src ${progDefines} -pthread ${progOptFlags} \
                         ${stdenv.lib.concatStringsSep " " baseWarnings} \
                         $(cat ${supportedOptionalWarnings stdenv}) \
                         $(cat ${supportedOptionalWarningsClang stdenv}) \
-                        examples/aipstack_example.cpp \
-                        src/aipstack/event_loop/EventLoopAmalgamation.cpp \
-                        src/aipstack/tap/TapDeviceAmalgamation.cpp \
-                        -o $out/bin/aipstack_example
+                        ${stdenv.lib.concatStringsSep " " sources} \
+                        -o $out/bin/${name}
                 )
             '';
             dontStrip = true;
@@ -80,7 +78,51 @@ let
 
 in
 rec {
-    aipstackExample = pkgs.callPackage aipstackExampleFunc {
+    aipstackExample = pkgs.callPackage aipstackProgramFunc {
         #stdenv = pkgs.clangStdenv;
+        name = "aipstack_example";
+        sources = [
+            "examples/aipstack_example.cpp"
+            "src/aipstack/event_loop/EventLoopAmalgamation.cpp"
+            "src/aipstack/tap/TapDeviceAmalgamation.cpp"
+            "src/aipstack/packet/linux/PacketRingDeviceLinux.cpp"
+            "src/aipstack/xdp/linux/XdpDeviceLinux.cpp"
+        ];
+    };
+
+    # Benchmark, built without assertions and sanitizers.
+    aipstackBench = pkgs.callPackage aipstackProgramFunc {
+        name = "aipstack_bench";
+        sources = [
+            "examples/aipstack_bench.cpp"
+            "src/aipstack/event_loop/EventLoopAmalgamation.cpp"
+            "src/aipstack/shm/linux/ShmRingDeviceLinux.cpp"
+        ];
+        progDefines = "";
+        progOptFlags = "-O2";
+    };
+
+    # Packet rate over the TAP, packet ring and XDP drivers (Linux, needs root).
+    aipstackDriverBench = pkgs.callPackage aipstackProgramFunc {
+        name = "aipstack_driver_bench";
+        sources = [
+            "examples/aipstack_driver_bench.cpp"
+            "src/aipstack/event_loop/EventLoopAmalgamation.cpp"
+            "src/aipstack/tap/TapDeviceAmalgamation.cpp"
+            "src/aipstack/packet/linux/PacketRingDeviceLinux.cpp"
+            "src/aipstack/xdp/linux/XdpDeviceLinux.cpp"
+        ];
+        progDefines = "";
+        progOptFlags = "-O2";
+    };
+
+    # Simulated-time TCP transfers, needs no event loop.
+    aipstackSim = pkgs.callPackage aipstackProgramFunc {
+        name = "aipstack_sim";
+        sources = [
+            "examples/aipstack_sim.cpp"
+        ];
+        progDefines = "";
+        progOptFlags = "-O2";
     };
 }
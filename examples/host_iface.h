@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AIPSTACK_HOST_IFACE_H
+#define AIPSTACK_HOST_IFACE_H
+
+#include <string>
+
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Instance.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/HostedPlatformImpl.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/eth/EthIpIface.h>
+
+namespace AIpStackExamples {
+
+// Like TapIface but attached to an existing network interface (e.g. one end
+// of a veth pair) through a Device such as PacketRingDeviceLinux or
+// XdpDeviceLinux, or to a link with another process by ShmRingDeviceLinux.
+// The Device takes the event loop, interface (or link) name, handlers and its
+// Params in its constructor.
+template <typename StackArg, typename TheEthIpIfaceService, typename Device>
+class HostIface {
+    using Platform = AIpStack::PlatformFacade<AIpStack::HostedPlatformImpl>;
+
+    AIPSTACK_MAKE_INSTANCE(TheEthIpIface, (TheEthIpIfaceService::template Compose<
+        AIpStack::HostedPlatformImpl, StackArg>))
+
+public:
+    HostIface (Platform platform, AIpStack::IpStack<StackArg> *stack,
+               std::string const &ifname, AIpStack::MacAddr const &mac_addr,
+               typename Device::Params const &params = typename Device::Params())
+    :
+        m_device(platform.ref().platformImpl()->getEventLoop(), ifname,
+            AIPSTACK_BIND_MEMBER_TN(&HostIface::frameReceived, this),
+            AIPSTACK_BIND_MEMBER_TN(&HostIface::txReady, this), params),
+        m_mac_addr(mac_addr),
+        m_eth_iface(platform, stack, AIpStack::EthIfaceDriverParams{
+            /*eth_mtu=*/ m_device.getMtu(),
+            /*mac_addr=*/ &m_mac_addr,
+            AIPSTACK_BIND_MEMBER_TN(&HostIface::driverSendFrame, this),
+            AIPSTACK_BIND_MEMBER_TN(&HostIface::driverGetEthState, this)
+        })
+    {}
+
+    inline AIpStack::IpIface<StackArg> & iface () {
+        return m_eth_iface.iface();
+    }
+
+    inline Device & device () {
+        return m_device;
+    }
+    
+private:
+    void frameReceived (AIpStack::IpBufRef frame, AIpStack::IpRxFlags rx_flags)
+    {
+        return m_eth_iface.recvFrame(frame, nullptr, rx_flags);
+    }
+    
+    void txReady ()
+    {
+        return m_eth_iface.txReady();
+    }
+    
+    AIpStack::IpErr driverSendFrame (AIpStack::IpBufRef frame)
+    {
+        return m_device.sendFrame(frame);
+    }
+    
+    AIpStack::EthIfaceState driverGetEthState ()
+    {
+        AIpStack::EthIfaceState state = {};
+        state.link_up = true;
+        return state;
+    }
+
+private:
+    Device m_device;
+    AIpStack::MacAddr m_mac_addr;
+    TheEthIpIface m_eth_iface;
+};
+
+}
+
+#endif
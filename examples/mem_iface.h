@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_MEM_IFACE_H
+#define AIPSTACK_MEM_IFACE_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Instance.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/infra/RxBufHold.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/HostedPlatformImpl.h>
+#include <aipstack/event_loop/EventLoop.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/EthTxQueue.h>
+
+namespace AIpStackExamples {
+
+// One direction of an in-memory Ethernet link. Frames are copied into a fixed
+// number of preallocated slots; when all slots are in use, sending fails with
+// BUFFER_FULL. The producer and the consumer may run in different threads (each
+// in its own event loop) or in the same thread. The consumer is woken up using
+// an EventLoopAsyncSignal when the queue becomes non-empty, and the producer
+// similarly after sending failed because the queue was full, once half of the
+// slots are free again. If completion reporting is enabled, the producer is
+// also woken up when slots have been freed, and can then get the number of
+// bytes transmitted using takeCompletedBytes. The consumer may hold
+// on to consumed frames (see IpRxBufHold); slots are freed in order, so a held
+// frame also delays freeing the slots of the frames after it. Like a virtual
+// Ethernet link, a frame may carry a TCP/UDP packet whose checksum is partial
+// (see IpChksumOffload), this is passed to the consumer along with the frame.
+class MemLink :
+    private AIpStack::NonCopyable<MemLink>
+{
+public:
+    MemLink (std::size_t frame_size, std::size_t num_slots) :
+        m_frame_size(frame_size),
+        m_num_slots(num_slots),
+        m_data(new char[frame_size * num_slots]),
+        m_lengths(new std::size_t[num_slots]),
+        m_chksum_partial(new bool[num_slots]),
+        m_holds(new SlotHold[num_slots]),
+        m_head(0),
+        m_count(0),
+        m_consumed(0),
+        m_producer_blocked(false),
+        m_report_completions(false),
+        m_completion_pending(false),
+        m_completed_bytes(0),
+        m_consumer_signal(nullptr),
+        m_producer_signal(nullptr)
+    {
+        AIPSTACK_ASSERT(frame_size > 0)
+        AIPSTACK_ASSERT(num_slots > 0)
+
+        for (std::size_t i = 0; i < num_slots; i++) {
+            m_holds[i].m_link = this;
+        }
+    }
+
+    inline std::size_t getFrameSize () const
+    {
+        return m_frame_size;
+    }
+
+    // Set the async-signal to be signaled when frames become available. This must
+    // be done before frames are pushed.
+    void setConsumerSignal (AIpStack::EventLoopAsyncSignal *signal)
+    {
+        m_consumer_signal = signal;
+    }
+
+    // Set the async-signal to be signaled when frames can be pushed again after
+    // pushFrame returned BUFFER_FULL.
+    void setProducerSignal (AIpStack::EventLoopAsyncSignal *signal)
+    {
+        m_producer_signal = signal;
+    }
+
+    // Enable reporting of transmitted (freed) frames, see takeCompletedBytes.
+    void enableCompletions ()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_report_completions = true;
+    }
+
+    // Return the total length of frames freed since the last call. The producer
+    // is signaled again when further frames are freed.
+    std::size_t takeCompletedBytes ()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::size_t bytes = m_completed_bytes;
+        m_completed_bytes = 0;
+        m_completion_pending = false;
+        return bytes;
+    }
+
+    AIpStack::IpErr pushFrame (AIpStack::IpBufRef frame, bool chksum_partial = false)
+    {
+        AIPSTACK_ASSERT(frame.tot_len <= m_frame_size)
+
+        bool was_empty;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (m_count == m_num_slots) {
+                m_producer_blocked = true;
+                return AIpStack::IpErr::BUFFER_FULL;
+            }
+
+            std::size_t slot = (m_head + m_count) % m_num_slots;
+            m_lengths[slot] = frame.tot_len;
+            m_chksum_partial[slot] = chksum_partial;
+            frame.takeBytes(frame.tot_len, m_data.get() + slot * m_frame_size);
+
+            was_empty = (m_consumed == m_count);
+            m_count++;
+        }
+
+        // Only signal when the first unconsumed frame is added, the consumer keeps
+        // processing frames until there are no unconsumed frames.
+        if (was_empty && m_consumer_signal != nullptr) {
+            m_consumer_signal->signal();
+        }
+
+        return AIpStack::IpErr::SUCCESS;
+    }
+
+    // Pass queued frames to the handler one by one until there are no unconsumed
+    // frames. The handler is also given an IpRxBufHold for the frame; the slot of
+    // a frame is released only after the handler returns and the hold (if taken)
+    // is released, so the handler can use the frame without copying. The last
+    // argument of the handler is the partial checksum flag of the frame.
+    template <typename Handler>
+    void consumeFrames (Handler handler)
+    {
+        while (true) {
+            std::size_t slot;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_consumed == m_count) {
+                    return;
+                }
+                slot = (m_head + m_consumed) % m_num_slots;
+            }
+
+            AIpStack::IpBufNode node{m_data.get() + slot * m_frame_size,
+                                     m_lengths[slot], nullptr};
+            handler(AIpStack::IpBufRef{&node, 0, m_lengths[slot]}, &m_holds[slot],
+                    m_chksum_partial[slot]);
+
+            bool wake_producer;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_consumed++;
+                wake_producer = freeConsumedSlots();
+            }
+            if (wake_producer) {
+                m_producer_signal->signal();
+            }
+        }
+    }
+
+private:
+    class SlotHold final : public AIpStack::IpRxBufHold {
+        friend class MemLink;
+
+        void rxBufReleased () override
+        {
+            bool wake_producer;
+            {
+                std::lock_guard<std::mutex> lock(m_link->m_mutex);
+                wake_producer = m_link->freeConsumedSlots();
+            }
+            if (wake_producer) {
+                m_link->m_producer_signal->signal();
+            }
+        }
+
+        MemLink *m_link;
+    };
+
+    // Free slots of consumed frames at the head which are not held. Returns
+    // whether the producer should be signaled.
+    bool freeConsumedSlots ()
+    {
+        while (m_consumed > 0 && !m_holds[m_head].isHeld()) {
+            if (m_report_completions) {
+                m_completed_bytes += m_lengths[m_head];
+            }
+            m_head = (m_head + 1) % m_num_slots;
+            m_count--;
+            m_consumed--;
+        }
+
+        bool wake = false;
+        if (m_producer_blocked && m_count <= m_num_slots / 2) {
+            m_producer_blocked = false;
+            wake = true;
+        }
+        if (m_completed_bytes > 0 && !m_completion_pending) {
+            m_completion_pending = true;
+            wake = true;
+        }
+        return wake && m_producer_signal != nullptr;
+    }
+
+    std::size_t m_frame_size;
+    std::size_t m_num_slots;
+    std::unique_ptr<char[]> m_data;
+    std::unique_ptr<std::size_t[]> m_lengths;
+    std::unique_ptr<bool[]> m_chksum_partial;
+    std::unique_ptr<SlotHold[]> m_holds;
+    std::mutex m_mutex;
+    std::size_t m_head;
+    std::size_t m_count;
+    std::size_t m_consumed;
+    bool m_producer_blocked;
+    bool m_report_completions;
+    bool m_completion_pending;
+    std::size_t m_completed_bytes;
+    AIpStack::EventLoopAsyncSignal *m_consumer_signal;
+    AIpStack::EventLoopAsyncSignal *m_producer_signal;
+};
+
+// An Ethernet interface driver which sends frames to one MemLink and receives
+// frames from another. Two MemIface instances connected with a pair of MemLink
+// objects (in opposite directions) form a point-to-point Ethernet link. The
+// received frames are processed in the event loop of the platform. The transmit
+// link may be of another type with the same pushFrame, getFrameSize and
+// setProducerSignal functions (such as NetemLink). If chksum_offload is set, the interface offers transmit
+// checksum offload and passes such frames on with the partial checksum flag.
+// If tx_queue_size is nonzero, frames are sent through an EthTxQueue of that
+// size, which limits the number of bytes queued in the transmit link based on
+// its completion reports.
+template <typename StackArg, typename TheEthIpIfaceService, typename TxLink = MemLink>
+class MemIface {
+    using Platform = AIpStack::PlatformFacade<AIpStack::HostedPlatformImpl>;
+
+    AIPSTACK_MAKE_INSTANCE(TheEthIpIface, (TheEthIpIfaceService::template Compose<
+        AIpStack::HostedPlatformImpl, StackArg>))
+
+public:
+    MemIface (Platform platform, AIpStack::IpStack<StackArg> *stack,
+              TxLink *tx_link, MemLink *rx_link, AIpStack::MacAddr const &mac_addr,
+              bool chksum_offload = false, std::size_t tx_queue_size = 0)
+    :
+        m_tx_link(tx_link),
+        m_rx_link(rx_link),
+        m_rx_signal(platform.ref().platformImpl()->getEventLoop(),
+            AIPSTACK_BIND_MEMBER_TN(&MemIface::rxSignalHandler, this)),
+        m_tx_signal(platform.ref().platformImpl()->getEventLoop(),
+            AIPSTACK_BIND_MEMBER_TN(&MemIface::txSignalHandler, this)),
+        m_mac_addr(mac_addr),
+        m_rx_batch(false),
+        m_eth_iface(platform, stack, AIpStack::EthIfaceDriverParams{
+            /*eth_mtu=*/ tx_link->getFrameSize(),
+            /*mac_addr=*/ &m_mac_addr,
+            AIPSTACK_BIND_MEMBER_TN(&MemIface::driverSendFrame, this),
+            AIPSTACK_BIND_MEMBER_TN(&MemIface::driverGetEthState, this),
+            /*offload_flags=*/ chksum_offload ?
+                AIpStack::IpIfaceOffloadFlags::TxProtoChksum :
+                AIpStack::IpIfaceOffloadFlags(),
+            /*tso_max_len=*/ 0,
+            /*send_tso_frame=*/ nullptr,
+            AIPSTACK_BIND_MEMBER_TN(&MemIface::driverSendChksumFrame, this)
+        })
+    {
+        if (tx_queue_size > 0) {
+            m_tx_queue_buf.reset(new char[tx_queue_size]);
+            
+            AIpStack::EthTxQueueParams queue_params;
+            queue_params.ring_buf = m_tx_queue_buf.get();
+            queue_params.ring_size = tx_queue_size;
+            queue_params.min_limit = tx_link->getFrameSize();
+            queue_params.max_limit = tx_queue_size;
+            queue_params.send_frame =
+                AIPSTACK_BIND_MEMBER_TN(&MemIface::linkSendFrame, this);
+            queue_params.send_chksum_frame =
+                AIPSTACK_BIND_MEMBER_TN(&MemIface::linkSendChksumFrame, this);
+            queue_params.tx_ready =
+                AIPSTACK_BIND_MEMBER_TN(&MemIface::queueTxReady, this);
+            m_tx_queue.reset(new TxQueue(platform, queue_params));
+            
+            m_tx_link->enableCompletions();
+        }
+        
+        m_rx_link->setConsumerSignal(&m_rx_signal);
+        m_tx_link->setProducerSignal(&m_tx_signal);
+    }
+
+    ~MemIface ()
+    {
+        m_tx_link->setProducerSignal(nullptr);
+        m_rx_link->setConsumerSignal(nullptr);
+    }
+
+    inline AIpStack::IpIface<StackArg> & iface () {
+        return m_eth_iface.iface();
+    }
+    
+    // Set whether received frames are passed to the stack in batches (all frames
+    // available at once), which allows the stack to coalesce received TCP
+    // segments if that is enabled (IpStackOptions::RxCoalesceFlows).
+    inline void setRxBatch (bool rx_batch) {
+        m_rx_batch = rx_batch;
+    }
+    
+    // Return the transmit queue, or null if not used.
+    inline AIpStack::EthTxQueue<AIpStack::HostedPlatformImpl> const * getTxQueue () const {
+        return m_tx_queue.get();
+    }
+    
+private:
+    void rxSignalHandler ()
+    {
+        bool rx_batch = m_rx_batch;
+        if (rx_batch) {
+            m_eth_iface.beginRecvBatch();
+        }
+        m_rx_link->consumeFrames(
+            [this](AIpStack::IpBufRef frame, AIpStack::IpRxBufHold *hold,
+                   bool chksum_partial)
+            {
+                m_eth_iface.recvFrame(frame, hold, chksum_partial ?
+                    AIpStack::IpRxFlags::ProtoChksumPartial : AIpStack::IpRxFlags());
+            });
+        if (rx_batch) {
+            m_eth_iface.endRecvBatch();
+        }
+    }
+    
+    void txSignalHandler ()
+    {
+        if (m_tx_queue) {
+            m_tx_queue->txCompleted(m_tx_link->takeCompletedBytes());
+            m_tx_queue->txReady();
+        } else {
+            m_eth_iface.txReady();
+        }
+    }
+    
+    void queueTxReady ()
+    {
+        m_eth_iface.txReady();
+    }
+    
+    AIpStack::IpErr driverSendFrame (AIpStack::IpBufRef frame)
+    {
+        return m_tx_queue ? m_tx_queue->sendFrame(frame) : linkSendFrame(frame);
+    }
+    
+    AIpStack::IpErr driverSendChksumFrame (AIpStack::IpBufRef frame)
+    {
+        return m_tx_queue ? m_tx_queue->sendChksumFrame(frame) :
+            linkSendChksumFrame(frame);
+    }
+    
+    AIpStack::IpErr linkSendFrame (AIpStack::IpBufRef frame)
+    {
+        return m_tx_link->pushFrame(frame);
+    }
+    
+    AIpStack::IpErr linkSendChksumFrame (AIpStack::IpBufRef frame)
+    {
+        return m_tx_link->pushFrame(frame, true);
+    }
+    
+    AIpStack::EthIfaceState driverGetEthState ()
+    {
+        AIpStack::EthIfaceState state = {};
+        state.link_up = true;
+        return state;
+    }
+
+private:
+    using TxQueue = AIpStack::EthTxQueue<AIpStack::HostedPlatformImpl>;
+    
+    TxLink *m_tx_link;
+    MemLink *m_rx_link;
+    AIpStack::EventLoopAsyncSignal m_rx_signal;
+    AIpStack::EventLoopAsyncSignal m_tx_signal;
+    AIpStack::MacAddr m_mac_addr;
+    bool m_rx_batch;
+    std::unique_ptr<char[]> m_tx_queue_buf;
+    std::unique_ptr<TxQueue> m_tx_queue;
+    TheEthIpIface m_eth_iface;
+};
+
+}
+
+#endif
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_NETEM_LINK_H
+#define AIPSTACK_NETEM_LINK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/event_loop/EventLoop.h>
+
+#include "mem_iface.h"
+
+namespace AIpStackExamples {
+
+// Distribution of the random part of the delay.
+enum class NetemDelayDist {Uniform, Normal, Pareto};
+
+struct NetemParams {
+    // Seed for the random number generator, runs with the same seed and the same
+    // sequence of frames make the same decisions.
+    std::uint64_t seed = 1;
+
+    // Fixed delay and the random variation (jitter) added to it. For Uniform the
+    // variation is in [-jitter, jitter], for Normal jitter is the standard
+    // deviation, and for Pareto jitter is the mean of a Pareto(alpha=3)
+    // distributed extra delay. Negative total delays are clamped to zero.
+    std::chrono::microseconds delay{0};
+    std::chrono::microseconds jitter{0};
+    NetemDelayDist delay_dist = NetemDelayDist::Uniform;
+
+    // Independent random loss probability.
+    double loss = 0.0;
+
+    // Burst loss using the Gilbert-Elliott model: the link moves from the good to
+    // the bad state with probability loss_enter_bad and back with probability
+    // loss_exit_bad (evaluated for each frame), and in the bad state frames are
+    // lost with probability loss_in_bad. Disabled if loss_enter_bad is zero.
+    double loss_enter_bad = 0.0;
+    double loss_exit_bad = 1.0;
+    double loss_in_bad = 1.0;
+
+    // Probability that a frame is duplicated (the copy gets its own delay).
+    double duplicate = 0.0;
+
+    // Probability that a frame skips the delay and is thus sent ahead of frames
+    // which are still being delayed.
+    double reorder = 0.0;
+
+    // Bottleneck token bucket: rate in bits per second (zero for unlimited) and
+    // bucket size in bytes. Frames wait in a FIFO queue of at most queue_limit
+    // frames for tokens, frames arriving to a full queue are dropped.
+    std::uint64_t rate_bps = 0;
+    std::size_t burst_bytes = 1514;
+    std::size_t queue_limit = 100;
+};
+
+struct NetemStats {
+    std::uint64_t frames_in = 0;
+    std::uint64_t frames_out = 0;
+    std::uint64_t lost_random = 0;
+    std::uint64_t lost_burst = 0;
+    std::uint64_t dropped_queue = 0;
+    std::uint64_t dropped_output = 0;
+    std::uint64_t duplicated = 0;
+    std::uint64_t reordered = 0;
+};
+
+// A link which passes frames to a MemLink after applying delay, loss,
+// duplication, reordering and rate limiting, similar to Linux netem. It can be
+// used as the transmit link of a MemIface. Frames are held in memory until
+// their delivery time, which is implemented using an EventLoopTimer in the
+// event loop of the sender; so pushFrame must be called from that event loop.
+// If the parameters do not require any emulation, frames are passed on directly.
+// Otherwise, for completion reporting (see MemLink), frames count as transmitted
+// as soon as they are accepted.
+class NetemLink :
+    private AIpStack::NonCopyable<NetemLink>
+{
+    using Clock = AIpStack::EventLoopClock;
+    using Time = AIpStack::EventLoopTime;
+    using Duration = AIpStack::EventLoopDuration;
+
+public:
+    NetemLink (AIpStack::EventLoop &loop, MemLink *output, NetemParams const &params) :
+        m_loop(loop),
+        m_output(output),
+        m_params(params),
+        m_timer(loop, AIPSTACK_BIND_MEMBER_TN(&NetemLink::timerHandler, this)),
+        m_rng(params.seed),
+        m_in_bad_state(false),
+        m_bucket_time(Clock::now()),
+        m_bucket_tokens(double(params.burst_bytes)),
+        m_last_departure(m_bucket_time),
+        m_seq(0),
+        m_report_completions(false),
+        m_completed_bytes(0),
+        m_producer_signal(nullptr),
+        m_passthrough(params.delay.count() == 0 && params.jitter.count() == 0 &&
+                      params.loss == 0.0 && params.loss_enter_bad == 0.0 &&
+                      params.duplicate == 0.0 && params.reorder == 0.0 &&
+                      params.rate_bps == 0)
+    {}
+
+    inline std::size_t getFrameSize () const
+    {
+        return m_output->getFrameSize();
+    }
+
+    inline NetemStats const & getStats () const
+    {
+        return m_stats;
+    }
+
+    // Only frames passed on directly can fail with BUFFER_FULL, so this
+    // forwards to the output; the signal is also used to report completions.
+    inline void setProducerSignal (AIpStack::EventLoopAsyncSignal *signal)
+    {
+        m_producer_signal = signal;
+        m_output->setProducerSignal(signal);
+    }
+
+    void enableCompletions ()
+    {
+        if (m_passthrough) {
+            m_output->enableCompletions();
+        } else {
+            m_report_completions = true;
+        }
+    }
+
+    std::size_t takeCompletedBytes ()
+    {
+        if (m_passthrough) {
+            return m_output->takeCompletedBytes();
+        }
+        std::size_t bytes = m_completed_bytes;
+        m_completed_bytes = 0;
+        return bytes;
+    }
+
+    AIpStack::IpErr pushFrame (AIpStack::IpBufRef frame, bool chksum_partial = false)
+    {
+        AIPSTACK_ASSERT(frame.tot_len <= getFrameSize())
+
+        m_stats.frames_in++;
+
+        if (m_passthrough) {
+            AIpStack::IpErr err = m_output->pushFrame(frame, chksum_partial);
+            if (err == AIpStack::IpErr::SUCCESS) {
+                m_stats.frames_out++;
+            }
+            return err;
+        }
+
+        if (m_report_completions) {
+            if (m_completed_bytes == 0 && m_producer_signal != nullptr) {
+                m_producer_signal->signal();
+            }
+            m_completed_bytes += frame.tot_len;
+        }
+
+        if (chance(m_params.loss)) {
+            m_stats.lost_random++;
+            return AIpStack::IpErr::SUCCESS;
+        }
+
+        if (m_params.loss_enter_bad > 0.0) {
+            m_in_bad_state = m_in_bad_state ? !chance(m_params.loss_exit_bad) :
+                chance(m_params.loss_enter_bad);
+            if (m_in_bad_state && chance(m_params.loss_in_bad)) {
+                m_stats.lost_burst++;
+                return AIpStack::IpErr::SUCCESS;
+            }
+        }
+
+        Time now = m_loop.getEventTime();
+
+        // Pass the frame through the bottleneck, this determines when it leaves
+        // the bottleneck queue.
+        Time departure = now;
+        if (m_params.rate_bps > 0) {
+            while (!m_queue_departures.empty() && m_queue_departures.front() <= now) {
+                m_queue_departures.pop_front();
+            }
+            if (m_queue_departures.size() >= m_params.queue_limit) {
+                m_stats.dropped_queue++;
+                return AIpStack::IpErr::SUCCESS;
+            }
+            departure = bottleneckDeparture(now, frame.tot_len);
+            m_queue_departures.push_back(departure);
+        }
+
+        std::vector<char> data(frame.tot_len);
+        frame.takeBytes(frame.tot_len, data.data());
+
+        bool duplicate = chance(m_params.duplicate);
+        if (duplicate) {
+            m_stats.duplicated++;
+            schedule(departure, data, chksum_partial);
+        }
+        schedule(departure, std::move(data), chksum_partial);
+
+        return AIpStack::IpErr::SUCCESS;
+    }
+
+private:
+    struct PendingFrame {
+        Time time;
+        std::uint64_t seq;
+        std::vector<char> data;
+        bool chksum_partial;
+    };
+
+    // Orders pending frames by time, then by arrival to keep FIFO order for equal
+    // times; std::priority_queue puts the greatest element first.
+    struct PendingCompare {
+        bool operator() (PendingFrame const &a, PendingFrame const &b) const
+        {
+            return (a.time != b.time) ? (a.time > b.time) : (a.seq > b.seq);
+        }
+    };
+
+    bool chance (double prob)
+    {
+        return prob > 0.0 &&
+               std::uniform_real_distribution<double>(0.0, 1.0)(m_rng) < prob;
+    }
+
+    Duration sampleDelay ()
+    {
+        double jitter = double(m_params.jitter.count());
+        double delay_us = double(m_params.delay.count());
+
+        if (jitter > 0.0) {
+            switch (m_params.delay_dist) {
+                case NetemDelayDist::Uniform: {
+                    delay_us += std::uniform_real_distribution<double>(
+                        -jitter, jitter)(m_rng);
+                } break;
+                case NetemDelayDist::Normal: {
+                    delay_us += std::normal_distribution<double>(0.0, jitter)(m_rng);
+                } break;
+                case NetemDelayDist::Pareto: {
+                    // Pareto with alpha=3 and scale chosen so that the mean is jitter.
+                    double alpha = 3.0;
+                    double scale = jitter * (alpha - 1.0) / alpha;
+                    double u = std::uniform_real_distribution<double>(0.0, 1.0)(m_rng);
+                    delay_us += scale / std::pow(1.0 - u, 1.0 / alpha) - scale;
+                } break;
+                default:
+                    AIPSTACK_ASSERT(false);
+            }
+        }
+
+        return std::chrono::duration_cast<Duration>(
+            std::chrono::duration<double, std::micro>(std::max(0.0, delay_us)));
+    }
+
+    // Token bucket: the frame departs once the previous frame has departed and
+    // there are enough tokens for it.
+    Time bottleneckDeparture (Time now, std::size_t len)
+    {
+        double rate_Bps = double(m_params.rate_bps) / 8.0;
+        Time start = std::max(now, m_last_departure);
+
+        double elapsed = std::chrono::duration<double>(start - m_bucket_time).count();
+        double tokens = std::min(double(m_params.burst_bytes),
+                                 m_bucket_tokens + elapsed * rate_Bps);
+
+        Time departure = start;
+        if (tokens < double(len)) {
+            double wait = (double(len) - tokens) / rate_Bps;
+            departure += std::chrono::duration_cast<Duration>(
+                std::chrono::duration<double>(wait));
+            tokens = double(len);
+        }
+
+        m_bucket_time = departure;
+        m_bucket_tokens = tokens - double(len);
+        m_last_departure = departure;
+        return departure;
+    }
+
+    void schedule (Time departure, std::vector<char> data, bool chksum_partial)
+    {
+        Time time = departure;
+        if (chance(m_params.reorder)) {
+            m_stats.reordered++;
+        } else {
+            time += sampleDelay();
+        }
+
+        m_pending.push(PendingFrame{time, m_seq++, std::move(data), chksum_partial});
+        updateTimer();
+    }
+
+    void updateTimer ()
+    {
+        if (m_pending.empty()) {
+            m_timer.unset();
+        }
+        else if (!m_timer.isSet() || m_timer.getSetTime() != m_pending.top().time) {
+            m_timer.setAt(m_pending.top().time);
+        }
+    }
+
+    void timerHandler ()
+    {
+        Time now = m_loop.getEventTime();
+
+        while (!m_pending.empty() && m_pending.top().time <= now) {
+            PendingFrame const &frame = m_pending.top();
+            std::vector<char> const &data = frame.data;
+            AIpStack::IpBufNode node{const_cast<char *>(data.data()), data.size(),
+                                     nullptr};
+            if (m_output->pushFrame(AIpStack::IpBufRef{&node, 0, data.size()},
+                                    frame.chksum_partial) == AIpStack::IpErr::SUCCESS)
+            {
+                m_stats.frames_out++;
+            } else {
+                m_stats.dropped_output++;
+            }
+            m_pending.pop();
+        }
+
+        updateTimer();
+    }
+
+private:
+    AIpStack::EventLoop &m_loop;
+    MemLink *m_output;
+    NetemParams m_params;
+    AIpStack::EventLoopTimer m_timer;
+    std::mt19937_64 m_rng;
+    bool m_in_bad_state;
+    Time m_bucket_time;
+    double m_bucket_tokens;
+    Time m_last_departure;
+    std::deque<Time> m_queue_departures;
+    std::priority_queue<PendingFrame, std::vector<PendingFrame>, PendingCompare>
+        m_pending;
+    std::uint64_t m_seq;
+    bool m_report_completions;
+    std::size_t m_completed_bytes;
+    AIpStack::EventLoopAsyncSignal *m_producer_signal;
+    bool m_passthrough;
+    NetemStats m_stats;
+};
+
+}
+
+#endif
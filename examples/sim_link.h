@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_SIM_LINK_H
+#define AIPSTACK_SIM_LINK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Instance.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/RxBufHold.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/SimPlatformImpl.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/eth/EthIpIface.h>
+
+namespace AIpStackExamples {
+
+// One direction of an Ethernet link in simulated time (see SimPlatformImpl).
+// Frames are serialized at a fixed rate (if nonzero) and arrive at the receiver
+// after a fixed propagation delay. Frames are dropped when the transmission
+// backlog would exceed queue_bytes, and frames larger than the black hole size (if
+// set) are silently discarded, which simulates a Path MTU black hole (a smaller
+// MTU further along the path without ICMP feedback). Frames are delivered from a platform timer,
+// never directly from pushFrame. Each delivered frame is in its own buffer which
+// the receiver may keep (see IpRxBufHold).
+class SimLink :
+    private AIpStack::NonCopyable<SimLink>
+{
+    using Platform = AIpStack::PlatformFacade<AIpStack::SimPlatformImpl>;
+    using TimeType = Platform::TimeType;
+
+public:
+    using ReceiveHandler = AIpStack::Function<
+        void(AIpStack::IpBufRef frame, AIpStack::IpRxBufHold *hold)>;
+
+    SimLink (Platform platform, std::size_t frame_size, std::uint64_t rate_bps,
+             TimeType delay, std::size_t queue_bytes) :
+        m_platform(platform),
+        m_frame_size(frame_size),
+        m_rate_bps(rate_bps),
+        m_delay(delay),
+        m_queue_bytes(queue_bytes),
+        m_black_hole_size(0),
+        m_timer(platform.ref(), AIPSTACK_BIND_MEMBER_TN(&SimLink::timerHandler, this)),
+        m_link_free_time(platform.getTime()),
+        m_frames_delivered(0),
+        m_frames_dropped(0)
+    {
+        AIPSTACK_ASSERT(frame_size > 0)
+    }
+
+    inline std::size_t getFrameSize () const
+    {
+        return m_frame_size;
+    }
+
+    inline std::uint64_t getFramesDelivered () const
+    {
+        return m_frames_delivered;
+    }
+
+    inline std::uint64_t getFramesDropped () const
+    {
+        return m_frames_dropped;
+    }
+
+    // Discard frames larger than max_frame_size (0 to disable).
+    void setBlackHoleSize (std::size_t max_frame_size)
+    {
+        m_black_hole_size = max_frame_size;
+    }
+
+    void setReceiveHandler (ReceiveHandler handler)
+    {
+        m_receive_handler = handler;
+    }
+
+    AIpStack::IpErr pushFrame (AIpStack::IpBufRef frame)
+    {
+        AIPSTACK_ASSERT(frame.tot_len <= m_frame_size)
+
+        if (m_black_hole_size != 0 && frame.tot_len > m_black_hole_size) {
+            m_frames_dropped++;
+            return AIpStack::IpErr::SUCCESS;
+        }
+
+        TimeType now = m_platform.getTime();
+        TimeType tx_start = (m_link_free_time > now) ? m_link_free_time : now;
+
+        if (m_rate_bps != 0) {
+            std::uint64_t backlog_bytes = (tx_start - now) * m_rate_bps / 8000000;
+            if (backlog_bytes + frame.tot_len > m_queue_bytes) {
+                m_frames_dropped++;
+                return AIpStack::IpErr::BUFFER_FULL;
+            }
+
+            // Serialization time in microseconds, rounded up.
+            std::uint64_t bits = std::uint64_t(frame.tot_len) * 8 * 1000000;
+            m_link_free_time = tx_start + (bits + m_rate_bps - 1) / m_rate_bps;
+        } else {
+            m_link_free_time = tx_start;
+        }
+
+        Frame entry{m_link_free_time + m_delay, std::vector<char>(frame.tot_len)};
+        frame.takeBytes(frame.tot_len, entry.data.data());
+        m_queue.push_back(std::move(entry));
+
+        // Arrival times are nondecreasing so only the first frame needs the timer.
+        if (!m_timer.isSet()) {
+            m_timer.setAt(m_queue.front().arrival);
+        }
+
+        return AIpStack::IpErr::SUCCESS;
+    }
+
+private:
+    struct Frame {
+        TimeType arrival;
+        std::vector<char> data;
+    };
+
+    // A delivered frame, freed when the receiver does not hold it.
+    class RxFrame final : public AIpStack::IpRxBufHold {
+    public:
+        RxFrame (std::vector<char> &&data) :
+            m_data(std::move(data)),
+            m_node{m_data.data(), m_data.size(), nullptr}
+        {}
+
+        inline AIpStack::IpBufRef getRef ()
+        {
+            return AIpStack::IpBufRef{&m_node, 0, m_data.size()};
+        }
+
+    private:
+        void rxBufReleased () override
+        {
+            delete this;
+        }
+
+    private:
+        std::vector<char> m_data;
+        AIpStack::IpBufNode m_node;
+    };
+
+    void timerHandler ()
+    {
+        TimeType now = m_platform.getTime();
+
+        while (!m_queue.empty() && m_queue.front().arrival <= now) {
+            // Take the frame out of the queue first since the receiver may cause
+            // more frames to be pushed.
+            Frame entry = std::move(m_queue.front());
+            m_queue.pop_front();
+
+            m_frames_delivered++;
+
+            if (m_receive_handler) {
+                RxFrame *rx_frame = new RxFrame(std::move(entry.data));
+                m_receive_handler(rx_frame->getRef(), rx_frame);
+                if (!rx_frame->isHeld()) {
+                    delete rx_frame;
+                }
+            }
+        }
+
+        if (!m_queue.empty() && !m_timer.isSet()) {
+            m_timer.setAt(m_queue.front().arrival);
+        }
+    }
+
+private:
+    Platform m_platform;
+    std::size_t m_frame_size;
+    std::uint64_t m_rate_bps;
+    TimeType m_delay;
+    std::size_t m_queue_bytes;
+    std::size_t m_black_hole_size;
+    Platform::Timer m_timer;
+    ReceiveHandler m_receive_handler;
+    std::deque<Frame> m_queue;
+    TimeType m_link_free_time;
+    std::uint64_t m_frames_delivered;
+    std::uint64_t m_frames_dropped;
+};
+
+// An Ethernet interface driver which sends frames to one SimLink and receives
+// frames from another, analogous to MemIface but for simulated time.
+template <typename StackArg, typename TheEthIpIfaceService>
+class SimIface {
+    using Platform = AIpStack::PlatformFacade<AIpStack::SimPlatformImpl>;
+
+    AIPSTACK_MAKE_INSTANCE(TheEthIpIface, (TheEthIpIfaceService::template Compose<
+        AIpStack::SimPlatformImpl, StackArg>))
+
+public:
+    SimIface (Platform platform, AIpStack::IpStack<StackArg> *stack,
+              SimLink *tx_link, SimLink *rx_link, AIpStack::MacAddr const &mac_addr)
+    :
+        m_tx_link(tx_link),
+        m_rx_link(rx_link),
+        m_mac_addr(mac_addr),
+        m_eth_iface(platform, stack, AIpStack::EthIfaceDriverParams{
+            /*eth_mtu=*/ tx_link->getFrameSize(),
+            /*mac_addr=*/ &m_mac_addr,
+            AIPSTACK_BIND_MEMBER_TN(&SimIface::driverSendFrame, this),
+            AIPSTACK_BIND_MEMBER_TN(&SimIface::driverGetEthState, this)
+        })
+    {
+        m_rx_link->setReceiveHandler(
+            AIPSTACK_BIND_MEMBER_TN(&SimIface::linkFrameReceived, this));
+    }
+
+    ~SimIface ()
+    {
+        m_rx_link->setReceiveHandler(SimLink::ReceiveHandler());
+    }
+
+    inline AIpStack::IpIface<StackArg> & iface () {
+        return m_eth_iface.iface();
+    }
+
+private:
+    void linkFrameReceived (AIpStack::IpBufRef frame, AIpStack::IpRxBufHold *hold)
+    {
+        m_eth_iface.recvFrame(frame, hold);
+    }
+
+    AIpStack::IpErr driverSendFrame (AIpStack::IpBufRef frame)
+    {
+        return m_tx_link->pushFrame(frame);
+    }
+
+    AIpStack::EthIfaceState driverGetEthState ()
+    {
+        AIpStack::EthIfaceState state = {};
+        state.link_up = true;
+        return state;
+    }
+
+private:
+    SimLink *m_tx_link;
+    SimLink *m_rx_link;
+    AIpStack::MacAddr m_mac_addr;
+    TheEthIpIface m_eth_iface;
+};
+
+}
+
+#endif
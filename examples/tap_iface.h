@@ -25,12 +25,17 @@
 #ifndef AIPSTACK_TAP_IFACE_H
 #define AIPSTACK_TAP_IFACE_H
 
+#include <cstdint>
 #include <string>
+#include <memory>
+#include <vector>
 
 #include <aipstack/misc/Function.h>
 #include <aipstack/infra/Instance.h>
 #include <aipstack/infra/Buf.h>
 #include <aipstack/infra/Err.h>
+#include <aipstack/infra/RxBufHold.h>
+#include <aipstack/infra/PacketBufPool.h>
 #include <aipstack/platform/PlatformFacade.h>
 #include <aipstack/platform/HostedPlatformImpl.h>
 #include <aipstack/proto/EthernetProto.h>
@@ -47,28 +52,61 @@ class TapIface {
         AIpStack::HostedPlatformImpl, StackArg>))
 
 public:
+    // If offload is true, checksum and TCP segmentation offload are used with
+    // the host kernel where supported by the TapDevice. If queue_group is given,
+    // this is one queue of a multi-queue device (each queue has its own stack).
+    // If rx_pool_bufs is nonzero, frames are received into a pool of that many
+    // buffers which the stack can keep (see TapDeviceLinux::setRxBufPool); each
+    // queue has its own pool. The stack must not hold any of them when this is
+    // destructed.
     TapIface (Platform platform, AIpStack::IpStack<StackArg> *stack,
-              std::string const &device_id, AIpStack::MacAddr const &mac_addr)
+              std::string const &device_id, AIpStack::MacAddr const &mac_addr,
+              bool offload = false,
+              AIpStack::TapDeviceQueueGroup *queue_group = nullptr,
+              std::size_t rx_pool_bufs = 0)
     :
         m_tap_device(platform.ref().platformImpl()->getEventLoop(), device_id,
-            AIPSTACK_BIND_MEMBER_TN(&TapIface::frameReceived, this)),
+            AIPSTACK_BIND_MEMBER_TN(&TapIface::frameReceived, this),
+            AIPSTACK_BIND_MEMBER_TN(&TapIface::txReady, this), offload, queue_group),
         m_mac_addr(mac_addr),
         m_eth_iface(platform, stack, AIpStack::EthIfaceDriverParams{
             /*eth_mtu=*/ m_tap_device.getMtu(),
             /*mac_addr=*/ &m_mac_addr,
             AIPSTACK_BIND_MEMBER_TN(&TapIface::driverSendFrame, this),
-            AIPSTACK_BIND_MEMBER_TN(&TapIface::driverGetEthState, this)
+            AIPSTACK_BIND_MEMBER_TN(&TapIface::driverGetEthState, this),
+            /*offload_flags=*/ m_tap_device.getOffloadFlags(),
+            /*tso_max_len=*/ m_tap_device.getTsoMaxLen(),
+            AIPSTACK_BIND_MEMBER_TN(&TapIface::driverSendTsoFrame, this),
+            AIPSTACK_BIND_MEMBER_TN(&TapIface::driverSendChksumFrame, this)
         })
-    {}
+    {
+        if (rx_pool_bufs > 0) {
+            AIpStack::IpPacketBufPoolParams pool_params;
+            pool_params.headroom = m_tap_device.getRxBufHeadroom();
+            pool_params.data_size = m_tap_device.getRxBufDataSize();
+            m_rx_pool_mem.resize(AIpStack::IpPacketBufPool::getMemSize(
+                rx_pool_bufs, pool_params.headroom, pool_params.data_size));
+            pool_params.mem = m_rx_pool_mem.data();
+            pool_params.mem_size = m_rx_pool_mem.size();
+            m_rx_pool = std::make_unique<AIpStack::IpPacketBufPool>(pool_params);
+            m_tap_device.setRxBufPool(m_rx_pool.get());
+        }
+    }
 
     inline AIpStack::IpIface<StackArg> & iface () {
         return m_eth_iface.iface();
     }
     
 private:
-    void frameReceived (AIpStack::IpBufRef frame)
+    void frameReceived (AIpStack::IpBufRef frame, AIpStack::IpRxFlags rx_flags,
+                        AIpStack::IpRxBufHold *hold)
+    {
+        return m_eth_iface.recvFrame(frame, hold, rx_flags);
+    }
+    
+    void txReady ()
     {
-        return m_eth_iface.recvFrame(frame);
+        return m_eth_iface.txReady();
     }
     
     AIpStack::IpErr driverSendFrame (AIpStack::IpBufRef frame)
@@ -76,6 +114,16 @@ private:
         return m_tap_device.sendFrame(frame);
     }
     
+    AIpStack::IpErr driverSendTsoFrame (AIpStack::IpBufRef frame, std::uint16_t seg_data_len)
+    {
+        return m_tap_device.sendTsoFrame(frame, seg_data_len);
+    }
+    
+    AIpStack::IpErr driverSendChksumFrame (AIpStack::IpBufRef frame)
+    {
+        return m_tap_device.sendChksumFrame(frame);
+    }
+    
     AIpStack::EthIfaceState driverGetEthState ()
     {
         AIpStack::EthIfaceState state = {};
@@ -84,6 +132,9 @@ private:
     }
 
 private:
+    // Declared before the device so that the device returns its buffer first.
+    std::vector<char> m_rx_pool_mem;
+    std::unique_ptr<AIpStack::IpPacketBufPool> m_rx_pool;
     AIpStack::TapDevice m_tap_device;
     AIpStack::MacAddr m_mac_addr;
     TheEthIpIface m_eth_iface;
@@ -37,6 +37,7 @@
 #include <aipstack/misc/OneOf.h>
 #include <aipstack/misc/MinMax.h>
 #include <aipstack/misc/Function.h>
+#include <aipstack/misc/Trace.h>
 #include <aipstack/structure/LinkModel.h>
 #include <aipstack/structure/LinkedList.h>
 #include <aipstack/structure/StructureRaiiWrapper.h>
@@ -45,6 +46,8 @@
 #include <aipstack/infra/Struct.h>
 #include <aipstack/infra/Buf.h>
 #include <aipstack/infra/SendRetry.h>
+#include <aipstack/infra/TxScheduler.h>
+#include <aipstack/infra/RxBufHold.h>
 #include <aipstack/infra/TxAllocHelper.h>
 #include <aipstack/infra/Err.h>
 #include <aipstack/infra/Options.h>
@@ -52,8 +55,12 @@
 #include <aipstack/infra/Instance.h>
 #include <aipstack/proto/EthernetProto.h>
 #include <aipstack/proto/ArpProto.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
 #include <aipstack/ip/IpAddr.h>
 #include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpStats.h>
+#include <aipstack/ip/IpTcpSegmenter.h>
 #include <aipstack/ip/hw/EthHw.h>
 #include <aipstack/platform/PlatformFacade.h>
 
@@ -118,7 +125,10 @@ struct EthIfaceDriverParams {
      *        to the application to include that in @ref IpStackOptions::HeaderBeforeIp.
      * @return Success or error code. The @ref EthIpIface does not itself check for any
      *         specific error code but the error code may be propagated to the IP layer
-     *         (@ref IpStack) which may do so.
+     *         (@ref IpStack) which may do so. If the transmit queue is full, this
+     *         should be @ref IpErr::BUFFER_FULL and the driver should later call
+     *         @ref EthIpIface::txReady (this also applies to the other send
+     *         functions).
      */
     Function<IpErr(IpBufRef frame)> send_frame = nullptr;
     
@@ -133,6 +143,108 @@ struct EthIfaceDriverParams {
      * @return Driver-provided-state (currently just the link-up flag).
      */
     Function<EthIfaceState()> get_eth_state = nullptr;
+    
+    /**
+     * Offload features supported by the driver.
+     * 
+     * Currently @ref IpIfaceOffloadFlags::TcpSegmentation and @ref
+     * IpIfaceOffloadFlags::TxProtoChksum are meaningful here, in which case
+     * respectively @ref send_tso_frame and @ref send_chksum_frame must be provided.
+     * Note that @ref EthIpIface always offers TCP segmentation to the IP layer and
+     * performs it in software if the driver does not support it; this still saves
+     * the IP layer from resolving the hardware address for each segment.
+     */
+    IpIfaceOffloadFlags offload_flags = IpIfaceOffloadFlags();
+    
+    /**
+     * Maximum size of frames passed to @ref send_tso_frame, including the Ethernet
+     * header.
+     * 
+     * This must be at least @ref eth_mtu if TCP segmentation is supported.
+     */
+    size_t tso_max_len = 0;
+    
+    /**
+     * Driver function to send an Ethernet frame containing an IPv4 TCP packet which
+     * is to be split into segments.
+     * 
+     * This is only used if @ref offload_flags includes @ref
+     * IpIfaceOffloadFlags::TcpSegmentation. The semantics are as for @ref
+     * IpIfaceDriverParams::send_ip4_tso_packet, the Ethernet header is to be
+     * copied to each resulting frame.
+     * 
+     * @param frame Frame to send, this includes the Ethernet header. Its size does
+     *        not exceed @ref tso_max_len.
+     * @param seg_data_len Maximum TCP data length in each segment.
+     * @return Success or error code. Either all segments must be sent or none.
+     */
+    Function<IpErr(IpBufRef frame, uint16_t seg_data_len)> send_tso_frame = nullptr;
+    
+    /**
+     * Driver function to send an Ethernet frame containing an IPv4 TCP or UDP
+     * packet whose checksum is to be completed by the driver.
+     * 
+     * This is only used if @ref offload_flags includes @ref
+     * IpIfaceOffloadFlags::TxProtoChksum. The semantics are as for @ref
+     * IpIfaceDriverParams::send_ip4_chksum_packet; @ref IpChksumOffload can be used
+     * with the frame after hiding the Ethernet header.
+     * 
+     * @param frame Frame to send, this includes the Ethernet header.
+     * @return Success or error code.
+     */
+    Function<IpErr(IpBufRef frame)> send_chksum_frame = nullptr;
+};
+
+/**
+ * Ethernet and ARP statistics counters of an @ref EthIpIface.
+ * 
+ * A snapshot can be obtained using @ref EthIpIface::getEthStats. IP-level counters of
+ * the interface are available via @ref IpIface::getStats.
+ */
+struct EthIpIfaceStats {
+    /**
+     * Frames received from the driver.
+     */
+    IpStatCounter in_frames;
+    
+    /**
+     * Received frames discarded because they are too short or have an unsupported
+     * EtherType.
+     */
+    IpStatCounter in_discards;
+    
+    /**
+     * Received ARP packets which passed sanity checks.
+     */
+    IpStatCounter arp_in_packets;
+    
+    /**
+     * Received ARP packets discarded due to errors (too short or unsupported
+     * hardware or protocol type).
+     */
+    IpStatCounter arp_in_errors;
+    
+    /**
+     * ARP requests sent (including unicast refresh requests).
+     */
+    IpStatCounter arp_out_requests;
+    
+    /**
+     * ARP replies sent.
+     */
+    IpStatCounter arp_out_replies;
+    
+    /**
+     * Outgoing IP packets not sent because the hardware address was not available
+     * (ARP resolution in progress or not possible).
+     */
+    IpStatCounter arp_misses;
+    
+    /**
+     * Outgoing IP packets not sent because other senders had their turn to send on the
+     * congested interface (see @ref EthIpIfaceOptions::TxSchedQuantum).
+     */
+    IpStatCounter out_sched_deferrals;
 };
 
 /**
@@ -176,7 +288,8 @@ class EthIpIface final :
     ,private EthHwIface
 #endif
 {
-    AIPSTACK_USE_VALS(Arg::Params, (NumArpEntries, ArpProtectCount, HeaderBeforeEth))
+    AIPSTACK_USE_VALS(Arg::Params, (NumArpEntries, ArpProtectCount, HeaderBeforeEth,
+                                    TxSchedQuantum))
     AIPSTACK_USE_TYPES(Arg::Params, (TimersStructureService))
     AIPSTACK_USE_TYPES(Arg, (PlatformImpl, StackArg))
     
@@ -314,14 +427,23 @@ public:
             /*hw_type=*/ IpHwType::Ethernet,
             /*hw_iface=*/ static_cast<EthHwIface *>(this),
             AIPSTACK_BIND_MEMBER_TN(&EthIpIface::driverSendIp4Packet, this),
-            AIPSTACK_BIND_MEMBER_TN(&EthIpIface::driverGetState, this)
+            AIPSTACK_BIND_MEMBER_TN(&EthIpIface::driverGetState, this),
+            /*offload_flags=*/ IpIfaceOffloadFlags::TcpSegmentation |
+                (params.offload_flags & IpIfaceOffloadFlags::TxProtoChksum),
+            /*tso_max_len=*/ TypeMax<uint16_t>(),
+            AIPSTACK_BIND_MEMBER_TN(&EthIpIface::driverSendIp4TsoPacket, this),
+            AIPSTACK_BIND_MEMBER_TN(&EthIpIface::driverSendIp4ChksumPacket, this)
         }),
-        m_timer(platform_, AIPSTACK_BIND_MEMBER_TN(&EthIpIface::timerHandler, this))
+        m_timer(platform_, AIPSTACK_BIND_MEMBER_TN(&EthIpIface::timerHandler, this)),
+        m_tx_sched(TxSchedQuantum)
     {
         AIPSTACK_ASSERT(params.eth_mtu >= EthHeader::Size)
         AIPSTACK_ASSERT(params.mac_addr != nullptr)
         AIPSTACK_ASSERT(params.send_frame)
         AIPSTACK_ASSERT(params.get_eth_state)
+        AIPSTACK_ASSERT(!driverHasTso() ||
+                        (params.send_tso_frame && params.tso_max_len >= params.eth_mtu))
+        AIPSTACK_ASSERT(!driverHasTxChksum() || params.send_chksum_frame)
         
         // Initialize ARP entries...
         for (auto &e : m_arp_entries) {
@@ -357,6 +479,18 @@ public:
         return m_driver_iface.iface();
     }
     
+    /**
+     * Return a snapshot of the Ethernet and ARP statistics counters.
+     * 
+     * This may be called from any thread, but the individual counters are
+     * read independently (see @ref IpStatCounter).
+     * 
+     * @return Copy of the statistics counters.
+     */
+    inline EthIpIfaceStats getEthStats () const {
+        return m_stats;
+    }
+    
     /**
      * Process a received Ethernet frame.
      * 
@@ -366,12 +500,21 @@ public:
      * this, especially @ref EthIfaceDriverParams::send_frame.
      * 
      * @param frame Received frame, presumably starting with the Ethernet header. The
-     *              referenced buffers will only be read from within this function call.
+     *              referenced buffers will only be read from within this function call,
+     *              unless the stack takes them over via `hold`.
+     * @param hold Optional hand-off object which allows the stack to keep using the
+     *             buffers after this returns, see @ref IpDriverIface::recvIp4Packet.
+     * @param rx_flags Checksum offload results for the frame, see @ref
+     *                 IpDriverIface::recvIp4Packet.
      */
-    void recvFrame (IpBufRef frame)
+    void recvFrame (IpBufRef frame, IpRxBufHold *hold = nullptr,
+                    IpRxFlags rx_flags = IpRxFlags())
     {
+        m_stats.in_frames.inc();
+        
         // Check that we have an Ethernet header.
         if (AIPSTACK_UNLIKELY(!frame.hasHeader(EthHeader::Size))) {
+            m_stats.in_discards.inc();
             return;
         }
         
@@ -386,11 +529,38 @@ public:
         
         // Handle based on the EtherType.
         if (AIPSTACK_LIKELY(ethtype == EthTypeIpv4)) {
-            m_driver_iface.recvIp4Packet(pkt);
+            m_driver_iface.recvIp4Packet(pkt, hold, rx_flags);
         }
         else if (ethtype == EthTypeArp) {
             recvArpPacket(pkt);
         }
+        else {
+            m_stats.in_discards.inc();
+        }
+    }
+    
+    /**
+     * Start a receive batch.
+     * 
+     * A driver which receives multiple frames at once should call this before
+     * passing them to @ref recvFrame and call @ref endRecvBatch after that, which
+     * allows received TCP segments to be coalesced; see @ref
+     * IpDriverIface::beginRecvBatch.
+     */
+    inline void beginRecvBatch ()
+    {
+        m_driver_iface.beginRecvBatch();
+    }
+    
+    /**
+     * End a receive batch, see @ref IpDriverIface::endRecvBatch.
+     * 
+     * @note The driver must support various driver functions being called from within
+     * this, especially @ref EthIfaceDriverParams::send_frame.
+     */
+    inline void endRecvBatch ()
+    {
+        m_driver_iface.endRecvBatch();
     }
     
     /**
@@ -410,14 +580,46 @@ public:
         m_driver_iface.stateChanged();
     }
     
+    /**
+     * Notify that the driver can accept frames again.
+     * 
+     * A driver whose send functions return @ref IpErr::BUFFER_FULL should call this
+     * soon after space in its transmit queue becomes available. This notifies the
+     * senders of the packets which could not be sent (see @ref send-retry), so that
+     * they can resume sending without waiting for a timeout. Senders are notified in
+     * order of their transmit priority (@ref IpSendRetryRequest::setTxPriority) and,
+     * if @ref EthIpIfaceOptions::TxSchedQuantum is nonzero, take turns sending.
+     * 
+     * @note The driver must support various driver functions being called from within
+     * this, especially @ref EthIfaceDriverParams::send_frame.
+     */
+    inline void txReady ()
+    {
+        m_tx_sched.dispatch();
+    }
+    
 private:
     IpErr driverSendIp4Packet (IpBufRef pkt, Ip4Addr ip_addr,
                                IpSendRetryRequest *retryReq)
+    {
+        return send_ip4_packet(pkt, ip_addr, retryReq, false);
+    }
+    
+    IpErr driverSendIp4ChksumPacket (IpBufRef pkt, Ip4Addr ip_addr,
+                                     IpSendRetryRequest *retryReq)
+    {
+        return send_ip4_packet(pkt, ip_addr, retryReq, true);
+    }
+    
+    IpErr send_ip4_packet (IpBufRef pkt, Ip4Addr ip_addr,
+                           IpSendRetryRequest *retryReq, bool chksum_offload)
     {
         // Try to resolve the MAC address.
         MacAddr dst_mac;
         IpErr resolve_err = resolve_hw_addr(ip_addr, &dst_mac, retryReq);
         if (AIPSTACK_UNLIKELY(resolve_err != IpErr::SUCCESS)) {
+            m_stats.arp_misses.inc();
+            AIPSTACK_TRACE(EthArpMiss, resolve_err, ip_addr.data[0], pkt.tot_len)
             return resolve_err;
         }
         
@@ -433,8 +635,84 @@ private:
         eth_header.set(EthHeader::SrcMac(),  *m_params.mac_addr);
         eth_header.set(EthHeader::EthType(), EthTypeIpv4);
         
+        // Check whether it is this sender's turn if the interface is congested.
+        if (AIPSTACK_UNLIKELY(!m_tx_sched.admit(retryReq, frame.tot_len))) {
+            m_stats.out_sched_deferrals.inc();
+            return IpErr::BUFFER_FULL;
+        }
+        
         // Send the frame via the lower-layer driver.
-        return m_params.send_frame(frame);
+        IpErr err = chksum_offload ? m_params.send_chksum_frame(frame) :
+            m_params.send_frame(frame);
+        return check_tx_full(err, retryReq);
+    }
+    
+    IpErr driverSendIp4TsoPacket (IpBufRef pkt, uint16_t seg_data_len, Ip4Addr ip_addr,
+                                  IpSendRetryRequest *retryReq, size_t &out_data_sent)
+    {
+        // Resolve the MAC address once for all segments.
+        MacAddr dst_mac;
+        IpErr resolve_err = resolve_hw_addr(ip_addr, &dst_mac, retryReq);
+        if (AIPSTACK_UNLIKELY(resolve_err != IpErr::SUCCESS)) {
+            m_stats.arp_misses.inc();
+            AIPSTACK_TRACE(EthArpMiss, resolve_err, ip_addr.data[0], pkt.tot_len)
+            return resolve_err;
+        }
+        
+        // Reveal the Ethernet header.
+        IpBufRef frame;
+        if (AIPSTACK_UNLIKELY(!pkt.revealHeader(EthHeader::Size, &frame))) {
+            return IpErr::NO_HEADER_SPACE;
+        }
+        
+        // Write the Ethernet header.
+        auto eth_header = EthHeader::MakeRef(frame.getChunkPtr());
+        eth_header.set(EthHeader::DstMac(),  dst_mac);
+        eth_header.set(EthHeader::SrcMac(),  *m_params.mac_addr);
+        eth_header.set(EthHeader::EthType(), EthTypeIpv4);
+        
+        // Check whether it is this sender's turn if the interface is congested.
+        if (AIPSTACK_UNLIKELY(!m_tx_sched.admit(retryReq, frame.tot_len))) {
+            m_stats.out_sched_deferrals.inc();
+            return IpErr::BUFFER_FULL;
+        }
+        
+        // If the driver can segment the whole frame, just pass it on.
+        bool tso = driverHasTso();
+        if (tso && frame.tot_len <= m_params.tso_max_len) {
+            return check_tx_full(m_params.send_tso_frame(frame, seg_data_len), retryReq);
+        }
+        
+        // Otherwise segment in software, into frames which the driver segments
+        // further if it can.
+        auto tcp_header = Tcp4Header::MakeRef(
+            frame.getChunkPtr() + (EthHeader::Size + Ip4Header::Size));
+        size_t hdrs_len = EthHeader::Size + Ip4Header::Size +
+            4 * size_t(tcp_header.get(Tcp4Header::OffsetFlags()) >> TcpOffsetShift);
+        size_t segs_per_pkt = !tso ? 1 :
+            MaxValue(size_t(1), (m_params.tso_max_len - hdrs_len) / seg_data_len);
+        
+        bool partial_chksum = driverHasTxChksum();
+        
+        IpErr err = IpTcpSegmenter::segment(frame, EthHeader::Size, seg_data_len,
+            segs_per_pkt, partial_chksum, [&](IpBufRef seg_frame) {
+                return (seg_frame.tot_len > hdrs_len + seg_data_len) ?
+                    m_params.send_tso_frame(seg_frame, seg_data_len) :
+                    partial_chksum ? m_params.send_chksum_frame(seg_frame) :
+                    m_params.send_frame(seg_frame);
+            },
+            out_data_sent);
+        return check_tx_full(err, retryReq);
+    }
+    
+    // If the driver's transmit queue is full, let the transmit scheduler register
+    // the requestor to be notified from txReady.
+    inline IpErr check_tx_full (IpErr err, IpSendRetryRequest *retryReq)
+    {
+        if (AIPSTACK_UNLIKELY(err == IpErr::BUFFER_FULL)) {
+            m_tx_sched.driverFull(retryReq);
+        }
+        return err;
     }
     
     IpIfaceDriverState driverGetState ()
@@ -448,6 +726,18 @@ private:
         return state;
     }
     
+    inline bool driverHasTso () const
+    {
+        return (m_params.offload_flags & IpIfaceOffloadFlags::TcpSegmentation) !=
+               EnumZero;
+    }
+    
+    inline bool driverHasTxChksum () const
+    {
+        return (m_params.offload_flags & IpIfaceOffloadFlags::TxProtoChksum) !=
+               EnumZero;
+    }
+    
 private: // EthHwIface
     MacAddr getMacAddr () override final
     {
@@ -479,6 +769,7 @@ private:
     {
         // Check that we have the ARP header.
         if (AIPSTACK_UNLIKELY(!pkt.hasHeader(ArpIp4Header::Size))) {
+            m_stats.arp_in_errors.inc();
             return;
         }
         auto arp_header = ArpIp4Header::MakeRef(pkt.getChunkPtr());
@@ -489,9 +780,12 @@ private:
             arp_header.get(ArpIp4Header::HwAddrLen())    != MacAddr::Size ||
             arp_header.get(ArpIp4Header::ProtoAddrLen()) != Ip4Addr::Size)
         {
+            m_stats.arp_in_errors.inc();
             return;
         }
         
+        m_stats.arp_in_packets.inc();
+        
         // Get some ARP header fields.
         uint16_t op_type    = arp_header.get(ArpIp4Header::OpType());
         MacAddr src_mac     = arp_header.get(ArpIp4Header::SrcHwAddr());
@@ -777,6 +1071,12 @@ private:
     
     IpErr send_arp_packet (uint16_t op_type, MacAddr dst_mac, Ip4Addr dst_ipaddr)
     {
+        if (op_type == ArpOpTypeRequest) {
+            m_stats.arp_out_requests.inc();
+        } else {
+            m_stats.arp_out_replies.inc();
+        }
+        
         // Get a local buffer for the frame,
         TxAllocHelper<EthArpPktSize, HeaderBeforeEth> frame_alloc(EthArpPktSize);
         
@@ -963,6 +1263,8 @@ private:
     StructureRaiiWrapper<ArpEntryTimerQueue> m_timer_queue;
     TimeType m_timers_ref_time;
     EthHeader::Ref m_rx_eth_header;
+    EthIpIfaceStats m_stats;
+    IpTxScheduler m_tx_sched;
     ArpEntry m_arp_entries[NumArpEntries];
     
     struct ArpEntriesAccessor :
@@ -1004,6 +1306,22 @@ struct EthIpIfaceOptions {
      */
     AIPSTACK_OPTION_DECL_VALUE(HeaderBeforeEth, size_t, 0)
     
+    /**
+     * Number of bytes a sender may send per turn while the transmit queue of the driver
+     * is congested, or 0 to disable fair scheduling.
+     * 
+     * When nonzero, after the driver refuses a frame with @ref IpErr::BUFFER_FULL,
+     * senders (such as TCP connections) take turns sending in round-robin order as
+     * space becomes available, higher transmit priority first (see @ref IpTxScheduler).
+     * This prevents a bulk sender from monopolizing a slow interface. A reasonable
+     * value is a few times the MTU.
+     * 
+     * This must only be enabled if the driver calls @ref EthIpIface::txReady whenever
+     * there is space in the transmit queue after a send function returned
+     * @ref IpErr::BUFFER_FULL.
+     */
+    AIPSTACK_OPTION_DECL_VALUE(TxSchedQuantum, size_t, 0)
+    
     /**
      * Data structure to use for ARP entry timers.
      * 
@@ -1039,6 +1357,7 @@ class EthIpIfaceService {
     AIPSTACK_OPTION_CONFIG_VALUE(EthIpIfaceOptions, NumArpEntries)
     AIPSTACK_OPTION_CONFIG_VALUE(EthIpIfaceOptions, ArpProtectCount)
     AIPSTACK_OPTION_CONFIG_VALUE(EthIpIfaceOptions, HeaderBeforeEth)
+    AIPSTACK_OPTION_CONFIG_VALUE(EthIpIfaceOptions, TxSchedQuantum)
     AIPSTACK_OPTION_CONFIG_TYPE(EthIpIfaceOptions, TimersStructureService)
     
 public:
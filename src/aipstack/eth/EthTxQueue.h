@@ -0,0 +1,509 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AIPSTACK_ETH_TX_QUEUE_H
+#define AIPSTACK_ETH_TX_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Hints.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/platform/PlatformFacade.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup eth-ip-iface
+ * @{
+ */
+
+/**
+ * Encapsulates parameters passed to the @ref EthTxQueue constructor.
+ * 
+ * The send functions have the same semantics as the corresponding functions in
+ * @ref EthIfaceDriverParams, and are the functions of the actual driver.
+ */
+struct EthTxQueueParams {
+    /**
+     * Memory for the queue of frames (must outlive the @ref EthTxQueue).
+     * 
+     * Each queued frame takes its length plus a small per-frame overhead.
+     */
+    char *ring_buf = nullptr;
+    
+    /**
+     * Size of @ref ring_buf in bytes.
+     * 
+     * This must cover the largest frame which may be sent plus the per-frame
+     * overhead, including TSO frames of the maximum size passed to
+     * @ref EthTxQueue::sendTsoFrame. A frame which does not fit can only be passed
+     * to the driver directly, when nothing is queued, so its sender has to wait
+     * until the queue is empty.
+     */
+    size_t ring_size = 0;
+    
+    /**
+     * Initial and minimum number of bytes passed to the driver and not yet reported
+     * as transmitted using @ref EthTxQueue::txCompleted.
+     * 
+     * This should be at least the largest frame size.
+     */
+    size_t min_limit = 0;
+    
+    /**
+     * Maximum number of bytes passed to the driver and not yet reported as transmitted.
+     */
+    size_t max_limit = 0;
+    
+    /**
+     * Driver function to send an Ethernet frame (must be provided).
+     */
+    Function<IpErr(IpBufRef frame)> send_frame = nullptr;
+    
+    /**
+     * Driver function to send a frame for TCP segmentation, used for frames queued using
+     * @ref EthTxQueue::sendTsoFrame.
+     */
+    Function<IpErr(IpBufRef frame, uint16_t seg_data_len)> send_tso_frame = nullptr;
+    
+    /**
+     * Driver function to send a frame whose checksum is to be completed, used for frames
+     * queued using @ref EthTxQueue::sendChksumFrame.
+     */
+    Function<IpErr(IpBufRef frame)> send_chksum_frame = nullptr;
+    
+    /**
+     * Function called when frames can be queued again after a send function of the
+     * @ref EthTxQueue returned @ref IpErr::BUFFER_FULL (must be provided).
+     * 
+     * This is normally bound to @ref EthIpIface::txReady.
+     */
+    Function<void()> tx_ready = nullptr;
+};
+
+/**
+ * Bounded software transmit queue in front of an Ethernet driver, which limits the
+ * amount of data in the driver's own transmit queue.
+ * 
+ * Deep transmit queues in drivers and hardware add latency for all traffic on an
+ * interface. This class keeps such queues short by limiting the number of bytes passed
+ * to the driver which have not been transmitted yet, holding further frames in a bounded
+ * ring buffer. The limit is adjusted dynamically from the observed completions similar to
+ * Linux byte queue limits (BQL): it is raised when the driver ran out of data while
+ * frames were being held back, and lowered to the amount actually used when the limit has
+ * not been reached over a number of completions.
+ * 
+ * This class is used by a driver as follows:
+ * - The @ref sendFrame, @ref sendTsoFrame and @ref sendChksumFrame functions are used as
+ *   the send functions in @ref EthIfaceDriverParams, and the functions of the driver
+ *   are passed in @ref EthTxQueueParams.
+ * - The driver calls @ref txCompleted to report the bytes of frames which have been
+ *   transmitted (or discarded), and @ref txReady when its send functions may succeed
+ *   again after returning @ref IpErr::BUFFER_FULL.
+ * 
+ * A frame is passed to the driver directly if nothing is queued and the limit allows it.
+ * Otherwise it is copied to the queue, and the queue is flushed in one batch from a timer
+ * which expires immediately, that is after the events currently being processed. When
+ * the queue is full the send functions return @ref IpErr::BUFFER_FULL and the
+ * @ref EthTxQueueParams::tx_ready function is called when at least half of the queue is
+ * free again, and also when nothing is queued and the driver may accept more data, so
+ * that the sender of a frame larger than the queue is not stalled. Queued frames which the driver fails to send with an error other than
+ * @ref IpErr::BUFFER_FULL are dropped.
+ * 
+ * @tparam PlatformImpl Platform layer implementation.
+ */
+template <typename PlatformImpl>
+class EthTxQueue :
+    private NonCopyable<EthTxQueue<PlatformImpl>>
+{
+    using Platform = PlatformFacade<PlatformImpl>;
+    
+    enum class FrameType : uint8_t {Plain, Tso, Chksum, Wrap};
+    
+    struct RecordHeader {
+        size_t len;
+        uint16_t seg_data_len;
+        FrameType type;
+    };
+    
+    static size_t const HeaderSize = sizeof(RecordHeader);
+    
+    // Number of completions without reaching the limit after which the limit
+    // is lowered.
+    static int const SlackCompletions = 16;
+    
+public:
+    /**
+     * Construct the transmit queue.
+     * 
+     * @param platform_ The platform facade.
+     * @param params Parameters, see @ref EthTxQueueParams.
+     */
+    EthTxQueue (Platform platform_, EthTxQueueParams const &params) :
+        m_params(params),
+        m_flush_timer(platform_, AIPSTACK_BIND_MEMBER_TN(&EthTxQueue::flushTimerHandler, this)),
+        m_read(0),
+        m_write(0),
+        m_used(0),
+        m_count(0),
+        m_limit(params.min_limit),
+        m_inflight(0),
+        m_peak_inflight(0),
+        m_slack_count(0),
+        m_limited(false),
+        m_driver_full(false),
+        m_sender_blocked(false)
+    {
+        AIPSTACK_ASSERT(params.ring_buf != nullptr)
+        AIPSTACK_ASSERT(params.min_limit > 0)
+        AIPSTACK_ASSERT(params.max_limit >= params.min_limit)
+        AIPSTACK_ASSERT(params.send_frame)
+        AIPSTACK_ASSERT(params.tx_ready)
+    }
+    
+    /**
+     * Send or queue an Ethernet frame.
+     * 
+     * @param frame Frame to send.
+     * @return Success or error code.
+     */
+    inline IpErr sendFrame (IpBufRef frame)
+    {
+        return send(frame, FrameType::Plain, 0);
+    }
+    
+    /**
+     * Send or queue an Ethernet frame for TCP segmentation.
+     * 
+     * @param frame Frame to send.
+     * @param seg_data_len Maximum TCP data length in each segment.
+     * @return Success or error code.
+     */
+    inline IpErr sendTsoFrame (IpBufRef frame, uint16_t seg_data_len)
+    {
+        return send(frame, FrameType::Tso, seg_data_len);
+    }
+    
+    /**
+     * Send or queue an Ethernet frame whose checksum is to be completed.
+     * 
+     * @param frame Frame to send.
+     * @return Success or error code.
+     */
+    inline IpErr sendChksumFrame (IpBufRef frame)
+    {
+        return send(frame, FrameType::Chksum, 0);
+    }
+    
+    /**
+     * Report that frames passed to the driver have been transmitted or discarded.
+     * 
+     * @param bytes Total length of these frames (not more than the number of bytes
+     *        passed to the driver and not yet reported).
+     */
+    void txCompleted (size_t bytes)
+    {
+        AIPSTACK_ASSERT(bytes <= m_inflight)
+        
+        if (bytes == 0) {
+            return;
+        }
+        
+        m_inflight -= bytes;
+        
+        if (m_limited) {
+            // If the driver ran out of data while frames were held back,
+            // the limit was too low.
+            if (m_inflight == 0) {
+                m_limit = MinValue(m_params.max_limit, m_limit + bytes);
+            }
+            reset_slack();
+        }
+        else if (++m_slack_count >= SlackCompletions) {
+            // The limit was not reached for a while, lower it to the most that
+            // was actually in the driver.
+            m_limit = MaxValue(m_params.min_limit, MinValue(m_limit, m_peak_inflight));
+            reset_slack();
+        }
+        
+        m_limited = false;
+        
+        schedule_flush();
+    }
+    
+    /**
+     * Report that the send functions of the driver may succeed again after one of them
+     * returned @ref IpErr::BUFFER_FULL.
+     */
+    void txReady ()
+    {
+        m_driver_full = false;
+        
+        schedule_flush();
+    }
+    
+    /**
+     * Return the current limit of bytes in the driver.
+     * 
+     * @return Current limit.
+     */
+    inline size_t getLimit () const
+    {
+        return m_limit;
+    }
+    
+    /**
+     * Return the number of bytes passed to the driver and not yet reported as
+     * transmitted.
+     * 
+     * @return Bytes in the driver.
+     */
+    inline size_t getInflight () const
+    {
+        return m_inflight;
+    }
+    
+    /**
+     * Return the number of frames in the queue.
+     * 
+     * @return Number of queued frames.
+     */
+    inline size_t getQueuedFrames () const
+    {
+        return m_count;
+    }
+    
+private:
+    IpErr send (IpBufRef frame, FrameType type, uint16_t seg_data_len)
+    {
+        // Pass the frame on directly if possible.
+        if (m_count == 0 && !m_driver_full && admit(frame.tot_len)) {
+            IpErr err = send_to_driver(frame, type, seg_data_len);
+            if (AIPSTACK_LIKELY(err != IpErr::BUFFER_FULL)) {
+                return err;
+            }
+        }
+        
+        // Copy the frame to the queue.
+        char *data = alloc_record(frame.tot_len, type, seg_data_len);
+        if (AIPSTACK_UNLIKELY(data == nullptr)) {
+            m_sender_blocked = true;
+            return IpErr::BUFFER_FULL;
+        }
+        frame.takeBytes(frame.tot_len, data);
+        
+        schedule_flush();
+        
+        return IpErr::SUCCESS;
+    }
+    
+    inline bool admit (size_t len)
+    {
+        // Always allow a frame if the driver is empty, so that frames larger
+        // than the limit can be sent.
+        if (m_inflight > 0 && len > m_limit - MinValue(m_limit, m_inflight)) {
+            m_limited = true;
+            return false;
+        }
+        return true;
+    }
+    
+    IpErr send_to_driver (IpBufRef frame, FrameType type, uint16_t seg_data_len)
+    {
+        IpErr err;
+        switch (type) {
+            case FrameType::Tso:
+                err = m_params.send_tso_frame(frame, seg_data_len);
+                break;
+            case FrameType::Chksum:
+                err = m_params.send_chksum_frame(frame);
+                break;
+            default:
+                err = m_params.send_frame(frame);
+                break;
+        }
+        
+        if (AIPSTACK_LIKELY(err == IpErr::SUCCESS)) {
+            m_inflight += frame.tot_len;
+            m_peak_inflight = MaxValue(m_peak_inflight, m_inflight);
+        }
+        else if (err == IpErr::BUFFER_FULL) {
+            m_driver_full = true;
+        }
+        
+        return err;
+    }
+    
+    inline void schedule_flush ()
+    {
+        // The timer is also needed with an empty queue to call tx_ready for a
+        // sender whose frame did not fit in the queue.
+        if ((m_count > 0 || m_sender_blocked) && !m_driver_full &&
+            !m_flush_timer.isSet())
+        {
+            m_flush_timer.setNow();
+        }
+    }
+    
+    void flushTimerHandler ()
+    {
+        while (m_count > 0 && !m_driver_full) {
+            RecordHeader hdr = read_header();
+            
+            if (!admit(hdr.len)) {
+                break;
+            }
+            
+            IpBufNode node{m_params.ring_buf + m_read + HeaderSize, hdr.len, nullptr};
+            IpErr err = send_to_driver(IpBufRef{&node, 0, hdr.len}, hdr.type,
+                                       hdr.seg_data_len);
+            if (err == IpErr::BUFFER_FULL) {
+                break;
+            }
+            
+            // Remove the frame from the queue (it is dropped on other errors).
+            free_record(hdr.len);
+        }
+        
+        // Let senders continue when half of the queue is free.
+        if (m_sender_blocked && m_used <= m_params.ring_size / 2) {
+            m_sender_blocked = false;
+            m_params.tx_ready();
+        }
+    }
+    
+    inline void reset_slack ()
+    {
+        m_peak_inflight = m_inflight;
+        m_slack_count = 0;
+    }
+    
+    // Records are stored contiguously; when one does not fit at the end of the
+    // buffer the rest of the buffer is skipped, marked with a Wrap record if a
+    // record header fits there.
+    char * alloc_record (size_t len, FrameType type, uint16_t seg_data_len)
+    {
+        size_t rec_size = HeaderSize + len;
+        
+        if (m_count == 0) {
+            m_read = 0;
+            m_write = 0;
+            m_used = 0;
+        }
+        
+        size_t pos;
+        size_t skip = 0;
+        if (m_count == 0 || m_write > m_read) {
+            if (rec_size <= m_params.ring_size - m_write) {
+                pos = m_write;
+            } else if (rec_size <= m_read) {
+                skip = m_params.ring_size - m_write;
+                pos = 0;
+            } else {
+                return nullptr;
+            }
+        } else {
+            if (rec_size > m_read - m_write) {
+                return nullptr;
+            }
+            pos = m_write;
+        }
+        
+        if (skip >= HeaderSize) {
+            write_header(m_write, RecordHeader{0, 0, FrameType::Wrap});
+        }
+        
+        write_header(pos, RecordHeader{len, seg_data_len, type});
+        
+        m_write = pos + rec_size;
+        m_used += skip + rec_size;
+        m_count++;
+        
+        return m_params.ring_buf + pos + HeaderSize;
+    }
+    
+    RecordHeader read_header ()
+    {
+        AIPSTACK_ASSERT(m_count > 0)
+        
+        if (m_params.ring_size - m_read >= HeaderSize) {
+            RecordHeader hdr = read_header_at(m_read);
+            if (hdr.type != FrameType::Wrap) {
+                return hdr;
+            }
+        }
+        
+        m_used -= m_params.ring_size - m_read;
+        m_read = 0;
+        
+        return read_header_at(m_read);
+    }
+    
+    void free_record (size_t len)
+    {
+        m_read += HeaderSize + len;
+        m_used -= HeaderSize + len;
+        m_count--;
+    }
+    
+    inline RecordHeader read_header_at (size_t pos)
+    {
+        RecordHeader hdr;
+        ::memcpy(&hdr, m_params.ring_buf + pos, HeaderSize);
+        return hdr;
+    }
+    
+    inline void write_header (size_t pos, RecordHeader const &hdr)
+    {
+        ::memcpy(m_params.ring_buf + pos, &hdr, HeaderSize);
+    }
+    
+private:
+    EthTxQueueParams m_params;
+    typename Platform::Timer m_flush_timer;
+    size_t m_read;
+    size_t m_write;
+    size_t m_used;
+    size_t m_count;
+    size_t m_limit;
+    size_t m_inflight;
+    size_t m_peak_inflight;
+    int m_slack_count;
+    bool m_limited;
+    bool m_driver_full;
+    bool m_sender_blocked;
+};
+
+/** @} */
+
+}
+
+#endif
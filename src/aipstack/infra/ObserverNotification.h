@@ -71,6 +71,11 @@ public:
         
     private:
         ListNode *m_first;
+#if AIPSTACK_ASSERTIONS
+        // Number of notifyObservers calls in progress, during which the list
+        // may contain the temporary node of a NotificationIterator.
+        int m_notifying = 0;
+#endif
         
     public:
         inline BaseObservable () :
@@ -104,15 +109,38 @@ public:
             }
         }
         
+        BaseObserver * removeFirst ()
+        {
+            // The first node may be the temporary node of a NotificationIterator.
+            #if AIPSTACK_ASSERTIONS
+            AIPSTACK_ASSERT(m_notifying == 0)
+            #endif
+            
+            ListNode *node = m_first;
+            if (node != nullptr) {
+                remove_node(*node);
+                node->m_prev = nullptr;
+            }
+            return static_cast<BaseObserver *>(node);
+        }
+        
         template <bool RemoveNotified, typename NotifyFunc>
         void notifyObservers (NotifyFunc notify)
         {
+            #if AIPSTACK_ASSERTIONS
+            m_notifying++;
+            #endif
+            
             NotificationIterator iter(*this);
             
             while (BaseObserver *observer = iter.template beginNotify<RemoveNotified>()) {
                 notify(*observer);
                 iter.endNotify();
             }
+            
+            #if AIPSTACK_ASSERTIONS
+            m_notifying--;
+            #endif
         }
         
     private:
@@ -435,6 +463,28 @@ public:
         BaseObservable::template notifyObservers<true>(convertObserverFunc(notify));
     }
     
+    /**
+     * Disassociate one of the observers associated with this observable and return it.
+     * 
+     * Which observer is removed is not specified. This is useful when observers need to
+     * be notified one at a time with other processing in between.
+     * 
+     * This must not be called while @ref notifyKeepObservers or @ref notifyRemoveObservers
+     * is in progress for this observable (i.e. from a `notify` function).
+     * 
+     * @return Pointer to the removed observer, or null if there were no associated
+     *         observers.
+     */
+    inline ObserverDerived * removeObserver ()
+    {
+        BaseObserver *base_observer = BaseObservable::removeFirst();
+        if (base_observer == nullptr) {
+            return nullptr;
+        }
+        auto &observer = static_cast<Observer<ObserverDerived> &>(*base_observer);
+        return &static_cast<ObserverDerived &>(observer);
+    }
+    
 private:
     template <typename Func>
     inline static auto convertObserverFunc (Func func)
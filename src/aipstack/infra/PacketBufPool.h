@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AIPSTACK_PACKET_BUF_POOL_H
+#define AIPSTACK_PACKET_BUF_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Hints.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/RxBufHold.h>
+
+namespace AIpStack {
+
+/**
+ * @ingroup infra
+ * @defgroup packet-buf-pool Packet Buffer Pool
+ * @brief Pool of fixed-size reference-counted packet buffers.
+ * 
+ * An @ref IpPacketBufPool divides a memory region given by the user (a slab) into
+ * a fixed number of buffers (@ref IpPacketBuf) of the same size. A driver
+ * allocates a buffer for each received frame and passes it to the stack together
+ * with its @ref IpRxBufHold (see @ref IpPacketBuf::rxHold), so that the stack can
+ * keep the buffer after the receive call returns (see @ref rx-buf-hold) without
+ * the frame being copied. Other users may keep the buffer by adding references
+ * (@ref IpPacketBuf::incRef). The buffer returns to the pool when there are no
+ * more references and it is not held by the stack.
+ * 
+ * Each buffer starts with headroom, space before the packet data where headers
+ * can be prepended (e.g. `HeaderBeforeIp` or `HeaderBeforeEth`, or a header which
+ * a device puts before the frame). Buffers and the packet data in them start at
+ * cache line boundaries (see @ref IpPacketBufPool::CacheLineSize).
+ * 
+ * The pool is not thread-safe. When the stack is used in multiple threads (e.g.
+ * one stack per queue of a multi-queue device), each thread should have its own
+ * pool. This serves as a per-thread cache which needs no synchronization, since a
+ * buffer is always released in the thread of the stack which received it.
+ * 
+ * @{
+ */
+
+class IpPacketBufPool;
+
+/**
+ * Parameters for @ref IpPacketBufPool.
+ */
+struct IpPacketBufPoolParams {
+    /**
+     * The memory to be used for buffers (must outlive the pool).
+     * 
+     * It does not need to be aligned; @ref IpPacketBufPool::getMemSize gives the
+     * size needed for a given number of buffers.
+     */
+    char *mem = nullptr;
+    
+    /**
+     * Size of @ref mem in bytes.
+     */
+    size_t mem_size = 0;
+    
+    /**
+     * Space in each buffer before the packet data, in bytes.
+     * 
+     * It is rounded up to a multiple of @ref IpPacketBufPool::CacheLineSize.
+     */
+    size_t headroom = 0;
+    
+    /**
+     * Space in each buffer for packet data, in bytes (must be nonzero).
+     */
+    size_t data_size = 0;
+};
+
+/**
+ * A buffer from an @ref IpPacketBufPool.
+ * 
+ * The buffer is allocated with one reference (@ref IpPacketBufPool::alloc).
+ * Additional references can be added with @ref incRef and are removed with @ref
+ * decRef. While the stack holds the buffer through @ref rxHold, that counts as
+ * an additional reference. When the last reference is removed or the stack
+ * releases the buffer and there are no references, the buffer is returned to the
+ * pool.
+ * 
+ * A typical receive in a driver is:
+ * 
+ * ```
+ * IpPacketBuf *buf = pool.alloc();
+ * // ... receive a frame of len bytes into buf->getData() ...
+ * eth_iface.recvFrame(buf->getRef(len), buf->rxHold());
+ * buf->decRef();
+ * ```
+ */
+class IpPacketBuf :
+    private IpRxBufHold
+{
+    friend class IpPacketBufPool;
+    
+public:
+    /**
+     * Return a pointer to the start of the headroom.
+     * 
+     * @return Start of the buffer memory (aligned to a cache line).
+     */
+    inline char * getBuffer () const
+    {
+        return m_buffer;
+    }
+    
+    /**
+     * Return a pointer to the packet data (after the headroom).
+     * 
+     * @return Start of packet data (aligned to a cache line).
+     */
+    inline char * getData () const
+    {
+        return m_buffer + m_headroom;
+    }
+    
+    /**
+     * Return the size of the headroom, @ref IpPacketBufPoolParams::headroom
+     * rounded up.
+     * 
+     * @return Size of the headroom in bytes.
+     */
+    inline size_t getHeadroom () const
+    {
+        return m_headroom;
+    }
+    
+    /**
+     * Return a buffer reference to packet data.
+     * 
+     * The reference refers to a buffer node in this object, it remains valid as
+     * long as the buffer is not returned to the pool.
+     * 
+     * @param len Length of the packet data in bytes (must fit in the buffer).
+     * @return Reference to `len` bytes at @ref getData, with the headroom
+     *         available before it (see @ref IpBufRef::revealHeader).
+     */
+    inline IpBufRef getRef (size_t len) const
+    {
+        AIPSTACK_ASSERT(len <= m_node.len - m_headroom)
+        
+        return IpBufRef{&m_node, m_headroom, len};
+    }
+    
+    /**
+     * Return the @ref IpRxBufHold to be passed to the stack with the packet.
+     * 
+     * @return The hold object of this buffer.
+     */
+    inline IpRxBufHold * rxHold ()
+    {
+        return static_cast<IpRxBufHold *>(this);
+    }
+    
+    /**
+     * Return whether the buffer is held by the stack through @ref rxHold.
+     * 
+     * @return True if held, false if not.
+     */
+    using IpRxBufHold::isHeld;
+    
+    /**
+     * Add a reference to the buffer.
+     * 
+     * The buffer must be referenced or held by the stack.
+     */
+    inline void incRef ()
+    {
+        AIPSTACK_ASSERT(m_refs > 0 || isHeld())
+        
+        m_refs++;
+    }
+    
+    /**
+     * Remove a reference to the buffer.
+     * 
+     * The buffer is returned to the pool if this was the last reference and the
+     * buffer is not held by the stack.
+     */
+    inline void decRef ()
+    {
+        AIPSTACK_ASSERT(m_refs > 0)
+        
+        m_refs--;
+        if (m_refs == 0 && !isHeld()) {
+            free();
+        }
+    }
+    
+    /**
+     * Return the number of references (not including a hold by the stack).
+     * 
+     * @return Number of references.
+     */
+    inline size_t getRefCount () const
+    {
+        return m_refs;
+    }
+    
+private:
+    inline IpPacketBuf (IpPacketBufPool *pool, char *buffer, size_t headroom,
+                        size_t size) :
+        m_pool(pool),
+        m_buffer(buffer),
+        m_headroom(headroom),
+        m_refs(0),
+        m_next_free(nullptr),
+        m_node{buffer, size, nullptr}
+    {}
+    
+    ~IpPacketBuf () = default;
+    
+    void rxBufReleased () override final
+    {
+        if (m_refs == 0) {
+            free();
+        }
+    }
+    
+    inline void free ();
+    
+private:
+    IpPacketBufPool *m_pool;
+    char *m_buffer;
+    size_t m_headroom;
+    size_t m_refs;
+    IpPacketBuf *m_next_free;
+    IpBufNode m_node;
+};
+
+/**
+ * Pool of fixed-size reference-counted packet buffers.
+ * 
+ * See the @ref packet-buf-pool module description.
+ */
+class IpPacketBufPool :
+    private NonCopyable<IpPacketBufPool>
+{
+    friend class IpPacketBuf;
+    
+public:
+    /**
+     * Alignment of the buffers and packet data in bytes.
+     */
+    static size_t const CacheLineSize = 64;
+    
+    /**
+     * Return the memory size needed for a pool.
+     * 
+     * @param num_bufs Number of buffers.
+     * @param headroom See @ref IpPacketBufPoolParams::headroom.
+     * @param data_size See @ref IpPacketBufPoolParams::data_size.
+     * @return The value of @ref IpPacketBufPoolParams::mem_size needed for
+     *         `num_bufs` buffers with any alignment of the memory.
+     */
+    static constexpr size_t getMemSize (size_t num_bufs, size_t headroom,
+                                        size_t data_size)
+    {
+        return (CacheLineSize - 1) + num_bufs * slotSize(headroom, data_size);
+    }
+    
+    /**
+     * Construct the pool, with all buffers free.
+     * 
+     * @param params Parameters, see @ref IpPacketBufPoolParams.
+     */
+    IpPacketBufPool (IpPacketBufPoolParams const &params) :
+        m_headroom(alignUp(params.headroom)),
+        m_data_size(params.data_size),
+        m_num_bufs(0),
+        m_num_free(0),
+        m_free_list(nullptr)
+    {
+        AIPSTACK_ASSERT(params.mem != nullptr)
+        AIPSTACK_ASSERT(params.data_size > 0)
+        
+        size_t slot_size = slotSize(params.headroom, params.data_size);
+        size_t skip = alignUp(uintptr_t(params.mem)) - uintptr_t(params.mem);
+        
+        if (params.mem_size >= skip) {
+            m_num_bufs = (params.mem_size - skip) / slot_size;
+        }
+        
+        // Put buffers into the free list in reverse so that they are allocated
+        // in address order.
+        for (size_t i = m_num_bufs; i > 0; i--) {
+            char *slot = params.mem + skip + (i - 1) * slot_size;
+            IpPacketBuf *buf = new(slot) IpPacketBuf(this, slot + HeaderSpace,
+                m_headroom, m_headroom + m_data_size);
+            buf->m_next_free = m_free_list;
+            m_free_list = buf;
+        }
+        
+        m_num_free = m_num_bufs;
+    }
+    
+    /**
+     * Destruct the pool.
+     * 
+     * All buffers must have been returned to the pool.
+     */
+    ~IpPacketBufPool ()
+    {
+        AIPSTACK_ASSERT(m_num_free == m_num_bufs)
+        
+        while (m_free_list != nullptr) {
+            IpPacketBuf *buf = m_free_list;
+            m_free_list = buf->m_next_free;
+            buf->~IpPacketBuf();
+        }
+    }
+    
+    /**
+     * Allocate a buffer.
+     * 
+     * @return A buffer with one reference, or null if no buffer is free.
+     */
+    inline IpPacketBuf * alloc ()
+    {
+        IpPacketBuf *buf = m_free_list;
+        if (AIPSTACK_UNLIKELY(buf == nullptr)) {
+            return nullptr;
+        }
+        
+        m_free_list = buf->m_next_free;
+        m_num_free--;
+        
+        buf->m_refs = 1;
+        
+        return buf;
+    }
+    
+    /**
+     * Return the headroom of buffers, see @ref IpPacketBuf::getHeadroom.
+     * 
+     * @return Headroom in bytes.
+     */
+    inline size_t getHeadroom () const
+    {
+        return m_headroom;
+    }
+    
+    /**
+     * Return the space for packet data in buffers.
+     * 
+     * @return @ref IpPacketBufPoolParams::data_size.
+     */
+    inline size_t getDataSize () const
+    {
+        return m_data_size;
+    }
+    
+    /**
+     * Return the number of buffers in the pool.
+     * 
+     * @return Number of buffers which fit into the memory.
+     */
+    inline size_t getNumBufs () const
+    {
+        return m_num_bufs;
+    }
+    
+    /**
+     * Return the number of free buffers.
+     * 
+     * @return Number of buffers which can be allocated.
+     */
+    inline size_t getNumFree () const
+    {
+        return m_num_free;
+    }
+    
+private:
+    static constexpr size_t alignUp (size_t x)
+    {
+        return (x + (CacheLineSize - 1)) / CacheLineSize * CacheLineSize;
+    }
+    
+    static size_t const HeaderSpace = (sizeof(IpPacketBuf) + (CacheLineSize - 1)) /
+        CacheLineSize * CacheLineSize;
+    
+    static constexpr size_t slotSize (size_t headroom, size_t data_size)
+    {
+        return HeaderSpace + alignUp(headroom) + alignUp(data_size);
+    }
+    
+    inline void freeBuf (IpPacketBuf *buf)
+    {
+        AIPSTACK_ASSERT(m_num_free < m_num_bufs)
+        
+        buf->m_next_free = m_free_list;
+        m_free_list = buf;
+        m_num_free++;
+    }
+    
+private:
+    size_t m_headroom;
+    size_t m_data_size;
+    size_t m_num_bufs;
+    size_t m_num_free;
+    IpPacketBuf *m_free_list;
+};
+
+inline void IpPacketBuf::free ()
+{
+    m_pool->freeBuf(this);
+}
+
+/** @} */
+
+}
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_RX_BUF_HOLD_H
+#define AIPSTACK_RX_BUF_HOLD_H
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+
+namespace AIpStack {
+
+/**
+ * @ingroup infra
+ * @defgroup rx-buf-hold Receive Buffer Hand-Off
+ * @brief Mechanism for the stack to keep using a received buffer after the receive
+ * call returns.
+ * 
+ * Normally, buffers passed to the stack as received packets (e.g. to
+ * @ref IpDriverIface::recvIp4Packet) are only read from within the receive call. A
+ * driver may however pass an @ref IpRxBufHold object together with a received packet,
+ * which allows the stack to take ownership of the buffer. This is used by @ref
+ * IpReassemblyService in the @ref IpReassemblyOptions::ChainFragments mode, where a
+ * reassembled datagram is delivered as a chain of the buffers of the fragments instead
+ * of being copied into a reassembly buffer.
+ * 
+ * After the receive call returns, the driver checks @ref IpRxBufHold::isHeld. If the
+ * buffer is not held, the driver may reuse it immediately. Otherwise, the driver must
+ * not modify or free the buffer (and the @ref IpRxBufHold) until the stack calls
+ * @ref IpRxBufHold::rxBufReleased.
+ * 
+ * @{
+ */
+
+/**
+ * Represents the ownership of a received buffer which the stack may take over.
+ * 
+ * See the @ref rx-buf-hold module description for an explanation of the mechanism.
+ */
+class IpRxBufHold :
+    private NonCopyable<IpRxBufHold>
+{
+public:
+    /**
+     * Construct a hold object in the not-held state.
+     */
+    inline IpRxBufHold () :
+        m_held(false)
+    {}
+    
+    /**
+     * Return whether the buffer is currently held by the stack.
+     * 
+     * @return True if held, false if not.
+     */
+    inline bool isHeld () const
+    {
+        return m_held;
+    }
+    
+    /**
+     * Take ownership of the buffer (called by the stack).
+     * 
+     * The buffer must not already be held.
+     */
+    inline void take ()
+    {
+        AIPSTACK_ASSERT(!m_held)
+        
+        m_held = true;
+    }
+    
+    /**
+     * Give up ownership of the buffer (called by the stack).
+     * 
+     * The buffer must be held. This changes the state to not-held and then calls
+     * @ref rxBufReleased.
+     */
+    inline void release ()
+    {
+        AIPSTACK_ASSERT(m_held)
+        
+        m_held = false;
+        rxBufReleased();
+    }
+    
+protected:
+    /**
+     * Destruct the hold object.
+     * 
+     * The buffer must not be held. This destructor is intentionally not virtual but
+     * is protected to prevent incorrect usage.
+     */
+    ~IpRxBufHold ()
+    {
+        AIPSTACK_ASSERT(!m_held)
+    }
+    
+    /**
+     * Callback called when the stack no longer uses the buffer.
+     * 
+     * This is called from @ref release, with the hold already in the not-held
+     * state. The callback may free or reuse the buffer and may destruct this object,
+     * but it must not call into the stack.
+     */
+    virtual void rxBufReleased () = 0;
+    
+private:
+    bool m_held;
+};
+
+/** @} */
+
+}
+
+#endif
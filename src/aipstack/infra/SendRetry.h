@@ -25,6 +25,8 @@
 #ifndef AIPSTACK_SEND_RETRY_H
 #define AIPSTACK_SEND_RETRY_H
 
+#include <stdint.h>
+
 #include <aipstack/infra/ObserverNotification.h>
 
 namespace AIpStack {
@@ -61,6 +63,7 @@ namespace AIpStack {
  */
 
 class IpSendRetryList;
+class IpTxScheduler;
 
 /**
  * Represents a request to be notified when a failed send attempt should be retried.
@@ -78,13 +81,16 @@ class IpSendRetryRequest
 {
     using BaseObserver = Observer<IpSendRetryRequest>;
     friend class IpSendRetryList;
+    friend class IpTxScheduler;
     friend Observable<IpSendRetryRequest>;
     
 public:
     /**
-     * Construct an unassociated request.
+     * Construct an unassociated request with the highest transmit priority (0).
      */
-    IpSendRetryRequest () = default;
+    IpSendRetryRequest () :
+        m_tx_priority(0)
+    {}
     
     /**
      * Return whether the request is associated.
@@ -103,6 +109,32 @@ public:
     {
         BaseObserver::reset();
     }
+    
+    /**
+     * Set the transmit priority of the sender.
+     * 
+     * The priority is used by transmit schedulers (@ref IpTxScheduler) to decide which
+     * sender may send first when an interface is congested. Zero is the highest
+     * priority; values beyond the number of priority classes of a scheduler are treated
+     * as its lowest priority. A change takes effect the next time the request is
+     * associated.
+     * 
+     * @param priority Transmit priority (0 is the highest).
+     */
+    inline void setTxPriority (uint8_t priority)
+    {
+        m_tx_priority = priority;
+    }
+    
+    /**
+     * Return the transmit priority of the sender.
+     * 
+     * @return Transmit priority, as set by @ref setTxPriority.
+     */
+    inline uint8_t getTxPriority () const
+    {
+        return m_tx_priority;
+    }
 
 protected:
     /**
@@ -127,6 +159,9 @@ protected:
      * generally implies the restriction to not destruct the object managing it.
      */
     virtual void retrySending () = 0;
+
+private:
+    uint8_t m_tx_priority;
 };
 
 /**
@@ -203,6 +238,22 @@ public:
             request.retrySending();
         });
     }
+    
+    /**
+     * Disassociate one of the requests associated with this retry list and return it.
+     * 
+     * Which request is removed is not specified. No notification is performed.
+     * 
+     * This must not be called while @ref dispatchRequests is in progress for this
+     * retry list (i.e. from an @ref IpSendRetryRequest::retrySending callback).
+     * 
+     * @return Pointer to the removed request, or null if there were no associated
+     *         requests.
+     */
+    inline IpSendRetryRequest * takeRequest ()
+    {
+        return BaseObservable::removeObserver();
+    }
 };
 
 /** @} */
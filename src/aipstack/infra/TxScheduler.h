@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AIPSTACK_TX_SCHEDULER_H
+#define AIPSTACK_TX_SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Hints.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/infra/SendRetry.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup send-retry
+ * @{
+ */
+
+/**
+ * Schedules senders fairly when a transmit queue is full.
+ * 
+ * This class is intended to be used by a network interface in place of a plain
+ * @ref IpSendRetryList for senders which failed because the driver transmit queue was full.
+ * Senders are identified by their @ref IpSendRetryRequest and grouped into priority
+ * classes according to @ref IpSendRetryRequest::getTxPriority.
+ * 
+ * When the quantum passed to the constructor is zero, the scheduler only records the
+ * senders which have been refused by the driver (@ref driverFull) and notifies them
+ * when the driver has space again (@ref dispatch), higher priority classes first.
+ * 
+ * With a nonzero quantum, the scheduler additionally enforces round-robin between
+ * senders while the interface is congested, that is from the time the driver
+ * refuses a packet until all waiting senders have been served. During that time:
+ * - Senders may only send from their @ref IpSendRetryRequest::retrySending callback
+ *   called from @ref dispatch, and at most a quantum of bytes per turn (the first
+ *   packet of a turn is always admitted). Other attempts are refused by @ref admit and
+ *   the sender is queued for a turn.
+ * - A higher priority class is always served before a lower one.
+ * - Packets without a send-retry request (e.g. TCP ACKs and ARP) are never refused by
+ *   the scheduler.
+ * 
+ * Round-robin scheduling requires the driver to reliably report when there is space in its
+ * transmit queue after it refused a packet, otherwise senders would be refused
+ * indefinitely.
+ */
+class IpTxScheduler :
+    private NonCopyable<IpTxScheduler>
+{
+public:
+    /**
+     * Number of priority classes.
+     */
+    static uint8_t const NumPriorities = 4;
+    
+    /**
+     * Construct the scheduler.
+     * 
+     * @param quantum Number of bytes a sender may send per turn while the interface is
+     *        congested, or zero to only order retry notifications by priority.
+     */
+    explicit IpTxScheduler (size_t quantum = 0) :
+        m_quantum(quantum),
+        m_current(nullptr),
+        m_budget(0),
+        m_congested(false),
+        m_dispatching(false),
+        m_stopped(false)
+    {
+        for (uint8_t &round : m_round) {
+            round = 0;
+        }
+    }
+    
+    /**
+     * Check whether a sender may send a packet to the driver now.
+     * 
+     * If this returns false, the packet must not be sent and the sender should be
+     * reported @ref IpErr::BUFFER_FULL; it has then been queued for notification.
+     * 
+     * @param req Send-retry request of the sender, or null.
+     * @param len Length of the packet in bytes.
+     * @return True if the packet may be sent, false if not.
+     */
+    inline bool admit (IpSendRetryRequest *req, size_t len)
+    {
+        if (AIPSTACK_LIKELY(!m_congested) || req == nullptr) {
+            return true;
+        }
+        return admit_congested(req, len);
+    }
+    
+    /**
+     * Report that the driver refused a packet because its transmit queue was full.
+     * 
+     * @param req Send-retry request of the sender, or null. If not null, the sender is
+     *        queued for notification.
+     */
+    void driverFull (IpSendRetryRequest *req)
+    {
+        if (m_quantum == 0) {
+            current_list(req).addRequest(req);
+            return;
+        }
+        
+        m_congested = true;
+        
+        if (m_dispatching) {
+            // Stop dispatching until the driver has space again.
+            m_stopped = true;
+        }
+        
+        if (req != nullptr) {
+            // The sender keeps its place in the current round.
+            current_list(req).addRequest(req);
+        }
+    }
+    
+    /**
+     * Notify queued senders; this should be called when the driver has space in its
+     * transmit queue after it refused a packet.
+     * 
+     * Must not be called from an @ref IpSendRetryRequest::retrySending callback.
+     */
+    void dispatch ()
+    {
+        AIPSTACK_ASSERT(!m_dispatching)
+        
+        if (m_quantum == 0) {
+            for (uint8_t prio = 0; prio < NumPriorities; prio++) {
+                m_lists[prio][m_round[prio]].dispatchRequests();
+            }
+            return;
+        }
+        
+        if (!m_congested) {
+            return;
+        }
+        
+        m_dispatching = true;
+        m_stopped = false;
+        
+        do {
+            IpSendRetryRequest *req = take_next();
+            if (req == nullptr) {
+                // Everyone has been served, the interface is no longer congested.
+                m_congested = false;
+                break;
+            }
+            
+            m_current = req;
+            m_budget = m_quantum;
+            
+            req->retrySending();
+            
+            m_current = nullptr;
+        } while (!m_stopped);
+        
+        m_dispatching = false;
+    }
+    
+private:
+    bool admit_congested (IpSendRetryRequest *req, size_t len)
+    {
+        if (req == m_current) {
+            if (m_budget == m_quantum || len <= m_budget) {
+                m_budget -= MinValue(len, m_budget);
+                return true;
+            }
+            
+            // The turn is over, continue in the next round.
+            next_list(req).addRequest(req);
+            return false;
+        }
+        
+        // Wait for a turn in the current round, unless already waiting.
+        if (!req->isActive()) {
+            current_list(req).addRequest(req);
+        }
+        return false;
+    }
+    
+    IpSendRetryRequest * take_next ()
+    {
+        for (uint8_t prio = 0; prio < NumPriorities; prio++) {
+            IpSendRetryRequest *req = m_lists[prio][m_round[prio]].takeRequest();
+            if (req == nullptr) {
+                // Current round is over, start the next one.
+                m_round[prio] ^= 1;
+                req = m_lists[prio][m_round[prio]].takeRequest();
+            }
+            if (req != nullptr) {
+                return req;
+            }
+        }
+        return nullptr;
+    }
+    
+    inline static uint8_t priority_class (IpSendRetryRequest *req)
+    {
+        uint8_t prio = (req != nullptr) ? req->getTxPriority() : 0;
+        return (prio < NumPriorities) ? prio : NumPriorities - 1;
+    }
+    
+    inline IpSendRetryList & current_list (IpSendRetryRequest *req)
+    {
+        uint8_t prio = priority_class(req);
+        return m_lists[prio][m_round[prio]];
+    }
+    
+    inline IpSendRetryList & next_list (IpSendRetryRequest *req)
+    {
+        uint8_t prio = priority_class(req);
+        return m_lists[prio][m_round[prio] ^ 1];
+    }
+    
+private:
+    size_t m_quantum;
+    IpSendRetryRequest *m_current;
+    size_t m_budget;
+    bool m_congested;
+    bool m_dispatching;
+    bool m_stopped;
+    uint8_t m_round[NumPriorities];
+    IpSendRetryList m_lists[NumPriorities][2];
+};
+
+/** @} */
+
+}
+
+#endif
@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_IP_CAPTURE_H
+#define AIPSTACK_IP_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Hints.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/BinaryTools.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStats.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup ip-stack
+ * @{
+ */
+
+/**
+ * Direction of a captured packet.
+ */
+enum class IpCaptureDir : uint8_t {
+    /**
+     * Packet received from the interface driver.
+     */
+    Rx = 1,
+    /**
+     * Packet passed to the interface driver for sending.
+     */
+    Tx = 2,
+};
+
+/**
+ * Filter determining which packets are captured by an @ref IpCaptureTap.
+ * 
+ * A packet is captured if it matches all of the criteria which are enabled. A
+ * default-constructed filter matches all packets in both directions.
+ * 
+ * If any of @ref proto, @ref addr_mask or @ref port is enabled, only packets with a
+ * valid IPv4 header are matched. The @ref port criterion only matches TCP and UDP
+ * packets which are not non-first fragments.
+ */
+struct IpCaptureFilter {
+    /**
+     * Whether to capture received packets.
+     */
+    bool rx = true;
+    
+    /**
+     * Whether to capture sent packets.
+     */
+    bool tx = true;
+    
+    /**
+     * IP protocol number to match, or zero to match any protocol.
+     */
+    uint8_t proto = 0;
+    
+    /**
+     * Address to match against the source or destination address.
+     * 
+     * Only the bits which are set in @ref addr_mask are compared.
+     */
+    Ip4Addr addr = Ip4Addr::ZeroAddr();
+    
+    /**
+     * Mask of address bits to compare, zero disables address matching.
+     */
+    Ip4Addr addr_mask = Ip4Addr::ZeroAddr();
+    
+    /**
+     * TCP or UDP port to match against the source or destination port, or zero to
+     * match any port.
+     */
+    uint16_t port = 0;
+};
+
+/**
+ * Metadata of a packet stored in an @ref IpCaptureTap.
+ */
+struct IpCaptureRecord {
+    /**
+     * Capture time in microseconds, as returned by the time function (zero if no time
+     * function is set, see @ref IpCaptureTap::setTimeFunc).
+     */
+    uint64_t time_us;
+    
+    /**
+     * Original length of the packet.
+     */
+    uint32_t orig_len;
+    
+    /**
+     * Number of bytes of the packet which were stored (at most the snap length).
+     */
+    uint32_t cap_len;
+    
+    /**
+     * Direction of the packet.
+     */
+    IpCaptureDir dir;
+};
+
+/**
+ * Packet capture ring for an @ref IpIface.
+ * 
+ * A capture tap is attached to an interface using @ref IpIface::setCaptureTap. The
+ * stack then copies each packet received from or sent to the interface driver which
+ * matches the filter (see @ref setFilter) into a preallocated ring of slots, truncated
+ * to the snap length. The packets are IPv4 packets starting with the IP header.
+ * 
+ * The ring is a single-producer single-consumer queue. The producer is the stack
+ * and the consumer may be another thread (see @ref peek and @ref consume), for
+ * example one running @ref IpCapturePcapngWriter. If the ring is full, new packets are
+ * dropped and counted (see @ref getDropped).
+ * 
+ * This class does not contain the ring storage; the @ref IpCaptureRing class template
+ * should be used to create a capture tap with storage.
+ */
+class IpCaptureTap :
+    private NonCopyable<IpCaptureTap>
+{
+public:
+    /**
+     * Construct the capture tap using the given storage.
+     * 
+     * @param records Array of `num_slots` records.
+     * @param data Array of `num_slots * snap_len` bytes.
+     * @param num_slots Number of slots, must be a power of two.
+     * @param snap_len Maximum number of bytes stored for each packet, must be
+     *        positive.
+     */
+    IpCaptureTap (IpCaptureRecord *records, char *data, size_t num_slots,
+                  size_t snap_len) :
+        m_records(records),
+        m_data(data),
+        m_num_slots(num_slots),
+        m_snap_len(snap_len),
+        m_write_idx(0),
+        m_read_idx(0)
+    {
+        AIPSTACK_ASSERT(num_slots > 0 && (num_slots & (num_slots - 1)) == 0)
+        AIPSTACK_ASSERT(snap_len > 0)
+    }
+    
+    /**
+     * Set the capture filter.
+     * 
+     * This must be called from the context in which the stack runs.
+     * 
+     * @param filter New filter (copied).
+     */
+    inline void setFilter (IpCaptureFilter const &filter)
+    {
+        m_filter = filter;
+    }
+    
+    /**
+     * Set the function used to obtain the capture time.
+     * 
+     * This must be called from the context in which the stack runs.
+     * 
+     * @param time_func Function returning the current time in microseconds, or null
+     *        to store zero timestamps.
+     */
+    inline void setTimeFunc (Function<uint64_t()> time_func)
+    {
+        m_time_func = time_func;
+    }
+    
+    /**
+     * Return the snap length.
+     * 
+     * @return Maximum number of bytes stored for each packet.
+     */
+    inline size_t getSnapLen () const
+    {
+        return m_snap_len;
+    }
+    
+    /**
+     * Return the number of packets which were dropped because the ring was full.
+     * 
+     * This may be called from any thread.
+     * 
+     * @return Number of dropped packets.
+     */
+    inline uint32_t getDropped () const
+    {
+        return m_dropped.get();
+    }
+    
+    /**
+     * Get the oldest packet in the ring without removing it.
+     * 
+     * This must only be called from the consumer thread.
+     * 
+     * @param data Set to the pointer to the packet data on success.
+     * @return Pointer to the packet record, or null if the ring is empty. The record
+     *         and data remain valid until @ref consume is called.
+     */
+    IpCaptureRecord const * peek (char const **data) const
+    {
+        size_t read_idx = m_read_idx.load(std::memory_order_relaxed);
+        if (read_idx == m_write_idx.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        
+        size_t slot = read_idx & (m_num_slots - 1);
+        *data = m_data + slot * m_snap_len;
+        return &m_records[slot];
+    }
+    
+    /**
+     * Remove the oldest packet from the ring.
+     * 
+     * This must only be called from the consumer thread, after @ref peek has returned
+     * a packet.
+     */
+    void consume ()
+    {
+        size_t read_idx = m_read_idx.load(std::memory_order_relaxed);
+        AIPSTACK_ASSERT(read_idx != m_write_idx.load(std::memory_order_relaxed))
+        
+        m_read_idx.store(read_idx + 1, std::memory_order_release);
+    }
+    
+    /**
+     * Capture a packet if it matches the filter.
+     * 
+     * This is called by the stack and must only be called from the context in which the
+     * stack runs.
+     * 
+     * @param dir Direction of the packet.
+     * @param pkt The packet starting with the IP header.
+     */
+    void capture (IpCaptureDir dir, IpBufRef pkt)
+    {
+        if (!matchFilter(dir, pkt)) {
+            return;
+        }
+        
+        size_t write_idx = m_write_idx.load(std::memory_order_relaxed);
+        if (AIPSTACK_UNLIKELY(
+                write_idx - m_read_idx.load(std::memory_order_acquire) >= m_num_slots))
+        {
+            m_dropped.inc();
+            return;
+        }
+        
+        size_t slot = write_idx & (m_num_slots - 1);
+        size_t cap_len = MinValue(pkt.tot_len, m_snap_len);
+        
+        IpCaptureRecord &rec = m_records[slot];
+        rec.time_us = m_time_func ? m_time_func() : 0;
+        rec.orig_len = uint32_t(pkt.tot_len);
+        rec.cap_len = uint32_t(cap_len);
+        rec.dir = dir;
+        pkt.takeBytes(cap_len, m_data + slot * m_snap_len);
+        
+        m_write_idx.store(write_idx + 1, std::memory_order_release);
+    }
+    
+private:
+    bool matchFilter (IpCaptureDir dir, IpBufRef pkt) const
+    {
+        if (!(dir == IpCaptureDir::Rx ? m_filter.rx : m_filter.tx)) {
+            return false;
+        }
+        
+        if (m_filter.proto == 0 && m_filter.addr_mask.isZero() &&
+            m_filter.port == 0)
+        {
+            return true;
+        }
+        
+        // Copy the IP header and the first four bytes of the payload (the ports)
+        // so that we do not need to care about buffer chunking.
+        char hdr[Ip4MaxHeaderSize + 4];
+        size_t hdr_avail = MinValue(pkt.tot_len, sizeof(hdr));
+        pkt.takeBytes(hdr_avail, hdr);
+        
+        if (hdr_avail < Ip4Header::Size) {
+            return false;
+        }
+        
+        auto ip4_header = Ip4Header::MakeRef(hdr);
+        uint8_t version_ihl = ip4_header.get(Ip4Header::VersionIhlDscpEcn()) >> 8;
+        size_t header_len = (version_ihl & Ip4IhlMask) * 4;
+        if ((version_ihl >> Ip4VersionShift) != 4 || header_len < Ip4Header::Size ||
+            header_len > hdr_avail)
+        {
+            return false;
+        }
+        
+        uint8_t proto = uint8_t(ip4_header.get(Ip4Header::TtlProto()));
+        if (m_filter.proto != 0 && proto != m_filter.proto) {
+            return false;
+        }
+        
+        if (!m_filter.addr_mask.isZero()) {
+            Ip4Addr match_addr = m_filter.addr & m_filter.addr_mask;
+            Ip4Addr src_addr = ip4_header.get(Ip4Header::SrcAddr());
+            Ip4Addr dst_addr = ip4_header.get(Ip4Header::DstAddr());
+            if ((src_addr & m_filter.addr_mask) != match_addr &&
+                (dst_addr & m_filter.addr_mask) != match_addr)
+            {
+                return false;
+            }
+        }
+        
+        if (m_filter.port != 0) {
+            uint16_t flags_offset = ip4_header.get(Ip4Header::FlagsOffset());
+            if ((proto != Ip4ProtocolTcp && proto != Ip4ProtocolUdp) ||
+                (flags_offset & Ip4OffsetMask) != 0 || hdr_avail < header_len + 4)
+            {
+                return false;
+            }
+            
+            uint16_t src_port =
+                ReadBinaryInt<uint16_t, BinaryBigEndian>(hdr + header_len);
+            uint16_t dst_port =
+                ReadBinaryInt<uint16_t, BinaryBigEndian>(hdr + header_len + 2);
+            if (src_port != m_filter.port && dst_port != m_filter.port) {
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+private:
+    IpCaptureRecord *m_records;
+    char *m_data;
+    size_t m_num_slots;
+    size_t m_snap_len;
+    IpCaptureFilter m_filter;
+    Function<uint64_t()> m_time_func;
+    IpStatCounter m_dropped;
+    std::atomic<size_t> m_write_idx;
+    std::atomic<size_t> m_read_idx;
+};
+
+/**
+ * An @ref IpCaptureTap including storage for the ring.
+ * 
+ * @tparam NumSlots Number of packets which can be stored, must be a power of two.
+ * @tparam SnapLen Maximum number of bytes stored for each packet.
+ */
+template <size_t NumSlots, size_t SnapLen>
+class IpCaptureRing : public IpCaptureTap
+{
+    static_assert(NumSlots > 0 && (NumSlots & (NumSlots - 1)) == 0, "");
+    static_assert(SnapLen > 0, "");
+    
+public:
+    /**
+     * Construct the capture ring.
+     */
+    IpCaptureRing () :
+        IpCaptureTap(m_ring_records, m_ring_data, NumSlots, SnapLen)
+    {}
+    
+private:
+    IpCaptureRecord m_ring_records[NumSlots];
+    char m_ring_data[NumSlots * SnapLen];
+};
+
+/** @} */
+
+}
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AIPSTACK_IP_CHKSUM_OFFLOAD_H
+#define AIPSTACK_IP_CHKSUM_OFFLOAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/BinaryTools.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Chksum.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/proto/Udp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup ip-stack
+ * @{
+ */
+
+/**
+ * Functions for transport-layer checksum offload.
+ * 
+ * This defines the semantics of packets with a partial checksum, as passed to
+ * drivers supporting @ref IpIfaceOffloadFlags::TxProtoChksum and as sent with
+ * @ref IpSendFlags::ProtoChksumOffload. Such a packet is an IPv4 packet with a
+ * TCP or UDP datagram whose checksum field contains the ones'-complement sum of
+ * the pseudo-header (@ref pseudoHeaderSum). The checksum is completed by
+ * calculating the checksum of the datagram starting at the transport header
+ * (which includes the partial sum in the checksum field) and storing it into
+ * the checksum field; for UDP, a zero result is stored as 0xFFFF.
+ * 
+ * A driver can pass the positions from @ref getChksumPosition to hardware
+ * which completes the checksum (these correspond to `csum_start` and
+ * `csum_offset` of virtio-net), or use @ref completeChksum to do it in
+ * software.
+ */
+class IpChksumOffload {
+public:
+    /**
+     * Calculate the partial checksum of an IPv4 TCP or UDP datagram.
+     * 
+     * @param src_addr Source address.
+     * @param dst_addr Destination address.
+     * @param proto Protocol number.
+     * @param len Length of the datagram (transport header and data).
+     * @return The ones'-complement sum of the pseudo-header (not inverted).
+     */
+    static uint16_t pseudoHeaderSum (Ip4Addr src_addr, Ip4Addr dst_addr,
+                                     uint8_t proto, uint16_t len)
+    {
+        IpChksumAccumulator chksum;
+        chksum.addWords(&src_addr.data);
+        chksum.addWords(&dst_addr.data);
+        chksum.addWord(WrapType<uint16_t>(), proto);
+        chksum.addWord(WrapType<uint16_t>(), len);
+        return uint16_t(~chksum.getChksum());
+    }
+    
+    /**
+     * Determine the position of the checksum in a packet with a partial checksum.
+     * 
+     * The IPv4 header and the transport header up to the checksum field must be
+     * contiguous in the first buffer of the packet.
+     * 
+     * @param pkt The packet, starting with the IPv4 header.
+     * @param out_start Set to the offset of the transport header in the packet.
+     * @param out_offset Set to the offset of the checksum field relative to the
+     *        transport header.
+     * @return True on success, false if this is not a TCP or UDP packet.
+     */
+    static bool getChksumPosition (IpBufRef pkt, size_t &out_start, size_t &out_offset)
+    {
+        uint8_t proto;
+        return getPosition(pkt, out_start, out_offset, proto);
+    }
+    
+    /**
+     * Complete the checksum of a packet with a partial checksum in software.
+     * 
+     * The same requirements as for @ref getChksumPosition apply. The checksum
+     * covers all data after the transport header up to the end of `pkt`, so
+     * for a packet which is to be fragmented this must be done before that.
+     * 
+     * @param pkt The packet, starting with the IPv4 header.
+     * @return True on success, false if this is not a TCP or UDP packet (nothing
+     *         is changed then).
+     */
+    static bool completeChksum (IpBufRef pkt)
+    {
+        size_t start;
+        size_t offset;
+        uint8_t proto;
+        if (AIPSTACK_UNLIKELY(!getPosition(pkt, start, offset, proto))) {
+            return false;
+        }
+        
+        IpChksumAccumulator chksum;
+        uint16_t calc_chksum = chksum.getChksum(pkt.hideHeader(start));
+        if (proto == Ip4ProtocolUdp && calc_chksum == 0) {
+            calc_chksum = TypeMax<uint16_t>();
+        }
+        
+        WriteBinaryInt<uint16_t, BinaryBigEndian>(
+            calc_chksum, pkt.getChunkPtr() + (start + offset));
+        
+        return true;
+    }
+    
+private:
+    static bool getPosition (IpBufRef pkt, size_t &out_start, size_t &out_offset,
+                             uint8_t &out_proto)
+    {
+        AIPSTACK_ASSERT(pkt.hasHeader(Ip4Header::Size))
+        
+        auto ip4_header = Ip4Header::MakeRef(pkt.getChunkPtr());
+        size_t header_len =
+            4 * size_t((ip4_header.get(Ip4Header::VersionIhlDscpEcn()) >> 8) & Ip4IhlMask);
+        uint8_t proto = uint8_t(ip4_header.get(Ip4Header::TtlProto()));
+        
+        size_t offset;
+        size_t trans_header_size;
+        if (proto == Ip4ProtocolTcp) {
+            offset = Tcp4Header::getOffset(Tcp4Header::Checksum());
+            trans_header_size = Tcp4Header::Size;
+        } else if (proto == Ip4ProtocolUdp) {
+            offset = Udp4Header::getOffset(Udp4Header::Checksum());
+            trans_header_size = Udp4Header::Size;
+        } else {
+            return false;
+        }
+        
+        AIPSTACK_ASSERT(header_len >= Ip4Header::Size)
+        AIPSTACK_ASSERT(pkt.hasHeader(header_len + trans_header_size))
+        (void)trans_header_size;
+        
+        out_start = header_len;
+        out_offset = offset;
+        out_proto = proto;
+        return true;
+    }
+};
+
+/** @} */
+
+}
+
+#endif
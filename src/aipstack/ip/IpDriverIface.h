@@ -27,6 +27,7 @@
 
 #include <aipstack/misc/NonCopyable.h>
 #include <aipstack/infra/Buf.h>
+#include <aipstack/infra/RxBufHold.h>
 #include <aipstack/ip/IpAddr.h>
 #include <aipstack/ip/IpStackTypes.h>
 #include <aipstack/ip/IpIface.h>
@@ -143,10 +144,50 @@ namespace AIpStack {
          * 
          * @param pkt Received packet, presumably starting with the IP header.
          *            The referenced buffers will only be read from within this
-         *            function call.
+         *            function call, unless the stack takes them over via `hold`.
+         * @param hold Optional hand-off object which allows the stack to keep
+         *             using the buffers after this returns (see @ref rx-buf-hold).
+         *             If given, the driver must check @ref IpRxBufHold::isHeld
+         *             after this returns.
+         * @param rx_flags Information from the driver about checksums which do not
+         *                 need to be verified (@ref IpRxFlags::ProtoChksumVerified,
+         *                 @ref IpRxFlags::Ip4HeaderChksumVerified and @ref
+         *                 IpRxFlags::ProtoChksumPartial).
          */
-        inline void recvIp4Packet (IpBufRef pkt) {
-            IpStack<Arg>::processRecvedIp4Packet(&iface(), pkt);
+        inline void recvIp4Packet (IpBufRef pkt, IpRxBufHold *hold = nullptr,
+                                   IpRxFlags rx_flags = IpRxFlags()) {
+            IpStack<Arg>::processRecvedIp4Packet(&iface(), pkt, hold, rx_flags);
+        }
+        
+        /**
+         * Start a receive batch.
+         * 
+         * A driver which receives multiple packets at once (e.g. all packets
+         * available in a receive queue) should call this before passing them to
+         * @ref recvIp4Packet and call @ref endRecvBatch after that. Within a batch,
+         * the stack may combine consecutive TCP segments of the same flow into one
+         * (see @ref IpStackOptions::RxCoalesceFlows), which requires the packets
+         * to be passed with an @ref IpRxBufHold. Processing of such packets may be
+         * delayed until @ref endRecvBatch.
+         * 
+         * Batches must not be nested, and the interface must not be destructed
+         * within a batch.
+         */
+        inline void beginRecvBatch () {
+            IpStack<Arg>::beginRecvBatch(&iface());
+        }
+        
+        /**
+         * End a receive batch.
+         * 
+         * This completes processing of any packets received in the batch started
+         * with @ref beginRecvBatch.
+         * 
+         * @note The driver must support various driver functions being called from
+         * within this, especially @ref IpIfaceDriverParams::send_ip4_packet.
+         */
+        inline void endRecvBatch () {
+            IpStack<Arg>::endRecvBatch(&iface());
         }
         
         /**
@@ -29,6 +29,7 @@
 
 #include <aipstack/misc/MinMax.h>
 #include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Hints.h>
 #include <aipstack/misc/NonCopyable.h>
 #include <aipstack/structure/LinkedList.h>
 #include <aipstack/structure/StructureRaiiWrapper.h>
@@ -36,6 +37,8 @@
 #include <aipstack/ip/IpAddr.h>
 #include <aipstack/ip/IpStackTypes.h>
 #include <aipstack/ip/IpIfaceDriverParams.h>
+#include <aipstack/ip/IpStats.h>
+#include <aipstack/ip/IpCapture.h>
 #include <aipstack/ip/hw/IpHwCommon.h>
 
 namespace AIpStack {
@@ -83,20 +86,38 @@ namespace AIpStack {
             m_params(params),
             m_ip_mtu(MinValueU(TypeMax<uint16_t>(), params.ip_mtu)),
             m_have_addr(false),
-            m_have_gateway(false)
+            m_have_gateway(false),
+            m_rx_batch(false),
+            m_capture_tap(nullptr)
         {
             AIPSTACK_ASSERT(stack != nullptr)
             AIPSTACK_ASSERT(m_ip_mtu >= IpStack<Arg>::MinMTU)
             AIPSTACK_ASSERT(params.send_ip4_packet)
             AIPSTACK_ASSERT(params.get_state)
+            AIPSTACK_ASSERT((params.offload_flags & IpIfaceOffloadFlags::TcpSegmentation) ==
+                            EnumZero || (params.send_ip4_tso_packet &&
+                                         params.tso_max_len >= m_ip_mtu &&
+                                         params.tso_max_len <= TypeMax<uint16_t>()))
+            AIPSTACK_ASSERT((params.offload_flags & IpIfaceOffloadFlags::TxProtoChksum) ==
+                            EnumZero || params.send_ip4_chksum_packet)
             
             // Add the interface to the list of interfaces.
             m_stack->m_iface_list.prepend(*this);
+            
+            if (params.loopback) {
+                AIPSTACK_ASSERT(m_stack->m_loopback_iface == nullptr)
+                m_stack->m_loopback_iface = this;
+            }
         }
 
         ~IpIface ()
         {
             AIPSTACK_ASSERT(m_listeners_list.isEmpty())
+            AIPSTACK_ASSERT(!m_rx_batch)
+            
+            if (m_params.loopback) {
+                m_stack->m_loopback_iface = nullptr;
+            }
             
             // Remove the interface from the list of interfaces.
             m_stack->m_iface_list.remove(*this);
@@ -243,11 +264,22 @@ namespace AIpStack {
         /**
          * Check if an address is the address of the interface.
          * 
+         * The loopback interface (see @ref IpIfaceDriverParams::loopback) considers
+         * all addresses in its subnet (except the network and broadcast addresses)
+         * and the addresses of all other interfaces its own, since packets to these
+         * addresses are sent and received through it.
+         * 
          * @param addr Address to check.
          * @return True if the interface has an IP address assigned and the
-         *         assigned address is the given address, false otherwise.
+         *         assigned address is the given address, or for the loopback
+         *         interface, if the given address is in its subnet (other than
+         *         the network and broadcast addresses) or is the address of
+         *         another interface; false otherwise.
          */
         inline bool ip4AddrIsLocalAddr (Ip4Addr addr) const {
+            if (AIPSTACK_UNLIKELY(m_params.loopback)) {
+                return loopbackAddrIsLocal(addr);
+            }
             return m_have_addr && addr == m_addr.addr;
         }
         
@@ -275,6 +307,48 @@ namespace AIpStack {
         inline IpIfaceDriverState getDriverState () const {
             return m_params.get_state();
         }
+        
+        /**
+         * Return a snapshot of the statistics counters of the interface.
+         * 
+         * This may be called from any thread, but the individual counters are
+         * read independently (see @ref IpStatCounter).
+         * 
+         * @return Copy of the interface statistics counters.
+         */
+        inline IpIfaceStats getStats () const {
+            return m_stats;
+        }
+        
+        /**
+         * Attach or detach a packet capture tap.
+         * 
+         * When a capture tap is attached, packets received from and sent to the
+         * interface driver are passed to @ref IpCaptureTap::capture (which applies
+         * the filter of the capture tap). The capture tap must remain valid while
+         * it is attached.
+         * 
+         * @param tap Capture tap to attach, or null to detach the current one.
+         */
+        inline void setCaptureTap (IpCaptureTap *tap) {
+            m_capture_tap = tap;
+        }
+
+    private:
+        bool loopbackAddrIsLocal (Ip4Addr addr) const {
+            // Check the subnet first so that the interfaces are only scanned for
+            // packets to the addresses of other interfaces.
+            if (m_have_addr && (addr & m_addr.netmask) == m_addr.netaddr) {
+                return addr != m_addr.netaddr && addr != m_addr.bcastaddr;
+            }
+            return m_stack->ip4AddrIsIfaceAddr(addr);
+        }
+        
+        inline void capturePacket (IpCaptureDir dir, IpBufRef pkt) {
+            if (AIPSTACK_UNLIKELY(m_capture_tap != nullptr)) {
+                m_capture_tap->capture(dir, pkt);
+            }
+        }
 
     private:
         LinkedListNode<typename IpStack<Arg>::IfaceLinkModel> m_iface_list_node;
@@ -287,6 +361,9 @@ namespace AIpStack {
         Ip4Addr m_gateway;
         bool m_have_addr;
         bool m_have_gateway;
+        bool m_rx_batch;
+        IpIfaceStats m_stats;
+        IpCaptureTap *m_capture_tap;
     };
     
     /** @} */
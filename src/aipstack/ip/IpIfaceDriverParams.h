@@ -90,7 +90,11 @@ namespace AIpStack {
          *        may use this to notify the requestor when sending should be retried.
          *        For example if the issue was that there is no ARP cache entry
          *        or similar entry for the given address, the notification should
-         *        be done when the associated ARP query is successful.
+         *        be done when the associated ARP query is successful. If the issue
+         *        was that the transmit queue is full (@ref IpErr::BUFFER_FULL), the
+         *        notification should be done as soon as there is space again; the
+         *        TCP implementation otherwise retries only after a timeout. An
+         *        @ref IpSendRetryList is suitable for this.
          * @return Success or error code.
          */
         Function<IpErr(IpBufRef pkt, Ip4Addr ip_addr, IpSendRetryRequest *sendRetryReq)>
@@ -107,6 +111,84 @@ namespace AIpStack {
          * @return Driver-provided-state (currently just the link-up flag).
          */
         Function<IpIfaceDriverState()> get_state = nullptr;
+        
+        /**
+         * Offload capabilities of the driver.
+         * 
+         * For each flag given here, the associated driver function must be
+         * provided (see @ref IpIfaceOffloadFlags).
+         */
+        IpIfaceOffloadFlags offload_flags = IpIfaceOffloadFlags();
+        
+        /**
+         * Maximum size of packets passed to @ref send_ip4_tso_packet, including
+         * the IP header.
+         * 
+         * This is only used with @ref IpIfaceOffloadFlags::TcpSegmentation, and
+         * then it must be at least the MTU and no greater than 65535. Larger
+         * packets are split by the stack before being passed to the driver.
+         */
+        size_t tso_max_len = 0;
+        
+        /**
+         * Driver function used to send a TCP packet which is to be segmented.
+         * 
+         * @note This function must be provided if @ref offload_flags includes
+         * @ref IpIfaceOffloadFlags::TcpSegmentation, otherwise it is not used.
+         * 
+         * The packet consists of an IPv4 header (without options), a TCP header
+         * and data, and may exceed the MTU. The driver must send it as a sequence
+         * of segments with up to `seg_data_len` bytes of data each, which is
+         * exactly what @ref IpTcpSegmenter::segment does. The IP header checksum
+         * of the given packet is valid but the TCP checksum is not. The same
+         * requirements as for @ref send_ip4_packet apply otherwise.
+         * 
+         * @param pkt Packet to send, this includes the IP header. Its size does not
+         *        exceed @ref tso_max_len.
+         * @param seg_data_len Maximum TCP data length in each segment. It is
+         *        guaranteed that segments of this size do not exceed the MTU.
+         * @param ip_addr Next hop address.
+         * @param sendRetryReq See @ref send_ip4_packet.
+         * @param out_data_sent Initially zero. If an error is returned after some
+         *        segments were sent, the driver may set this to the amount of TCP
+         *        data in those segments. On success it is not used.
+         * @return Success or error code.
+         */
+        Function<IpErr(IpBufRef pkt, uint16_t seg_data_len, Ip4Addr ip_addr,
+                       IpSendRetryRequest *sendRetryReq, size_t &out_data_sent)>
+            send_ip4_tso_packet = nullptr;
+        
+        /**
+         * Driver function used to send a TCP or UDP packet whose checksum is to be
+         * completed by the driver.
+         * 
+         * @note This function must be provided if @ref offload_flags includes
+         * @ref IpIfaceOffloadFlags::TxProtoChksum, otherwise it is not used.
+         * 
+         * The packet has a partial checksum which the driver must complete as
+         * described for @ref IpChksumOffload. Such packets are never fragments.
+         * Packets with complete checksums are still passed to @ref send_ip4_packet.
+         * The same requirements as for @ref send_ip4_packet apply otherwise.
+         * 
+         * @param pkt Packet to send, this includes the IP header.
+         * @param ip_addr Next hop address.
+         * @param sendRetryReq See @ref send_ip4_packet.
+         * @return Success or error code.
+         */
+        Function<IpErr(IpBufRef pkt, Ip4Addr ip_addr, IpSendRetryRequest *sendRetryReq)>
+            send_ip4_chksum_packet = nullptr;
+        
+        /**
+         * Whether this is the loopback interface of the stack, which passes the
+         * packets sent through it back to the stack as received packets.
+         * 
+         * At most one interface of a stack may be a loopback interface. Packets to the
+         * address of any interface are routed through the loopback interface, and it
+         * accepts them as its own, as well as packets to any address in its own subnet
+         * (see @ref IpStack::routeIp4 and @ref IpIface::ip4AddrIsLocalAddr). This is
+         * normally used via @ref IpLoopbackIface.
+         */
+        bool loopback = false;
     };
 
     /** @} */
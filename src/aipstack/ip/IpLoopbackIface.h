@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AIPSTACK_IP_LOOPBACK_IFACE_H
+#define AIPSTACK_IP_LOOPBACK_IFACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Hints.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/infra/SendRetry.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStackTypes.h>
+#include <aipstack/ip/IpIfaceDriverParams.h>
+#include <aipstack/ip/IpDriverIface.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/hw/IpHwCommon.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup ip-stack
+ * @{
+ */
+
+/**
+ * Encapsulates parameters passed to the @ref IpLoopbackIface constructor.
+ */
+struct IpLoopbackIfaceParams {
+    /**
+     * Memory for the queue of packets (must outlive the @ref IpLoopbackIface).
+     * 
+     * Each queued packet takes its length plus a small per-packet overhead.
+     */
+    char *ring_buf = nullptr;
+    
+    /**
+     * Size of @ref ring_buf in bytes.
+     * 
+     * It must be enough for one packet of @ref ip_mtu bytes with its overhead
+     * (this is an assert); @ref IpLoopbackIface::RingOverhead gives the overhead.
+     */
+    size_t ring_size = 0;
+    
+    /**
+     * The MTU of the interface, by default the largest IPv4 packet size.
+     */
+    size_t ip_mtu = 65535;
+};
+
+/**
+ * Loopback network interface, which passes packets sent through it back to the
+ * stack as received packets.
+ * 
+ * The interface is registered as the loopback interface of the stack (see @ref
+ * IpIfaceDriverParams::loopback) and is assigned the address 127.0.0.1/8 (which
+ * may be changed using @ref IpIface::setIp4Addr). Packets to addresses in its
+ * subnet and to the address of any other interface are sent through it, so
+ * that local clients and servers communicate without any real interface.
+ * 
+ * Sent packets are copied into a ring buffer, since the stack only allows the
+ * driver to access them within the send call, and they are passed to the stack
+ * in a timer which expires immediately, that is after the events currently
+ * being processed; packets queued while these are being processed (such as
+ * replies) are passed on in the next round. Delivering packets directly from
+ * the send call would recurse into the stack. The received packets refer to the
+ * ring buffer directly.
+ * 
+ * Checksums are neither generated nor verified: the interface offers transmit
+ * checksum offload (see @ref IpIfaceOffloadFlags::TxProtoChksum) and reports
+ * all received packets as having verified (or partial) checksums. Together
+ * with the large default MTU, this makes the throughput of local connections
+ * limited mostly by copying data.
+ * 
+ * When the ring buffer is full, sending fails with @ref IpErr::BUFFER_FULL and
+ * the sender is notified through its @ref IpSendRetryRequest once packets have
+ * been passed on.
+ * 
+ * @tparam Arg Template parameter of @ref IpStack.
+ */
+template <typename Arg>
+class IpLoopbackIface :
+    private NonCopyable<IpLoopbackIface<Arg>>
+{
+    using Platform = typename IpStack<Arg>::Platform;
+    
+    struct RecordHeader {
+        size_t len;
+        IpRxFlags rx_flags;
+        bool wrap;
+    };
+    
+    static size_t const HeaderSize = sizeof(RecordHeader);
+    
+public:
+    /**
+     * Number of bytes in the ring buffer used for each packet in addition to the
+     * packet itself (at most, with alignment).
+     */
+    static size_t const RingOverhead = 2 * HeaderSize;
+    
+    /**
+     * Construct the loopback interface, registering it with the stack.
+     * 
+     * There must be no other loopback interface in the stack (this is an assert).
+     * 
+     * @param stack Pointer to the IP stack.
+     * @param params Parameters, see @ref IpLoopbackIfaceParams.
+     */
+    IpLoopbackIface (IpStack<Arg> *stack, IpLoopbackIfaceParams const &params) :
+        m_ring_buf(params.ring_buf),
+        m_ring_size(params.ring_size),
+        m_deliver_timer(stack->platform(),
+            AIPSTACK_BIND_MEMBER_TN(&IpLoopbackIface::deliverTimerHandler, this)),
+        m_read(0),
+        m_write(0),
+        m_count(0),
+        m_driver_iface(stack, IpIfaceDriverParams{
+            /*ip_mtu=*/ params.ip_mtu,
+            /*hw_type=*/ IpHwType::Undefined,
+            /*hw_iface=*/ nullptr,
+            AIPSTACK_BIND_MEMBER_TN(&IpLoopbackIface::driverSendIp4Packet, this),
+            AIPSTACK_BIND_MEMBER_TN(&IpLoopbackIface::driverGetState, this),
+            /*offload_flags=*/ IpIfaceOffloadFlags::TxProtoChksum,
+            /*tso_max_len=*/ 0,
+            /*send_ip4_tso_packet=*/ nullptr,
+            AIPSTACK_BIND_MEMBER_TN(&IpLoopbackIface::driverSendIp4ChksumPacket, this),
+            /*loopback=*/ true
+        })
+    {
+        AIPSTACK_ASSERT(params.ring_buf != nullptr)
+        AIPSTACK_ASSERT(params.ring_size >= RingOverhead + params.ip_mtu)
+        
+        m_driver_iface.iface().setIp4Addr(
+            IpIfaceIp4AddrSetting(8, Ip4Addr::FromBytes(127, 0, 0, 1)));
+    }
+    
+    /**
+     * Get the @ref IpIface representing this network interface.
+     * 
+     * @return Reference to the @ref IpIface.
+     */
+    inline IpIface<Arg> & iface ()
+    {
+        return m_driver_iface.iface();
+    }
+    
+    /**
+     * Return the number of packets waiting to be passed to the stack.
+     * 
+     * @return Number of queued packets.
+     */
+    inline size_t getQueuedPackets () const
+    {
+        return m_count;
+    }
+    
+private:
+    IpErr driverSendIp4Packet (IpBufRef pkt, Ip4Addr, IpSendRetryRequest *retryReq)
+    {
+        return queue_packet(pkt,
+            IpRxFlags::Ip4HeaderChksumVerified|IpRxFlags::ProtoChksumVerified, retryReq);
+    }
+    
+    IpErr driverSendIp4ChksumPacket (IpBufRef pkt, Ip4Addr, IpSendRetryRequest *retryReq)
+    {
+        return queue_packet(pkt,
+            IpRxFlags::Ip4HeaderChksumVerified|IpRxFlags::ProtoChksumPartial, retryReq);
+    }
+    
+    IpIfaceDriverState driverGetState ()
+    {
+        return IpIfaceDriverState();
+    }
+    
+    IpErr queue_packet (IpBufRef pkt, IpRxFlags rx_flags, IpSendRetryRequest *retryReq)
+    {
+        char *data = alloc_record(pkt.tot_len, rx_flags);
+        if (AIPSTACK_UNLIKELY(data == nullptr)) {
+            m_retry_list.addRequest(retryReq);
+            return IpErr::BUFFER_FULL;
+        }
+        pkt.takeBytes(pkt.tot_len, data);
+        
+        if (!m_deliver_timer.isSet()) {
+            m_deliver_timer.setNow();
+        }
+        
+        return IpErr::SUCCESS;
+    }
+    
+    void deliverTimerHandler ()
+    {
+        // Pass on the packets queued until now. A packet is removed only after it
+        // has been processed, so that packets queued meanwhile do not overwrite it.
+        for (size_t count = m_count; count > 0; count--) {
+            RecordHeader hdr = read_header();
+            
+            IpBufNode node{m_ring_buf + m_read + HeaderSize, hdr.len, nullptr};
+            m_driver_iface.recvIp4Packet(IpBufRef{&node, 0, hdr.len}, nullptr,
+                                         hdr.rx_flags);
+            
+            m_read += align_record(HeaderSize + hdr.len);
+            m_count--;
+        }
+        
+        if (m_count > 0) {
+            m_deliver_timer.setNow();
+        }
+        
+        if (m_retry_list.hasRequests()) {
+            m_retry_list.dispatchRequests();
+        }
+    }
+    
+    // Records are stored contiguously, aligned for the header; when one does not
+    // fit at the end of the buffer the rest of the buffer is skipped, marked with
+    // a wrap record if a record header fits there.
+    char * alloc_record (size_t len, IpRxFlags rx_flags)
+    {
+        size_t rec_size = align_record(HeaderSize + len);
+        
+        if (m_count == 0) {
+            m_read = 0;
+            m_write = 0;
+        }
+        
+        size_t pos;
+        if (m_count == 0 || m_write > m_read) {
+            if (rec_size <= m_ring_size - m_write) {
+                pos = m_write;
+            } else if (rec_size < m_read) {
+                if (m_ring_size - m_write >= HeaderSize) {
+                    write_header(m_write, RecordHeader{0, IpRxFlags(), true});
+                }
+                pos = 0;
+            } else {
+                return nullptr;
+            }
+        } else {
+            // The write position must stay behind the read position so that a
+            // full buffer is distinguished from an empty one.
+            if (rec_size >= m_read - m_write) {
+                return nullptr;
+            }
+            pos = m_write;
+        }
+        
+        write_header(pos, RecordHeader{len, rx_flags, false});
+        
+        m_write = pos + rec_size;
+        m_count++;
+        
+        return m_ring_buf + pos + HeaderSize;
+    }
+    
+    RecordHeader read_header ()
+    {
+        AIPSTACK_ASSERT(m_count > 0)
+        
+        if (m_ring_size - m_read >= HeaderSize) {
+            RecordHeader hdr = read_header_at(m_read);
+            if (!hdr.wrap) {
+                return hdr;
+            }
+        }
+        
+        m_read = 0;
+        
+        return read_header_at(m_read);
+    }
+    
+    inline static size_t align_record (size_t size)
+    {
+        return (size + alignof(RecordHeader) - 1) / alignof(RecordHeader) *
+               alignof(RecordHeader);
+    }
+    
+    inline RecordHeader read_header_at (size_t pos)
+    {
+        RecordHeader hdr;
+        ::memcpy(&hdr, m_ring_buf + pos, HeaderSize);
+        return hdr;
+    }
+    
+    inline void write_header (size_t pos, RecordHeader const &hdr)
+    {
+        ::memcpy(m_ring_buf + pos, &hdr, HeaderSize);
+    }
+    
+private:
+    char *m_ring_buf;
+    size_t m_ring_size;
+    typename Platform::Timer m_deliver_timer;
+    IpSendRetryList m_retry_list;
+    size_t m_read;
+    size_t m_write;
+    size_t m_count;
+    IpDriverIface<Arg> m_driver_iface;
+};
+
+/** @} */
+
+}
+
+#endif
@@ -160,7 +160,8 @@ protected:
      * specifically do not call @ref reset or @ref moveFrom. Note that the
      * implementation calls all these callbacks for the same remote address
      * in a loop, and that the callbacks may be called from within
-     * @ref IpStack::handleIcmpPacketTooBig and @ref IpStack::handleLocalPacketTooBig.
+     * @ref IpStack::handleIcmpPacketTooBig, @ref IpStack::handleLocalPacketTooBig
+     * and @ref IpStack::handlePathMtuProbeAcked.
      * 
      * @param pmtu The new PMTU estimate (guaranteed to be at least MinMTU).
      */
@@ -249,6 +249,46 @@ public:
         return true;
     }
     
+    bool handleProbeAcked (Ip4Addr remote_addr, uint16_t probe_mtu)
+    {
+        // Find the entry of this address. If it there is none, do nothing.
+        MtuLinkModelRef mtu_ref = m_mtu_index.findEntry(remote_addr, *this);
+        if (mtu_ref.isNull()) {
+            return false;
+        }
+        
+        MtuEntry &mtu_entry = *mtu_ref;
+        AIPSTACK_ASSERT(mtu_entry.state == OneOf(EntryState::Referenced, EntryState::Unused))
+        AIPSTACK_ASSERT(mtu_entry.remote_addr == remote_addr)
+        
+        // Make sure the PMTU will not exceed the interface MTU. Unlike for
+        // handlePacketTooBig, we do nothing if there is no route, since then
+        // we cannot know how far we may raise the PMTU.
+        IpRouteInfoIp4<StackArg> route_info;
+        if (!m_ip_stack->routeIp4(remote_addr, route_info)) {
+            return false;
+        }
+        uint16_t raise_mtu = MinValue(probe_mtu, route_info.iface->getMtu());
+        
+        // The probe just confirmed this PMTU, so restart the timeout even if
+        // the PMTU does not change.
+        mtu_entry.minutes_old = 0;
+        
+        if (raise_mtu <= mtu_entry.mtu) {
+            return false;
+        }
+        
+        // Update PMTU.
+        mtu_entry.mtu = raise_mtu;
+        
+        // Notify all MtuRef referencing this entry.
+        if (mtu_entry.state == EntryState::Referenced) {
+            notify_pmtu_changed(mtu_entry);
+        }
+        
+        return true;
+    }
+    
     class MtuRef :
         private NonCopyable<MtuRef>
     #ifndef IN_DOXYGEN
@@ -25,9 +25,12 @@
 #ifndef AIPSTACK_IPREASSEMBLY_H
 #define AIPSTACK_IPREASSEMBLY_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
+#include <type_traits>
+
 #include <aipstack/misc/Use.h>
 #include <aipstack/misc/Assert.h>
 #include <aipstack/misc/MinMax.h>
@@ -36,10 +39,13 @@
 #include <aipstack/misc/Function.h>
 #include <aipstack/infra/Struct.h>
 #include <aipstack/infra/Buf.h>
+#include <aipstack/infra/RxBufHold.h>
 #include <aipstack/infra/Options.h>
 #include <aipstack/infra/Instance.h>
 #include <aipstack/proto/Ip4Proto.h>
 #include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStats.h>
+#include <aipstack/ip/IpReassemblyChained.h>
 #include <aipstack/platform/PlatformFacade.h>
 
 namespace AIpStack {
@@ -69,14 +75,15 @@ template <typename Arg>
 class IpReassembly :
     private NonCopyable<IpReassembly<Arg>>
 {
-    AIPSTACK_USE_VALS(Arg::Params, (MaxReassEntrys, MaxReassSize, MaxReassHoles,
-                                    MaxReassTimeSeconds))
+    AIPSTACK_USE_VALS(Arg::Params, (MaxReassEntrys, MaxReassEntrysPerSource,
+                                    MaxReassSize, MaxReassHoles, MaxReassTimeSeconds))
     AIPSTACK_USE_TYPES(Arg, (PlatformImpl))
     
     using Platform = PlatformFacade<PlatformImpl>;
     AIPSTACK_USE_TYPES(Platform, (TimeType))
     
     static_assert(MaxReassEntrys > 0, "");
+    static_assert(MaxReassEntrysPerSource >= 0, "");
     static_assert(MaxReassSize >= Ip4RequiredRecvSize, "");
     static_assert(MaxReassHoles >= 1, "");
     static_assert(MaxReassHoles <= 250, ""); // important to prevent num_holes overflow
@@ -113,6 +120,10 @@ class IpReassembly :
         uint16_t first_hole_offset;
         // The total data length, or 0 if last fragment not yet received.
         uint16_t data_length;
+        // Number of data bytes received, counting only data which filled holes
+        // so that duplicate or overlapping fragments do not add to it. Used to
+        // choose entries to evict.
+        uint16_t recv_length;
         // Time after which the entry is considered invalid.
         TimeType expiration_time;
         // IPv4 header (options not stored).
@@ -123,8 +134,13 @@ class IpReassembly :
         char data[ReassBufferSize];
     };
     
+    // The reassembled data is referenced together with the header before it.
+    static_assert(offsetof(ReassEntry, data) ==
+                  offsetof(ReassEntry, header) + Ip4Header::Size, "");
+    
 private:
     typename Platform::Timer m_timer;
+    IpStackStats *m_stats;
     IpBufNode m_reass_node;
     ReassEntry m_reass_packets[MaxReassEntrys];
     
@@ -133,9 +149,11 @@ public:
      * Constructor.
      * 
      * @param platform_ The platform facade.
+     * @param stats Statistics counters to update (must outlive this object).
      */
-    IpReassembly (Platform platform_) :
-        m_timer(platform_, AIPSTACK_BIND_MEMBER_TN(&IpReassembly::timerHandler, this))
+    IpReassembly (Platform platform_, IpStackStats *stats) :
+        m_timer(platform_, AIPSTACK_BIND_MEMBER_TN(&IpReassembly::timerHandler, this)),
+        m_stats(stats)
     {
         // Start the timer for the first interval.
         m_timer.setAfter(PurgeTimerInterval);
@@ -168,23 +186,34 @@ public:
      * @param header Pointer to the IPv4 header (only the base header is used).
      *        The data in the header must match the various arguments of this
      *        function (ident...fragment_offset).
+     * @param header_len The length of the IPv4 header of the incoming packet must
+     *        be passed, and if a datagram is reassembled then this will be changed
+     *        to the length of the IPv4 header which precedes the reassembled
+     *        payload (here the base header of the first fragment, without
+     *        options).
      * @param dgram The IP payload of the incoming datagram must be passed,
      *        and if a datagram is reassembled (return value is true) then this
      *        will be changed to reference the reassembled payload, otherwise it
      *        will not be changed. If a reassembled datagram is returned, then the
      *        referenced memory region may be used until the next call of this
      *        function.
+     * @param hold Hand-off object for the packet buffer provided by the driver, or
+     *        null. This is not used since the fragment data is copied.
      * @return True if a datagram was reassembled, false if not.
      */
     bool reassembleIp4 (uint16_t ident, Ip4Addr src_addr, Ip4Addr dst_addr, uint8_t proto,
                         uint8_t ttl, bool more_fragments, uint16_t fragment_offset,
-                        char const *header, IpBufRef &dgram)
+                        char const *header, uint8_t &header_len, IpBufRef &dgram,
+                        IpRxBufHold *hold)
     {
+        (void)hold;
+        
         AIPSTACK_ASSERT(dgram.tot_len <= TypeMax<uint16_t>())
         AIPSTACK_ASSERT(more_fragments || fragment_offset > 0)
         
         // Sanity check data length.
         if (dgram.tot_len == 0) {
+            m_stats->ip_reasm_fails.inc();
             return false;
         }
         
@@ -194,14 +223,15 @@ public:
         
         if (reass == nullptr) {
             // Allocate an entry.
-            reass = alloc_reass_entry(now, ttl);
+            reass = alloc_reass_entry(now, ttl, src_addr);
             
             // Copy the IP header.
             ::memcpy(reass->header, header, Ip4Header::Size);
             
-            // Set first hole and unknown data length.
+            // Set first hole, unknown data length and no data received.
             reass->first_hole_offset = 0;
             reass->data_length = 0;
+            reass->recv_length = 0;
             
             // Write a hole from start of data to infinity (ReassBufferSize).
             // The final HoleDescriptor::Size bytes of the hole serve as
@@ -211,6 +241,11 @@ public:
             hole.set(typename HoleDescriptor::HoleSize(),       ReassBufferSize);
             hole.set(typename HoleDescriptor::NextHoleOffset(), ReassNullLink);
         }
+        else if (fragment_offset == 0) {
+            // Keep the IP header of the first fragment, which will precede the
+            // reassembled data.
+            ::memcpy(reass->header, header, Ip4Header::Size);
+        }
         
         do {
             // Verify that the fragment fits into the buffer.
@@ -247,10 +282,12 @@ public:
                 }
             }
             
-            // Update the holes based on this fragment.
+            // Update the holes based on this fragment, summing up the number of
+            // bytes of the holes that it fills.
             uint16_t prev_hole_offset = ReassNullLink;
             uint16_t hole_offset = reass->first_hole_offset;
             uint8_t num_holes = 0;
+            uint16_t filled_len = 0;
             do {
                 AIPSTACK_ASSERT(prev_hole_offset == ReassNullLink ||
                              hole_offset_valid(prev_hole_offset))
@@ -283,6 +320,8 @@ public:
                 
                 // The fragment overlaps with the hole. We will be dismantling
                 // this hole and creating between zero and two new holes.
+                filled_len += uint16_t(MinValue(fragment_end, hole_end) -
+                                       MaxValue(fragment_offset, hole_offset));
                 
                 // Create a new hole on the left if needed.
                 if (fragment_offset > hole_offset) {
@@ -341,6 +380,8 @@ public:
             // Copy the fragment data into the reassembly buffer.
             IpBufRef dgram_tmp = dgram;
             dgram_tmp.takeBytes(dgram.tot_len, reass->data + fragment_offset);
+            reass->recv_length += filled_len;
+            AIPSTACK_ASSERT(reass->recv_length <= MaxReassSize)
             
             // If we have not yet received the final fragment or there
             // are still holes after the end, the reassembly is not complete.
@@ -369,9 +410,12 @@ public:
             // Invalidate the reassembly entry.
             reass->first_hole_offset = ReassNullLink;
             
-            // Setup dgram to point to the reassembled data.
-            m_reass_node = IpBufNode{reass->data, MaxReassSize, nullptr};
-            dgram = IpBufRef{&m_reass_node, 0, reass->data_length};
+            // Setup dgram to point to the reassembled data, with the stored IP
+            // header before it (e.g. for sending ICMP errors).
+            m_reass_node = IpBufNode{reass->header, Ip4Header::Size + MaxReassSize,
+                                     nullptr};
+            dgram = IpBufRef{&m_reass_node, Ip4Header::Size, reass->data_length};
+            header_len = Ip4Header::Size;
             
             // Continue to process the reassembled datagram.
             return true;
@@ -379,9 +423,20 @@ public:
         
     invalidate_reass:
         reass->first_hole_offset = ReassNullLink;
+        m_stats->ip_reasm_fails.inc();
         return false;
     }
     
+    /**
+     * Finish using a reassembled datagram.
+     * 
+     * This must be called after each reassembly when the datagram is no longer
+     * used. It does nothing here since the data is in the reassembly buffer.
+     */
+    inline void releaseReassembled ()
+    {
+    }
+    
 private:
     ReassEntry * find_reass_entry (TimeType now, uint16_t ident, Ip4Addr src_addr,
                                    Ip4Addr dst_addr, uint8_t proto)
@@ -397,6 +452,8 @@ private:
             // If the entry has expired, mark is as free and ignore.
             if (TimeType(reass.expiration_time - now) > ReassMaxExpirationTicks) {
                 reass.first_hole_offset = ReassNullLink;
+                m_stats->ip_reasm_fails.inc();
+                m_stats->ip_reasm_timeouts.inc();
                 continue;
             }
             
@@ -406,7 +463,7 @@ private:
             if (reass_hdr.get(Ip4Header::Ident())    == ident &&
                 reass_hdr.get(Ip4Header::SrcAddr())  == src_addr &&
                 reass_hdr.get(Ip4Header::DstAddr())  == dst_addr &&
-                uint8_t(reass_hdr.get(Ip4Header::TtlProto()) == proto))
+                uint8_t(reass_hdr.get(Ip4Header::TtlProto())) == proto)
             {
                 found_entry = &reass;
             }
@@ -415,26 +472,55 @@ private:
         return found_entry;
     }
     
-    ReassEntry * alloc_reass_entry (TimeType now, uint8_t ttl)
+    ReassEntry * alloc_reass_entry (TimeType now, uint8_t ttl, Ip4Addr src_addr)
     {
         TimeType future = now + ReassMaxExpirationTicks;
         
-        ReassEntry *result_reass = nullptr;
+        ReassEntry *free_reass = nullptr;
+        ReassEntry *evict_reass = nullptr;
+        ReassEntry *src_evict_reass = nullptr;
+        int src_count = 0;
         
         for (auto &reass : m_reass_packets) {
-            // If the entry is unused, use it.
+            // Remember the first unused entry.
             if (reass.first_hole_offset == ReassNullLink) {
-                result_reass = &reass;
-                break;
+                if (free_reass == nullptr) {
+                    free_reass = &reass;
+                }
+                continue;
             }
             
-            // Look for the entry with the least expiration time.
-            if (result_reass == nullptr ||
-                TimeType(future - reass.expiration_time) >
-                    TimeType(future - result_reass->expiration_time))
-            {
-                result_reass = &reass;
+            // Look for the entry to evict overall and among the entries of
+            // this source.
+            if (is_better_eviction(future, &reass, evict_reass)) {
+                evict_reass = &reass;
             }
+            if (Ip4Header::MakeRef(reass.header).get(Ip4Header::SrcAddr()) == src_addr) {
+                src_count++;
+                if (is_better_eviction(future, &reass, src_evict_reass)) {
+                    src_evict_reass = &reass;
+                }
+            }
+        }
+        
+        // Choose the entry: if the source has reached its quota, one of its own
+        // entries, otherwise an unused entry if any, otherwise any entry.
+        ReassEntry *result_reass;
+        if (MaxReassEntrysPerSource > 0 && src_count >= MaxReassEntrysPerSource) {
+            result_reass = src_evict_reass;
+            m_stats->ip_reasm_quota_evictions.inc();
+        }
+        else if (free_reass != nullptr) {
+            result_reass = free_reass;
+        }
+        else {
+            result_reass = evict_reass;
+            m_stats->ip_reasm_evictions.inc();
+        }
+        
+        // If we are reusing an entry in use, that reassembly has failed.
+        if (result_reass->first_hole_offset != ReassNullLink) {
+            m_stats->ip_reasm_fails.inc();
         }
         
         // Set the expiration time.
@@ -444,6 +530,22 @@ private:
         return result_reass;
     }
     
+    // Check if an entry should be evicted rather than the current candidate
+    // (which may be null). We prefer the entry with the least data received,
+    // which is furthest from completion, then the one which expires first.
+    static bool is_better_eviction (TimeType future, ReassEntry const *reass,
+                                    ReassEntry const *current)
+    {
+        if (current == nullptr) {
+            return true;
+        }
+        if (reass->recv_length != current->recv_length) {
+            return reass->recv_length < current->recv_length;
+        }
+        return TimeType(future - reass->expiration_time) >
+               TimeType(future - current->expiration_time);
+    }
+    
     static void reass_link_prev (ReassEntry *reass, uint16_t prev_hole_offset, uint16_t hole_offset)
     {
         AIPSTACK_ASSERT(prev_hole_offset == ReassNullLink || hole_offset_valid(prev_hole_offset))
@@ -484,6 +586,17 @@ struct IpReassemblyOptions {
      */
     AIPSTACK_OPTION_DECL_VALUE(MaxReassEntrys, int, 1)
     
+    /**
+     * Maximum number of datagrams from the same source address being reassembled,
+     * or 0 for no limit.
+     * 
+     * When a new datagram arrives from a source which already uses this many
+     * entries, the least complete of those entries is discarded and reused. This
+     * prevents a single source from occupying all entries. When all entries are in
+     * use, regardless of this option, the least complete entry is discarded.
+     */
+    AIPSTACK_OPTION_DECL_VALUE(MaxReassEntrysPerSource, int, 0)
+    
     /**
      * Maximum size of reassembled datagrams. This affects memory use.
      */
@@ -499,6 +612,32 @@ struct IpReassemblyOptions {
      * as an additional restriction to the TTL seconds limit.
      */
     AIPSTACK_OPTION_DECL_VALUE(MaxReassTimeSeconds, uint8_t, 60)
+    
+    /**
+     * Whether to reassemble by chaining the buffers of the fragments instead of
+     * copying the data into a reassembly buffer.
+     * 
+     * If enabled, fragments are only accepted if the driver passes an
+     * @ref IpRxBufHold with the packet (see @ref rx-buf-hold) and the fragment
+     * data is contiguous in one buffer node. Such buffers are held until the
+     * datagram has been reassembled and processed, or reassembly fails or times
+     * out. The reassembled datagram is a chain of the fragment buffers with the IP
+     * header of the first fragment preceding the data. Partially overlapping
+     * fragments cause the datagram to be discarded.
+     * 
+     * In this mode, @ref MaxReassSize does not affect memory use, and memory is
+     * instead used for @ref MaxReassFrags fragment descriptors per entry.
+     */
+    AIPSTACK_OPTION_DECL_VALUE(ChainFragments, bool, false)
+    
+    /**
+     * Maximum number of fragments of a datagram, only used if @ref ChainFragments
+     * is enabled.
+     * 
+     * The default allows a maximum-size datagram to be received over an interface
+     * with an MTU of 1500.
+     */
+    AIPSTACK_OPTION_DECL_VALUE(MaxReassFrags, uint8_t, 45)
 };
 
 /**
@@ -517,10 +656,16 @@ class IpReassemblyService {
     template <typename>
     friend class IpReassembly;
     
+    template <typename>
+    friend class IpReassemblyChained;
+    
     AIPSTACK_OPTION_CONFIG_VALUE(IpReassemblyOptions, MaxReassEntrys)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpReassemblyOptions, MaxReassEntrysPerSource)
     AIPSTACK_OPTION_CONFIG_VALUE(IpReassemblyOptions, MaxReassSize)
     AIPSTACK_OPTION_CONFIG_VALUE(IpReassemblyOptions, MaxReassHoles)
     AIPSTACK_OPTION_CONFIG_VALUE(IpReassemblyOptions, MaxReassTimeSeconds)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpReassemblyOptions, ChainFragments)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpReassemblyOptions, MaxReassFrags)
     
 public:
 #ifndef IN_DOXYGEN
@@ -528,7 +673,10 @@ public:
     struct Compose {
         using PlatformImpl = PlatformImpl_;
         using Params = IpReassemblyService;
-        AIPSTACK_DEF_INSTANCE(Compose, IpReassembly)        
+        
+        template <typename Instance_self=Compose>
+        using Instance = std::conditional_t<ChainFragments,
+            IpReassemblyChained<Instance_self>, IpReassembly<Instance_self>>;
     };
 #endif
 };
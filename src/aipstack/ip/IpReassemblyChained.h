@@ -0,0 +1,564 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_IPREASSEMBLY_CHAINED_H
+#define AIPSTACK_IPREASSEMBLY_CHAINED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <aipstack/misc/Use.h>
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/RxBufHold.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStats.h>
+#include <aipstack/platform/PlatformFacade.h>
+
+namespace AIpStack {
+
+#ifndef IN_DOXYGEN
+
+/**
+ * Implements IPv4 datagram reassembly without copying the fragment data.
+ * 
+ * This is used instead of @ref IpReassembly when the option
+ * @ref IpReassemblyOptions::ChainFragments is enabled. Each received fragment
+ * remains in the buffer where the driver received it; the driver must pass an
+ * @ref IpRxBufHold with the packet and the reassembly takes ownership of the
+ * buffer using that. A reassembly entry only contains a small array of fragment
+ * descriptors sorted by offset, and holes are the gaps between them. When all
+ * data has been received, the buffer nodes of the fragment descriptors are linked
+ * and the reassembled datagram is delivered as a chain over the original buffers.
+ * 
+ * Overlapping fragments are not supported, a partial overlap causes the whole
+ * datagram to be discarded (exact duplicates are ignored). The payload of each
+ * fragment must be contiguous in one buffer node.
+ * 
+ * Since incomplete datagrams hold driver buffers, the timer is kept set for the
+ * earliest expiration of the incomplete datagrams, so that the buffers are
+ * released when a datagram expires even if no more fragments arrive (unlike
+ * @ref IpReassembly, which only purges periodically).
+ * 
+ * @tparam Arg An instantiated @ref IpReassemblyService::Compose template
+ *         or a type derived from such.
+ */
+template <typename Arg>
+class IpReassemblyChained :
+    private NonCopyable<IpReassemblyChained<Arg>>
+{
+    AIPSTACK_USE_VALS(Arg::Params, (MaxReassEntrys, MaxReassEntrysPerSource,
+                                    MaxReassSize, MaxReassHoles, MaxReassTimeSeconds,
+                                    MaxReassFrags))
+    AIPSTACK_USE_TYPES(Arg, (PlatformImpl))
+    
+    using Platform = PlatformFacade<PlatformImpl>;
+    AIPSTACK_USE_TYPES(Platform, (TimeType))
+    
+    static_assert(MaxReassEntrys > 0, "");
+    static_assert(MaxReassEntrysPerSource >= 0, "");
+    static_assert(MaxReassSize >= Ip4RequiredRecvSize, "");
+    static_assert(MaxReassHoles >= 1, "");
+    static_assert(MaxReassTimeSeconds >= 5, "");
+    static_assert(MaxReassFrags >= 2, "");
+    
+    // Maximum time that a reassembly entry can be valid.
+    static TimeType const ReassMaxExpirationTicks =
+        MaxReassTimeSeconds * TimeType(Platform::TimeFreq);
+    
+    static_assert(ReassMaxExpirationTicks <= Platform::WorkingTimeSpanTicks, "");
+    
+    enum class EntryState : uint8_t {Free, Active, Delivering};
+    
+    // Descriptor of one received fragment.
+    struct ReassFrag {
+        // Node referencing the driver's buffer from the start of the buffer to the
+        // end of the fragment data. When the datagram is delivered, nodes other than
+        // the first are adjusted to start at the fragment data.
+        IpBufNode node;
+        // Offset of the fragment data within node.
+        size_t buf_offset;
+        // Offset and length of the fragment data within the datagram.
+        uint16_t frag_offset;
+        uint16_t frag_len;
+        // Hold of the driver's buffer.
+        IpRxBufHold *hold;
+    };
+    
+    struct ReassEntry {
+        EntryState state;
+        // Number of fragments in frags.
+        uint8_t num_frags;
+        // The total data length, or 0 if last fragment not yet received.
+        uint16_t data_length;
+        // Number of data bytes received (fragments do not overlap).
+        uint16_t recv_length;
+        // Length of the IP header before the data of the first fragment (offset
+        // zero), valid once that fragment has been received.
+        uint8_t first_header_len;
+        // Time after which the entry is considered invalid.
+        TimeType expiration_time;
+        // Link in the stack of entries being delivered.
+        ReassEntry *next_delivering;
+        // IPv4 header (options not stored).
+        char header[Ip4Header::Size];
+        // Fragment descriptors sorted by frag_offset.
+        ReassFrag frags[MaxReassFrags];
+    };
+    
+private:
+    typename Platform::Timer m_timer;
+    IpStackStats *m_stats;
+    ReassEntry *m_delivering;
+    ReassEntry m_reass_packets[MaxReassEntrys];
+    
+public:
+    IpReassemblyChained (Platform platform_, IpStackStats *stats) :
+        m_timer(platform_, AIPSTACK_BIND_MEMBER_TN(&IpReassemblyChained::timerHandler, this)),
+        m_stats(stats),
+        m_delivering(nullptr)
+    {
+        // Mark all reassembly entries as unused.
+        for (auto &reass : m_reass_packets) {
+            reass.state = EntryState::Free;
+            reass.num_frags = 0;
+        }
+    }
+    
+    ~IpReassemblyChained ()
+    {
+        AIPSTACK_ASSERT(m_delivering == nullptr)
+        
+        // Give back any buffers held for incomplete datagrams.
+        for (auto &reass : m_reass_packets) {
+            release_entry(&reass);
+        }
+    }
+    
+    inline Platform platform () const
+    {
+        return m_timer.platform();
+    }
+    
+    /**
+     * Process a received packet and possibly return a reassembled datagram.
+     * 
+     * The arguments are as for @ref IpReassembly::reassembleIp4, except that
+     * `hold` must be provided for a fragment to be accepted. If the fragment is
+     * accepted, the buffer is held until the datagram is reassembled and
+     * released or the reassembly fails.
+     * 
+     * If a datagram is reassembled, `dgram` references a chain of the fragment
+     * buffers, which remains valid until the matching call of @ref
+     * releaseReassembled. The IP header of the first fragment precedes the data
+     * in the first buffer, and `header_len` is changed to its length.
+     */
+    bool reassembleIp4 (uint16_t ident, Ip4Addr src_addr, Ip4Addr dst_addr, uint8_t proto,
+                        uint8_t ttl, bool more_fragments, uint16_t fragment_offset,
+                        char const *header, uint8_t &header_len, IpBufRef &dgram,
+                        IpRxBufHold *hold)
+    {
+        AIPSTACK_ASSERT(dgram.tot_len <= TypeMax<uint16_t>())
+        AIPSTACK_ASSERT(more_fragments || fragment_offset > 0)
+        AIPSTACK_ASSERT(hold == nullptr || !hold->isHeld())
+        
+        // Sanity check data length, and check that we can hold the buffer and
+        // that the data is contiguous.
+        if (dgram.tot_len == 0 || hold == nullptr ||
+            dgram.getChunkLength() != dgram.tot_len)
+        {
+            m_stats->ip_reasm_fails.inc();
+            return false;
+        }
+        
+        // Check if we have a reassembly entry for this datagram.
+        TimeType now = platform().getTime();
+        ReassEntry *reass = find_reass_entry(now, ident, src_addr, dst_addr, proto);
+        
+        if (reass == nullptr) {
+            // Allocate an entry.
+            reass = alloc_reass_entry(now, ttl, src_addr);
+            if (reass == nullptr) {
+                m_stats->ip_reasm_fails.inc();
+                return false;
+            }
+            
+            // Copy the IP header.
+            ::memcpy(reass->header, header, Ip4Header::Size);
+            
+            // No fragments and unknown data length.
+            reass->state = EntryState::Active;
+            reass->num_frags = 0;
+            reass->data_length = 0;
+            reass->recv_length = 0;
+            
+            // The new entry may expire before the others.
+            update_timer();
+        }
+        
+        do {
+            // Verify that the fragment fits into the maximum size.
+            if (fragment_offset > MaxReassSize ||
+                dgram.tot_len > uint16_t(MaxReassSize - fragment_offset))
+            {
+                goto invalidate_reass;
+            }
+            uint16_t fragment_end = uint16_t(fragment_offset + dgram.tot_len);
+            
+            // Find the position of the fragment: the number of fragments
+            // which start before it.
+            uint8_t pos = 0;
+            while (pos < reass->num_frags &&
+                   reass->frags[pos].frag_offset < fragment_offset)
+            {
+                pos++;
+            }
+            
+            // Ignore an exact duplicate of a fragment we already have.
+            if (pos < reass->num_frags &&
+                reass->frags[pos].frag_offset == fragment_offset &&
+                reass->frags[pos].frag_len == dgram.tot_len)
+            {
+                return false;
+            }
+            
+            // Check for overlap with the previous and next fragments.
+            if (pos > 0 && frag_end(reass->frags[pos - 1]) > fragment_offset) {
+                goto invalidate_reass;
+            }
+            if (pos < reass->num_frags && fragment_end > reass->frags[pos].frag_offset) {
+                goto invalidate_reass;
+            }
+            
+            // Last-fragment related sanity checks, as in IpReassembly.
+            if (!more_fragments) {
+                // Check for inconsistent data_length.
+                if (reass->data_length != 0 && fragment_end != reass->data_length) {
+                    goto invalidate_reass;
+                }
+                
+                // Check for data beyond the end. Due to the overlap check, only
+                // fragments after this one (pos) could contain such data.
+                if (pos < reass->num_frags) {
+                    goto invalidate_reass;
+                }
+                
+                // Remember the data_length.
+                reass->data_length = fragment_end;
+            } else {
+                // Check for data beyond the end.
+                if (reass->data_length != 0 && fragment_end > reass->data_length) {
+                    goto invalidate_reass;
+                }
+            }
+            
+            // Check that there is space for the fragment descriptor.
+            if (reass->num_frags == MaxReassFrags) {
+                goto invalidate_reass;
+            }
+            
+            // Insert the fragment descriptor and take the buffer.
+            ::memmove(&reass->frags[pos + 1], &reass->frags[pos],
+                      (reass->num_frags - pos) * sizeof(ReassFrag));
+            ReassFrag &frag = reass->frags[pos];
+            frag.node = IpBufNode{dgram.node->ptr, dgram.offset + dgram.tot_len, nullptr};
+            frag.buf_offset = dgram.offset;
+            frag.frag_offset = fragment_offset;
+            frag.frag_len = uint16_t(dgram.tot_len);
+            frag.hold = hold;
+            reass->num_frags++;
+            reass->recv_length += frag.frag_len;
+            if (fragment_offset == 0) {
+                reass->first_header_len = header_len;
+            }
+            hold->take();
+            
+            // If we have not yet received the final fragment or not all data,
+            // the reassembly is not complete.
+            if (reass->data_length == 0 || reass->recv_length < reass->data_length) {
+                // If there are too many holes, invalidate.
+                if (count_holes(reass) > MaxReassHoles) {
+                    goto invalidate_reass;
+                }
+                return false;
+            }
+            
+            // Fragments do not overlap and do not extend past data_length,
+            // so they must cover the data exactly.
+            AIPSTACK_ASSERT(reass->recv_length == reass->data_length)
+            AIPSTACK_ASSERT(reass->frags[0].frag_offset == 0)
+            
+            // Link the nodes. Nodes after the first must start at the data
+            // since only the first node has an offset in IpBufRef.
+            for (uint8_t i = 0; i < reass->num_frags; i++) {
+                ReassFrag &f = reass->frags[i];
+                AIPSTACK_ASSERT(i == 0 ||
+                    f.frag_offset == frag_end(reass->frags[i - 1]))
+                if (i > 0) {
+                    f.node.ptr += f.buf_offset;
+                    f.node.len = f.frag_len;
+                    reass->frags[i - 1].node.next = &f.node;
+                }
+            }
+            
+            // The entry is in use until releaseReassembled.
+            reass->state = EntryState::Delivering;
+            reass->next_delivering = m_delivering;
+            m_delivering = reass;
+            update_timer();
+            
+            // Setup dgram to point to the reassembled data.
+            dgram = IpBufRef{&reass->frags[0].node, reass->frags[0].buf_offset,
+                             reass->data_length};
+            header_len = reass->first_header_len;
+            
+            // Continue to process the reassembled datagram.
+            return true;
+        } while (false);
+        
+    invalidate_reass:
+        release_entry(reass);
+        update_timer();
+        m_stats->ip_reasm_fails.inc();
+        return false;
+    }
+    
+    /**
+     * Release the buffers of the most recently reassembled datagram.
+     * 
+     * This must be called exactly once after each reassembly (true returned
+     * from @ref reassembleIp4), when the datagram is no longer used.
+     */
+    void releaseReassembled ()
+    {
+        AIPSTACK_ASSERT(m_delivering != nullptr)
+        AIPSTACK_ASSERT(m_delivering->state == EntryState::Delivering)
+        
+        ReassEntry *reass = m_delivering;
+        m_delivering = reass->next_delivering;
+        release_entry(reass);
+    }
+    
+private:
+    inline static uint16_t frag_end (ReassFrag const &frag)
+    {
+        return uint16_t(frag.frag_offset + frag.frag_len);
+    }
+    
+    // Count holes like IpReassembly, including the final hole which extends to
+    // infinity.
+    static uint8_t count_holes (ReassEntry const *reass)
+    {
+        uint8_t num_holes = 1;
+        uint16_t prev_end = 0;
+        for (uint8_t i = 0; i < reass->num_frags; i++) {
+            if (reass->frags[i].frag_offset > prev_end) {
+                num_holes++;
+            }
+            prev_end = frag_end(reass->frags[i]);
+        }
+        return num_holes;
+    }
+    
+    // Check if an entry should be evicted rather than the current candidate
+    // (which may be null), preferring the least complete entry.
+    static bool is_better_eviction (TimeType future, ReassEntry const *reass,
+                                    ReassEntry const *current)
+    {
+        if (current == nullptr) {
+            return true;
+        }
+        if (reass->recv_length != current->recv_length) {
+            return reass->recv_length < current->recv_length;
+        }
+        return TimeType(future - reass->expiration_time) >
+               TimeType(future - current->expiration_time);
+    }
+    
+    // Release the buffers of an entry and mark it as free.
+    static void release_entry (ReassEntry *reass)
+    {
+        uint8_t num_frags = reass->num_frags;
+        reass->state = EntryState::Free;
+        reass->num_frags = 0;
+        
+        for (uint8_t i = 0; i < num_frags; i++) {
+            reass->frags[i].hold->release();
+        }
+    }
+    
+    ReassEntry * find_reass_entry (TimeType now, uint16_t ident, Ip4Addr src_addr,
+                                   Ip4Addr dst_addr, uint8_t proto)
+    {
+        ReassEntry *found_entry = nullptr;
+        
+        for (auto &reass : m_reass_packets) {
+            // Ignore free entries and entries being delivered.
+            if (reass.state != EntryState::Active) {
+                continue;
+            }
+            
+            // If the entry has expired, free it and ignore.
+            if (TimeType(reass.expiration_time - now) > ReassMaxExpirationTicks) {
+                release_entry(&reass);
+                m_stats->ip_reasm_fails.inc();
+                m_stats->ip_reasm_timeouts.inc();
+                continue;
+            }
+            
+            // If the entry matches, return it after going through all
+            // so that we purge all expired entries.
+            auto reass_hdr = Ip4Header::MakeRef(reass.header);
+            if (reass_hdr.get(Ip4Header::Ident())    == ident &&
+                reass_hdr.get(Ip4Header::SrcAddr())  == src_addr &&
+                reass_hdr.get(Ip4Header::DstAddr())  == dst_addr &&
+                uint8_t(reass_hdr.get(Ip4Header::TtlProto())) == proto)
+            {
+                found_entry = &reass;
+            }
+        }
+        
+        return found_entry;
+    }
+    
+    ReassEntry * alloc_reass_entry (TimeType now, uint8_t ttl, Ip4Addr src_addr)
+    {
+        TimeType future = now + ReassMaxExpirationTicks;
+        
+        ReassEntry *free_reass = nullptr;
+        ReassEntry *evict_reass = nullptr;
+        ReassEntry *src_evict_reass = nullptr;
+        int src_count = 0;
+        
+        for (auto &reass : m_reass_packets) {
+            // Remember the first unused entry.
+            if (reass.state == EntryState::Free) {
+                if (free_reass == nullptr) {
+                    free_reass = &reass;
+                }
+                continue;
+            }
+            
+            // Entries being delivered cannot be reused.
+            if (reass.state == EntryState::Delivering) {
+                continue;
+            }
+            
+            // Look for the entry to evict overall and among the entries of
+            // this source, as in IpReassembly.
+            if (is_better_eviction(future, &reass, evict_reass)) {
+                evict_reass = &reass;
+            }
+            if (Ip4Header::MakeRef(reass.header).get(Ip4Header::SrcAddr()) == src_addr) {
+                src_count++;
+                if (is_better_eviction(future, &reass, src_evict_reass)) {
+                    src_evict_reass = &reass;
+                }
+            }
+        }
+        
+        // Choose the entry: if the source has reached its quota, one of its own
+        // entries, otherwise an unused entry if any, otherwise any entry.
+        ReassEntry *result_reass;
+        if (MaxReassEntrysPerSource > 0 && src_count >= MaxReassEntrysPerSource) {
+            result_reass = src_evict_reass;
+            m_stats->ip_reasm_quota_evictions.inc();
+        }
+        else if (free_reass != nullptr) {
+            result_reass = free_reass;
+        }
+        else {
+            result_reass = evict_reass;
+            if (result_reass == nullptr) {
+                return nullptr;
+            }
+            m_stats->ip_reasm_evictions.inc();
+        }
+        
+        // If we are reusing an entry in use, that reassembly has failed.
+        if (result_reass->state != EntryState::Free) {
+            release_entry(result_reass);
+            m_stats->ip_reasm_fails.inc();
+        }
+        
+        // Set the expiration time.
+        uint8_t seconds = MinValue(ttl, MaxReassTimeSeconds);
+        result_reass->expiration_time = now + seconds * TimeType(Platform::TimeFreq);
+        
+        return result_reass;
+    }
+    
+    // Set the timer for the earliest expiration of the active entries (the first
+    // time at which find_reass_entry considers one expired), or unset it if there
+    // are none.
+    void update_timer ()
+    {
+        TimeType now = platform().getTime();
+        bool have_active = false;
+        TimeType min_ticks = 0;
+        
+        for (auto const &reass : m_reass_packets) {
+            if (reass.state != EntryState::Active) {
+                continue;
+            }
+            
+            // Entries which have already expired are purged right away.
+            TimeType ticks = TimeType(reass.expiration_time - now);
+            ticks = (ticks > ReassMaxExpirationTicks) ? 0 : TimeType(ticks + 1);
+            
+            if (!have_active || ticks < min_ticks) {
+                have_active = true;
+                min_ticks = ticks;
+            }
+        }
+        
+        if (have_active) {
+            m_timer.setAt(TimeType(now + min_ticks));
+        } else {
+            m_timer.unset();
+        }
+    }
+    
+    void timerHandler ()
+    {
+        // Purge the expired reassembly entries, releasing their buffers.
+        TimeType now = platform().getTime();
+        find_reass_entry(now, 0, Ip4Addr::ZeroAddr(), Ip4Addr::ZeroAddr(), 0);
+        
+        // Wait for the next entry to expire.
+        update_timer();
+    }
+};
+
+#endif
+
+}
+
+#endif
@@ -40,6 +40,7 @@
 #include <aipstack/misc/EnumBitfieldUtils.h>
 #include <aipstack/misc/NonCopyable.h>
 #include <aipstack/misc/ResourceTuple.h>
+#include <aipstack/misc/Trace.h>
 #include <aipstack/structure/LinkedList.h>
 #include <aipstack/structure/LinkModel.h>
 #include <aipstack/structure/StructureRaiiWrapper.h>
@@ -48,19 +49,25 @@
 #include <aipstack/infra/Buf.h>
 #include <aipstack/infra/Chksum.h>
 #include <aipstack/infra/SendRetry.h>
+#include <aipstack/infra/RxBufHold.h>
 #include <aipstack/infra/TxAllocHelper.h>
 #include <aipstack/infra/Options.h>
 #include <aipstack/infra/ObserverNotification.h>
 #include <aipstack/infra/Instance.h>
 #include <aipstack/proto/Ip4Proto.h>
 #include <aipstack/proto/Icmp4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
 #include <aipstack/ip/IpAddr.h>
 #include <aipstack/ip/IpStackTypes.h>
 #include <aipstack/ip/IpIface.h>
+#include <aipstack/ip/IpStats.h>
 #include <aipstack/ip/IpIfaceListener.h>
 #include <aipstack/ip/IpIfaceStateObserver.h>
 #include <aipstack/ip/IpDriverIface.h>
 #include <aipstack/ip/IpMtuRef.h>
+#include <aipstack/ip/IpTcpSegmenter.h>
+#include <aipstack/ip/IpChksumOffload.h>
+#include <aipstack/ip/IpTcpRxCoalescer.h>
 #include <aipstack/platform/PlatformFacade.h>
 
 namespace AIpStack {
@@ -133,7 +140,8 @@ class IpStack :
     template <typename> friend class IpMtuRef;
     
     AIPSTACK_USE_TYPES(Arg, (Params, ProtocolServicesList))
-    AIPSTACK_USE_VALS(Params, (HeaderBeforeIp, IcmpTTL, AllowBroadcastPing))
+    AIPSTACK_USE_VALS(Params, (HeaderBeforeIp, IcmpTTL, AllowBroadcastPing,
+                               RxCoalesceFlows, RxCoalesceSegs))
     AIPSTACK_USE_TYPES(Params, (PathMtuCacheService, ReassemblyService))
 
 public:
@@ -156,6 +164,10 @@ private:
     AIPSTACK_MAKE_INSTANCE(PathMtuCache, (
         PathMtuCacheService::template Compose<PlatformImpl, Arg>))
     
+    static_assert(RxCoalesceFlows >= 0, "");
+    
+    using RxCoalescer = IpTcpRxCoalescer<Arg, RxCoalesceFlows, RxCoalesceSegs>;
+    
     // Instantiate the protocols.
     template <int ProtocolIndex>
     struct ProtocolHelper {
@@ -263,8 +275,9 @@ public:
      *        to @ref IpStackService::Compose.
      */
     IpStack (PlatformFacade<PlatformImpl> platform) :
-        m_reassembly(platform),
+        m_reassembly(platform, &m_stats),
         m_path_mtu_cache(platform, this),
+        m_loopback_iface(nullptr),
         m_next_id(0),
         m_protocols(ResourceTupleInitSame(), IpProtocolHandlerArgs<Arg>{platform, this})
     {}
@@ -290,6 +303,33 @@ public:
     {
         return m_reassembly.platform();
     }
+    
+    /**
+     * Return a snapshot of the stack-wide statistics counters.
+     * 
+     * This may be called from any thread, but the individual counters are read
+     * independently (see @ref IpStatCounter). Per-interface counters are available
+     * via @ref IpIface::getStats.
+     * 
+     * @return Copy of the statistics counters.
+     */
+    inline IpStackStats getStats () const
+    {
+        return m_stats;
+    }
+    
+    /**
+     * Return a reference to the stack-wide statistics counters for updating.
+     * 
+     * This is intended to be used by protocol handlers to update the counters
+     * belonging to them. It must only be used from the context in which the stack runs.
+     * 
+     * @return Reference to the statistics counters.
+     */
+    inline IpStackStats & stats ()
+    {
+        return m_stats;
+    }
 
     /**
      * Get the template parameter for a protocol API class template.
@@ -377,6 +417,8 @@ public:
         AIPSTACK_ASSERT(dgram.offset >= Ip4Header::Size)
         AIPSTACK_ASSERT((send_flags & ~IpSendFlags::AllFlags) == EnumZero)
         
+        m_stats.ip_out_requests.inc();
+        
         // Reveal IP header.
         IpBufRef pkt = dgram.revealHeaderMust(Ip4Header::Size);
         
@@ -389,12 +431,17 @@ public:
             route_ok = routeIp4(addrs.remote_addr, route_info);
         }
         if (AIPSTACK_UNLIKELY(!route_ok)) {
+            m_stats.ip_out_no_routes.inc();
+            AIPSTACK_TRACE(IpTxError, IpErr::NO_IP_ROUTE, addrs.remote_addr.data[0],
+                           dgram.tot_len)
             return IpErr::NO_IP_ROUTE;
         }
         
         // Check if sending is allowed.
         IpErr check_err = checkSendIp4Allowed(addrs, send_flags, route_info.iface);
         if (AIPSTACK_UNLIKELY(check_err != IpErr::SUCCESS)) {
+            m_stats.ip_out_discards.inc();
+            AIPSTACK_TRACE(IpTxError, check_err, addrs.remote_addr.data[0], dgram.tot_len)
             return check_err;
         }
 
@@ -404,6 +451,9 @@ public:
         if (AIPSTACK_UNLIKELY(pkt.tot_len > route_info.iface->getMtu())) {
             // Reject fragmentation?
             if (AIPSTACK_UNLIKELY((send_flags & IpSendFlags::DontFragmentFlag) != EnumZero)) {
+                m_stats.ip_out_frag_fails.inc();
+                AIPSTACK_TRACE(IpTxError, IpErr::FRAG_NEEDED, addrs.remote_addr.data[0],
+                               dgram.tot_len)
                 return IpErr::FRAG_NEEDED;
             }
             
@@ -451,15 +501,46 @@ public:
         // Send the packet to the driver.
         // Fast path is no fragmentation, this permits tail call optimization.
         if (AIPSTACK_LIKELY((send_flags & IpSendFlags(Ip4FlagMF)) == EnumZero)) {
-            return route_info.iface->m_params.send_ip4_packet(
-                pkt, route_info.addr, retryReq);
+            return send_to_driver(route_info.iface, pkt, route_info.addr, retryReq,
+                (send_flags & IpSendFlags::ProtoChksumOffload) != EnumZero);
         }
         
         // Slow path...
+        // Fragments cannot have the checksum completed by the driver.
+        if ((send_flags & IpSendFlags::ProtoChksumOffload) != EnumZero) {
+            IpChksumOffload::completeChksum(pkt);
+        }
         return send_fragmented(pkt, route_info, send_flags, retryReq);
     }
     
 private:
+    // Pass a packet to the driver. If it has a partial transport checksum
+    // (chksum_offload), the driver completes that if it can, otherwise it is
+    // completed here.
+    AIPSTACK_ALWAYS_INLINE
+    static IpErr send_to_driver (Iface *iface, IpBufRef pkt, Ip4Addr addr,
+                                 IpSendRetryRequest *retryReq, bool chksum_offload)
+    {
+        iface->m_stats.out_transmits.inc();
+        
+        if (chksum_offload) {
+            if (AIPSTACK_LIKELY(iface_has_tx_chksum(iface))) {
+                iface->capturePacket(IpCaptureDir::Tx, pkt);
+                return iface->m_params.send_ip4_chksum_packet(pkt, addr, retryReq);
+            }
+            IpChksumOffload::completeChksum(pkt);
+        }
+        
+        iface->capturePacket(IpCaptureDir::Tx, pkt);
+        return iface->m_params.send_ip4_packet(pkt, addr, retryReq);
+    }
+    
+    inline static bool iface_has_tx_chksum (Iface *iface)
+    {
+        return (iface->m_params.offload_flags & IpIfaceOffloadFlags::TxProtoChksum) !=
+               EnumZero;
+    }
+    
     IpErr send_fragmented (IpBufRef pkt, IpRouteInfoIp4<Arg> route_info,
                            IpSendFlags send_flags, IpSendRetryRequest *retryReq)
     {
@@ -467,10 +548,16 @@ private:
         uint16_t pkt_send_len =
             Ip4RoundFragLen(Ip4Header::Size, route_info.iface->getMtu());
         
+        m_stats.ip_out_frag_reqds.inc();
+        
         // Send the first fragment.
+        m_stats.ip_out_frag_creates.inc();
+        route_info.iface->m_stats.out_transmits.inc();
+        route_info.iface->capturePacket(IpCaptureDir::Tx, pkt.subTo(pkt_send_len));
         IpErr err = route_info.iface->m_params.send_ip4_packet(
             pkt.subTo(pkt_send_len), route_info.addr, retryReq);
         if (AIPSTACK_UNLIKELY(err != IpErr::SUCCESS)) {
+            m_stats.ip_out_frag_fails.inc();
             return err;
         }
         
@@ -517,6 +604,9 @@ private:
                 Ip4Header::Size, &data_node, pkt_send_len, &header_node);
             
             // Send the packet to the driver.
+            m_stats.ip_out_frag_creates.inc();
+            route_info.iface->m_stats.out_transmits.inc();
+            route_info.iface->capturePacket(IpCaptureDir::Tx, frag_pkt);
             err = route_info.iface->m_params.send_ip4_packet(
                 frag_pkt, route_info.addr, retryReq);
             
@@ -524,6 +614,11 @@ private:
             if ((send_flags & IpSendFlags(Ip4FlagMF)) == EnumZero ||
                 AIPSTACK_UNLIKELY(err != IpErr::SUCCESS))
             {
+                if (AIPSTACK_LIKELY(err == IpErr::SUCCESS)) {
+                    m_stats.ip_out_frag_oks.inc();
+                } else {
+                    m_stats.ip_out_frag_fails.inc();
+                }
                 return err;
             }
             
@@ -567,12 +662,15 @@ public:
         
         // Get routing information (fill in route_info).
         if (AIPSTACK_UNLIKELY(!routeIp4(addrs.remote_addr, prep.route_info))) {
+            m_stats.ip_out_no_routes.inc();
+            AIPSTACK_TRACE(IpTxError, IpErr::NO_IP_ROUTE, addrs.remote_addr.data[0], 0)
             return IpErr::NO_IP_ROUTE;
         }
         
         // Check if sending is allowed.
         IpErr check_err = checkSendIp4Allowed(addrs, send_flags, prep.route_info.iface);
         if (AIPSTACK_UNLIKELY(check_err != IpErr::SUCCESS)) {
+            m_stats.ip_out_discards.inc();
             return check_err;
         }
 
@@ -600,6 +698,11 @@ public:
         // Save the partial header checksum.
         prep.partial_chksum_state = chksum.getState();
         
+        // The transport checksum is only left to the driver if it supports that.
+        prep.chksum_offload =
+            (send_flags & IpSendFlags::ProtoChksumOffload) != EnumZero &&
+            iface_has_tx_chksum(prep.route_info.iface);
+        
         return IpErr::SUCCESS;
     }
     
@@ -632,11 +735,16 @@ public:
         AIPSTACK_ASSERT(dgram.tot_len <= TypeMax<uint16_t>())
         AIPSTACK_ASSERT(dgram.offset >= Ip4Header::Size)
         
+        m_stats.ip_out_requests.inc();
+        
         // Reveal IP header.
         IpBufRef pkt = dgram.revealHeaderMust(Ip4Header::Size);
         
         // This function does not support fragmentation.
         if (AIPSTACK_UNLIKELY(pkt.tot_len > prep.route_info.iface->getMtu())) {
+            m_stats.ip_out_frag_fails.inc();
+            AIPSTACK_TRACE(IpTxError, IpErr::FRAG_NEEDED,
+                           prep.route_info.addr.data[0], dgram.tot_len)
             return IpErr::FRAG_NEEDED;
         }
         
@@ -655,8 +763,134 @@ public:
         ip4_header.set(Ip4Header::HeaderChksum(), chksum.getChksum());
         
         // Send the packet to the driver.
-        return prep.route_info.iface->m_params.send_ip4_packet(
-            pkt, prep.route_info.addr, retryReq);
+        return send_to_driver(prep.route_info.iface, pkt, prep.route_info.addr,
+                              retryReq, prep.chksum_offload);
+    }
+    
+    /**
+     * Send a TCP datagram as multiple segments after preparation with
+     * @ref prepareSendIp4Dgram.
+     * 
+     * This is like @ref sendIp4DgramFast except that the datagram, consisting of
+     * a TCP header and data, may exceed the MTU. It is sent as a sequence of
+     * segments with up to `seg_data_len` bytes of data each, as done by
+     * @ref IpTcpSegmenter. If the interface driver supports
+     * @ref IpIfaceOffloadFlags::TcpSegmentation, the datagram is passed to the
+     * driver as a whole (or in parts no larger than
+     * @ref IpIfaceDriverParams::tso_max_len), otherwise the stack splits it and
+     * passes the segments to the driver one by one. In either case, routing and
+     * other per-datagram work is only done once.
+     * 
+     * The TCP checksum in the datagram is not used, it is calculated for each
+     * segment. This function does not support fragmentation. If segments of
+     * `seg_data_len` would be too large, the error @ref IpErr::FRAG_NEEDED is
+     * returned.
+     * 
+     * @param prep Structure with internal information that was filled in
+     *             using @ref prepareSendIp4Dgram (see @ref sendIp4DgramFast).
+     * @param dgram The TCP header followed by the data, with the same requirements
+     *              as for @ref sendIp4DgramFast. Additionally, the TCP header must
+     *              be contiguous and there must be some data. The tot_len must not
+     *              exceed 2^16-1 minus the IPv4 header size.
+     * @param seg_data_len Maximum TCP data length in each segment (nonzero).
+     * @param retryReq If not null, this may provide notification when to retry sending
+     *                 after an unsuccessful attempt (notification is not guaranteed).
+     * @param out_data_sent Set to the amount of TCP data in segments which were
+     *        sent successfully. Some segments may have been sent even if an error
+     *        is returned, in which case the caller should account for them.
+     * @return Success or error code.
+     */
+    IpErr sendIp4TcpSegmentsFast (IpSendPreparedIp4<Arg> const &prep, IpBufRef dgram,
+                                  uint16_t seg_data_len, IpSendRetryRequest *retryReq,
+                                  size_t &out_data_sent)
+    {
+        AIPSTACK_ASSERT(dgram.tot_len <= TypeMax<uint16_t>() - Ip4Header::Size)
+        AIPSTACK_ASSERT(dgram.offset >= Ip4Header::Size)
+        AIPSTACK_ASSERT(dgram.getChunkLength() >= Tcp4Header::Size)
+        AIPSTACK_ASSERT(seg_data_len > 0)
+        
+        out_data_sent = 0;
+        
+        m_stats.ip_out_requests.inc();
+        
+        Iface *iface = prep.route_info.iface;
+        
+        // Determine the TCP header and data length.
+        auto tcp_header = Tcp4Header::MakeRef(dgram.getChunkPtr());
+        size_t tcp_header_len =
+            4 * size_t(tcp_header.get(Tcp4Header::OffsetFlags()) >> TcpOffsetShift);
+        AIPSTACK_ASSERT(dgram.tot_len > tcp_header_len)
+        size_t data_len = dgram.tot_len - tcp_header_len;
+        
+        // Check that the segments will not exceed the MTU.
+        if (AIPSTACK_UNLIKELY(Ip4Header::Size + tcp_header_len + seg_data_len >
+                              iface->getMtu()))
+        {
+            m_stats.ip_out_frag_fails.inc();
+            AIPSTACK_TRACE(IpTxError, IpErr::FRAG_NEEDED,
+                           prep.route_info.addr.data[0], dgram.tot_len)
+            return IpErr::FRAG_NEEDED;
+        }
+        
+        // Reveal IP header.
+        IpBufRef pkt = dgram.revealHeaderMust(Ip4Header::Size);
+        
+        // Write remaining IP header fields and the header checksum. We reserve
+        // one identification number for each segment.
+        auto ip4_header = Ip4Header::MakeRef(pkt.getChunkPtr());
+        IpChksumAccumulator chksum(prep.partial_chksum_state);
+        
+        chksum.addWord(WrapType<uint16_t>(), uint16_t(pkt.tot_len));
+        ip4_header.set(Ip4Header::TotalLen(), uint16_t(pkt.tot_len));
+        
+        uint16_t ident = m_next_id;
+        m_next_id += uint16_t((data_len + seg_data_len - 1) / seg_data_len);
+        chksum.addWord(WrapType<uint16_t>(), ident);
+        ip4_header.set(Ip4Header::Ident(), ident);
+        
+        ip4_header.set(Ip4Header::HeaderChksum(), chksum.getChksum());
+        
+        bool tso = (iface->m_params.offload_flags &
+                    IpIfaceOffloadFlags::TcpSegmentation) != EnumZero;
+        
+        // Fast path is passing the whole packet to a driver with TSO support.
+        if (tso && pkt.tot_len <= iface->m_params.tso_max_len) {
+            iface->m_stats.out_transmits.inc();
+            iface->capturePacket(IpCaptureDir::Tx, pkt);
+            IpErr err = iface->m_params.send_ip4_tso_packet(
+                pkt, seg_data_len, prep.route_info.addr, retryReq, out_data_sent);
+            if (AIPSTACK_LIKELY(err == IpErr::SUCCESS)) {
+                out_data_sent = data_len;
+            }
+            AIPSTACK_ASSERT(out_data_sent <= data_len)
+            return err;
+        }
+        
+        // Otherwise split the packet, into parts which the driver can segment
+        // further if possible, or into individual segments. The checksum of
+        // individual segments is left to the driver if it supports that.
+        size_t segs_per_pkt = 1;
+        if (tso) {
+            size_t max_pkt_data =
+                iface->m_params.tso_max_len - (Ip4Header::Size + tcp_header_len);
+            segs_per_pkt = MaxValue(size_t(1), max_pkt_data / seg_data_len);
+        }
+        bool partial_chksum = iface_has_tx_chksum(iface);
+        
+        return IpTcpSegmenter::segment(pkt, 0, seg_data_len, segs_per_pkt,
+            partial_chksum, [&](IpBufRef seg_pkt) {
+                if (seg_pkt.tot_len > Ip4Header::Size + tcp_header_len + seg_data_len) {
+                    iface->m_stats.out_transmits.inc();
+                    iface->capturePacket(IpCaptureDir::Tx, seg_pkt);
+                    size_t part_sent = 0;
+                    return iface->m_params.send_ip4_tso_packet(
+                        seg_pkt, seg_data_len, prep.route_info.addr, retryReq, part_sent);
+                } else {
+                    return send_to_driver(iface, seg_pkt, prep.route_info.addr,
+                                          retryReq, partial_chksum);
+                }
+            },
+            out_data_sent);
     }
 
 private:
@@ -678,9 +912,7 @@ private:
         }
 
         if (AIPSTACK_LIKELY((send_flags & IpSendFlags::AllowNonLocalSrc) == EnumZero)) {
-            if (AIPSTACK_UNLIKELY(!iface->m_have_addr ||
-                                  addrs.local_addr != iface->m_addr.addr))
-            {
+            if (AIPSTACK_UNLIKELY(!iface->ip4AddrIsLocalAddr(addrs.local_addr))) {
                 return IpErr::NONLOCAL_SRC;
             }
         }
@@ -694,7 +926,11 @@ public:
      * 
      * Determines the interface and next hop address for sending a packet to
      * the given address. The logic is:
-     * - If there is any interface with an address configured for which the
+     * - If the destination address is the address of any interface and there is
+     *   a loopback interface (@ref IpIfaceDriverParams::loopback), the resulting
+     *   interface is the loopback interface and the resulting hop address is the
+     *   destination address.
+     * - Otherwise, if there is any interface with an address configured for which the
      *   destination address belongs to the subnet of the interface, the
      *   resulting interface is the most recently added interface out of
      *   such interfaces with the longest prefix length, and the resulting
@@ -718,6 +954,15 @@ public:
              iface = m_iface_list.next(*iface))
         {
             if (iface->ip4AddrIsLocal(dst_addr)) {
+                // Packets to our own addresses go through the loopback interface.
+                if (AIPSTACK_UNLIKELY(dst_addr == iface->m_addr.addr) &&
+                    m_loopback_iface != nullptr)
+                {
+                    route_info.iface = m_loopback_iface;
+                    route_info.addr = dst_addr;
+                    return true;
+                }
+                
                 int iface_prefix = iface->m_addr.prefix;
                 if (iface_prefix > best_prefix) {
                     best_prefix = iface_prefix;
@@ -747,8 +992,9 @@ public:
      * that it also accepts the all-ones broadcast address. The logic is:
      * - If the destination address is all-ones, or the interface has an address
      *   configured and the destination address belongs to the subnet of the interface,
-     *   the resulting hop address is the destination address (and the resulting
-     *   interface is as given).
+     *   or the interface is the loopback interface and the destination address is
+     *   the address of any interface, the resulting hop address is the destination
+     *   address (and the resulting interface is as given).
      * - Otherwise, if the interface has a gateway configured, the resulting
      *   hop address is the gateway address of the interface (and the resulting
      *   interface is as given).
@@ -765,7 +1011,9 @@ public:
     {
         AIPSTACK_ASSERT(iface != nullptr)
         
-        if (dst_addr.isAllOnes() || iface->ip4AddrIsLocal(dst_addr)) {
+        if (dst_addr.isAllOnes() || iface->ip4AddrIsLocal(dst_addr) ||
+            iface->ip4AddrIsLocalAddr(dst_addr))
+        {
             route_info.addr = dst_addr;
         }
         else if (iface->m_have_gateway) {
@@ -822,6 +1070,30 @@ public:
         return m_path_mtu_cache.handlePacketTooBig(remote_addr, TypeMax<uint16_t>());
     }
     
+    /**
+     * Raise a Path MTU estimate after a probe packet of the given size has been
+     * confirmed to reach the destination.
+     * 
+     * This is to be called by a protocol handler which implements
+     * Packetization Layer Path MTU Discovery (RFC 4821, RFC 8899), when it
+     * receives an acknowledgement for a probe packet. The Path MTU estimate is
+     * raised to min(interface_mtu, probe_mtu) if it is less than that. Nothing
+     * is done if there is no existing Path MTU estimate for the address or if
+     * there is no route for the address.
+     * 
+     * If the Path MTU estimate was raised, then all existing @ref IpMtuRef setup
+     * for this address are notified (@ref IpMtuRef::pmtuChanged are called),
+     * directly from this function.
+     * 
+     * @param remote_addr Address to which the probe was sent.
+     * @param probe_mtu Size of the IP packet which was confirmed to be delivered.
+     * @return True if the Path MTU estimate was raised, false if not.
+     */
+    inline bool handlePathMtuProbeAcked (Ip4Addr remote_addr, uint16_t probe_mtu)
+    {
+        return m_path_mtu_cache.handleProbeAcked(remote_addr, probe_mtu);
+    }
+    
     /**
      * Check if the source address of a received datagram appears to be
      * a unicast address.
@@ -881,6 +1153,7 @@ public:
         // calculated length.
         IpBufRef data = rx_dgram.revealHeaderMust(rx_ip_info.header_len).subTo(data_len);
 
+        m_stats.icmp_out_dest_unreachs.inc();
         return sendIcmp4Message(addrs, rx_ip_info.iface, Icmp4TypeDestUnreach,
                                 du_meta.icmp_code, du_meta.icmp_rest, data);
     }
@@ -891,7 +1164,9 @@ public:
      * 
      * This checks for a route to the given remote IP address and verifies that the
      * selected network interface has an IP address configured. If that is OK, it succeeds
-     * and provides the interface and its local address.
+     * and provides the interface and its local address. If the remote address is an
+     * address of the stack itself (reached through the loopback interface), that
+     * same address is provided as the local address.
      * 
      * @param remote_addr Remote IP address.
      * @param out_iface On success, is set to a pointer to the selected network interface
@@ -916,7 +1191,8 @@ public:
         }
 
         out_iface = route_info.iface;
-        out_local_addr = addr_setting.addr;
+        out_local_addr = route_info.iface->ip4AddrIsLocalAddr(remote_addr) ?
+            remote_addr : addr_setting.addr;
         return IpErr::SUCCESS;
     }
     
@@ -937,10 +1213,28 @@ public:
 #endif
     
 private:
-    static void processRecvedIp4Packet (Iface *iface, IpBufRef pkt)
+    bool ip4AddrIsIfaceAddr (Ip4Addr addr) const
     {
+        for (Iface *iface = m_iface_list.first(); iface != nullptr;
+             iface = m_iface_list.next(*iface))
+        {
+            if (iface->m_have_addr && addr == iface->m_addr.addr) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    static void processRecvedIp4Packet (Iface *iface, IpBufRef pkt, IpRxBufHold *hold,
+                                        IpRxFlags rx_flags)
+    {
+        iface->m_stats.in_receives.inc();
+        iface->capturePacket(IpCaptureDir::Rx, pkt);
+        
         // Check base IP header length.
         if (AIPSTACK_UNLIKELY(!pkt.hasHeader(Ip4Header::Size))) {
+            iface->m_stats.in_hdr_errors.inc();
+            AIPSTACK_TRACE(IpRxDrop, TraceDropReason::BadHeader, 0, 0)
             return;
         }
         
@@ -967,6 +1261,8 @@ private:
         } else {
             // Check IP version.
             if (AIPSTACK_UNLIKELY((version_ihl >> Ip4VersionShift) != 4)) {
+                iface->m_stats.in_hdr_errors.inc();
+                AIPSTACK_TRACE(IpRxDrop, TraceDropReason::BadHeader, 0, 0)
                 return;
             }
             
@@ -976,6 +1272,8 @@ private:
             if (AIPSTACK_UNLIKELY(header_len < Ip4Header::Size ||
                                  !pkt.hasHeader(header_len)))
             {
+                iface->m_stats.in_hdr_errors.inc();
+                AIPSTACK_TRACE(IpRxDrop, TraceDropReason::BadHeader, 0, 0)
                 return;
             }
             
@@ -990,6 +1288,8 @@ private:
         
         // Check total length.
         if (AIPSTACK_UNLIKELY(total_len < header_len || total_len > pkt.tot_len)) {
+            iface->m_stats.in_truncated_pkts.inc();
+            AIPSTACK_TRACE(IpRxDrop, TraceDropReason::BadLength, 0, 0)
             return;
         }
         
@@ -1015,12 +1315,22 @@ private:
         uint16_t flags_offset = ip4_header.get(Ip4Header::FlagsOffset());
         chksum.addWord(WrapType<uint16_t>(), flags_offset);        
         
-        // Verify IP header checksum.
-        if (AIPSTACK_UNLIKELY(chksum.getChksum() != 0)) {
+        // Verify IP header checksum, unless the driver has done that.
+        if ((rx_flags & IpRxFlags::Ip4HeaderChksumVerified) == EnumZero &&
+            AIPSTACK_UNLIKELY(chksum.getChksum() != 0))
+        {
+            iface->m_stats.in_hdr_errors.inc();
+            AIPSTACK_TRACE(IpRxDrop, TraceDropReason::BadChecksum, src_addr.data[0],
+                           dst_addr.data[0])
             return;
         }
         
+        // Note that the interface may be removed by callbacks while the datagram
+        // is processed below, so the stack is remembered for use afterward.
+        IpStack *stack = iface->m_stack;
+        
         // Check if the more-fragments flag is set or the fragment offset is nonzero.
+        bool reassembled = false;
         if (AIPSTACK_UNLIKELY((flags_offset & (Ip4FlagMF|Ip4OffsetMask)) != 0)) {
             // Only accept fragmented packets which are unicasts to the
             // incoming interface address. This is to prevent filling up
@@ -1028,6 +1338,9 @@ private:
             // we don't check this for non-fragmented packets for
             // performance reasons, it generally up to protocol handlers.
             if (!iface->ip4AddrIsLocalAddr(dst_addr)) {
+                iface->m_stats.in_addr_errors.inc();
+                AIPSTACK_TRACE(IpRxDrop, TraceDropReason::BadAddress, src_addr.data[0],
+                               dst_addr.data[0])
                 return;
             }
             
@@ -1035,24 +1348,71 @@ private:
             bool more_fragments = (flags_offset & Ip4FlagMF) != 0;
             uint16_t fragment_offset = (flags_offset & Ip4OffsetMask) * 8;
             
+            stack->m_stats.ip_reasm_reqds.inc();
+            
             // Perform reassembly.
-            if (!iface->m_stack->m_reassembly.reassembleIp4(
+            if (!stack->m_reassembly.reassembleIp4(
                 ip4_header.get(Ip4Header::Ident()), src_addr, dst_addr,
                 ttl_proto.proto(), ttl_proto.ttl(), more_fragments,
-                fragment_offset, ip4_header.data, dgram))
+                fragment_offset, ip4_header.data, header_len, dgram, hold))
             {
                 return;
             }
+            
+            stack->m_stats.ip_reasm_oks.inc();
+            reassembled = true;
             // Continue processing the reassembled datagram.
-            // Note, dgram was modified pointing to the reassembled data.
+            // Note, dgram was modified pointing to the reassembled data, and
+            // header_len to the length of the IP header before it.
         }
         
-        // Create the IpRxInfoIp4 struct.
+        // Create the IpRxInfoIp4 struct. A partial transport checksum means that
+        // the checksum does not need to be verified. Driver information about the
+        // transport checksum does not apply to a reassembled datagram.
         IpRxInfoIp4<Arg> ip_info = {src_addr, dst_addr, ttl_proto, iface, header_len};
+        if ((rx_flags & (IpRxFlags::ProtoChksumVerified|IpRxFlags::ProtoChksumPartial))
+            != EnumZero && AIPSTACK_LIKELY(!reassembled))
+        {
+            ip_info.rx_flags = IpRxFlags::ProtoChksumVerified;
+        }
 
         // Do the real processing now that the datagram is complete and
-        // sanity checked.
-        recvIp4Dgram(ip_info, dgram);
+        // sanity checked. Within a receive batch, this goes through receive
+        // coalescing, which may delay processing until the end of the batch.
+        iface->m_stats.in_delivers.inc();
+        if (RxCoalesceFlows > 0 && iface->m_rx_batch) {
+            stack->m_rx_coalescer.recvIp4Dgram(ip_info, dgram,
+                reassembled ? nullptr : hold, stack->m_stats, RecvIp4DgramFunc());
+        } else {
+            recvIp4Dgram(ip_info, dgram);
+        }
+        
+        // Let the reassembly release the buffers of a reassembled datagram.
+        if (AIPSTACK_UNLIKELY(reassembled)) {
+            stack->m_reassembly.releaseReassembled();
+        }
+    }
+    
+    struct RecvIp4DgramFunc {
+        inline void operator() (IpRxInfoIp4<Arg> const &ip_info, IpBufRef dgram) const
+        {
+            recvIp4Dgram(ip_info, dgram);
+        }
+    };
+    
+    static void beginRecvBatch (Iface *iface)
+    {
+        AIPSTACK_ASSERT(!iface->m_rx_batch)
+        
+        iface->m_rx_batch = true;
+    }
+    
+    static void endRecvBatch (Iface *iface)
+    {
+        AIPSTACK_ASSERT(iface->m_rx_batch)
+        
+        iface->m_rx_batch = false;
+        iface->m_stack->m_rx_coalescer.flushIface(iface, RecvIp4DgramFunc());
     }
     
     static void recvIp4Dgram (IpRxInfoIp4<Arg> ip_info, IpBufRef dgram)
@@ -1093,6 +1453,10 @@ private:
         if (proto == Ip4ProtocolIcmp) {
             return recvIcmp4Dgram(ip_info, dgram);
         }
+        
+        ip_info.iface->m_stack->m_stats.ip_in_unknown_protos.inc();
+        AIPSTACK_TRACE(IpRxDrop, TraceDropReason::UnknownProto, ip_info.src_addr.data[0],
+                       ip_info.dst_addr.data[0])
     }
     
     static void recvIcmp4Dgram (IpRxInfoIp4<Arg> const &ip_info, IpBufRef const &dgram)
@@ -1117,8 +1481,12 @@ private:
             is_broadcast_dst = true;
         }
         
+        IpStack *stack = ip_info.iface->m_stack;
+        stack->m_stats.icmp_in_msgs.inc();
+        
         // Check ICMP header length.
         if (AIPSTACK_UNLIKELY(!dgram.hasHeader(Icmp4Header::Size))) {
+            stack->m_stats.icmp_in_errors.inc();
             return;
         }
         
@@ -1131,15 +1499,16 @@ private:
         // Verify ICMP checksum.
         uint16_t calc_chksum = IpChksum(dgram);
         if (AIPSTACK_UNLIKELY(calc_chksum != 0)) {
+            stack->m_stats.icmp_in_errors.inc();
             return;
         }
         
         // Get ICMP data by hiding the ICMP header.
         IpBufRef icmp_data = dgram.hideHeader(Icmp4Header::Size);
         
-        IpStack *stack = ip_info.iface->m_stack;
-        
         if (type == Icmp4TypeEchoRequest) {
+            stack->m_stats.icmp_in_echos.inc();
+            
             // Got echo request, send echo reply.
             // But if this is a broadcast request, respond only if allowed.
             if (is_broadcast_dst && !AllowBroadcastPing) {
@@ -1148,6 +1517,7 @@ private:
             stack->sendIcmp4EchoReply(rest, icmp_data, ip_info.src_addr, ip_info.iface);
         }
         else if (type == Icmp4TypeDestUnreach) {
+            stack->m_stats.icmp_in_dest_unreachs.inc();
             stack->handleIcmp4DestUnreach(code, rest, icmp_data, ip_info.iface);
         }
     }
@@ -1163,12 +1533,15 @@ private:
         }
         
         Ip4Addrs addrs = {iface->m_addr.addr, dst_addr};
+        m_stats.icmp_out_echo_reps.inc();
         sendIcmp4Message(addrs, iface, Icmp4TypeEchoReply, /*code=*/0, rest, data);
     }
 
     IpErr sendIcmp4Message (Ip4Addrs const &addrs, Iface *iface,
                             uint8_t type, uint8_t code, Icmp4RestType rest, IpBufRef data)
     {
+        m_stats.icmp_out_msgs.inc();
+        
         // Allocate memory for headers.
         TxAllocHelper<Icmp4Header::Size, HeaderBeforeIp4Dgram>
             dgram_alloc(Icmp4Header::Size);
@@ -1253,9 +1626,12 @@ private:
     }
     
 private:
+    IpStackStats m_stats;
     Reassembly m_reassembly;
     PathMtuCache m_path_mtu_cache;
+    RxCoalescer m_rx_coalescer;
     StructureRaiiWrapper<IfaceList> m_iface_list;
+    Iface *m_loopback_iface;
     uint16_t m_next_id;
     InstantiateVariadic<ResourceTuple, ProtocolsList> m_protocols;
 };
@@ -1298,6 +1674,24 @@ struct IpStackOptions {
      * This must be @ref IpReassemblyService instantiated with the desired options.
      */
     AIPSTACK_OPTION_DECL_TYPE(ReassemblyService, void)
+    
+    /**
+     * Maximum number of TCP flows for which received segments are coalesced at
+     * the same time (0 disables receive coalescing).
+     * 
+     * Receive coalescing (software GRO) combines consecutive TCP segments of the
+     * same flow received within a receive batch (see @ref
+     * IpDriverIface::beginRecvBatch) into one segment, reducing the per-segment
+     * processing cost in TCP. Only packets received with an @ref IpRxBufHold are
+     * coalesced.
+     */
+    AIPSTACK_OPTION_DECL_VALUE(RxCoalesceFlows, int, 0)
+    
+    /**
+     * Maximum number of received TCP segments combined into one by receive
+     * coalescing (see @ref RxCoalesceFlows).
+     */
+    AIPSTACK_OPTION_DECL_VALUE(RxCoalesceSegs, int, 16)
 };
 
 /**
@@ -1327,6 +1721,8 @@ class IpStackService {
     AIPSTACK_OPTION_CONFIG_VALUE(IpStackOptions, AllowBroadcastPing)
     AIPSTACK_OPTION_CONFIG_TYPE(IpStackOptions, PathMtuCacheService)
     AIPSTACK_OPTION_CONFIG_TYPE(IpStackOptions, ReassemblyService)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpStackOptions, RxCoalesceFlows)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpStackOptions, RxCoalesceSegs)
     
 public:
     /**
@@ -181,6 +181,77 @@ struct IpIfaceDriverState {
     bool link_up = true;
 };
 
+/**
+ * Offload capabilities of an IP interface driver.
+ * 
+ * These are reported by the driver via @ref IpIfaceDriverParams::offload_flags.
+ * 
+ * Operators provided by @ref AIPSTACK_ENUM_BITFIELD_OPS are available.
+ */
+enum class IpIfaceOffloadFlags : uint16_t {
+    /**
+     * TCP segmentation offload.
+     * 
+     * The driver accepts TCP packets larger than the MTU together with a segment
+     * size via @ref IpIfaceDriverParams::send_ip4_tso_packet, and splits them into
+     * segments itself (see @ref IpTcpSegmenter for the exact semantics).
+     */
+    TcpSegmentation = uint16_t(1) << 0,
+    
+    /**
+     * Transmit checksum offload for TCP and UDP.
+     * 
+     * The driver accepts TCP and UDP packets whose checksum is still to be
+     * calculated via @ref IpIfaceDriverParams::send_ip4_chksum_packet, and
+     * completes the checksum itself (see @ref IpChksumOffload for the exact
+     * semantics).
+     */
+    TxProtoChksum = uint16_t(1) << 1,
+};
+
+#ifndef IN_DOXYGEN
+AIPSTACK_ENUM_BITFIELD_OPS(IpIfaceOffloadFlags)
+#endif
+
+/**
+ * Flags with additional information about a received packet.
+ * 
+ * These are found in @ref IpRxInfoIp4::rx_flags.
+ * 
+ * Operators provided by @ref AIPSTACK_ENUM_BITFIELD_OPS are available.
+ */
+enum class IpRxFlags : uint8_t {
+    /**
+     * The checksum of the transport-layer protocol (such as TCP) has already been
+     * verified, the protocol handler does not need to verify it.
+     */
+    ProtoChksumVerified = uint8_t(1) << 0,
+    
+    /**
+     * The IPv4 header checksum has already been verified.
+     * 
+     * This is only meaningful when passed by the driver to @ref
+     * IpDriverIface::recvIp4Packet, it is not included in @ref
+     * IpRxInfoIp4::rx_flags.
+     */
+    Ip4HeaderChksumVerified = uint8_t(1) << 1,
+    
+    /**
+     * The transport-layer checksum is partial, that is it only includes the
+     * pseudo-header as with @ref IpSendFlags::ProtoChksumOffload.
+     * 
+     * This is passed by drivers for packets which originate from the same host
+     * and were not checksummed because they never crossed a physical link (e.g.
+     * `VIRTIO_NET_HDR_F_NEEDS_CSUM`). The data is trusted, so the stack treats
+     * this like @ref ProtoChksumVerified.
+     */
+    ProtoChksumPartial = uint8_t(1) << 2,
+};
+
+#ifndef IN_DOXYGEN
+AIPSTACK_ENUM_BITFIELD_OPS(IpRxFlags)
+#endif
+
 /**
  * Contains definitions of flags as accepted by @ref AIpStack::IpStack::sendIp4Dgram
  * "IpStack::sendIp4Dgram" and @ref AIpStack::IpStack::prepareSendIp4Dgram
@@ -213,10 +284,23 @@ enum class IpSendFlags : uint16_t {
      */
     DontFragmentFlag = Ip4FlagDF,
 
+    /**
+     * The transport-layer checksum is to be calculated by the driver or the stack.
+     * 
+     * This may only be used for TCP and UDP datagrams. The checksum field must
+     * contain the ones'-complement sum of the pseudo-header (not inverted, see
+     * @ref IpChksumOffload::pseudoHeaderSum). If the interface supports @ref
+     * IpIfaceOffloadFlags::TxProtoChksum, the packet is passed to the driver
+     * which completes the checksum, otherwise the stack completes it before
+     * sending the packet. For @ref IpStack::prepareSendIp4Dgram the semantics
+     * differ, see @ref IpSendPreparedIp4::chksum_offload.
+     */
+    ProtoChksumOffload = uint16_t(1) << 2,
+
     /**
      * Mask of all flags which may be passed to send functions.
      */
-    AllFlags = AllowBroadcastFlag|AllowNonLocalSrc|DontFragmentFlag,
+    AllFlags = AllowBroadcastFlag|AllowNonLocalSrc|DontFragmentFlag|ProtoChksumOffload,
 };
 
 #ifndef IN_DOXYGEN
@@ -380,6 +464,17 @@ struct IpRxInfoIp4 {
      * The length of the IPv4 header in bytes.
      */
     uint8_t header_len;
+    
+    /**
+     * Additional information about the received packet.
+     */
+    IpRxFlags rx_flags = IpRxFlags();
+    
+    /**
+     * The number of received segments combined into this datagram by receive
+     * coalescing (see @ref IpStackOptions::RxCoalesceFlows), otherwise 1.
+     */
+    uint16_t num_segs = 1;
 };
 
 /**
@@ -404,6 +499,17 @@ struct IpSendPreparedIp4 {
      * Partially calculated IP header checksum (should not be used externally).
      */
     IpChksumAccumulator::State partial_chksum_state;
+    
+    /**
+     * Whether the driver completes the transport checksum (should be read by the
+     * sender).
+     * 
+     * This is set if @ref IpSendFlags::ProtoChksumOffload was requested and the
+     * interface supports @ref IpIfaceOffloadFlags::TxProtoChksum. Datagrams sent
+     * using this structure must then contain only the pseudo-header sum in the
+     * checksum field, otherwise they must contain the complete checksum.
+     */
+    bool chksum_offload;
 };
 
 /** @} */
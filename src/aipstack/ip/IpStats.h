@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_IP_STATS_H
+#define AIPSTACK_IP_STATS_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup ip-stack
+ * @{
+ */
+
+/**
+ * A statistics counter which can be read from any thread.
+ * 
+ * The counter is updated only from the context in which the stack runs (there is a
+ * single writer), so incrementing is done using a relaxed load and store and not an
+ * atomic read-modify-write operation. On common architectures this compiles to the same
+ * code as incrementing a plain integer. Reading (including copying the counter) uses a
+ * relaxed load, so each individual value read from another thread is consistent, but
+ * there is no ordering between different counters.
+ * 
+ * The counter is 32-bit and wraps around like a MIB Counter32.
+ */
+class IpStatCounter {
+public:
+    /**
+     * Construct a counter with value zero.
+     */
+    inline IpStatCounter () :
+        m_value(0)
+    {}
+    
+    /**
+     * Construct a counter with the value read from another counter.
+     * 
+     * @param other Counter to read the value from.
+     */
+    inline IpStatCounter (IpStatCounter const &other) :
+        m_value(other.get())
+    {}
+    
+    /**
+     * Set the value of this counter to the value read from another counter.
+     * 
+     * @param other Counter to read the value from.
+     * @return `*this`
+     */
+    inline IpStatCounter & operator= (IpStatCounter const &other)
+    {
+        m_value.store(other.get(), std::memory_order_relaxed);
+        return *this;
+    }
+    
+    /**
+     * Return the current value of the counter.
+     * 
+     * This may be called from any thread.
+     * 
+     * @return Counter value.
+     */
+    inline uint32_t get () const
+    {
+        return m_value.load(std::memory_order_relaxed);
+    }
+    
+    /**
+     * Increment the counter by the given amount.
+     * 
+     * This must only be called from the context in which the stack runs.
+     * 
+     * @param amount Amount to add (default 1).
+     */
+    inline void inc (uint32_t amount = 1)
+    {
+        m_value.store(uint32_t(get() + amount), std::memory_order_relaxed);
+    }
+    
+private:
+    std::atomic<uint32_t> m_value;
+};
+
+/**
+ * Stack-wide statistics counters of the @ref IpStack.
+ * 
+ * The counters follow the corresponding objects of the IP-MIB (RFC 4293), UDP-MIB
+ * (RFC 4113) and TCP-MIB (RFC 4022). Counters related to receiving IP packets which can
+ * be attributed to an interface are kept in @ref IpIfaceStats instead.
+ * 
+ * A snapshot can be obtained using @ref IpStack::getStats.
+ */
+struct IpStackStats {
+    /**
+     * Datagrams which the protocols and ICMP supplied for transmission.
+     */
+    IpStatCounter ip_out_requests;
+    
+    /**
+     * Outgoing datagrams discarded because no route could be found.
+     */
+    IpStatCounter ip_out_no_routes;
+    
+    /**
+     * Outgoing datagrams rejected due to broadcast or source address restrictions.
+     */
+    IpStatCounter ip_out_discards;
+    
+    /**
+     * Outgoing datagrams which needed to be fragmented.
+     */
+    IpStatCounter ip_out_frag_reqds;
+    
+    /**
+     * Outgoing datagrams which have been successfully fragmented and sent.
+     */
+    IpStatCounter ip_out_frag_oks;
+    
+    /**
+     * Outgoing datagrams which needed fragmentation but could not be fragmented.
+     */
+    IpStatCounter ip_out_frag_fails;
+    
+    /**
+     * Fragments generated as a result of fragmentation.
+     */
+    IpStatCounter ip_out_frag_creates;
+    
+    /**
+     * Received fragments which needed reassembly.
+     */
+    IpStatCounter ip_reasm_reqds;
+    
+    /**
+     * Datagrams which have been successfully reassembled.
+     */
+    IpStatCounter ip_reasm_oks;
+    
+    /**
+     * Reassembly failures (inconsistent fragments, too many holes, entries
+     * evicted or timed out).
+     */
+    IpStatCounter ip_reasm_fails;
+    
+    /**
+     * Incomplete datagrams discarded because the reassembly time limit expired
+     * (included in @ref ip_reasm_fails).
+     */
+    IpStatCounter ip_reasm_timeouts;
+    
+    /**
+     * Incomplete datagrams discarded to make space for a new datagram when all
+     * reassembly entries were in use (included in @ref ip_reasm_fails).
+     */
+    IpStatCounter ip_reasm_evictions;
+    
+    /**
+     * Incomplete datagrams discarded to make space for a new datagram from the
+     * same source which reached its quota of reassembly entries (included in
+     * @ref ip_reasm_fails).
+     */
+    IpStatCounter ip_reasm_quota_evictions;
+    
+    /**
+     * Received datagrams discarded because of an unknown protocol.
+     */
+    IpStatCounter ip_in_unknown_protos;
+    
+    /**
+     * Received ICMP messages directed to the stack.
+     */
+    IpStatCounter icmp_in_msgs;
+    
+    /**
+     * Received ICMP messages which were discarded due to errors (bad length or checksum).
+     */
+    IpStatCounter icmp_in_errors;
+    
+    /**
+     * Received ICMP Echo Request messages.
+     */
+    IpStatCounter icmp_in_echos;
+    
+    /**
+     * Received ICMP Destination Unreachable messages.
+     */
+    IpStatCounter icmp_in_dest_unreachs;
+    
+    /**
+     * ICMP messages which the stack attempted to send.
+     */
+    IpStatCounter icmp_out_msgs;
+    
+    /**
+     * ICMP Echo Reply messages which the stack attempted to send.
+     */
+    IpStatCounter icmp_out_echo_reps;
+    
+    /**
+     * ICMP Destination Unreachable messages which the stack attempted to send.
+     */
+    IpStatCounter icmp_out_dest_unreachs;
+    
+    /**
+     * UDP datagrams delivered to listeners or associations.
+     */
+    IpStatCounter udp_in_datagrams;
+    
+    /**
+     * Received UDP datagrams which were not accepted by any listener or association.
+     */
+    IpStatCounter udp_no_ports;
+    
+    /**
+     * Received UDP datagrams discarded due to errors (bad length or checksum).
+     */
+    IpStatCounter udp_in_errors;
+    
+    /**
+     * UDP datagrams which the stack attempted to send.
+     */
+    IpStatCounter udp_out_datagrams;
+    
+    /**
+     * Received TCP segments, including those received in error.
+     */
+    IpStatCounter tcp_in_segs;
+    
+    /**
+     * Received TCP segments discarded due to errors (bad length or checksum).
+     */
+    IpStatCounter tcp_in_errs;
+    
+    /**
+     * TCP segments sent, excluding retransmitted data segments.
+     */
+    IpStatCounter tcp_out_segs;
+    
+    /**
+     * TCP segments retransmitted (after a timeout or fast retransmit).
+     */
+    IpStatCounter tcp_retrans_segs;
+    
+    /**
+     * TCP segments sent with the RST flag.
+     */
+    IpStatCounter tcp_out_rsts;
+    
+    /**
+     * TCP connections initiated locally (SYN-SENT entered).
+     */
+    IpStatCounter tcp_active_opens;
+    
+    /**
+     * TCP connections initiated by a peer (SYN-RCVD entered from a listener).
+     */
+    IpStatCounter tcp_passive_opens;
+    
+    /**
+     * TCP Path MTU probes sent (packetization-layer PMTUD).
+     */
+    IpStatCounter tcp_pmtu_probes;
+    
+    /**
+     * TCP Path MTU probes which were acknowledged, raising the Path MTU estimate.
+     */
+    IpStatCounter tcp_pmtu_probe_acks;
+    
+    /**
+     * Repeated retransmission timeouts which were attributed to a Path MTU black
+     * hole, lowering the Path MTU estimate.
+     */
+    IpStatCounter tcp_pmtu_black_holes;
+    
+    /**
+     * Received TCP segments which were combined with a preceding segment by
+     * receive coalescing (these are not counted in @ref tcp_in_segs).
+     */
+    IpStatCounter tcp_in_coalesced;
+};
+
+/**
+ * Statistics counters of an @ref IpIface.
+ * 
+ * The counters follow the ipIfStatsTable of the IP-MIB (RFC 4293).
+ * 
+ * A snapshot can be obtained using @ref IpIface::getStats.
+ */
+struct IpIfaceStats {
+    /**
+     * IPv4 packets received from the driver.
+     */
+    IpStatCounter in_receives;
+    
+    /**
+     * Received packets discarded due to header errors (too short, bad version,
+     * bad header length or bad header checksum).
+     */
+    IpStatCounter in_hdr_errors;
+    
+    /**
+     * Received packets discarded because the total length in the header exceeds
+     * the packet length or is less than the header length.
+     */
+    IpStatCounter in_truncated_pkts;
+    
+    /**
+     * Received fragments discarded because they are not addressed to the interface.
+     */
+    IpStatCounter in_addr_errors;
+    
+    /**
+     * Complete (possibly reassembled) datagrams passed on for processing by
+     * interface listeners and protocol handlers.
+     */
+    IpStatCounter in_delivers;
+    
+    /**
+     * IPv4 packets (including individual fragments) passed to the driver for sending.
+     */
+    IpStatCounter out_transmits;
+};
+
+/** @} */
+
+}
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_IP_TCP_RX_COALESCER_H
+#define AIPSTACK_IP_TCP_RX_COALESCER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/misc/Hints.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Chksum.h>
+#include <aipstack/infra/RxBufHold.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStackTypes.h>
+#include <aipstack/ip/IpStats.h>
+
+namespace AIpStack {
+
+#ifndef IN_DOXYGEN
+
+/**
+ * Coalesces received TCP segments of the same flow (software GRO).
+ * 
+ * This is used by @ref IpStack for packets received within a receive batch (see
+ * @ref IpDriverIface::beginRecvBatch) when @ref IpStackOptions::RxCoalesceFlows
+ * is nonzero. A segment which continues a pending segment of the same flow, with
+ * the same acknowledgement number, window and options, is appended to it and
+ * the combined segment is delivered to the protocol handler as a chain over the
+ * original buffers when it cannot be extended any more, at the latest at the end
+ * of the batch. The buffers are kept using @ref IpRxBufHold, so only packets
+ * which the driver passes with a hold object can be coalesced.
+ * 
+ * Only segments with just the ACK flag (and possibly PSH) and with data in a
+ * single buffer are coalesced; a PSH ends a combined segment. The TCP checksum
+ * of each coalesced segment is verified here and delivered segments have the
+ * @ref IpRxFlags::ProtoChksumVerified flag. Segments which are not coalesced
+ * are delivered immediately, after any pending segment of the same flow.
+ * 
+ * @tparam Arg Template parameter of @ref IpStack.
+ * @tparam NumFlows Maximum number of flows with a pending segment.
+ * @tparam MaxSegs Maximum number of segments in a combined segment.
+ */
+template <typename Arg, int NumFlows, int MaxSegs>
+class IpTcpRxCoalescer :
+    private NonCopyable<IpTcpRxCoalescer<Arg, NumFlows, MaxSegs>>
+{
+    static_assert(NumFlows > 0, "");
+    static_assert(MaxSegs >= 2 && MaxSegs <= TypeMax<uint16_t>(), "");
+    
+    // Limit for the length of a combined segment, so that it would still
+    // fit into an IP packet.
+    static size_t const MaxCombinedLen = TypeMax<uint16_t>() - Ip4Header::Size;
+    
+    struct Flow {
+        // Information for delivery, from the first segment.
+        IpRxInfoIp4<Arg> ip_info;
+        // Pointer to the TCP header of the first segment.
+        char *tcp_header;
+        // Sequence number expected in the next segment.
+        uint32_t next_seq;
+        // Total TCP length (header and data) of the combined segment.
+        size_t tot_len;
+        // Number of segments, zero if the entry is free.
+        int num_segs;
+        // Buffer nodes and holds of the segments (the first node includes
+        // the TCP header).
+        IpBufNode nodes[MaxSegs];
+        IpRxBufHold *holds[MaxSegs];
+    };
+    
+public:
+    inline IpTcpRxCoalescer () :
+        m_evict_index(0)
+    {
+        for (Flow &flow : m_flows) {
+            flow.num_segs = 0;
+        }
+    }
+    
+    inline ~IpTcpRxCoalescer ()
+    {
+        for (Flow &flow : m_flows) {
+            AIPSTACK_ASSERT(flow.num_segs == 0)
+            (void)flow;
+        }
+    }
+    
+    /**
+     * Process a received IPv4 datagram.
+     * 
+     * The datagram is either held in a pending combined segment or is passed
+     * to `deliver` (after any pending segment of the same flow).
+     * 
+     * @param ip_info Information about the received datagram.
+     * @param dgram The datagram payload.
+     * @param hold Hold object of the packet buffer, or null.
+     * @param stats Stack statistics for counting coalesced segments.
+     * @param deliver Function called as
+     *        `deliver(IpRxInfoIp4<Arg> const &ip_info, IpBufRef dgram)`
+     *        to deliver a datagram.
+     */
+    template <typename Deliver>
+    void recvIp4Dgram (IpRxInfoIp4<Arg> const &ip_info, IpBufRef dgram,
+                       IpRxBufHold *hold, IpStackStats &stats, Deliver deliver)
+    {
+        // Only TCP is of interest, deliver anything else directly.
+        if (ip_info.ttl_proto.proto() != Ip4ProtocolTcp ||
+            AIPSTACK_UNLIKELY(!dgram.hasHeader(Tcp4Header::Size)))
+        {
+            return deliver(ip_info, dgram);
+        }
+        
+        char *tcp_ptr = dgram.getChunkPtr();
+        auto tcp_header = Tcp4Header::MakeRef(tcp_ptr);
+        uint16_t offset_flags = tcp_header.get(Tcp4Header::OffsetFlags());
+        size_t tcp_header_len = 4 * size_t(offset_flags >> TcpOffsetShift);
+        uint16_t flags = offset_flags & TcpFlagsMask;
+        
+        // Find any pending segment of the same flow.
+        Flow *flow = findFlow(ip_info, tcp_header);
+        
+        // Check if the segment is suitable for coalescing.
+        bool suitable = hold != nullptr &&
+            (flags & ~Tcp4FlagPsh) == Tcp4FlagAck &&
+            tcp_header_len >= Tcp4Header::Size &&
+            dgram.tot_len > tcp_header_len &&
+            dgram.tot_len <= dgram.node->len - dgram.offset &&
+            chksumIsValid(ip_info, dgram);
+        
+        if (AIPSTACK_LIKELY(suitable)) {
+            // Try to append the segment to the pending segment.
+            if (flow != nullptr) {
+                if (canAppend(*flow, tcp_header, tcp_header_len, dgram.tot_len)) {
+                    appendSegment(*flow, tcp_ptr, tcp_header_len, dgram, hold, flags);
+                    stats.tcp_in_coalesced.inc();
+                    
+                    // Deliver immediately if this cannot be extended any more.
+                    if ((flags & Tcp4FlagPsh) != 0 || flow->num_segs == MaxSegs) {
+                        flushFlow(*flow, deliver);
+                    }
+                    return;
+                }
+                
+                // Deliver the pending segment first.
+                flushFlow(*flow, deliver);
+            }
+            
+            // Start a new pending segment unless there is a PSH.
+            if ((flags & Tcp4FlagPsh) == 0) {
+                startSegment(ip_info, tcp_ptr, dgram, hold, deliver);
+                return;
+            }
+            
+            // Deliver with the checksum verified.
+            IpRxInfoIp4<Arg> verified_info = ip_info;
+            verified_info.rx_flags |= IpRxFlags::ProtoChksumVerified;
+            return deliver(verified_info, dgram);
+        }
+        
+        // Deliver any pending segment of the flow and then this one.
+        if (flow != nullptr) {
+            flushFlow(*flow, deliver);
+        }
+        deliver(ip_info, dgram);
+    }
+    
+    /**
+     * Deliver all pending segments received through the given interface.
+     * 
+     * @param iface The interface.
+     * @param deliver Function for delivering datagrams (see @ref recvIp4Dgram).
+     */
+    template <typename Deliver>
+    void flushIface (IpIface<Arg> *iface, Deliver deliver)
+    {
+        for (Flow &flow : m_flows) {
+            if (flow.num_segs > 0 && flow.ip_info.iface == iface) {
+                flushFlow(flow, deliver);
+            }
+        }
+    }
+    
+private:
+    static uint16_t const TcpFlagsMask = (uint16_t(1) << TcpOffsetShift) - 1;
+    
+    Flow * findFlow (IpRxInfoIp4<Arg> const &ip_info, Tcp4Header::Ref tcp_header)
+    {
+        for (Flow &flow : m_flows) {
+            if (flow.num_segs == 0) {
+                continue;
+            }
+            auto flow_header = Tcp4Header::MakeRef(flow.tcp_header);
+            if (flow.ip_info.src_addr == ip_info.src_addr &&
+                flow.ip_info.dst_addr == ip_info.dst_addr &&
+                flow.ip_info.iface == ip_info.iface &&
+                flow_header.get(Tcp4Header::SrcPort()) ==
+                    tcp_header.get(Tcp4Header::SrcPort()) &&
+                flow_header.get(Tcp4Header::DstPort()) ==
+                    tcp_header.get(Tcp4Header::DstPort()))
+            {
+                return &flow;
+            }
+        }
+        return nullptr;
+    }
+    
+    static bool chksumIsValid (IpRxInfoIp4<Arg> const &ip_info, IpBufRef dgram)
+    {
+        if ((ip_info.rx_flags & IpRxFlags::ProtoChksumVerified) != EnumZero) {
+            return true;
+        }
+        
+        IpChksumAccumulator chksum;
+        chksum.addWords(&ip_info.src_addr.data);
+        chksum.addWords(&ip_info.dst_addr.data);
+        chksum.addWord(WrapType<uint16_t>(), Ip4ProtocolTcp);
+        chksum.addWord(WrapType<uint16_t>(), uint16_t(dgram.tot_len));
+        return chksum.getChksum(dgram) == 0;
+    }
+    
+    static bool canAppend (Flow const &flow, Tcp4Header::Ref tcp_header,
+                           size_t tcp_header_len, size_t tcp_len)
+    {
+        auto flow_header = Tcp4Header::MakeRef(flow.tcp_header);
+        size_t flow_header_len =
+            4 * size_t(flow_header.get(Tcp4Header::OffsetFlags()) >> TcpOffsetShift);
+        
+        // The segment must continue the data and have the same acknowledgement
+        // number, window and options (e.g. timestamps) as the first segment.
+        return tcp_header.get(Tcp4Header::SeqNum()) == flow.next_seq &&
+            tcp_header.get(Tcp4Header::AckNum()) ==
+                flow_header.get(Tcp4Header::AckNum()) &&
+            tcp_header.get(Tcp4Header::WindowSize()) ==
+                flow_header.get(Tcp4Header::WindowSize()) &&
+            tcp_header_len == flow_header_len &&
+            ::memcmp(tcp_header.data + Tcp4Header::Size,
+                     flow.tcp_header + Tcp4Header::Size,
+                     tcp_header_len - Tcp4Header::Size) == 0 &&
+            flow.tot_len + (tcp_len - tcp_header_len) <= MaxCombinedLen;
+    }
+    
+    template <typename Deliver>
+    void startSegment (IpRxInfoIp4<Arg> const &ip_info, char *tcp_ptr, IpBufRef dgram,
+                       IpRxBufHold *hold, Deliver deliver)
+    {
+        // Find a free entry, or deliver the pending segment of some flow.
+        Flow *flow = nullptr;
+        for (Flow &f : m_flows) {
+            if (f.num_segs == 0) {
+                flow = &f;
+                break;
+            }
+        }
+        if (flow == nullptr) {
+            flow = &m_flows[m_evict_index];
+            m_evict_index = (m_evict_index + 1) % NumFlows;
+            flushFlow(*flow, deliver);
+        }
+        
+        auto tcp_header = Tcp4Header::MakeRef(tcp_ptr);
+        size_t tcp_header_len =
+            4 * size_t(tcp_header.get(Tcp4Header::OffsetFlags()) >> TcpOffsetShift);
+        
+        hold->take();
+        
+        flow->ip_info = ip_info;
+        flow->ip_info.rx_flags |= IpRxFlags::ProtoChksumVerified;
+        flow->tcp_header = tcp_ptr;
+        flow->next_seq = tcp_header.get(Tcp4Header::SeqNum()) +
+                         uint32_t(dgram.tot_len - tcp_header_len);
+        flow->tot_len = dgram.tot_len;
+        flow->num_segs = 1;
+        flow->nodes[0] = IpBufNode{tcp_ptr, dgram.tot_len, nullptr};
+        flow->holds[0] = hold;
+    }
+    
+    static void appendSegment (Flow &flow, char *tcp_ptr, size_t tcp_header_len,
+                               IpBufRef dgram, IpRxBufHold *hold, uint16_t flags)
+    {
+        AIPSTACK_ASSERT(flow.num_segs > 0 && flow.num_segs < MaxSegs)
+        
+        size_t data_len = dgram.tot_len - tcp_header_len;
+        
+        hold->take();
+        
+        // Link the data of this segment after the previous node.
+        IpBufNode &node = flow.nodes[flow.num_segs];
+        node = IpBufNode{tcp_ptr + tcp_header_len, data_len, nullptr};
+        flow.nodes[flow.num_segs - 1].next = &node;
+        flow.holds[flow.num_segs] = hold;
+        flow.num_segs++;
+        
+        flow.next_seq += uint32_t(data_len);
+        flow.tot_len += data_len;
+        
+        // Carry a PSH over to the header of the combined segment.
+        if ((flags & Tcp4FlagPsh) != 0) {
+            auto flow_header = Tcp4Header::MakeRef(flow.tcp_header);
+            flow_header.set(Tcp4Header::OffsetFlags(),
+                uint16_t(flow_header.get(Tcp4Header::OffsetFlags()) | Tcp4FlagPsh));
+        }
+    }
+    
+    template <typename Deliver>
+    static void flushFlow (Flow &flow, Deliver deliver)
+    {
+        AIPSTACK_ASSERT(flow.num_segs > 0)
+        
+        // Free the entry before delivery, which may result in reentrant calls.
+        int num_segs = flow.num_segs;
+        flow.num_segs = 0;
+        
+        IpRxInfoIp4<Arg> ip_info = flow.ip_info;
+        ip_info.num_segs = uint16_t(num_segs);
+        size_t tot_len = flow.tot_len;
+        IpBufNode nodes[MaxSegs];
+        IpRxBufHold *holds[MaxSegs];
+        for (int i = 0; i < num_segs; i++) {
+            nodes[i] = flow.nodes[i];
+            nodes[i].next = (i + 1 < num_segs) ? &nodes[i + 1] : nullptr;
+            holds[i] = flow.holds[i];
+        }
+        
+        deliver(ip_info, IpBufRef{&nodes[0], 0, tot_len});
+        
+        for (int i = 0; i < num_segs; i++) {
+            holds[i]->release();
+        }
+    }
+    
+private:
+    int m_evict_index;
+    Flow m_flows[NumFlows];
+};
+
+// Specialization used when coalescing is disabled.
+template <typename Arg, int MaxSegs>
+class IpTcpRxCoalescer<Arg, 0, MaxSegs> :
+    private NonCopyable<IpTcpRxCoalescer<Arg, 0, MaxSegs>>
+{
+public:
+    template <typename Deliver>
+    inline void recvIp4Dgram (IpRxInfoIp4<Arg> const &ip_info, IpBufRef dgram,
+                              IpRxBufHold *, IpStackStats &, Deliver deliver)
+    {
+        deliver(ip_info, dgram);
+    }
+    
+    template <typename Deliver>
+    inline void flushIface (IpIface<Arg> *, Deliver)
+    {}
+};
+
+#endif
+
+}
+
+#endif
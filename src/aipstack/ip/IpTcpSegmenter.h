@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_IP_TCP_SEGMENTER_H
+#define AIPSTACK_IP_TCP_SEGMENTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Chksum.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpChksumOffload.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup ip-stack
+ * @{
+ */
+
+/**
+ * Splits a large TCP packet into segments (software TCP segmentation).
+ * 
+ * This defines the semantics of TCP segmentation offload (see @ref
+ * IpIfaceOffloadFlags::TcpSegmentation) and is used by the stack when the
+ * interface driver does not support it. Drivers which emulate the offload
+ * can use it too.
+ * 
+ * The input packet consists of an IPv4 header without options, a TCP header
+ * (possibly with options) and data. Each resulting packet gets a copy of the
+ * headers with the following fields adjusted:
+ * - IP total length, identification (incremented by one for each segment)
+ *   and header checksum.
+ * - TCP sequence number and checksum. The FIN and PSH flags are kept only in
+ *   the last segment.
+ */
+class IpTcpSegmenter {
+public:
+    /**
+     * Send a TCP packet as a sequence of segments.
+     * 
+     * The headers of the input packet must be contiguous in its first buffer,
+     * which is modified in place and referenced by all resulting packets, so
+     * `send_pkt` must not access the resulting packets after it returns.
+     * 
+     * @param pkt The packet, starting `hdr_offset` bytes before the IP header.
+     *        The data must not be empty.
+     * @param hdr_offset Length of any link-layer header before the IP header.
+     *        Resulting packets include a copy of this header (not modified).
+     * @param seg_data_len Maximum TCP data length in each segment (nonzero).
+     * @param segs_per_pkt Number of segments to combine into each resulting
+     *        packet (normally 1). If greater than 1, the resulting packets are
+     *        themselves to be segmented and their TCP checksum is not calculated.
+     * @param partial_chksum If true, the TCP checksum of single segments is only
+     *        the partial checksum to be completed by the driver (see @ref
+     *        IpChksumOffload).
+     * @param send_pkt Function called for each resulting packet as
+     *        `IpErr send_pkt(IpBufRef pkt)`.
+     * @param out_data_sent Set to the amount of TCP data in packets sent
+     *        successfully, which is less than the total if there was an error.
+     * @return Success or the error from `send_pkt` at which sending stopped.
+     */
+    template <typename SendPkt>
+    static IpErr segment (IpBufRef pkt, size_t hdr_offset, uint16_t seg_data_len,
+                          size_t segs_per_pkt, bool partial_chksum, SendPkt send_pkt,
+                          size_t &out_data_sent)
+    {
+        AIPSTACK_ASSERT(seg_data_len > 0)
+        AIPSTACK_ASSERT(segs_per_pkt > 0)
+        AIPSTACK_ASSERT(pkt.getChunkLength() >= hdr_offset + Ip4TcpHeaderSize)
+        
+        char *ip_ptr = pkt.getChunkPtr() + hdr_offset;
+        auto ip4_header = Ip4Header::MakeRef(ip_ptr);
+        auto tcp_header = Tcp4Header::MakeRef(ip_ptr + Ip4Header::Size);
+        
+        AIPSTACK_ASSERT(ip4_header.get(Ip4Header::VersionIhlDscpEcn()) >> 8 ==
+                        ((4 << Ip4VersionShift) | 5))
+        
+        // Determine the length of all headers.
+        uint16_t offset_flags = tcp_header.get(Tcp4Header::OffsetFlags());
+        size_t tcp_header_len = 4 * size_t(offset_flags >> TcpOffsetShift);
+        size_t hdrs_len = hdr_offset + Ip4Header::Size + tcp_header_len;
+        AIPSTACK_ASSERT(tcp_header_len >= Tcp4Header::Size)
+        AIPSTACK_ASSERT(pkt.getChunkLength() >= hdrs_len)
+        
+        // Get the data.
+        IpBufRef data = pkt.hideHeader(hdrs_len);
+        AIPSTACK_ASSERT(data.tot_len > 0)
+        
+        Ip4Addr src_addr = ip4_header.get(Ip4Header::SrcAddr());
+        Ip4Addr dst_addr = ip4_header.get(Ip4Header::DstAddr());
+        uint16_t ident = ip4_header.get(Ip4Header::Ident());
+        uint32_t seq_num = tcp_header.get(Tcp4Header::SeqNum());
+        uint16_t mid_offset_flags = offset_flags & ~(Tcp4FlagFin|Tcp4FlagPsh);
+        size_t max_pkt_data = size_t(seg_data_len) * segs_per_pkt;
+        
+        out_data_sent = 0;
+        
+        while (true) {
+            size_t pkt_data = MinValue(data.tot_len, max_pkt_data);
+            bool last = pkt_data == data.tot_len;
+            uint16_t tcp_len = uint16_t(tcp_header_len + pkt_data);
+            uint16_t ip_len = uint16_t(Ip4Header::Size + tcp_len);
+            
+            // Write the IP header fields and the header checksum.
+            ip4_header.set(Ip4Header::TotalLen(), ip_len);
+            ip4_header.set(Ip4Header::Ident(), ident);
+            ip4_header.set(Ip4Header::HeaderChksum(), 0);
+            ip4_header.set(Ip4Header::HeaderChksum(), IpChksum(ip_ptr, Ip4Header::Size));
+            
+            // Write the TCP header fields.
+            tcp_header.set(Tcp4Header::SeqNum(), seq_num);
+            tcp_header.set(Tcp4Header::OffsetFlags(), last ? offset_flags : mid_offset_flags);
+            tcp_header.set(Tcp4Header::Checksum(), 0);
+            
+            // Calculate the TCP checksum, unless this is to be segmented further
+            // or the driver will calculate it.
+            if (pkt_data <= seg_data_len) {
+                if (partial_chksum) {
+                    tcp_header.set(Tcp4Header::Checksum(),
+                        IpChksumOffload::pseudoHeaderSum(
+                            src_addr, dst_addr, Ip4ProtocolTcp, tcp_len));
+                } else {
+                    IpChksumAccumulator chksum;
+                    chksum.addWords(&src_addr.data);
+                    chksum.addWords(&dst_addr.data);
+                    chksum.addWord(WrapType<uint16_t>(), Ip4ProtocolTcp);
+                    chksum.addWord(WrapType<uint16_t>(), tcp_len);
+                    chksum.addEvenBytes(tcp_header.data, tcp_header_len);
+                    tcp_header.set(Tcp4Header::Checksum(),
+                                   chksum.getChksum(data.subTo(pkt_data)));
+                }
+            }
+            
+            // Construct the packet with the headers and this part of the data.
+            IpBufNode data_node = data.toNode();
+            IpBufNode header_node;
+            IpBufRef seg_pkt = pkt.subHeaderToContinuedBy(
+                hdrs_len, &data_node, hdrs_len + pkt_data, &header_node);
+            
+            IpErr err = send_pkt(seg_pkt);
+            if (AIPSTACK_UNLIKELY(err != IpErr::SUCCESS)) {
+                return err;
+            }
+            
+            out_data_sent += pkt_data;
+            
+            if (last) {
+                return IpErr::SUCCESS;
+            }
+            
+            // Advance to the next part.
+            data.skipBytes(pkt_data);
+            seq_num += uint32_t(pkt_data);
+            ident += uint16_t((pkt_data + seg_data_len - 1) / seg_data_len);
+        }
+    }
+};
+
+/** @} */
+
+}
+
+#endif
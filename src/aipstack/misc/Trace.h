@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_TRACE_H
+#define AIPSTACK_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include <aipstack/misc/Hints.h>
+#include <aipstack/misc/MinMax.h>
+
+/**
+ * @ingroup misc
+ * @defgroup tracing Trace Probes
+ * @brief Compile-time enabled trace probes in the TCP/IP hot path.
+ * 
+ * Trace probes (@ref AIPSTACK_TRACE) are placed at points of interest in the stack, such
+ * as retransmission timeouts, congestion window reductions, send errors reported by
+ * drivers and dropped packets. When tracing is enabled, each probe writes a small fixed-size
+ * binary record (@ref TraceRecord) into a ring buffer belonging to the current thread
+ * (see @ref TraceThreadRing). Writing a record does not involve any locking or atomic
+ * read-modify-write operations.
+ * 
+ * Tracing is disabled by default and can be enabled by the application by defining the
+ * macro `AIPSTACK_CONFIG_ENABLE_TRACE` (to anything). When tracing is disabled, probes
+ * expand to nothing and their arguments are not evaluated.
+ * 
+ * Additional configuration macros which the application may define:
+ * - `AIPSTACK_CONFIG_TRACE_RING_SIZE`: number of records in each ring buffer, must be
+ *   a power of two (default 4096).
+ * - `AIPSTACK_CONFIG_TRACE_TIME()`: expression evaluating to a `uint32_t` timestamp
+ *   which is stored into each record (default: no timestamp, zero is stored).
+ * 
+ * The contents of a ring buffer can be copied out using @ref TraceRingBuffer::snapshot
+ * and printed using the functions in @ref TraceFormat.h.
+ * 
+ * @{
+ */
+
+#ifdef AIPSTACK_CONFIG_ENABLE_TRACE
+#define AIPSTACK_TRACE_ENABLED 1
+#else
+#define AIPSTACK_TRACE_ENABLED 0
+#endif
+
+#ifndef IN_DOXYGEN
+#ifdef AIPSTACK_CONFIG_TRACE_RING_SIZE
+#define AIPSTACK_TRACE_RING_SIZE AIPSTACK_CONFIG_TRACE_RING_SIZE
+#else
+#define AIPSTACK_TRACE_RING_SIZE 4096
+#endif
+
+#ifdef AIPSTACK_CONFIG_TRACE_TIME
+#define AIPSTACK_TRACE_TIME() uint32_t(AIPSTACK_CONFIG_TRACE_TIME())
+#else
+#define AIPSTACK_TRACE_TIME() uint32_t(0)
+#endif
+#endif
+
+namespace AIpStack {
+
+/**
+ * Identifies the kind of a trace event.
+ * 
+ * The meaning of the arguments of each event is documented with the event.
+ */
+enum class TraceEvent : uint16_t {
+    /**
+     * A received IPv4 packet was dropped.
+     * 
+     * arg0: reason (@ref TraceDropReason), arg1: source address,
+     * arg2: destination address.
+     */
+    IpRxDrop,
+
+    /**
+     * Sending an IPv4 datagram failed before reaching the driver.
+     * 
+     * arg0: error code (@ref IpErr), arg1: destination address, arg2: datagram length.
+     */
+    IpTxError,
+
+    /**
+     * A packet could not be sent because the hardware address was not resolved.
+     * 
+     * arg0: error code (@ref IpErr), arg1: next-hop IPv4 address, arg2: packet length.
+     */
+    EthArpMiss,
+
+    /**
+     * A received TCP segment was dropped due to an error.
+     * 
+     * arg0: reason (@ref TraceDropReason), arg1: source address, arg2: segment length.
+     */
+    TcpRxDrop,
+
+    /**
+     * A TCP retransmission timer expired and retransmission was performed.
+     * 
+     * arg0: local port, arg1: new RTO (in RTT units), arg2: snd_una.
+     */
+    TcpRtoFired,
+
+    /**
+     * TCP fast retransmit was triggered by duplicate ACKs.
+     * 
+     * arg0: local port, arg1: new cwnd, arg2: new ssthresh.
+     */
+    TcpFastRtx,
+
+    /**
+     * The TCP congestion window was reduced after an idle period.
+     * 
+     * arg0: local port, arg1: new cwnd, arg2: unused.
+     */
+    TcpIdleCwndReset,
+
+    /**
+     * Sending a TCP segment failed and a retry was scheduled.
+     * 
+     * arg0: error code (@ref IpErr), arg1: local port, arg2: remote port.
+     */
+    TcpTxError,
+
+    /**
+     * A TCP RST segment was sent.
+     * 
+     * arg0: local port, arg1: remote address, arg2: remote port.
+     */
+    TcpRstSent,
+
+    /**
+     * A TCP connection was aborted.
+     * 
+     * arg0: local port, arg1: TCP state, arg2: whether an RST was sent.
+     */
+    TcpAbort,
+
+    /**
+     * Number of defined events (not an event).
+     */
+    NumEvents
+};
+
+/**
+ * Reason codes used with the @ref TraceEvent::IpRxDrop and @ref TraceEvent::TcpRxDrop
+ * events.
+ */
+enum class TraceDropReason : uint16_t {
+    /**
+     * Bad header (too short, bad version or header length).
+     */
+    BadHeader,
+
+    /**
+     * Bad length field.
+     */
+    BadLength,
+
+    /**
+     * Bad checksum.
+     */
+    BadChecksum,
+
+    /**
+     * Fragment not addressed to the interface.
+     */
+    BadAddress,
+
+    /**
+     * No handler for the protocol.
+     */
+    UnknownProto,
+
+    /**
+     * Number of defined reasons (not a reason).
+     */
+    NumReasons
+};
+
+/**
+ * A binary trace record as stored in a @ref TraceRingBuffer.
+ */
+struct TraceRecord {
+    /**
+     * Timestamp (see `AIPSTACK_CONFIG_TRACE_TIME` in the @ref tracing module).
+     */
+    uint32_t time;
+
+    /**
+     * The event (a @ref TraceEvent value).
+     */
+    uint16_t event;
+
+    /**
+     * First event argument.
+     */
+    uint16_t arg0;
+
+    /**
+     * Second event argument.
+     */
+    uint32_t arg1;
+
+    /**
+     * Third event argument.
+     */
+    uint32_t arg2;
+};
+
+/**
+ * Ring buffer of trace records with a single writer.
+ * 
+ * Records are written by @ref record which must only be called from a single thread.
+ * When the buffer is full, the oldest records are overwritten. The contents may be copied
+ * out using @ref snapshot from any thread.
+ * 
+ * @tparam Size Number of records in the buffer, must be a power of two.
+ */
+template <size_t Size>
+class TraceRingBuffer {
+    static_assert(Size > 0 && (Size & (Size - 1)) == 0, "Size must be a power of two");
+    static_assert(Size <= (size_t(1) << 31), "");
+
+public:
+    /**
+     * Construct an empty ring buffer.
+     */
+    TraceRingBuffer () :
+        m_write_count(0)
+    {}
+
+    /**
+     * Write a record into the ring buffer.
+     * 
+     * This must only be called from the thread which owns the ring buffer.
+     * 
+     * @param event Event to record.
+     * @param arg0 First argument.
+     * @param arg1 Second argument.
+     * @param arg2 Third argument.
+     */
+    AIPSTACK_ALWAYS_INLINE
+    void record (TraceEvent event, uint16_t arg0, uint32_t arg1, uint32_t arg2)
+    {
+        uint32_t count = m_write_count.load(std::memory_order_relaxed);
+
+        TraceRecord &rec = m_records[count % Size];
+        rec.time = AIPSTACK_TRACE_TIME();
+        rec.event = uint16_t(event);
+        rec.arg0 = arg0;
+        rec.arg1 = arg1;
+        rec.arg2 = arg2;
+
+        m_write_count.store(uint32_t(count + 1), std::memory_order_release);
+    }
+
+    /**
+     * Return the total number of records written so far (modulo 2^32).
+     * 
+     * @return Number of records written.
+     */
+    inline uint32_t writeCount () const
+    {
+        return m_write_count.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Copy the most recent records out of the ring buffer, oldest first.
+     * 
+     * This may be called from any thread. If the writer is active concurrently, records
+     * which may have been overwritten during copying are not included in the result.
+     * 
+     * @param out Array to copy the records to.
+     * @param max_records Maximum number of records to copy (size of `out`).
+     * @return Number of records copied.
+     */
+    size_t snapshot (TraceRecord *out, size_t max_records) const
+    {
+        uint32_t end_count = writeCount();
+        uint32_t num = uint32_t(MinValueU(MinValueU(end_count, Size), max_records));
+        uint32_t start_count = uint32_t(end_count - num);
+
+        for (uint32_t i = 0; i < num; i++) {
+            out[i] = m_records[uint32_t(start_count + i) % Size];
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        // Drop any records which the writer may have overwritten while we were copying.
+        // The record being written at new_count (not yet published) is also considered.
+        uint32_t new_count = m_write_count.load(std::memory_order_relaxed);
+        uint32_t since_start = uint32_t(new_count - start_count) + 1;
+        if (since_start <= Size) {
+            return num;
+        }
+        uint32_t overwritten = since_start - uint32_t(Size);
+        if (overwritten >= num) {
+            return 0;
+        }
+
+        uint32_t valid = num - overwritten;
+        for (uint32_t i = 0; i < valid; i++) {
+            out[i] = out[overwritten + i];
+        }
+        return valid;
+    }
+
+private:
+    std::atomic<uint32_t> m_write_count;
+    TraceRecord m_records[Size];
+};
+
+/**
+ * The ring buffer type used by trace probes.
+ */
+using TraceRing = TraceRingBuffer<AIPSTACK_TRACE_RING_SIZE>;
+
+#if AIPSTACK_TRACE_ENABLED || defined(IN_DOXYGEN)
+
+/**
+ * Return the trace ring buffer of the current thread.
+ * 
+ * This is only available when tracing is enabled. A pointer to the ring buffer may be
+ * passed to another thread in order to take snapshots from there.
+ * 
+ * @return Reference to the ring buffer of the current thread.
+ */
+inline TraceRing & TraceThreadRing ()
+{
+    static thread_local TraceRing ring;
+    return ring;
+}
+
+#endif
+
+}
+
+#ifdef IN_DOXYGEN
+
+/**
+ * Trace probe.
+ * 
+ * If tracing is enabled (see the @ref tracing module description), this records an event
+ * with the given arguments into the ring buffer of the current thread, otherwise it does
+ * nothing (and does not evaluate the arguments).
+ * 
+ * This macro expands to a block construct which generally does not require a semicolon.
+ * 
+ * @param event Name of the event, an enumerator of @ref AIpStack::TraceEvent
+ *        "TraceEvent" (without qualification).
+ * @param arg0 First argument, converted to `uint16_t`.
+ * @param arg1 Second argument, converted to `uint32_t`.
+ * @param arg2 Third argument, converted to `uint32_t`.
+ */
+#define AIPSTACK_TRACE(event, arg0, arg1, arg2) { implementation hidden }
+
+#else
+
+#if AIPSTACK_TRACE_ENABLED
+#define AIPSTACK_TRACE(event, arg0, arg1, arg2) { \
+    ::AIpStack::TraceThreadRing().record(::AIpStack::TraceEvent::event, \
+        uint16_t(arg0), uint32_t(arg1), uint32_t(arg2)); }
+#else
+#define AIPSTACK_TRACE(event, arg0, arg1, arg2) {}
+#endif
+
+#endif
+
+/** @} */
+
+#endif
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/packet/linux/PacketRingDeviceLinux.h>
+
+namespace AIpStack {
+
+// Offset of the frame data in a transmit ring frame, see tpacket_parse_header
+// in the kernel.
+static std::size_t const PacketTxDataOffset = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+
+// Offset of the struct sockaddr_ll following a received frame header.
+static std::size_t const PacketRxAddrOffset = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+
+// Frame size used to describe the receive ring (frames are variable-sized in
+// the blocks with TPACKET_V3, but the kernel still checks this).
+static std::size_t const PacketRxFrameSize = 2048;
+
+static std::size_t packet_round_up (std::size_t x, std::size_t unit)
+{
+    return ((x + unit - 1) / unit) * unit;
+}
+
+// Status words in the rings are shared with the kernel.
+static std::uint32_t packet_load_status (void const *ptr)
+{
+    std::uint32_t status = *static_cast<std::uint32_t const volatile *>(ptr);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return status;
+}
+
+static void packet_store_status (void *ptr, std::uint32_t status)
+{
+    std::atomic_thread_fence(std::memory_order_release);
+    *static_cast<std::uint32_t volatile *>(ptr) = status;
+}
+
+PacketRingDeviceLinux::RingMapping::RingMapping () :
+    ptr(nullptr),
+    size(0)
+{}
+
+PacketRingDeviceLinux::RingMapping::~RingMapping ()
+{
+    if (ptr != nullptr) {
+        ::munmap(ptr, size);
+    }
+}
+
+PacketRingDeviceLinux::PacketRingDeviceLinux (
+    AIpStack::EventLoop &loop, std::string const &ifname, FrameReceivedHandler handler,
+    TxReadyHandler tx_ready_handler, PacketRingDeviceLinuxParams const &params)
+:
+    m_handler(handler),
+    m_tx_ready_handler(tx_ready_handler),
+    m_fd_watcher(loop, AIPSTACK_BIND_MEMBER(&PacketRingDeviceLinux::handleFdEvents, this)),
+    m_kick_timer(loop, AIPSTACK_BIND_MEMBER(&PacketRingDeviceLinux::kickTimerHandler, this)),
+    m_rx_block_size(params.rx_block_size),
+    m_rx_block_count(params.rx_block_count),
+    m_rx_block_index(0),
+    m_tx_frame_count(params.tx_frame_count),
+    m_tx_index(0),
+    m_tx_pending(false),
+    m_active(true),
+    m_tx_blocked(false)
+{
+    std::size_t page_size = std::size_t(::sysconf(_SC_PAGESIZE));
+    
+    if (m_rx_block_size == 0 || m_rx_block_size % page_size != 0 ||
+        m_rx_block_size % PacketRxFrameSize != 0 || m_rx_block_count == 0 ||
+        m_tx_frame_count == 0)
+    {
+        throw std::runtime_error("Invalid packet ring parameters.");
+    }
+    
+    unsigned int ifindex = ::if_nametoindex(ifname.c_str());
+    if (ifindex == 0) {
+        throw std::runtime_error("Network interface not found.");
+    }
+    
+    {
+        AIpStack::FileDescriptorWrapper sock{::socket(AF_INET, SOCK_DGRAM, 0)};
+        if (!sock) {
+            throw std::runtime_error("socket(AF_INET, SOCK_DGRAM) failed.");
+        }
+        
+        struct ifreq ifr;
+        std::memset(&ifr, 0, sizeof(ifr));
+        std::snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ifname.c_str());
+        
+        if (::ioctl(*sock, SIOCGIFMTU, reinterpret_cast<void *>(&ifr)) < 0) {
+            throw std::runtime_error("ioctl(SIOCGIFMTU) failed.");
+        }
+        
+        m_frame_mtu = std::size_t(ifr.ifr_mtu) + AIpStack::EthHeader::Size;
+    }
+    
+    // Nothing is received before the socket is bound below.
+    m_fd = AIpStack::FileDescriptorWrapper{::socket(AF_PACKET, SOCK_RAW, 0)};
+    if (!m_fd) {
+        throw std::runtime_error("socket(AF_PACKET) failed.");
+    }
+    
+    m_fd.setNonblocking();
+    
+    int version = TPACKET_V3;
+    if (::setsockopt(*m_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        throw std::runtime_error("setsockopt(PACKET_VERSION) failed.");
+    }
+    
+    // Skip malformed frames in the transmit ring instead of stopping.
+    int loss = 1;
+    if (::setsockopt(*m_fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)) < 0) {
+        throw std::runtime_error("setsockopt(PACKET_LOSS) failed.");
+    }
+    
+    struct tpacket_req3 rx_req;
+    std::memset(&rx_req, 0, sizeof(rx_req));
+    rx_req.tp_block_size = static_cast<unsigned int>(m_rx_block_size);
+    rx_req.tp_block_nr = static_cast<unsigned int>(m_rx_block_count);
+    rx_req.tp_frame_size = static_cast<unsigned int>(PacketRxFrameSize);
+    rx_req.tp_frame_nr = static_cast<unsigned int>(
+        m_rx_block_count * (m_rx_block_size / PacketRxFrameSize));
+    rx_req.tp_retire_blk_tov = params.rx_block_timeout_ms;
+    
+    if (::setsockopt(*m_fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req)) < 0) {
+        throw std::runtime_error("setsockopt(PACKET_RX_RING) failed.");
+    }
+    
+    // Transmit frames are fixed-size, each holding a frame of the MTU.
+    m_tx_frame_size = packet_round_up(PacketTxDataOffset + m_frame_mtu, TPACKET_ALIGNMENT);
+    m_tx_block_size = packet_round_up(m_tx_frame_size, page_size);
+    m_tx_frames_per_block = m_tx_block_size / m_tx_frame_size;
+    std::size_t tx_block_count =
+        (m_tx_frame_count + m_tx_frames_per_block - 1) / m_tx_frames_per_block;
+    m_tx_frame_count = tx_block_count * m_tx_frames_per_block;
+    
+    struct tpacket_req3 tx_req;
+    std::memset(&tx_req, 0, sizeof(tx_req));
+    tx_req.tp_block_size = static_cast<unsigned int>(m_tx_block_size);
+    tx_req.tp_block_nr = static_cast<unsigned int>(tx_block_count);
+    tx_req.tp_frame_size = static_cast<unsigned int>(m_tx_frame_size);
+    tx_req.tp_frame_nr = static_cast<unsigned int>(m_tx_frame_count);
+    
+    if (::setsockopt(*m_fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req)) < 0) {
+        throw std::runtime_error("setsockopt(PACKET_TX_RING) failed.");
+    }
+    
+    // The transmit ring is mapped right after the receive ring.
+    std::size_t rx_ring_size = m_rx_block_count * m_rx_block_size;
+    std::size_t ring_size = rx_ring_size + tx_block_count * m_tx_block_size;
+    
+    void *ring = ::mmap(nullptr, ring_size, PROT_READ|PROT_WRITE, MAP_SHARED, *m_fd, 0);
+    if (ring == MAP_FAILED) {
+        throw std::runtime_error("mmap of packet rings failed.");
+    }
+    m_ring.ptr = static_cast<char *>(ring);
+    m_ring.size = ring_size;
+    m_tx_ring = m_ring.ptr + rx_ring_size;
+    
+    struct sockaddr_ll addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = int(ifindex);
+    
+    if (::bind(*m_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        throw std::runtime_error("bind(AF_PACKET) failed.");
+    }
+    
+    if (params.promiscuous) {
+        struct packet_mreq mreq;
+        std::memset(&mreq, 0, sizeof(mreq));
+        mreq.mr_ifindex = int(ifindex);
+        mreq.mr_type = PACKET_MR_PROMISC;
+        
+        if (::setsockopt(*m_fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                         &mreq, sizeof(mreq)) < 0)
+        {
+            throw std::runtime_error("setsockopt(PACKET_ADD_MEMBERSHIP) failed.");
+        }
+    }
+    
+    m_fd_watcher.initFd(*m_fd, AIpStack::EventLoopFdEvents::Read);
+}
+
+PacketRingDeviceLinux::~PacketRingDeviceLinux ()
+{}
+
+std::size_t PacketRingDeviceLinux::getMtu () const
+{
+    return m_frame_mtu;
+}
+
+AIpStack::IpErr PacketRingDeviceLinux::sendFrame (AIpStack::IpBufRef frame)
+{
+    if (!m_active) {
+        return AIpStack::IpErr::HW_ERROR;
+    }
+    
+    if (frame.tot_len < AIpStack::EthHeader::Size) {
+        return AIpStack::IpErr::HW_ERROR;
+    }
+    else if (frame.tot_len > m_frame_mtu) {
+        return AIpStack::IpErr::PKT_TOO_LARGE;
+    }
+    
+    char *tx_frame = tx_frame_ptr(m_tx_index);
+    auto *hdr = reinterpret_cast<struct tpacket3_hdr *>(tx_frame);
+    
+    // If the next slot still holds a frame we have not passed to the kernel yet,
+    // do that now, it may then be sent synchronously.
+    std::uint32_t status = packet_load_status(&hdr->tp_status);
+    if (status == TP_STATUS_SEND_REQUEST && m_tx_pending) {
+        kick_tx();
+        status = packet_load_status(&hdr->tp_status);
+    }
+    
+    if (status != TP_STATUS_AVAILABLE && status != TP_STATUS_WRONG_FORMAT) {
+        // Wait until the slot is released to report that sending is possible.
+        if (m_tx_ready_handler && !m_tx_blocked) {
+            m_tx_blocked = true;
+            m_fd_watcher.updateEvents(
+                AIpStack::EventLoopFdEvents::Read|AIpStack::EventLoopFdEvents::Write);
+        }
+        return AIpStack::IpErr::BUFFER_FULL;
+    }
+    
+    std::size_t len = frame.tot_len;
+    frame.takeBytes(len, tx_frame + PacketTxDataOffset);
+    
+    hdr->tp_next_offset = 0;
+    hdr->tp_len = static_cast<std::uint32_t>(len);
+    hdr->tp_snaplen = static_cast<std::uint32_t>(len);
+    packet_store_status(&hdr->tp_status, TP_STATUS_SEND_REQUEST);
+    
+    m_tx_index = (m_tx_index + 1 == m_tx_frame_count) ? 0 : (m_tx_index + 1);
+    
+    // Frames are passed to the kernel after the current event loop iteration,
+    // together with any others queued until then.
+    if (!m_tx_pending) {
+        m_tx_pending = true;
+        m_kick_timer.setAfter(AIpStack::EventLoopDuration::zero());
+    }
+    
+    return AIpStack::IpErr::SUCCESS;
+}
+
+char * PacketRingDeviceLinux::tx_frame_ptr (std::size_t index) const
+{
+    std::size_t block = index / m_tx_frames_per_block;
+    std::size_t frame = index % m_tx_frames_per_block;
+    return m_tx_ring + block * m_tx_block_size + frame * m_tx_frame_size;
+}
+
+void PacketRingDeviceLinux::kick_tx ()
+{
+    m_tx_pending = false;
+    m_kick_timer.unset();
+    
+    // Errors here are not reported; frames which could not be sent remain
+    // queued and are sent by a later call.
+    ::sendto(*m_fd, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+}
+
+void PacketRingDeviceLinux::kickTimerHandler ()
+{
+    if (m_tx_pending && m_active) {
+        kick_tx();
+    }
+}
+
+void PacketRingDeviceLinux::handleFdEvents (AIpStack::EventLoopFdEvents events)
+{
+    AIPSTACK_ASSERT(m_active)
+    
+    do {
+        if ((events & AIpStack::EventLoopFdEvents::Error) != AIpStack::EnumZero) {
+            std::fprintf(stderr, "PacketRingDeviceLinux: Error event. Stopping.\n");
+            goto error;
+        }
+        
+        // A transmit slot was released after sending failed, stop waiting for
+        // that and report it.
+        if ((events & AIpStack::EventLoopFdEvents::Write) != AIpStack::EnumZero &&
+            m_tx_blocked)
+        {
+            m_tx_blocked = false;
+            m_fd_watcher.updateEvents(AIpStack::EventLoopFdEvents::Read);
+            m_tx_ready_handler();
+        }
+        
+        if ((events & AIpStack::EventLoopFdEvents::Read) == AIpStack::EnumZero) {
+            return;
+        }
+        
+        // Process the blocks which the kernel has passed to us, in order.
+        for (std::size_t i = 0; i < m_rx_block_count; i++) {
+            char *block = m_ring.ptr + m_rx_block_index * m_rx_block_size;
+            auto *desc = reinterpret_cast<struct tpacket_block_desc *>(block);
+            
+            if ((packet_load_status(&desc->hdr.bh1.block_status) &
+                 TP_STATUS_USER) == 0)
+            {
+                break;
+            }
+            
+            process_rx_block(block);
+            
+            packet_store_status(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL);
+            
+            m_rx_block_index = (m_rx_block_index + 1 == m_rx_block_count) ?
+                0 : (m_rx_block_index + 1);
+        }
+    } while (false);
+    
+    return;
+    
+error:
+    m_fd_watcher.reset();
+    m_kick_timer.unset();
+    m_active = false;
+}
+
+void PacketRingDeviceLinux::process_rx_block (char *block)
+{
+    auto *desc = reinterpret_cast<struct tpacket_block_desc *>(block);
+    std::uint32_t num_pkts = desc->hdr.bh1.num_pkts;
+    char *pkt = block + desc->hdr.bh1.offset_to_first_pkt;
+    
+    for (std::uint32_t i = 0; i < num_pkts; i++) {
+        auto *hdr = reinterpret_cast<struct tpacket3_hdr *>(pkt);
+        auto *ll_addr = reinterpret_cast<struct sockaddr_ll *>(pkt + PacketRxAddrOffset);
+        
+        // Skip frames sent by the host through this interface, and frames
+        // which were truncated since they did not fit into a block.
+        if (ll_addr->sll_pkttype != PACKET_OUTGOING && hdr->tp_snaplen == hdr->tp_len) {
+            // Frames with a partial checksum come from the local host (e.g.
+            // through a veth), the checksum of others may have been verified.
+            AIpStack::IpRxFlags rx_flags = AIpStack::IpRxFlags();
+            if ((hdr->tp_status & TP_STATUS_CSUMNOTREADY) != 0) {
+                rx_flags |= AIpStack::IpRxFlags::ProtoChksumPartial;
+            }
+            else if ((hdr->tp_status & TP_STATUS_CSUM_VALID) != 0) {
+                rx_flags |= AIpStack::IpRxFlags::ProtoChksumVerified;
+            }
+            
+            std::size_t len = hdr->tp_snaplen;
+            AIpStack::IpBufNode node{pkt + hdr->tp_mac, len, nullptr};
+            
+            m_handler(AIpStack::IpBufRef{&node, 0, len}, rx_flags);
+        }
+        
+        pkt += hdr->tp_next_offset;
+    }
+}
+
+}
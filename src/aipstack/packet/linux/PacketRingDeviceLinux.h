@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AIPSTACK_PACKET_RING_DEVICE_LINUX_H
+#define AIPSTACK_PACKET_RING_DEVICE_LINUX_H
+
+#include <cstddef>
+#include <string>
+
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/platform_specific/FileDescriptorWrapper.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/ip/IpStackTypes.h>
+#include <aipstack/event_loop/EventLoop.h>
+
+namespace AIpStack {
+
+struct PacketRingDeviceLinuxParams {
+    // Size of a receive ring block (a multiple of the page size) and the
+    // number of blocks. Frames which do not fit into a block are dropped.
+    std::size_t rx_block_size = std::size_t(1) << 18;
+    std::size_t rx_block_count = 16;
+
+    // Time in milliseconds after which a partially filled receive block is
+    // passed to us, this bounds the added receive latency.
+    unsigned int rx_block_timeout_ms = 1;
+
+    // Number of frames in the transmit ring.
+    std::size_t tx_frame_count = 256;
+
+    // Receive frames to any destination address. This is needed unless the
+    // stack uses the MAC address of the interface.
+    bool promiscuous = true;
+};
+
+// Ethernet device driver for an existing network interface (e.g. a veth),
+// using an AF_PACKET socket with TPACKET_V3 memory-mapped receive and
+// transmit rings. Received frames are passed to the handler directly from the
+// receive ring, without copying. Transmitted frames are copied into the
+// transmit ring, and the kernel is asked to send all frames queued in one
+// event loop iteration with a single sendto call.
+//
+// The interface is similar to TapDeviceLinux, so it can be used in its place.
+class PacketRingDeviceLinux :
+    private AIpStack::NonCopyable<PacketRingDeviceLinux>
+{
+public:
+    using FrameReceivedHandler =
+        Function<void(AIpStack::IpBufRef frame, AIpStack::IpRxFlags rx_flags)>;
+    using TxReadyHandler = Function<void()>;
+    using Params = PacketRingDeviceLinuxParams;
+
+    PacketRingDeviceLinux (AIpStack::EventLoop &loop, std::string const &ifname,
+                           FrameReceivedHandler handler,
+                           TxReadyHandler tx_ready_handler = nullptr,
+                           PacketRingDeviceLinuxParams const &params =
+                               PacketRingDeviceLinuxParams());
+
+    ~PacketRingDeviceLinux ();
+
+    std::size_t getMtu () const;
+
+    AIpStack::IpErr sendFrame (AIpStack::IpBufRef frame);
+
+private:
+    // Owns the mapping of the rings.
+    class RingMapping :
+        private AIpStack::NonCopyable<RingMapping>
+    {
+    public:
+        RingMapping ();
+        ~RingMapping ();
+        
+        char *ptr;
+        std::size_t size;
+    };
+
+    void handleFdEvents (AIpStack::EventLoopFdEvents events);
+
+    void kickTimerHandler ();
+
+    void process_rx_block (char *block);
+
+    char * tx_frame_ptr (std::size_t index) const;
+
+    void kick_tx ();
+
+private:
+    FrameReceivedHandler m_handler;
+    TxReadyHandler m_tx_ready_handler;
+    AIpStack::FileDescriptorWrapper m_fd;
+    RingMapping m_ring;
+    AIpStack::EventLoopFdWatcher m_fd_watcher;
+    AIpStack::EventLoopTimer m_kick_timer;
+    std::size_t m_frame_mtu;
+    std::size_t m_rx_block_size;
+    std::size_t m_rx_block_count;
+    std::size_t m_rx_block_index;
+    char *m_tx_ring;
+    std::size_t m_tx_block_size;
+    std::size_t m_tx_frames_per_block;
+    std::size_t m_tx_frame_size;
+    std::size_t m_tx_frame_count;
+    std::size_t m_tx_index;
+    bool m_tx_pending;
+    bool m_active;
+    bool m_tx_blocked;
+};
+
+}
+
+#endif
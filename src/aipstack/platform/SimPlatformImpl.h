@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_SIM_PLATFORM_IMPL_H
+#define AIPSTACK_SIM_PLATFORM_IMPL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/structure/LinkModel.h>
+#include <aipstack/structure/Accessor.h>
+#include <aipstack/structure/StructureRaiiWrapper.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup platform
+ * @{
+ */
+
+/**
+ * Platform implementation based on simulated (virtual) time.
+ * 
+ * This implements the interface described by @ref PlatformImplStub without any
+ * dependency on a real clock or event loop. The clock only moves forward when the
+ * application calls one of the run functions (@ref step, @ref runUntil, @ref runFor
+ * or @ref runUntilIdle), and then it jumps directly to the expiration time of the
+ * next timer. There is no waiting, so hours of simulated traffic can be processed
+ * in as much real time as the actual processing takes.
+ * 
+ * Any number of stacks can share one SimPlatformImpl, and everything is driven from
+ * the thread which calls the run functions. Drivers connecting such stacks should
+ * deliver frames from @ref Timer handlers (e.g. a timer set to the current time plus
+ * the link delay) rather than calling into the receiving stack directly.
+ * 
+ * Timers which expire at the same time are dispatched in the order in which they
+ * were set. Together with the absence of a real clock this makes runs completely
+ * deterministic, so that they are suitable as a base for reproducible regression
+ * tests.
+ * 
+ * The time unit is one microsecond (@ref TimeFreq is 1e6).
+ */
+class SimPlatformImpl :
+    private NonCopyable<SimPlatformImpl>
+{
+public:
+    /**
+     * Reference to the platform implementation.
+     */
+    using ThePlatformRef = PlatformRef<SimPlatformImpl>;
+
+    /**
+     * Construct the simulated platform.
+     * 
+     * @param start_time Initial value of the simulated clock.
+     */
+    inline SimPlatformImpl (std::uint64_t start_time = 0);
+
+    /**
+     * Destruct the simulated platform.
+     * 
+     * There must be no remaining @ref Timer objects.
+     */
+    inline ~SimPlatformImpl ();
+
+    static bool const ImplIsStatic = false;
+
+    using TimeType = std::uint64_t;
+
+    static constexpr double TimeFreq = 1e6;
+    
+    static constexpr TimeType RelativeTimeLimit = TypeMax<TimeType>() / 64;
+    
+    /**
+     * Return the current simulated time.
+     * 
+     * @return The simulated time.
+     */
+    inline TimeType getTime () { return m_now; }
+
+    /**
+     * Return the current simulated time (same as @ref getTime).
+     * 
+     * @return The simulated time.
+     */
+    inline TimeType getEventTime () { return m_now; }
+
+    /**
+     * Get the expiration time of the earliest timer.
+     * 
+     * Timers which were set to a time in the past are reported as expiring at the
+     * current time.
+     * 
+     * @param out_time On success, is set to the expiration time.
+     * @return True if there is any timer set, false if not.
+     */
+    inline bool getNextTime (TimeType &out_time) const;
+
+    /**
+     * Dispatch the earliest timer, advancing time to its expiration time.
+     * 
+     * @return True if a timer was dispatched, false if no timer was set.
+     */
+    inline bool step ();
+
+    /**
+     * Dispatch all timers which expire at or before the given time, then advance
+     * time to that time.
+     * 
+     * Timers set by handlers are also dispatched if they expire in time. If
+     * @ref stop is called from a handler, returns after that handler, without
+     * advancing time further.
+     * 
+     * @param end_time Time to run until. If this is in the past, any already
+     *        expired timers are dispatched but time stays the same.
+     */
+    inline void runUntil (TimeType end_time);
+
+    /**
+     * Run for the given duration; equivalent to runUntil(getTime() + duration).
+     * 
+     * @param duration Duration in ticks.
+     */
+    inline void runFor (TimeType duration);
+
+    /**
+     * Dispatch timers until none are set, @ref stop is called or the limit of
+     * dispatched timers is reached.
+     * 
+     * Note that a stack with active TCP connections or periodic timers never
+     * becomes idle, so a limit or a call to @ref stop is generally needed.
+     * 
+     * @param max_events Maximum number of timers to dispatch.
+     * @return True if returned because no timer remains set, false otherwise.
+     */
+    inline bool runUntilIdle (std::size_t max_events = TypeMax<std::size_t>());
+
+    /**
+     * Request the current run function to return after the current handler.
+     * 
+     * The request is cleared when a run function is next called.
+     */
+    inline void stop () { m_stop = true; }
+
+    /**
+     * Return the total number of timer handlers dispatched so far.
+     * 
+     * @return The number of dispatched timers.
+     */
+    inline std::uint64_t getNumDispatched () const { return m_num_dispatched; }
+
+    class Timer :
+        private NonCopyable<Timer>,
+        private ThePlatformRef
+    {
+        friend class SimPlatformImpl;
+
+    public:
+        inline Timer (ThePlatformRef ref, Function<void()> handler);
+
+        inline ~Timer ();
+
+        using ThePlatformRef::ref;
+
+        inline bool isSet () const { return m_is_set; }
+
+        inline TimeType getSetTime () const { return m_set_time; }
+
+        inline void unset ();
+
+        inline void setAt (TimeType abs_time);
+
+    private:
+        inline SimPlatformImpl & sim () const { return *ref().platformImpl(); }
+
+    private:
+        LinkedHeapNode<PointerLinkModel<Timer>> m_heap_node;
+        Function<void()> m_handler;
+        TimeType m_set_time;
+        TimeType m_time;
+        std::uint64_t m_seq;
+        bool m_is_set;
+    };
+
+private:
+    struct TimerHeapNodeAccessor;
+    struct TimerCompare;
+
+    using TimerLinkModel = PointerLinkModel<Timer>;
+    using TimerHeap = LinkedHeap<TimerHeapNodeAccessor, TimerCompare, TimerLinkModel>;
+
+    inline bool dispatch_first (TimeType end_time);
+
+private:
+    StructureRaiiWrapper<TimerHeap> m_timer_heap;
+    TimeType m_now;
+    std::uint64_t m_next_seq;
+    std::uint64_t m_num_dispatched;
+    std::size_t m_num_timers;
+    bool m_stop;
+};
+
+/** @} */
+
+#ifndef IN_DOXYGEN
+
+struct SimPlatformImpl::TimerHeapNodeAccessor : public MemberAccessor<
+    Timer, LinkedHeapNode<TimerLinkModel>, &Timer::m_heap_node> {};
+
+struct SimPlatformImpl::TimerCompare {
+    using State = TimerLinkModel::State;
+    using Ref = TimerLinkModel::Ref;
+
+    // Order by the effective time and then by the sequence number assigned in
+    // setAt, so that timers expiring at the same time are dispatched in FIFO order.
+    inline static int compareEntries (State, Ref ref1, Ref ref2)
+    {
+        Timer &tim1 = *ref1;
+        Timer &tim2 = *ref2;
+
+        if (tim1.m_time != tim2.m_time) {
+            return (tim1.m_time < tim2.m_time) ? -1 : 1;
+        }
+
+        if (tim1.m_seq != tim2.m_seq) {
+            return (tim1.m_seq < tim2.m_seq) ? -1 : 1;
+        }
+
+        return 0;
+    }
+};
+
+SimPlatformImpl::SimPlatformImpl (std::uint64_t start_time) :
+    m_now(start_time),
+    m_next_seq(0),
+    m_num_dispatched(0),
+    m_num_timers(0),
+    m_stop(false)
+{}
+
+SimPlatformImpl::~SimPlatformImpl ()
+{
+    AIPSTACK_ASSERT(m_num_timers == 0)
+}
+
+bool SimPlatformImpl::getNextTime (TimeType &out_time) const
+{
+    Timer *tim = m_timer_heap.first();
+    if (tim == nullptr) {
+        return false;
+    }
+    out_time = tim->m_time;
+    return true;
+}
+
+bool SimPlatformImpl::step ()
+{
+    m_stop = false;
+
+    return dispatch_first(TypeMax<TimeType>());
+}
+
+void SimPlatformImpl::runUntil (TimeType end_time)
+{
+    m_stop = false;
+
+    while (dispatch_first(end_time)) {
+        if (m_stop) {
+            return;
+        }
+    }
+
+    if (end_time > m_now) {
+        m_now = end_time;
+    }
+}
+
+void SimPlatformImpl::runFor (TimeType duration)
+{
+    return runUntil(m_now + duration);
+}
+
+bool SimPlatformImpl::runUntilIdle (std::size_t max_events)
+{
+    m_stop = false;
+
+    for (std::size_t i = 0; i < max_events; i++) {
+        if (!dispatch_first(TypeMax<TimeType>())) {
+            return true;
+        }
+        if (m_stop) {
+            return false;
+        }
+    }
+
+    return m_timer_heap.isEmpty();
+}
+
+bool SimPlatformImpl::dispatch_first (TimeType end_time)
+{
+    Timer *tim = m_timer_heap.first();
+    if (tim == nullptr || tim->m_time > end_time) {
+        return false;
+    }
+
+    AIPSTACK_ASSERT(tim->m_is_set)
+    AIPSTACK_ASSERT(tim->m_time >= m_now)
+
+    // Jump to the expiration time, then mark the timer as not set before calling
+    // the handler, as required by the platform interface. The handler may set the
+    // timer again or destruct it.
+    m_now = tim->m_time;
+    m_timer_heap.remove(*tim);
+    tim->m_is_set = false;
+    m_num_dispatched++;
+
+    tim->m_handler();
+
+    return true;
+}
+
+SimPlatformImpl::Timer::Timer (ThePlatformRef ref, Function<void()> handler) :
+    ThePlatformRef(ref),
+    m_handler(handler),
+    m_set_time(0),
+    m_time(0),
+    m_seq(0),
+    m_is_set(false)
+{
+    sim().m_num_timers++;
+}
+
+SimPlatformImpl::Timer::~Timer ()
+{
+    SimPlatformImpl &sim = this->sim();
+
+    if (m_is_set) {
+        sim.m_timer_heap.remove(*this);
+    }
+
+    AIPSTACK_ASSERT(sim.m_num_timers > 0)
+    sim.m_num_timers--;
+}
+
+void SimPlatformImpl::Timer::unset ()
+{
+    if (m_is_set) {
+        sim().m_timer_heap.remove(*this);
+        m_is_set = false;
+    }
+}
+
+void SimPlatformImpl::Timer::setAt (TimeType abs_time)
+{
+    SimPlatformImpl &sim = this->sim();
+
+    if (m_is_set) {
+        sim.m_timer_heap.remove(*this);
+    }
+
+    // Times in the past (interpreted modulo the TimeType range as per the platform
+    // interface) are dispatched at the current time. With this the heap never
+    // contains times before m_now and ordinary comparisons can be used.
+    TimeType rel_time = TimeType(abs_time - sim.m_now);
+    bool in_past = rel_time > TypeMax<TimeType>() / 2;
+
+    m_set_time = abs_time;
+    m_time = in_past ? sim.m_now : abs_time;
+    m_seq = sim.m_next_seq++;
+    m_is_set = true;
+
+    sim.m_timer_heap.insert(*this);
+}
+
+#endif
+
+}
+
+#endif
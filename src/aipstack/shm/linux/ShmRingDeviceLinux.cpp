@@ -0,0 +1,684 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/shm/linux/ShmRingDeviceLinux.h>
+
+namespace AIpStack {
+
+// The rings are accessed by two processes through atomics in shared memory,
+// which requires that they are lock-free.
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "");
+
+static std::uint32_t const ShmMagic = 0x41495352;
+static std::uint32_t const ShmVersion = 1;
+
+static std::size_t const ShmCacheLine = 64;
+
+// Each slot holds the frame length followed by the frame.
+static std::size_t const ShmSlotDataOffset = 16;
+
+// Limit of ring_size, so that a ring does not overflow the indices.
+static std::uint32_t const ShmMaxRingSize = std::uint32_t(1) << 20;
+
+// Number of file descriptors passed to the peer: the memfd and the two
+// doorbells.
+static int const ShmNumPassedFds = 3;
+
+// At the start of the shared memory, written by the creator before the peer
+// connects.
+struct ShmRegionHeader {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t ring_size;
+    std::uint32_t slot_size;
+    std::uint32_t frame_mtu;
+};
+
+// Control block of a ring, follows the region header. Ring 0 is from the
+// creator to the peer, ring 1 the other way.
+struct ShmRingDeviceLinuxRingCtl {
+    // Written by the producer: the index after the last frame which can be
+    // consumed, and a request to ring its doorbell when slots are released
+    // (the consumer clears it before ringing).
+    alignas(ShmCacheLine) std::atomic<std::uint32_t> head;
+    std::atomic<std::uint32_t> producer_waiting;
+    
+    // Written by the consumer: the index after the last released slot, and a
+    // request to ring its doorbell when frames are added (the producer clears
+    // it before ringing).
+    alignas(ShmCacheLine) std::atomic<std::uint32_t> tail;
+    std::atomic<std::uint32_t> consumer_waiting;
+};
+
+static std::size_t const ShmCtlOffset = ShmCacheLine;
+
+static std::size_t const ShmSlotsOffset =
+    ShmCtlOffset + 2 * sizeof(ShmRingDeviceLinuxRingCtl);
+
+static_assert(sizeof(ShmRegionHeader) <= ShmCtlOffset, "");
+
+static std::size_t shm_round_up (std::size_t x, std::size_t unit)
+{
+    return ((x + unit - 1) / unit) * unit;
+}
+
+static std::size_t shm_region_size (std::uint32_t ring_size, std::size_t slot_size)
+{
+    return ShmSlotsOffset + 2 * std::size_t(ring_size) * slot_size;
+}
+
+// The link is found through an abstract Unix socket address, so nothing is
+// left in the filesystem.
+static socklen_t shm_make_addr (std::string const &name, struct sockaddr_un *addr)
+{
+    std::string path = std::string("aipstack-shm/") + name;
+    
+    std::memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (1 + path.size() > sizeof(addr->sun_path)) {
+        throw std::runtime_error("Shared memory link name too long.");
+    }
+    std::memcpy(addr->sun_path + 1, path.data(), path.size());
+    
+    return socklen_t(offsetof(struct sockaddr_un, sun_path) + 1 + path.size());
+}
+
+ShmRingDeviceLinux::Mapping::Mapping () :
+    ptr(nullptr),
+    size(0)
+{}
+
+ShmRingDeviceLinux::Mapping::~Mapping ()
+{
+    if (ptr != nullptr) {
+        ::munmap(ptr, size);
+    }
+}
+
+bool ShmRingDeviceLinux::Mapping::map (int fd, std::size_t map_size)
+{
+    AIPSTACK_ASSERT(ptr == nullptr)
+    
+    void *addr = ::mmap(nullptr, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    ptr = static_cast<char *>(addr);
+    size = map_size;
+    return true;
+}
+
+ShmRingDeviceLinux::ShmRingDeviceLinux (
+    AIpStack::EventLoop &loop, std::string const &name, FrameReceivedHandler handler,
+    TxReadyHandler tx_ready_handler, ShmRingDeviceLinuxParams const &params)
+:
+    m_handler(handler),
+    m_tx_ready_handler(tx_ready_handler),
+    m_sock_watcher(loop, AIPSTACK_BIND_MEMBER(&ShmRingDeviceLinux::handleSockEvents, this)),
+    m_doorbell_watcher(loop,
+        AIPSTACK_BIND_MEMBER(&ShmRingDeviceLinux::handleDoorbellEvents, this)),
+    m_kick_timer(loop, AIPSTACK_BIND_MEMBER(&ShmRingDeviceLinux::kickTimerHandler, this)),
+    m_rx_timer(loop, AIPSTACK_BIND_MEMBER(&ShmRingDeviceLinux::rxTimerHandler, this)),
+    m_tx_ctl(nullptr),
+    m_rx_ctl(nullptr),
+    m_tx_slots(nullptr),
+    m_rx_slots(nullptr),
+    m_frame_mtu(params.mtu + AIpStack::EthHeader::Size),
+    m_slot_size(0),
+    m_ring_size(0),
+    m_tx_head(0),
+    m_tx_tail(0),
+    m_rx_tail(0),
+    m_rx_flags(params.trust_rx_chksum ?
+        AIpStack::IpRxFlags::ProtoChksumVerified : AIpStack::IpRxFlags()),
+    m_creator(false),
+    m_listening(false),
+    m_connected(false),
+    m_tx_pending(false),
+    m_active(true),
+    m_tx_blocked(false)
+{
+    if (params.ring_size < 2 || params.ring_size > ShmMaxRingSize ||
+        (params.ring_size & (params.ring_size - 1)) != 0 ||
+        params.mtu == 0 || params.mtu > UINT32_MAX / 2)
+    {
+        throw std::runtime_error("Invalid shared memory ring parameters.");
+    }
+    
+    // Connect to the link if it exists, otherwise create it. If another
+    // process creates it at the same time, bind fails and we connect again.
+    bool attached = false;
+    for (int attempt = 0; attempt < 2 && !attached; attempt++) {
+        attached = try_connect(name) || create_link(name, params);
+    }
+    if (!attached) {
+        throw std::runtime_error("Could not connect to or create the shared memory link.");
+    }
+    
+    m_sock_watcher.initFd(*m_sock, AIpStack::EventLoopFdEvents::Read);
+}
+
+ShmRingDeviceLinux::~ShmRingDeviceLinux ()
+{}
+
+std::size_t ShmRingDeviceLinux::getMtu () const
+{
+    return m_frame_mtu;
+}
+
+bool ShmRingDeviceLinux::isConnected () const
+{
+    return m_connected;
+}
+
+bool ShmRingDeviceLinux::try_connect (std::string const &name)
+{
+    struct sockaddr_un addr;
+    socklen_t addr_len = shm_make_addr(name, &addr);
+    
+    AIpStack::FileDescriptorWrapper sock{
+        ::socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0)};
+    if (!sock) {
+        throw std::runtime_error("socket(AF_UNIX) failed.");
+    }
+    
+    // A listening socket accepts into its backlog, so this does not wait for
+    // the creator.
+    if (::connect(*sock, reinterpret_cast<struct sockaddr *>(&addr), addr_len) < 0) {
+        if (errno == ECONNREFUSED || errno == ENOENT) {
+            return false;
+        }
+        throw std::runtime_error("connect(AF_UNIX) failed.");
+    }
+    
+    sock.setNonblocking();
+    
+    m_sock = std::move(sock);
+    m_creator = false;
+    
+    return true;
+}
+
+bool ShmRingDeviceLinux::create_link (
+    std::string const &name, ShmRingDeviceLinuxParams const &params)
+{
+    struct sockaddr_un addr;
+    socklen_t addr_len = shm_make_addr(name, &addr);
+    
+    AIpStack::FileDescriptorWrapper sock{
+        ::socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC|SOCK_NONBLOCK, 0)};
+    if (!sock) {
+        throw std::runtime_error("socket(AF_UNIX) failed.");
+    }
+    
+    if (::bind(*sock, reinterpret_cast<struct sockaddr *>(&addr), addr_len) < 0) {
+        if (errno == EADDRINUSE) {
+            return false;
+        }
+        throw std::runtime_error("bind(AF_UNIX) failed.");
+    }
+    
+    if (::listen(*sock, 1) < 0) {
+        throw std::runtime_error("listen(AF_UNIX) failed.");
+    }
+    
+    std::size_t slot_size =
+        shm_round_up(ShmSlotDataOffset + m_frame_mtu, ShmCacheLine);
+    std::size_t size = shm_round_up(shm_region_size(params.ring_size, slot_size),
+                                    std::size_t(::sysconf(_SC_PAGESIZE)));
+    
+    m_mem_fd = AIpStack::FileDescriptorWrapper{::memfd_create("aipstack-shm", MFD_CLOEXEC)};
+    if (!m_mem_fd) {
+        throw std::runtime_error("memfd_create failed.");
+    }
+    
+    if (::ftruncate(*m_mem_fd, off_t(size)) < 0) {
+        throw std::runtime_error("ftruncate of memfd failed.");
+    }
+    
+    if (!m_mem.map(*m_mem_fd, size)) {
+        throw std::runtime_error("mmap of memfd failed.");
+    }
+    
+    // The memfd is zero-filled.
+    auto *header = reinterpret_cast<ShmRegionHeader *>(m_mem.ptr);
+    header->magic = ShmMagic;
+    header->version = ShmVersion;
+    header->ring_size = params.ring_size;
+    header->slot_size = std::uint32_t(slot_size);
+    header->frame_mtu = std::uint32_t(m_frame_mtu);
+    
+    for (int i = 0; i < 2; i++) {
+        auto *ctl = new(m_mem.ptr + ShmCtlOffset + i * sizeof(ShmRingDeviceLinuxRingCtl))
+            ShmRingDeviceLinuxRingCtl();
+        ctl->head.store(0, std::memory_order_relaxed);
+        ctl->producer_waiting.store(0, std::memory_order_relaxed);
+        ctl->tail.store(0, std::memory_order_relaxed);
+        ctl->consumer_waiting.store(1, std::memory_order_relaxed);
+    }
+    
+    for (auto &doorbell_fd : m_doorbell_fds) {
+        doorbell_fd = AIpStack::FileDescriptorWrapper{
+            ::eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)};
+        if (!doorbell_fd) {
+            throw std::runtime_error("eventfd failed.");
+        }
+    }
+    
+    m_sock = std::move(sock);
+    m_creator = true;
+    m_listening = true;
+    
+    attach_rings();
+    
+    return true;
+}
+
+void ShmRingDeviceLinux::attach_rings ()
+{
+    auto *header = reinterpret_cast<ShmRegionHeader const *>(m_mem.ptr);
+    m_ring_size = header->ring_size;
+    m_slot_size = header->slot_size;
+    
+    auto *ctls = reinterpret_cast<ShmRingDeviceLinuxRingCtl *>(m_mem.ptr + ShmCtlOffset);
+    char *slots[2] = {
+        m_mem.ptr + ShmSlotsOffset,
+        m_mem.ptr + ShmSlotsOffset + std::size_t(m_ring_size) * m_slot_size
+    };
+    
+    int tx_ring = m_creator ? 0 : 1;
+    m_tx_ctl = &ctls[tx_ring];
+    m_tx_slots = slots[tx_ring];
+    m_rx_ctl = &ctls[1 - tx_ring];
+    m_rx_slots = slots[1 - tx_ring];
+}
+
+void ShmRingDeviceLinux::handleSockEvents (AIpStack::EventLoopFdEvents)
+{
+    AIPSTACK_ASSERT(m_active)
+    
+    if (m_listening) {
+        accept_peer();
+    }
+    else if (!m_connected) {
+        receive_link();
+    }
+    else {
+        // The peer sends nothing after the link is set up, so this means
+        // that it has closed its device or exited.
+        fail("Peer disconnected. Stopping.");
+    }
+}
+
+void ShmRingDeviceLinux::accept_peer ()
+{
+    AIpStack::FileDescriptorWrapper conn{
+        ::accept4(*m_sock, nullptr, nullptr, SOCK_CLOEXEC|SOCK_NONBLOCK)};
+    if (!conn) {
+        if (!AIpStack::FileDescriptorWrapper::errIsEAGAINorEWOULDBLOCK(errno)) {
+            fail("accept failed. Stopping.");
+        }
+        return;
+    }
+    
+    // Pass the memfd and the doorbells along with the magic number.
+    std::uint32_t magic = ShmMagic;
+    struct iovec iov = {&magic, sizeof(magic)};
+    
+    union {
+        char buf[CMSG_SPACE(ShmNumPassedFds * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    std::memset(&control, 0, sizeof(control));
+    
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(ShmNumPassedFds * sizeof(int));
+    int fds[ShmNumPassedFds] = {*m_mem_fd, *m_doorbell_fds[0], *m_doorbell_fds[1]};
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    
+    if (::sendmsg(*conn, &msg, MSG_NOSIGNAL) != ssize_t(sizeof(magic))) {
+        fail("Passing the link to the peer failed. Stopping.");
+        return;
+    }
+    
+    // Only one peer can connect, stop listening.
+    m_sock_watcher.reset();
+    m_sock = std::move(conn);
+    m_sock_watcher.initFd(*m_sock, AIpStack::EventLoopFdEvents::Read);
+    m_mem_fd = AIpStack::FileDescriptorWrapper();
+    m_listening = false;
+    
+    set_connected();
+}
+
+void ShmRingDeviceLinux::receive_link ()
+{
+    std::uint32_t magic = 0;
+    struct iovec iov = {&magic, sizeof(magic)};
+    
+    union {
+        char buf[CMSG_SPACE(ShmNumPassedFds * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    
+    ssize_t res = ::recvmsg(*m_sock, &msg, MSG_CMSG_CLOEXEC);
+    if (res < 0 && AIpStack::FileDescriptorWrapper::errIsEAGAINorEWOULDBLOCK(errno)) {
+        return;
+    }
+    
+    // Take ownership of any received descriptors first so they are closed
+    // on failure.
+    AIpStack::FileDescriptorWrapper fds[ShmNumPassedFds];
+    int num_fds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (std::size_t i = 0; i < count; i++) {
+            int fd;
+            std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (num_fds < ShmNumPassedFds) {
+                fds[num_fds++] = AIpStack::FileDescriptorWrapper{fd};
+            } else {
+                ::close(fd);
+            }
+        }
+    }
+    
+    if (res != ssize_t(sizeof(magic)) || magic != ShmMagic ||
+        num_fds != ShmNumPassedFds || (msg.msg_flags & MSG_CTRUNC) != 0)
+    {
+        fail("Did not receive the link from its creator. Stopping.");
+        return;
+    }
+    
+    struct stat st;
+    if (::fstat(*fds[0], &st) < 0 || st.st_size < off_t(ShmSlotsOffset) ||
+        !m_mem.map(*fds[0], std::size_t(st.st_size)))
+    {
+        fail("Mapping the shared memory failed. Stopping.");
+        return;
+    }
+    
+    // Check that the creator uses the same format and MTU, and that the
+    // rings fit into the memory.
+    auto *header = reinterpret_cast<ShmRegionHeader const *>(m_mem.ptr);
+    std::uint32_t ring_size = header->ring_size;
+    std::uint32_t slot_size = header->slot_size;
+    if (header->magic != ShmMagic || header->version != ShmVersion ||
+        header->frame_mtu != m_frame_mtu || ring_size < 2 ||
+        ring_size > ShmMaxRingSize || (ring_size & (ring_size - 1)) != 0 ||
+        slot_size < ShmSlotDataOffset + m_frame_mtu || slot_size > (1u << 20) ||
+        shm_region_size(ring_size, slot_size) > m_mem.size)
+    {
+        fail("Parameters of the link do not match. Stopping.");
+        return;
+    }
+    
+    m_doorbell_fds[0] = std::move(fds[1]);
+    m_doorbell_fds[1] = std::move(fds[2]);
+    
+    attach_rings();
+    
+    set_connected();
+}
+
+void ShmRingDeviceLinux::set_connected ()
+{
+    m_connected = true;
+    
+    m_doorbell_watcher.initFd(*m_doorbell_fds[m_creator ? 0 : 1],
+                              AIpStack::EventLoopFdEvents::Read);
+    
+    // Pick up any frames which were queued before we were watching.
+    m_rx_timer.setAfter(AIpStack::EventLoopDuration::zero());
+}
+
+AIpStack::IpErr ShmRingDeviceLinux::sendFrame (AIpStack::IpBufRef frame)
+{
+    if (!m_active) {
+        return AIpStack::IpErr::HW_ERROR;
+    }
+    
+    if (!m_connected) {
+        return AIpStack::IpErr::LINK_DOWN;
+    }
+    
+    if (frame.tot_len < AIpStack::EthHeader::Size) {
+        return AIpStack::IpErr::HW_ERROR;
+    }
+    else if (frame.tot_len > m_frame_mtu) {
+        return AIpStack::IpErr::PKT_TOO_LARGE;
+    }
+    
+    if (!tx_space_available()) {
+        // Ask the peer to ring our doorbell when it releases slots, then check
+        // again in case it released them before seeing the request.
+        m_tx_ctl->producer_waiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        
+        if (!tx_space_available()) {
+            if (m_tx_ready_handler) {
+                m_tx_blocked = true;
+            }
+            return AIpStack::IpErr::BUFFER_FULL;
+        }
+    }
+    
+    char *slot = m_tx_slots + std::size_t(m_tx_head & (m_ring_size - 1)) * m_slot_size;
+    std::uint32_t len = std::uint32_t(frame.tot_len);
+    std::memcpy(slot, &len, sizeof(len));
+    frame.takeBytes(len, slot + ShmSlotDataOffset);
+    
+    // The frame is visible to the peer right away, if it is processing frames
+    // it will see it without a doorbell.
+    m_tx_head++;
+    m_tx_ctl->head.store(m_tx_head, std::memory_order_release);
+    
+    // Whether the peer needs a doorbell is checked after the current event
+    // loop iteration, so that one covers all frames sent until then.
+    if (!m_tx_pending) {
+        m_tx_pending = true;
+        m_kick_timer.setAfter(AIpStack::EventLoopDuration::zero());
+    }
+    
+    return AIpStack::IpErr::SUCCESS;
+}
+
+bool ShmRingDeviceLinux::tx_space_available ()
+{
+    if (m_tx_head - m_tx_tail < m_ring_size) {
+        return true;
+    }
+    m_tx_tail = m_tx_ctl->tail.load(std::memory_order_acquire);
+    return m_tx_head - m_tx_tail < m_ring_size;
+}
+
+void ShmRingDeviceLinux::ring_peer_doorbell ()
+{
+    // Errors are not reported, the counter cannot overflow in practice.
+    std::uint64_t value = 1;
+    ssize_t res = ::write(*m_doorbell_fds[m_creator ? 1 : 0], &value, sizeof(value));
+    (void)res;
+}
+
+void ShmRingDeviceLinux::kickTimerHandler ()
+{
+    m_tx_pending = false;
+    
+    if (!m_active) {
+        return;
+    }
+    
+    // The fence orders the stores of head before the load of the flag, which
+    // the peer sets before checking head again.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    
+    if (m_tx_ctl->consumer_waiting.load(std::memory_order_relaxed) != 0 &&
+        m_tx_ctl->consumer_waiting.exchange(0, std::memory_order_relaxed) != 0)
+    {
+        ring_peer_doorbell();
+    }
+}
+
+void ShmRingDeviceLinux::rxTimerHandler ()
+{
+    if (m_active && m_connected) {
+        process_rx();
+    }
+}
+
+void ShmRingDeviceLinux::handleDoorbellEvents (AIpStack::EventLoopFdEvents events)
+{
+    AIPSTACK_ASSERT(m_active)
+    AIPSTACK_ASSERT(m_connected)
+    
+    if ((events & AIpStack::EventLoopFdEvents::Error) != AIpStack::EnumZero) {
+        fail("Error event on doorbell. Stopping.");
+        return;
+    }
+    
+    std::uint64_t value;
+    ssize_t res = ::read(*m_doorbell_fds[m_creator ? 0 : 1], &value, sizeof(value));
+    (void)res;
+    
+    // The doorbell is rung for released slots and for new frames.
+    if (m_tx_blocked && tx_space_available()) {
+        m_tx_blocked = false;
+        m_tx_ready_handler();
+        if (!m_active) {
+            return;
+        }
+    }
+    
+    m_rx_timer.unset();
+    process_rx();
+}
+
+void ShmRingDeviceLinux::process_rx ()
+{
+    // Process the frames which are there now, frames added meanwhile are
+    // processed in the next event loop iteration.
+    std::uint32_t head = m_rx_ctl->head.load(std::memory_order_acquire);
+    std::uint32_t count = head - m_rx_tail;
+    if (count > m_ring_size) {
+        fail("Invalid receive ring state. Stopping.");
+        return;
+    }
+    
+    for (std::uint32_t i = 0; i < count; i++) {
+        char *slot = m_rx_slots + std::size_t(m_rx_tail & (m_ring_size - 1)) * m_slot_size;
+        
+        // The length is read once since the peer could change it.
+        std::uint32_t len;
+        std::memcpy(&len, slot, sizeof(len));
+        
+        if (len >= AIpStack::EthHeader::Size && len <= m_frame_mtu) {
+            AIpStack::IpBufNode node{slot + ShmSlotDataOffset, len, nullptr};
+            m_handler(AIpStack::IpBufRef{&node, 0, len}, m_rx_flags);
+        }
+        
+        m_rx_tail++;
+        m_rx_ctl->tail.store(m_rx_tail, std::memory_order_release);
+    }
+    
+    if (count > 0) {
+        // Ring the doorbell of the peer if it is waiting for slots.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        
+        if (m_rx_ctl->producer_waiting.load(std::memory_order_relaxed) != 0 &&
+            m_rx_ctl->producer_waiting.exchange(0, std::memory_order_relaxed) != 0)
+        {
+            ring_peer_doorbell();
+        }
+        
+        // Keep polling while frames are arriving, the peer does not ring the
+        // doorbell meanwhile.
+        m_rx_timer.setAfter(AIpStack::EventLoopDuration::zero());
+        return;
+    }
+    
+    // The ring is empty, ask for the doorbell, then check again in case a frame
+    // was added before the peer saw the request.
+    m_rx_ctl->consumer_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    
+    if (m_rx_ctl->head.load(std::memory_order_relaxed) != m_rx_tail) {
+        m_rx_ctl->consumer_waiting.store(0, std::memory_order_relaxed);
+        m_rx_timer.setAfter(AIpStack::EventLoopDuration::zero());
+    }
+}
+
+void ShmRingDeviceLinux::fail (char const *msg)
+{
+    std::fprintf(stderr, "ShmRingDeviceLinux: %s\n", msg);
+    
+    m_sock_watcher.reset();
+    m_doorbell_watcher.reset();
+    m_kick_timer.unset();
+    m_rx_timer.unset();
+    m_connected = false;
+    m_active = false;
+}
+
+}
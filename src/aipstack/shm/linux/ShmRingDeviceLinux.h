@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AIPSTACK_SHM_RING_DEVICE_LINUX_H
+#define AIPSTACK_SHM_RING_DEVICE_LINUX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/platform_specific/FileDescriptorWrapper.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/ip/IpStackTypes.h>
+#include <aipstack/event_loop/EventLoop.h>
+
+namespace AIpStack {
+
+struct ShmRingDeviceLinuxParams {
+    // Number of frame slots in the ring for each direction (a power of two).
+    // The process which creates the link decides this.
+    std::uint32_t ring_size = 1024;
+
+    // Maximum IP packet size, both ends must use the same value.
+    std::size_t mtu = 1500;
+
+    // Report the transport checksums of received frames as verified. Frames
+    // cannot be corrupted in shared memory, so this only skips redundant
+    // verification, but it must only be used if the peer is trusted.
+    bool trust_rx_chksum = false;
+};
+
+struct ShmRingDeviceLinuxRingCtl;
+
+// Ethernet device driver for a point-to-point link between two processes on
+// the same host, each with its own stack. The link is identified by a name:
+// the first process to create a device with the name listens on an abstract
+// Unix socket derived from it and creates a memfd with one single-producer
+// single-consumer ring of frame slots for each direction, and the second one
+// connects and receives the memfd and an eventfd for each side. The link is
+// up from then until one of the processes closes its device.
+//
+// Received frames are passed to the handler directly from shared memory, and
+// each slot is released after the handler returns. Transmitted frames are
+// copied into slots and are visible to the peer immediately. The eventfd of
+// the peer (the doorbell) is written at most once per event loop iteration,
+// and only if the peer has drained its ring and is waiting; while the peer
+// is processing frames it sees new ones without a doorbell.
+//
+// The interface is similar to TapDeviceLinux, so it can be used in its place.
+class ShmRingDeviceLinux :
+    private AIpStack::NonCopyable<ShmRingDeviceLinux>
+{
+public:
+    using FrameReceivedHandler =
+        Function<void(AIpStack::IpBufRef frame, AIpStack::IpRxFlags rx_flags)>;
+    using TxReadyHandler = Function<void()>;
+    using Params = ShmRingDeviceLinuxParams;
+
+    ShmRingDeviceLinux (AIpStack::EventLoop &loop, std::string const &name,
+                        FrameReceivedHandler handler,
+                        TxReadyHandler tx_ready_handler = nullptr,
+                        ShmRingDeviceLinuxParams const &params =
+                            ShmRingDeviceLinuxParams());
+
+    ~ShmRingDeviceLinux ();
+
+    std::size_t getMtu () const;
+
+    // Whether the peer has connected (and not yet disconnected). Frames can
+    // only be sent while connected, sendFrame returns LINK_DOWN otherwise.
+    bool isConnected () const;
+
+    AIpStack::IpErr sendFrame (AIpStack::IpBufRef frame);
+
+private:
+    // Owns the mapping of the shared memory.
+    class Mapping :
+        private AIpStack::NonCopyable<Mapping>
+    {
+    public:
+        Mapping ();
+        ~Mapping ();
+        
+        bool map (int fd, std::size_t size);
+        
+        char *ptr;
+        std::size_t size;
+    };
+
+    bool try_connect (std::string const &name);
+
+    bool create_link (std::string const &name, ShmRingDeviceLinuxParams const &params);
+
+    void attach_rings ();
+
+    void handleSockEvents (AIpStack::EventLoopFdEvents events);
+
+    void handleDoorbellEvents (AIpStack::EventLoopFdEvents events);
+
+    void kickTimerHandler ();
+
+    void rxTimerHandler ();
+
+    void accept_peer ();
+
+    void receive_link ();
+
+    void set_connected ();
+
+    void process_rx ();
+
+    void ring_peer_doorbell ();
+
+    bool tx_space_available ();
+
+    void fail (char const *msg);
+
+private:
+    FrameReceivedHandler m_handler;
+    TxReadyHandler m_tx_ready_handler;
+    Mapping m_mem;
+    AIpStack::FileDescriptorWrapper m_mem_fd;
+    AIpStack::FileDescriptorWrapper m_sock;
+    AIpStack::FileDescriptorWrapper m_doorbell_fds[2];
+    AIpStack::EventLoopFdWatcher m_sock_watcher;
+    AIpStack::EventLoopFdWatcher m_doorbell_watcher;
+    AIpStack::EventLoopTimer m_kick_timer;
+    AIpStack::EventLoopTimer m_rx_timer;
+    ShmRingDeviceLinuxRingCtl *m_tx_ctl;
+    ShmRingDeviceLinuxRingCtl *m_rx_ctl;
+    char *m_tx_slots;
+    char *m_rx_slots;
+    std::size_t m_frame_mtu;
+    std::size_t m_slot_size;
+    std::uint32_t m_ring_size;
+    std::uint32_t m_tx_head;
+    std::uint32_t m_tx_tail;
+    std::uint32_t m_rx_tail;
+    AIpStack::IpRxFlags m_rx_flags;
+    bool m_creator;
+    bool m_listening;
+    bool m_connected;
+    bool m_tx_pending;
+    bool m_active;
+    bool m_tx_blocked;
+};
+
+}
+
+#endif
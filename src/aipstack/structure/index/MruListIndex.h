@@ -116,7 +116,7 @@ public:
         }
         
     private:
-        Ref findFirstNextCommon (LookupKeyArg key, Ref start, State st)
+        Ref findFirstNextCommon (LookupKeyArg key, Ref start, State st) const
         {
             for (Ref e = start; !e.isNull(); e = m_list.next(e, st)) {
                 if (KeyFuncs::KeysAreEqual(KeyFuncs::GetKeyOfEntry(*e), key)) {
@@ -37,8 +37,10 @@ namespace AIpStack {
 
 #if defined(__linux__)
 using TapDevice = TapDeviceLinux;
+using TapDeviceQueueGroup = TapDeviceLinuxQueueGroup;
 #elif defined(_WIN32)
 using TapDevice = TapDeviceWindows;
+using TapDeviceQueueGroup = TapDeviceWindowsQueueGroup;
 #endif
 
 }
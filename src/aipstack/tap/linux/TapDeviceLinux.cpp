@@ -27,6 +27,8 @@
 #include <cerrno>
 #include <cstddef>
 #include <stdexcept>
+#include <algorithm>
+#include <mutex>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -40,17 +42,157 @@
 
 #include <aipstack/misc/Assert.h>
 #include <aipstack/misc/Function.h>
+#include <aipstack/misc/MinMax.h>
 #include <aipstack/proto/EthernetProto.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/proto/Udp4Proto.h>
+#include <aipstack/proto/DhcpProto.h>
+#include <aipstack/ip/IpChksumOffload.h>
 #include <aipstack/tap/linux/TapDeviceLinux.h>
 
 namespace AIpStack {
 
+// The basic virtio-net header (struct virtio_net_hdr, in host byte order) and its
+// constants. These are defined here since <linux/virtio_net.h> cannot be included
+// from C++.
+struct TapVnetHdr {
+    std::uint8_t flags;
+    std::uint8_t gso_type;
+    std::uint16_t hdr_len;
+    std::uint16_t gso_size;
+    std::uint16_t csum_start;
+    std::uint16_t csum_offset;
+};
+
+static std::uint8_t const TapVnetFlagNeedsCsum = 1;
+static std::uint8_t const TapVnetFlagDataValid = 2;
+static std::uint8_t const TapVnetGsoNone = 0;
+static std::uint8_t const TapVnetGsoTcpv4 = 1;
+static std::uint8_t const TapVnetGsoEcn = 0x80;
+
+// Maximum frame size with offload, for TCP frames to be segmented.
+static std::size_t const TapTsoMaxLen = AIpStack::EthHeader::Size + 65535;
+
+// Fill in the virtio-net header for a frame with a partial checksum, or a TCP
+// frame to be segmented (whose checksum is not valid). In the latter case the
+// pseudo-header sum is also written to the frame.
+static bool tap_prepare_offload (
+    char *data, std::size_t len, bool tso, std::uint16_t seg_data_len,
+    TapVnetHdr &vnet_hdr)
+{
+    AIpStack::IpBufNode node{data, len, nullptr};
+    AIpStack::IpBufRef pkt =
+        AIpStack::IpBufRef{&node, 0, len}.hideHeader(AIpStack::EthHeader::Size);
+    
+    std::size_t start;
+    std::size_t offset;
+    if (!AIpStack::IpChksumOffload::getChksumPosition(pkt, start, offset)) {
+        return false;
+    }
+    
+    if (tso) {
+        auto ip4_header = AIpStack::Ip4Header::MakeRef(pkt.getChunkPtr());
+        auto tcp_header = AIpStack::Tcp4Header::MakeRef(pkt.getChunkPtr() + start);
+        std::size_t tcp_len = pkt.tot_len - start;
+        std::size_t tcp_hdr_len = 4 *
+            std::size_t(tcp_header.get(AIpStack::Tcp4Header::OffsetFlags()) >>
+                        AIpStack::TcpOffsetShift);
+        
+        tcp_header.set(AIpStack::Tcp4Header::Checksum(),
+            AIpStack::IpChksumOffload::pseudoHeaderSum(
+                ip4_header.get(AIpStack::Ip4Header::SrcAddr()),
+                ip4_header.get(AIpStack::Ip4Header::DstAddr()),
+                AIpStack::Ip4ProtocolTcp, std::uint16_t(tcp_len)));
+        
+        if (tcp_len - AIpStack::MinValue(tcp_len, tcp_hdr_len) > seg_data_len) {
+            vnet_hdr.gso_type = TapVnetGsoTcpv4;
+            vnet_hdr.gso_size = seg_data_len;
+            vnet_hdr.hdr_len = std::uint16_t(
+                AIpStack::EthHeader::Size + start + tcp_hdr_len);
+        }
+    }
+    
+    vnet_hdr.flags = TapVnetFlagNeedsCsum;
+    vnet_hdr.csum_start = std::uint16_t(AIpStack::EthHeader::Size + start);
+    vnet_hdr.csum_offset = std::uint16_t(offset);
+    
+    return true;
+}
+
+// Check if a received frame needs to be seen by all queues of a multi-queue
+// device: frames to a group (broadcast or multicast) address, ARP, and DHCP
+// messages to the client (which may be unicast).
+static bool tap_frame_is_shared (char *data, std::size_t len)
+{
+    if (len < AIpStack::EthHeader::Size) {
+        return false;
+    }
+    
+    if ((std::uint8_t(data[0]) & 1) != 0) {
+        return true;
+    }
+    
+    auto eth_header = AIpStack::EthHeader::MakeRef(data);
+    std::uint16_t eth_type = eth_header.get(AIpStack::EthHeader::EthType());
+    
+    if (eth_type == AIpStack::EthTypeArp) {
+        return true;
+    }
+    
+    if (eth_type != AIpStack::EthTypeIpv4 ||
+        len < AIpStack::EthHeader::Size + AIpStack::Ip4Header::Size)
+    {
+        return false;
+    }
+    
+    auto ip4_header = AIpStack::Ip4Header::MakeRef(data + AIpStack::EthHeader::Size);
+    std::size_t ip4_header_len = 4 * std::size_t(
+        (ip4_header.get(AIpStack::Ip4Header::VersionIhlDscpEcn()) >> 8) &
+        AIpStack::Ip4IhlMask);
+    std::uint8_t proto = std::uint8_t(ip4_header.get(AIpStack::Ip4Header::TtlProto()));
+    
+    if (proto != AIpStack::Ip4ProtocolUdp ||
+        len < AIpStack::EthHeader::Size + ip4_header_len + AIpStack::Udp4Header::Size)
+    {
+        return false;
+    }
+    
+    auto udp_header = AIpStack::Udp4Header::MakeRef(
+        data + AIpStack::EthHeader::Size + ip4_header_len);
+    
+    return udp_header.get(AIpStack::Udp4Header::DstPort()) == AIpStack::DhcpClientPort;
+}
+
+TapDeviceLinuxQueueGroup::TapDeviceLinuxQueueGroup ()
+{}
+
+TapDeviceLinuxQueueGroup::~TapDeviceLinuxQueueGroup ()
+{
+    AIPSTACK_ASSERT(m_queues.empty())
+}
+
+std::string TapDeviceLinuxQueueGroup::getDeviceName () const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_device_name;
+}
+
 TapDeviceLinux::TapDeviceLinux (
-    AIpStack::EventLoop &loop, std::string const &device_id, FrameReceivedHandler handler)
+    AIpStack::EventLoop &loop, std::string const &device_id, FrameReceivedHandler handler,
+    TxReadyHandler tx_ready_handler, bool offload,
+    TapDeviceLinuxQueueGroup *queue_group)
 :
     m_handler(handler),
+    m_tx_ready_handler(tx_ready_handler),
     m_fd_watcher(loop, AIPSTACK_BIND_MEMBER(&TapDeviceLinux::handleFdEvents, this)),
-    m_active(true)
+    m_vnet_hdr_size(offload ? sizeof(TapVnetHdr) : 0),
+    m_rx_pool(nullptr),
+    m_rx_buf(nullptr),
+    m_queue_group(queue_group),
+    m_shared_signal(loop, AIPSTACK_BIND_MEMBER(&TapDeviceLinux::sharedSignalHandler, this)),
+    m_active(true),
+    m_tx_blocked(false)
 {
     m_fd = AIpStack::FileDescriptorWrapper{::open("/dev/net/tun", O_RDWR)};
     if (!m_fd) {
@@ -62,16 +204,51 @@ TapDeviceLinux::TapDeviceLinux (
     std::string devname_real;
 
     {
+        // With a queue group, the lock ensures that all queues attach to the
+        // device created by the first one.
+        std::unique_lock<std::mutex> group_lock;
+        std::string const *devname = &device_id;
+        if (queue_group != nullptr) {
+            group_lock = std::unique_lock<std::mutex>(queue_group->m_mutex);
+            if (!queue_group->m_device_name.empty()) {
+                devname = &queue_group->m_device_name;
+            }
+        }
+        
         struct ifreq ifr;
         std::memset(&ifr, 0, sizeof(ifr));
         ifr.ifr_flags |= IFF_NO_PI|IFF_TAP;
-        std::snprintf(ifr.ifr_name, IFNAMSIZ, "%s", device_id.c_str());
+        if (offload) {
+            ifr.ifr_flags |= IFF_VNET_HDR;
+        }
+        if (queue_group != nullptr) {
+            ifr.ifr_flags |= IFF_MULTI_QUEUE;
+        }
+        std::snprintf(ifr.ifr_name, IFNAMSIZ, "%s", devname->c_str());
         
         if (::ioctl(*m_fd, TUNSETIFF, reinterpret_cast<void *>(&ifr)) < 0) {
             throw std::runtime_error("ioctl(TUNSETIFF) failed.");
         }
 
         devname_real = ifr.ifr_name;
+        
+        if (queue_group != nullptr) {
+            queue_group->m_device_name = devname_real;
+        }
+    }
+    
+    if (offload) {
+        // Use the basic virtio-net header, and let the kernel send us frames with a
+        // partial checksum and TCP frames which are to be segmented.
+        int hdr_size = int(m_vnet_hdr_size);
+        if (::ioctl(*m_fd, TUNSETVNETHDRSZ, &hdr_size) < 0) {
+            throw std::runtime_error("ioctl(TUNSETVNETHDRSZ) failed.");
+        }
+        
+        unsigned int offload_flags = TUN_F_CSUM|TUN_F_TSO4;
+        if (::ioctl(*m_fd, TUNSETOFFLOAD, offload_flags) < 0) {
+            throw std::runtime_error("ioctl(TUNSETOFFLOAD) failed.");
+        }
     }
     
     {
@@ -91,42 +268,143 @@ TapDeviceLinux::TapDeviceLinux (
         m_frame_mtu = std::size_t(ifr.ifr_mtu) + AIpStack::EthHeader::Size;
     }
     
-    m_read_buffer.resize(m_frame_mtu);
-    m_write_buffer.resize(m_frame_mtu);
+    m_max_frame_len = offload ? AIpStack::MaxValue(m_frame_mtu, TapTsoMaxLen) : m_frame_mtu;
+    
+    m_read_buffer.resize(m_vnet_hdr_size + m_max_frame_len);
+    m_write_buffer.resize(m_vnet_hdr_size + m_max_frame_len);
     
     m_fd_watcher.initFd(*m_fd, AIpStack::EventLoopFdEvents::Read);
+    
+    if (queue_group != nullptr) {
+        std::lock_guard<std::mutex> lock(queue_group->m_mutex);
+        queue_group->m_queues.push_back(this);
+    }
 }
 
 TapDeviceLinux::~TapDeviceLinux ()
-{}
+{
+    // After this, other queues will not pass frames to us.
+    if (m_queue_group != nullptr) {
+        std::lock_guard<std::mutex> lock(m_queue_group->m_mutex);
+        auto &queues = m_queue_group->m_queues;
+        auto it = std::find(queues.begin(), queues.end(), this);
+        if (it != queues.end()) {
+            queues.erase(it);
+        }
+    }
+    
+    setRxBufPool(nullptr);
+}
 
 std::size_t TapDeviceLinux::getMtu () const
 {
     return m_frame_mtu;
 }
 
+AIpStack::IpIfaceOffloadFlags TapDeviceLinux::getOffloadFlags () const
+{
+    return (m_vnet_hdr_size == 0) ? AIpStack::IpIfaceOffloadFlags() :
+        (AIpStack::IpIfaceOffloadFlags::TcpSegmentation |
+         AIpStack::IpIfaceOffloadFlags::TxProtoChksum);
+}
+
+std::size_t TapDeviceLinux::getTsoMaxLen () const
+{
+    return (m_vnet_hdr_size == 0) ? 0 : m_max_frame_len;
+}
+
+void TapDeviceLinux::setRxBufPool (AIpStack::IpPacketBufPool *pool)
+{
+    AIPSTACK_ASSERT(pool == nullptr || (pool->getHeadroom() >= getRxBufHeadroom() &&
+                                        pool->getDataSize() >= getRxBufDataSize()))
+    
+    if (m_rx_buf != nullptr) {
+        m_rx_buf->decRef();
+        m_rx_buf = nullptr;
+    }
+    
+    m_rx_pool = pool;
+}
+
+std::size_t TapDeviceLinux::getRxBufHeadroom () const
+{
+    // The virtio-net header is read just before the frame.
+    return m_vnet_hdr_size;
+}
+
+std::size_t TapDeviceLinux::getRxBufDataSize () const
+{
+    return m_max_frame_len;
+}
+
 AIpStack::IpErr TapDeviceLinux::sendFrame (AIpStack::IpBufRef frame)
+{
+    return send_frame(frame, TxType::Plain, 0);
+}
+
+AIpStack::IpErr TapDeviceLinux::sendChksumFrame (AIpStack::IpBufRef frame)
+{
+    AIPSTACK_ASSERT(m_vnet_hdr_size > 0)
+    
+    return send_frame(frame, TxType::Chksum, 0);
+}
+
+AIpStack::IpErr TapDeviceLinux::sendTsoFrame (
+    AIpStack::IpBufRef frame, std::uint16_t seg_data_len)
+{
+    AIPSTACK_ASSERT(m_vnet_hdr_size > 0)
+    AIPSTACK_ASSERT(seg_data_len > 0)
+    
+    return send_frame(frame, TxType::Tso, seg_data_len);
+}
+
+AIpStack::IpErr TapDeviceLinux::send_frame (
+    AIpStack::IpBufRef frame, TxType type, std::uint16_t seg_data_len)
 {
     if (!m_active) {
         return AIpStack::IpErr::HW_ERROR;
     }
     
+    std::size_t max_len = (type == TxType::Tso) ? m_max_frame_len : m_frame_mtu;
+    
     if (frame.tot_len < AIpStack::EthHeader::Size) {
         return AIpStack::IpErr::HW_ERROR;
     }
-    else if (frame.tot_len > m_frame_mtu) {
+    else if (frame.tot_len > max_len) {
         return AIpStack::IpErr::PKT_TOO_LARGE;
     }
     
+    // The frame follows the virtio-net header (if used).
     char *buffer = m_write_buffer.data();
+    char *data = buffer + m_vnet_hdr_size;
     
     std::size_t len = frame.tot_len;
-    frame.takeBytes(len, buffer);
+    frame.takeBytes(len, data);
+    
+    if (m_vnet_hdr_size > 0) {
+        TapVnetHdr vnet_hdr;
+        std::memset(&vnet_hdr, 0, sizeof(vnet_hdr));
+        
+        if (type != TxType::Plain &&
+            !tap_prepare_offload(data, len, type == TxType::Tso, seg_data_len, vnet_hdr))
+        {
+            return AIpStack::IpErr::HW_ERROR;
+        }
+        
+        std::memcpy(buffer, &vnet_hdr, sizeof(vnet_hdr));
+        len += m_vnet_hdr_size;
+    }
     
     auto write_res = ::write(*m_fd, buffer, len);
     if (write_res < 0) {
         int error = errno;
         if (AIpStack::FileDescriptorWrapper::errIsEAGAINorEWOULDBLOCK(error)) {
+            // Wait until the device is writable again to report that.
+            if (m_tx_ready_handler && !m_tx_blocked) {
+                m_tx_blocked = true;
+                m_fd_watcher.updateEvents(
+                    AIpStack::EventLoopFdEvents::Read|AIpStack::EventLoopFdEvents::Write);
+            }
             return AIpStack::IpErr::BUFFER_FULL;
         }
         return AIpStack::IpErr::HW_ERROR;
@@ -152,7 +430,29 @@ void TapDeviceLinux::handleFdEvents (AIpStack::EventLoopFdEvents events)
             goto error;
         }
         
-        auto read_res = ::read(*m_fd, m_read_buffer.data(), m_frame_mtu);
+        // Writing is possible again after it failed, stop waiting for that and
+        // report it.
+        if ((events & AIpStack::EventLoopFdEvents::Write) != AIpStack::EnumZero &&
+            m_tx_blocked)
+        {
+            m_tx_blocked = false;
+            m_fd_watcher.updateEvents(AIpStack::EventLoopFdEvents::Read);
+            m_tx_ready_handler();
+        }
+        
+        if ((events & AIpStack::EventLoopFdEvents::Read) == AIpStack::EnumZero) {
+            return;
+        }
+        
+        // Use a buffer from the pool if possible; the same one is used until a
+        // frame in it is kept by the receiver.
+        if (m_rx_pool != nullptr && m_rx_buf == nullptr) {
+            m_rx_buf = m_rx_pool->alloc();
+        }
+        char *read_buf = (m_rx_buf != nullptr) ?
+            m_rx_buf->getData() - m_vnet_hdr_size : m_read_buffer.data();
+        
+        auto read_res = ::read(*m_fd, read_buf, m_read_buffer.size());
         if (read_res <= 0) {
             bool is_error = false;
             if (read_res < 0) {
@@ -166,15 +466,58 @@ void TapDeviceLinux::handleFdEvents (AIpStack::EventLoopFdEvents events)
             return;
         }
         
-        AIPSTACK_ASSERT(std::size_t(read_res) <= m_frame_mtu)
+        AIPSTACK_ASSERT(std::size_t(read_res) <= m_read_buffer.size())
         
-        AIpStack::IpBufNode node{
-            m_read_buffer.data(),
-            std::size_t(read_res),
-            nullptr
-        };
+        std::size_t len = std::size_t(read_res);
+        AIpStack::IpRxFlags rx_flags = AIpStack::IpRxFlags();
         
-        m_handler(AIpStack::IpBufRef{&node, 0, std::size_t(read_res)});
+        if (m_vnet_hdr_size > 0) {
+            if (len < m_vnet_hdr_size) {
+                return;
+            }
+            
+            TapVnetHdr vnet_hdr;
+            std::memcpy(&vnet_hdr, read_buf, sizeof(vnet_hdr));
+            len -= m_vnet_hdr_size;
+            
+            // A frame from the host which is not checksummed (only locally
+            // generated frames are like that) is treated as verified by the stack.
+            if ((vnet_hdr.flags & TapVnetFlagNeedsCsum) != 0) {
+                rx_flags |= AIpStack::IpRxFlags::ProtoChksumPartial;
+            }
+            else if ((vnet_hdr.flags & TapVnetFlagDataValid) != 0) {
+                rx_flags |= AIpStack::IpRxFlags::ProtoChksumVerified;
+            }
+            
+            // TCP frames which are to be segmented are processed by the stack
+            // as single large segments. Other kinds are not enabled.
+            int gso_type = vnet_hdr.gso_type & ~TapVnetGsoEcn;
+            if (gso_type != TapVnetGsoNone &&
+                gso_type != TapVnetGsoTcpv4)
+            {
+                return;
+            }
+        }
+        
+        char *frame_data = read_buf + m_vnet_hdr_size;
+        
+        if (m_queue_group != nullptr && tap_frame_is_shared(frame_data, len)) {
+            pass_shared_frame(frame_data, len, rx_flags);
+        }
+        
+        if (m_rx_buf != nullptr) {
+            AIpStack::IpPacketBuf *buf = m_rx_buf;
+            m_handler(buf->getRef(len), rx_flags, buf->rxHold());
+            
+            // If the receiver kept the buffer, leave it to the receiver.
+            if (buf->isHeld() || buf->getRefCount() > 1) {
+                m_rx_buf = nullptr;
+                buf->decRef();
+            }
+        } else {
+            AIpStack::IpBufNode node{frame_data, len, nullptr};
+            m_handler(AIpStack::IpBufRef{&node, 0, len}, rx_flags, nullptr);
+        }
     } while (false);
     
     return;
@@ -184,4 +527,40 @@ error:
     m_active = false;
 }
 
+void TapDeviceLinux::pass_shared_frame (
+    char const *data, std::size_t len, AIpStack::IpRxFlags rx_flags)
+{
+    std::lock_guard<std::mutex> lock(m_queue_group->m_mutex);
+    
+    for (TapDeviceLinux *queue : m_queue_group->m_queues) {
+        // Frames are dropped if a queue is not keeping up.
+        if (queue == this || queue->m_shared_frames.size() >= MaxSharedFrames) {
+            continue;
+        }
+        
+        queue->m_shared_frames.push_back(SharedFrame{
+            std::vector<char>(data, data + len), rx_flags});
+        queue->m_shared_signal.signal();
+    }
+}
+
+void TapDeviceLinux::sharedSignalHandler ()
+{
+    std::vector<SharedFrame> frames;
+    {
+        std::lock_guard<std::mutex> lock(m_queue_group->m_mutex);
+        frames.swap(m_shared_frames);
+    }
+    
+    if (!m_active) {
+        return;
+    }
+    
+    for (SharedFrame &frame : frames) {
+        AIpStack::IpBufNode node{frame.data.data(), frame.data.size(), nullptr};
+        m_handler(AIpStack::IpBufRef{&node, 0, frame.data.size()}, frame.rx_flags,
+                  nullptr);
+    }
+}
+
 }
@@ -26,44 +26,145 @@
 #define AIPSTACK_TAP_DEVICE_LINUX_H
 
 #include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
+#include <mutex>
 
 #include <aipstack/misc/NonCopyable.h>
 #include <aipstack/misc/Function.h>
 #include <aipstack/misc/platform_specific/FileDescriptorWrapper.h>
 #include <aipstack/infra/Err.h>
 #include <aipstack/infra/Buf.h>
+#include <aipstack/infra/RxBufHold.h>
+#include <aipstack/infra/PacketBufPool.h>
+#include <aipstack/ip/IpStackTypes.h>
 #include <aipstack/event_loop/EventLoop.h>
 
 namespace AIpStack {
 
+class TapDeviceLinux;
+
+// Shared state of the queues of a multi-queue TAP device (IFF_MULTI_QUEUE).
+// Each queue is a TapDeviceLinux constructed with the same group, normally each
+// with its own event loop (thread) and IpStack. The kernel distributes received
+// frames among the queues by flow hash, and replies to a flow go to the queue
+// which sent into it. Frames which the stack of every queue needs to see
+// (broadcast and multicast frames, ARP and DHCP client traffic) are passed to
+// all queues. The group must outlive its queues.
+class TapDeviceLinuxQueueGroup :
+    private AIpStack::NonCopyable<TapDeviceLinuxQueueGroup>
+{
+    friend class TapDeviceLinux;
+
+public:
+    TapDeviceLinuxQueueGroup ();
+
+    ~TapDeviceLinuxQueueGroup ();
+
+    // Name of the device, known after the first queue has been created.
+    std::string getDeviceName () const;
+
+private:
+    mutable std::mutex m_mutex;
+    std::string m_device_name;
+    std::vector<TapDeviceLinux *> m_queues;
+};
+
 class TapDeviceLinux :
     private AIpStack::NonCopyable<TapDeviceLinux>
 {
 public:
-    using FrameReceivedHandler = Function<void(AIpStack::IpBufRef frame)>;
+    // The hold is given for frames in buffers from the receive pool (see
+    // setRxBufPool) and may be passed on to the stack, otherwise it is null.
+    using FrameReceivedHandler = Function<void(AIpStack::IpBufRef frame,
+        AIpStack::IpRxFlags rx_flags, AIpStack::IpRxBufHold *hold)>;
+    using TxReadyHandler = Function<void()>;
 
+    // If offload is true, the device is opened with a virtio-net header
+    // (IFF_VNET_HDR), so that partial-checksum frames and TCP frames to be
+    // segmented can be exchanged with the kernel. Received frames may then be
+    // larger than the MTU (up to getTsoMaxLen).
+    //
+    // If queue_group is given, the device is opened in multi-queue mode and this
+    // object is one of its queues, see TapDeviceLinuxQueueGroup. The device_id
+    // is then only used for the first queue of the group.
     TapDeviceLinux (AIpStack::EventLoop &loop, std::string const &device_id,
-                    FrameReceivedHandler handler);
+                    FrameReceivedHandler handler,
+                    TxReadyHandler tx_ready_handler = nullptr,
+                    bool offload = false,
+                    TapDeviceLinuxQueueGroup *queue_group = nullptr);
     
     ~TapDeviceLinux ();
     
     std::size_t getMtu () const;
 
+    // Offload features for EthIfaceDriverParams::offload_flags.
+    AIpStack::IpIfaceOffloadFlags getOffloadFlags () const;
+
+    // Maximum frame size for sendTsoFrame.
+    std::size_t getTsoMaxLen () const;
+
     AIpStack::IpErr sendFrame (AIpStack::IpBufRef frame);
 
+    // These may only be used if getOffloadFlags includes the respective flag,
+    // see EthIfaceDriverParams::send_chksum_frame and send_tso_frame.
+    AIpStack::IpErr sendChksumFrame (AIpStack::IpBufRef frame);
+
+    AIpStack::IpErr sendTsoFrame (AIpStack::IpBufRef frame, std::uint16_t seg_data_len);
+
+    // Read frames directly into buffers from the pool (or stop doing that if the
+    // pool is null), so that the receiver can keep them without copying. The
+    // buffers must have at least getRxBufHeadroom bytes of headroom and
+    // getRxBufDataSize bytes of data space. When the pool has no free buffers,
+    // frames are received into the internal buffer as without a pool. The pool
+    // must outlive this object or be unset before it is destructed.
+    void setRxBufPool (AIpStack::IpPacketBufPool *pool);
+
+    std::size_t getRxBufHeadroom () const;
+
+    std::size_t getRxBufDataSize () const;
+
 private:
+    enum class TxType {Plain, Chksum, Tso};
+
+    // Maximum number of frames from other queues waiting to be processed.
+    static std::size_t const MaxSharedFrames = 64;
+
+    struct SharedFrame {
+        std::vector<char> data;
+        AIpStack::IpRxFlags rx_flags;
+    };
+
+    AIpStack::IpErr send_frame (AIpStack::IpBufRef frame, TxType type,
+                                std::uint16_t seg_data_len);
+
     void handleFdEvents (AIpStack::EventLoopFdEvents events);
 
+    void pass_shared_frame (char const *data, std::size_t len,
+                            AIpStack::IpRxFlags rx_flags);
+
+    void sharedSignalHandler ();
+
 private:
     FrameReceivedHandler m_handler;
+    TxReadyHandler m_tx_ready_handler;
     AIpStack::FileDescriptorWrapper m_fd;
     AIpStack::EventLoopFdWatcher m_fd_watcher;
     std::size_t m_frame_mtu;
+    std::size_t m_max_frame_len;
+    std::size_t m_vnet_hdr_size;
     std::vector<char> m_read_buffer;
+    AIpStack::IpPacketBufPool *m_rx_pool;
+    // Buffer from m_rx_pool for the next frame, reused until it is kept.
+    AIpStack::IpPacketBuf *m_rx_buf;
     std::vector<char> m_write_buffer;
-    bool m_active;    
+    TapDeviceLinuxQueueGroup *m_queue_group;
+    AIpStack::EventLoopAsyncSignal m_shared_signal;
+    // Frames from other queues, protected by the group mutex.
+    std::vector<SharedFrame> m_shared_frames;
+    bool m_active;
+    bool m_tx_blocked;
 };
 
 }
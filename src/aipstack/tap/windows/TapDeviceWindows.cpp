@@ -73,14 +73,21 @@ void TapDeviceWindows::IoUnit::iocpNotifierHandler ()
 }
 
 TapDeviceWindows::TapDeviceWindows (
-    EventLoop &loop, std::string const &device_id, FrameReceivedHandler handler)
+    EventLoop &loop, std::string const &device_id, FrameReceivedHandler handler,
+    TxReadyHandler tx_ready_handler, bool, TapDeviceWindowsQueueGroup *queue_group)
 :
     m_handler(handler),
+    m_tx_ready_handler(tx_ready_handler),
     m_send_first(0),
     m_send_count(0),
+    m_tx_blocked(false),
     m_send_units(ResourceArrayInitSame(), std::ref(loop), std::ref(*this)),
     m_recv_unit(loop, *this)
 {
+    if (queue_group != nullptr) {
+        throw std::runtime_error("Multi-queue TAP is not supported.");
+    }
+    
     std::string component_id;
     std::string device_name;
     if (!tapwin_parse_tap_spec(device_id, component_id, device_name)) {
@@ -152,6 +159,7 @@ IpErr TapDeviceWindows::sendFrame (IpBufRef frame)
     
     if (m_send_count >= NumSendUnits) {
         //std::fprintf(stderr, "TAP send: out of buffers\n");
+        m_tx_blocked = true;
         return IpErr::BUFFER_FULL;
     }
     
@@ -227,6 +235,14 @@ void TapDeviceWindows::sendCompleted (IoUnit &send_unit)
         m_send_first = Modulo(NumSendUnits).inc(m_send_first);
         m_send_count--;
     }
+    
+    // If sending failed due to no free send units, report when there is one.
+    if (m_tx_blocked && m_send_count < NumSendUnits) {
+        m_tx_blocked = false;
+        if (m_tx_ready_handler) {
+            m_tx_ready_handler();
+        }
+    }
 }
 
 void TapDeviceWindows::recvCompleted (IoUnit &recv_unit)
@@ -248,7 +264,7 @@ void TapDeviceWindows::recvCompleted (IoUnit &recv_unit)
     
     IpBufNode node{buffer, (std::size_t)bytes, nullptr};
     
-    m_handler(IpBufRef{&node, 0, (std::size_t)bytes});
+    m_handler(IpBufRef{&node, 0, (std::size_t)bytes}, IpRxFlags(), nullptr);
     
     startRecv();
 }
@@ -26,6 +26,7 @@
 #define AIPSTACK_TAP_DEVICE_WINDOWS_H
 
 #include <cstddef>
+#include <cstdint>
 #include <string>
 #include <memory>
 #include <vector>
@@ -37,10 +38,20 @@
 #include <aipstack/misc/ResourceArray.h>
 #include <aipstack/infra/Err.h>
 #include <aipstack/infra/Buf.h>
+#include <aipstack/infra/RxBufHold.h>
+#include <aipstack/infra/PacketBufPool.h>
+#include <aipstack/ip/IpStackTypes.h>
 #include <aipstack/event_loop/EventLoop.h>
 
 namespace AIpStack {
 
+// Multi-queue devices are not supported by the TAP-Windows driver. This exists
+// for compatibility with TapDeviceLinuxQueueGroup; a TapDeviceWindows cannot be
+// constructed with a queue group.
+class TapDeviceWindowsQueueGroup :
+    private NonCopyable<TapDeviceWindowsQueueGroup>
+{};
+
 class TapDeviceWindows :
     private NonCopyable<TapDeviceWindows>
 {
@@ -66,10 +77,19 @@ class TapDeviceWindows :
     };
     
 public:
-    using FrameReceivedHandler = Function<void(AIpStack::IpBufRef frame)>;
+    // The hold is always null, see setRxBufPool.
+    using FrameReceivedHandler = Function<void(AIpStack::IpBufRef frame,
+        AIpStack::IpRxFlags rx_flags, AIpStack::IpRxBufHold *hold)>;
+    using TxReadyHandler = Function<void()>;
     
+    // Offload is not supported by the TAP-Windows driver, the offload argument
+    // is accepted for compatibility with TapDeviceLinux and ignored. The
+    // queue_group must be null.
     TapDeviceWindows (EventLoop &loop, std::string const &device_id,
-                      FrameReceivedHandler handler);
+                      FrameReceivedHandler handler,
+                      TxReadyHandler tx_ready_handler = nullptr,
+                      bool offload = false,
+                      TapDeviceWindowsQueueGroup *queue_group = nullptr);
 
     ~TapDeviceWindows ();
     
@@ -77,8 +97,37 @@ public:
         return m_frame_mtu;
     }
 
+    IpIfaceOffloadFlags getOffloadFlags () const {
+        return IpIfaceOffloadFlags();
+    }
+
+    std::size_t getTsoMaxLen () const {
+        return 0;
+    }
+
     IpErr sendFrame (IpBufRef frame);
     
+    // Never used since no offload features are reported.
+    IpErr sendChksumFrame (IpBufRef) {
+        return IpErr::HW_ERROR;
+    }
+
+    IpErr sendTsoFrame (IpBufRef, std::uint16_t) {
+        return IpErr::HW_ERROR;
+    }
+
+    // Frames are received with overlapped I/O into buffers of the receive unit,
+    // the pool is accepted for compatibility with TapDeviceLinux and ignored.
+    void setRxBufPool (IpPacketBufPool *) {}
+
+    std::size_t getRxBufHeadroom () const {
+        return 0;
+    }
+
+    std::size_t getRxBufDataSize () const {
+        return m_frame_mtu;
+    }
+    
 private:
     bool startRecv ();
     void sendCompleted (IoUnit &send_unit);
@@ -86,10 +135,12 @@ private:
     
 private:
     FrameReceivedHandler m_handler;
+    TxReadyHandler m_tx_ready_handler;
     std::shared_ptr<WinHandleWrapper> m_device;
     std::size_t m_frame_mtu;
     std::size_t m_send_first;
     std::size_t m_send_count;
+    bool m_tx_blocked;
     ResourceArray<IoUnit, NumSendUnits> m_send_units;
     IoUnit m_recv_unit;    
 };
@@ -42,6 +42,7 @@
 #include <aipstack/misc/ResourceArray.h>
 #include <aipstack/misc/NonCopyable.h>
 #include <aipstack/misc/OneOf.h>
+#include <aipstack/misc/Trace.h>
 #include <aipstack/structure/LinkedList.h>
 #include <aipstack/structure/LinkModel.h>
 #include <aipstack/structure/StructureRaiiWrapper.h>
@@ -76,7 +77,8 @@ class IpTcpProto :
 {
     AIPSTACK_USE_VALS(Arg::Params, (TcpTTL, NumTcpPcbs, NumOosSegs,
                                     EphemeralPortFirst, EphemeralPortLast,
-                                    LinkWithArrayIndices))
+                                    LinkWithArrayIndices, PmtuProbing,
+                                    SegmentationOffload))
     AIPSTACK_USE_TYPES(Arg::Params, (PcbIndexService))
     AIPSTACK_USE_TYPES(Arg, (PlatformImpl, StackArg))
     
@@ -190,12 +192,14 @@ class IpTcpProto :
      * AbrtTimer: for aborting PCB (TIME_WAIT, abandonment)
      * OutputTimer: for pcb_output after send buffer extension
      * RtxTimer: for retransmission, window probe and cwnd idle reset
+     * PmtuTimer: for restarting the Path MTU search (PmtuProbing)
      */
     struct AbrtTimer {};
     struct OutputTimer {};
     struct RtxTimer {};
+    struct PmtuTimer {};
     using PcbMultiTimer = MultiTimer<PlatformImpl, TcpPcb, MultiTimerUserData,
-                                     AbrtTimer, OutputTimer, RtxTimer>;
+                                     AbrtTimer, OutputTimer, RtxTimer, PmtuTimer>;
     
     /**
      * A TCP Protocol Control Block.
@@ -346,6 +350,11 @@ class IpTcpProto :
             Output::pcb_rtx_timer_handler(this);
         }
         
+        inline void timerExpired (PmtuTimer)
+        {
+            Output::pcb_pmtu_timer_handler(this);
+        }
+        
         // Send retry callback.
         void retrySending () override final { Output::pcb_send_retry(this); }
     };
@@ -429,6 +438,7 @@ private:
         AIPSTACK_ASSERT(!pcb->tim(AbrtTimer()).isSet())
         AIPSTACK_ASSERT(!pcb->tim(OutputTimer()).isSet())
         AIPSTACK_ASSERT(!pcb->tim(RtxTimer()).isSet())
+        AIPSTACK_ASSERT(!pcb->tim(PmtuTimer()).isSet())
         AIPSTACK_ASSERT(!pcb->IpSendRetryRequest::isActive())
         AIPSTACK_ASSERT(pcb->tcp == this)
         AIPSTACK_ASSERT(pcb->state == TcpState::CLOSED)
@@ -451,6 +461,8 @@ private:
         AIPSTACK_ASSERT(pcb->state != TcpState::CLOSED)
         IpTcpProto *tcp = pcb->tcp;
         
+        AIPSTACK_TRACE(TcpAbort, pcb->local_port, pcb->state, send_rst)
+        
         // Send RST if desired.
         if (send_rst) {
             Output::pcb_send_rst(pcb);
@@ -488,6 +500,7 @@ private:
         // Reset other relevant fields to initial state.
         pcb->PcbMultiTimer::unsetAll();
         pcb->IpSendRetryRequest::reset();
+        pcb->setTxPriority(0);
         pcb->state = TcpState::CLOSED;
         
         tcp->pcb_assert_closed(pcb);
@@ -777,6 +790,8 @@ private:
         // Add the PCB to the active index.
         m_pcb_index_active.addEntry({*pcb, *this}, *this);
         
+        m_stack->stats().tcp_active_opens.inc();
+        
         // Start the connection timeout.
         pcb->tim(AbrtTimer()).setAfter(Constants::SynSentTimeoutTicks);
         
@@ -915,6 +930,8 @@ struct IpTcpProtoOptions {
     AIPSTACK_OPTION_DECL_VALUE(EphemeralPortLast, uint16_t, 65535)
     AIPSTACK_OPTION_DECL_TYPE(PcbIndexService, void)
     AIPSTACK_OPTION_DECL_VALUE(LinkWithArrayIndices, bool, true)
+    AIPSTACK_OPTION_DECL_VALUE(PmtuProbing, bool, false)
+    AIPSTACK_OPTION_DECL_VALUE(SegmentationOffload, bool, false)
 };
 
 template <typename... Options>
@@ -929,6 +946,8 @@ class IpTcpProtoService {
     AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, EphemeralPortLast)
     AIPSTACK_OPTION_CONFIG_TYPE(IpTcpProtoOptions, PcbIndexService)
     AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, LinkWithArrayIndices)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, PmtuProbing)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, SegmentationOffload)
     
 public:
     // This tells IpStack which IP protocol we receive packets for.
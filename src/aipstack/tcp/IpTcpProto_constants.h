@@ -124,6 +124,22 @@ public:
     // Number of bits needed to represent the maximum supported duplicate ACK count.
     static int const DupAckBits = BitsInInt<FastRtxDupAcks + MaxAdditionaDupAcks>::Value;
     
+    // Path MTU probing: number of lost probes of one size after which the size is
+    // assumed to exceed the Path MTU (MAX_PROBES in RFC 8899).
+    static uint8_t const PmtuMaxProbes = 3;
+    
+    // Path MTU probing: the search is complete when the range of possible
+    // Path MTUs above the current estimate is smaller than this.
+    static uint16_t const PmtuSearchGranularity = 32;
+    
+    // Path MTU probing: the Path MTU which is assumed to work initially, this
+    // is fallen back to when a black hole is detected (BASE_PLPMTU in RFC 8899).
+    static uint16_t const PmtuBaseMtu = MaxValue(IpStack<StackArg>::MinMTU, uint16_t(1200));
+    
+    // Path MTU probing: time after the search has stopped to restarting it from
+    // the current Path MTU (PMTU_RAISE_TIMER in RFC 8899).
+    static TimeType const PmtuRaiseTimeTicks = 600.0 * Platform::TimeFreq;
+    
     // Window scale shift count to send and use in outgoing ACKs.
     static uint8_t const RcvWndShift = 6;
     static_assert(RcvWndShift <= 14, "");
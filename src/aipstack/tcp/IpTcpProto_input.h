@@ -36,6 +36,7 @@
 #include <aipstack/misc/MinMax.h>
 #include <aipstack/misc/BinaryTools.h>
 #include <aipstack/misc/OneOf.h>
+#include <aipstack/misc/Trace.h>
 #include <aipstack/infra/Buf.h>
 #include <aipstack/infra/Chksum.h>
 #include <aipstack/proto/Ip4Proto.h>
@@ -74,8 +75,14 @@ public:
             return;
         }
         
+        IpStackStats &stats = tcp->m_stack->stats();
+        stats.tcp_in_segs.inc();
+        
         // Check header size, must fit in first buffer.
         if (AIPSTACK_UNLIKELY(!dgram.hasHeader(Tcp4Header::Size))) {
+            stats.tcp_in_errs.inc();
+            AIPSTACK_TRACE(TcpRxDrop, TraceDropReason::BadHeader, ip_info.src_addr.data[0],
+                           dgram.tot_len)
             return;
         }
         
@@ -89,15 +96,21 @@ public:
         tcp_meta.ack_num     = tcp_header.get(Tcp4Header::AckNum());
         tcp_meta.flags       = tcp_header.get(Tcp4Header::OffsetFlags());
         tcp_meta.window_size = tcp_header.get(Tcp4Header::WindowSize());
-        
-        // Check TCP checksum.
-        IpChksumAccumulator chksum_accum;
-        chksum_accum.addWords(&ip_info.src_addr.data);
-        chksum_accum.addWords(&ip_info.dst_addr.data);
-        chksum_accum.addWord(WrapType<uint16_t>(), Ip4ProtocolTcp);
-        chksum_accum.addWord(WrapType<uint16_t>(), uint16_t(dgram.tot_len));
-        if (AIPSTACK_UNLIKELY(chksum_accum.getChksum(dgram) != 0)) {
-            return;
+        tcp_meta.num_segs    = ip_info.num_segs;
+        
+        // Check TCP checksum, unless it has been verified already.
+        if ((ip_info.rx_flags & IpRxFlags::ProtoChksumVerified) == EnumZero) {
+            IpChksumAccumulator chksum_accum;
+            chksum_accum.addWords(&ip_info.src_addr.data);
+            chksum_accum.addWords(&ip_info.dst_addr.data);
+            chksum_accum.addWord(WrapType<uint16_t>(), Ip4ProtocolTcp);
+            chksum_accum.addWord(WrapType<uint16_t>(), uint16_t(dgram.tot_len));
+            if (AIPSTACK_UNLIKELY(chksum_accum.getChksum(dgram) != 0)) {
+                stats.tcp_in_errs.inc();
+                AIPSTACK_TRACE(TcpRxDrop, TraceDropReason::BadChecksum,
+                               ip_info.src_addr.data[0], dgram.tot_len)
+                return;
+            }
         }
         
         // Get a buffer reference starting at the option data.
@@ -113,6 +126,9 @@ public:
         // The former bound is checked indirectly since opts_len would have
         // wrapped around.
         if (AIPSTACK_UNLIKELY(opts_len > tcp_data.tot_len)) {
+            stats.tcp_in_errs.inc();
+            AIPSTACK_TRACE(TcpRxDrop, TraceDropReason::BadHeader, ip_info.src_addr.data[0],
+                           dgram.tot_len)
             return;
         }
         
@@ -365,6 +381,11 @@ public:
         pcb->setFlag(PcbFlags::CWND_INIT);
         con->m_v.ssthresh = Constants::MaxWindow;
         con->m_v.cwnd_acked = 0;
+        
+        // Start the Path MTU search.
+        if (TcpProto::PmtuProbing) {
+            Output::pcb_pmtu_search_init(pcb);
+        }
     }
     
 private:
@@ -455,6 +476,8 @@ private:
             AIPSTACK_ASSERT(lis->m_num_pcbs < TypeMax<int>())
             lis->m_num_pcbs++;
             
+            tcp->m_stack->stats().tcp_passive_opens.inc();
+            
             // Add the PCB to the active index.
             tcp->m_pcb_index_active.addEntry({*pcb, *tcp}, *tcp);
             
@@ -543,7 +566,9 @@ private:
         
         if (AIPSTACK_LIKELY(accepting_data_in_state(pcb->state))) {
             // Process received data or FIN.
-            if (!pcb_input_rcv_processing(pcb, eff_rel_seq, seg_fin, tcp_data)) {
+            if (!pcb_input_rcv_processing(pcb, eff_rel_seq, seg_fin, tcp_data,
+                                          tcp_meta.num_segs))
+            {
                 return;
             }
         }
@@ -1148,7 +1173,7 @@ private:
     }
     
     static bool pcb_input_rcv_processing (TcpPcb *pcb, SeqType eff_rel_seq, bool seg_fin,
-                                          IpBufRef const &tcp_data)
+                                          IpBufRef const &tcp_data, uint16_t num_segs)
     {
         AIPSTACK_ASSERT(accepting_data_in_state(pcb->state))
         
@@ -1245,6 +1270,15 @@ private:
             if (rcv_datalen > 0) {
                 con->m_v.rcv_buf.skipBytes(rcv_datalen);
             }
+            // If this was a segment combined by receive coalescing and there is
+            // still a gap, send a duplicate ACK for each of the combined segments
+            // (the last one via ACK_PENDING), so that the peer sees as many
+            // duplicate ACKs as without coalescing and can do fast retransmit.
+            else if (AIPSTACK_UNLIKELY(num_segs > 1) && need_ack) {
+                for (uint16_t i = 1; i < num_segs; i++) {
+                    Output::pcb_send_empty_ack(pcb);
+                }
+            }
         }
         
         // Compute the amount of processed sequence numbers. Note that rcv_fin
@@ -33,12 +33,14 @@
 #include <aipstack/misc/Hints.h>
 #include <aipstack/misc/MinMax.h>
 #include <aipstack/misc/OneOf.h>
+#include <aipstack/misc/Trace.h>
 #include <aipstack/infra/Buf.h>
 #include <aipstack/infra/Chksum.h>
 #include <aipstack/infra/TxAllocHelper.h>
 #include <aipstack/infra/Err.h>
 #include <aipstack/proto/Tcp4Proto.h>
 #include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpChksumOffload.h>
 #include <aipstack/tcp/TcpUtils.h>
 
 namespace AIpStack {
@@ -57,13 +59,17 @@ class IpTcpProto_output
     AIPSTACK_USE_VALS(TcpUtils, (seq_add, seq_diff, seq_lt2, seq_add_sat, tcplen,
                                  can_output_in_state, snd_open_in_state))
     AIPSTACK_USE_TYPES(TcpProto, (TcpPcb, PcbFlags, Input, TimeType, Constants, OutputTimer,
-                                  RtxTimer, StackArg, Connection, PcbKey))
+                                  RtxTimer, PmtuTimer, StackArg, Connection, PcbKey))
     AIPSTACK_USE_TYPES(Constants, (RttType, RttNextType))
+    AIPSTACK_USE_VALS(TcpProto, (PmtuProbing, SegmentationOffload))
     AIPSTACK_USE_VALS(IpStack<StackArg>, (HeaderBeforeIp4Dgram))
     using MtuRef = IpMtuRef<StackArg>;
 
     static RttType const RttTypeMax = TypeMax<RttType>();
     
+    // Result of pcb_pmtu_probe_action.
+    enum class PmtuProbeAction {Regular, Probe, Wait};
+    
 public:
     // Check if our FIN has been ACKed.
     static bool pcb_fin_acked (TcpPcb *pcb)
@@ -320,10 +326,42 @@ public:
         // queued, and there is some window availabe. But for the case
         // of rtx_or_window_probe, this condition is always true.
         while ((snd_buf_cur->tot_len > data_threshold || fin) && rem_wnd > 0) {
+            // Determine the segment size, this is snd_mss except when a
+            // Path MTU probe is to be sent or during a black hole test.
+            uint16_t seg_mss = pcb->snd_mss;
+            size_t seg_max = seg_mss;
+            bool pmtu_probe = false;
+            if (PmtuProbing && AIPSTACK_UNLIKELY(con->m_v.pmtu_probe_size != 0 ||
+                                                 con->m_v.pmtu_bh_test) &&
+                !rtx_or_window_probe)
+            {
+                if (con->m_v.pmtu_bh_test) {
+                    seg_mss = con->m_v.pmtu_probe_low - Ip4TcpHeaderSize;
+                    seg_max = seg_mss;
+                } else {
+                    PmtuProbeAction action = pcb_pmtu_probe_action(pcb, rem_wnd);
+                    if (action == PmtuProbeAction::Wait) {
+                        break;
+                    }
+                    if (action == PmtuProbeAction::Probe) {
+                        seg_mss = con->m_v.pmtu_probe_size - Ip4TcpHeaderSize;
+                        seg_max = seg_mss;
+                        pmtu_probe = true;
+                    }
+                }
+            }
+            
+            // With segmentation offload, send multiple full segments as one
+            // large packet which is split into segments further down.
+            if (SegmentationOffload && seg_mss == pcb->snd_mss && !rtx_or_window_probe) {
+                seg_max = pcb_output_offload_len(
+                    pcb, snd_buf_cur->tot_len, rem_wnd, data_threshold);
+            }
+            
             // Send a segment.
             SeqType seg_seqlen;
-            IpErr err = pcb_output_segment(
-                pcb, output_helper, *snd_buf_cur, fin, rem_wnd, &seg_seqlen);
+            IpErr err = pcb_output_segment(pcb, output_helper, *snd_buf_cur, fin,
+                                           rem_wnd, seg_mss, seg_max, &seg_seqlen);
             
             // If we got the FRAG_NEEDED error, make sure the Path MTU estimate
             // does not exceed the interface MTU, to handle lowering of the
@@ -351,6 +389,14 @@ public:
             AIPSTACK_ASSERT(seg_seqlen <= rem_wnd)
             AIPSTACK_ASSERT(seg_seqlen <= snd_buf_cur->tot_len + fin)
             
+            // If this was a Path MTU probe, remember where it ends so that
+            // we can recognize when it is acknowledged.
+            if (PmtuProbing && AIPSTACK_UNLIKELY(pmtu_probe)) {
+                con->m_v.pmtu_probe_end = pcb->snd_nxt;
+                con->m_v.pmtu_probe_sent = true;
+                pcb->tcp->m_stack->stats().tcp_pmtu_probes.inc();
+            }
+            
             // Check sent sequence length to see if a FIN was sent.
             size_t data_sent;
             if (AIPSTACK_UNLIKELY(seg_seqlen > snd_buf_cur->tot_len)) {
@@ -544,6 +590,8 @@ public:
             }
             con->m_v.cwnd_acked = 0;
             
+            AIPSTACK_TRACE(TcpIdleCwndReset, pcb->local_port, con->m_v.cwnd, 0)
+            
             // This is all, the remainder of this function is for retransmission.
             return;
         }
@@ -570,6 +618,8 @@ public:
         pcb->rto = MinValue(Constants::MaxRtxTime, doubled_rto);
         pcb->tim(RtxTimer()).setAfter(pcb_rto_time(pcb));
         
+        AIPSTACK_TRACE(TcpRtoFired, pcb->local_port, pcb->rto, pcb->snd_una)
+        
         // In SYN_SENT and SYN_RCVD, only retransmit the SYN or SYN-ACK.
         if (syn_sent_rcvd) {
             pcb_send_syn(pcb);
@@ -596,6 +646,10 @@ public:
                 // Update ssthresh (RFC 5681).
                 pcb_update_ssthresh_for_rtx(pcb);
             }
+            // For repeated retransmissions, test for a Path MTU black hole.
+            else if (PmtuProbing) {
+                pcb_pmtu_check_black_hole(pcb);
+            }
             
             // Set cwnd to one segment (RFC 5681).
             // Also reset cwnd_acked to avoid old accumulated value
@@ -745,6 +799,19 @@ public:
         {
             pcb->clearFlag(PcbFlags::RECOVER);
         }
+        
+        // If the small segments of a black hole test are being ACKed while
+        // the full-sized segments before them were not, assume a black hole.
+        if (PmtuProbing && con != nullptr && AIPSTACK_UNLIKELY(con->m_v.pmtu_bh_test)) {
+            pcb_pmtu_black_hole_found(pcb);
+        }
+        
+        // Check if an outstanding Path MTU probe has been ACKed.
+        if (PmtuProbing && con != nullptr && AIPSTACK_UNLIKELY(con->m_v.pmtu_probe_sent) &&
+            !seq_lt2(ack_num, con->m_v.pmtu_probe_end))
+        {
+            pcb_pmtu_probe_acked(pcb);
+        }
     }
     
     // Called from Input when the number of duplicate ACKs has
@@ -781,6 +848,8 @@ public:
             con->m_v.cwnd = seq_add_sat(con->m_v.ssthresh, three_mss);
             pcb->clearFlag(PcbFlags::CWND_INIT);
             
+            AIPSTACK_TRACE(TcpFastRtx, pcb->local_port, con->m_v.cwnd, con->m_v.ssthresh)
+            
             // Schedule output due to possible CWND increase.
             pcb->setFlag(PcbFlags::OUT_PENDING);
         }
@@ -845,8 +914,8 @@ public:
     }
     
     // This is called from the lower layers when sending failed but
-    // is now expected to succeed. Currently the mechanism is used to
-    // retry after ARP resolution completes.
+    // is now expected to succeed, such as after ARP resolution completes
+    // or when the driver has space in its transmit queue again.
     static void pcb_send_retry (TcpPcb *pcb)
     {
         AIPSTACK_ASSERT(pcb->state != TcpState::CLOSED)
@@ -856,6 +925,13 @@ public:
             pcb_send_syn(pcb);
         }
         else if (can_output_in_state(pcb->state) && pcb_has_snd_outstanding(pcb)) {
+            // If the OutputTimer is waiting to retry after a send error, stop it
+            // since we are retrying now (it is set again if this fails).
+            if (pcb->hasFlag(PcbFlags::OUT_RETRY)) {
+                pcb->clearFlag(PcbFlags::OUT_RETRY);
+                pcb->tim(OutputTimer()).unset();
+            }
+            
             // Try sending data/FIN as permissible.
             pcb_output(pcb, false);
             
@@ -913,10 +989,16 @@ public:
         }
         
         // Update the snd_mss.
+        bool decreased = new_snd_mss < pcb->snd_mss;
         pcb->snd_mss = new_snd_mss;
         
         Connection *con = pcb->con;
         
+        // Update the Path MTU search.
+        if (PmtuProbing) {
+            pcb_pmtu_search_update(pcb, decreased);
+        }
+        
         // Make sure that ssthresh does not become lesser than snd_mss.
         if (con->m_v.ssthresh < pcb->snd_mss) {
             con->m_v.ssthresh = pcb->snd_mss;
@@ -949,6 +1031,263 @@ public:
         // handleLocalPacketTooBig -> pcb_pmtu_changed.
     }
     
+    // Packetization Layer Path MTU Discovery (RFC 4821, RFC 8899).
+    // 
+    // With PmtuProbing enabled, we search for the largest working Path MTU
+    // between the current estimate (snd_mss+Ip4TcpHeaderSize) and
+    // pmtu_probe_high, the largest PMTU which may work (initially limited by
+    // base_snd_mss). A probe is a data segment of pmtu_probe_size bytes (as
+    // an IP packet) sent in place of a regular segment. When the probe is
+    // ACKed, the Path MTU cache is raised to the probe size, which raises
+    // snd_mss via pcb_pmtu_changed. After PmtuMaxProbes lost probes of one
+    // size, pmtu_probe_high is lowered below that size. The first probe of a
+    // search is at pmtu_probe_high and the following ones bisect the range,
+    // so that the full MTU is reached with a single probe if the path permits
+    // and the search otherwise converges in a logarithmic number of probes.
+    // While no search is in progress, the PmtuTimer restarts it from the
+    // current PMTU after PmtuRaiseTimeTicks, in case the path has changed.
+    // 
+    // The search is also what recovers from black hole detection. When
+    // retransmission timeouts repeat while the PMTU exceeds pmtu_probe_low
+    // (the largest PMTU known to work), this may be a black hole or just a
+    // loss of connectivity. To tell them apart, every other repeated timeout
+    // retransmits with segments which fit into pmtu_probe_low (pmtu_bh_test).
+    // Only if these are ACKed is it a black hole; the PMTU is then lowered to
+    // pmtu_probe_low and the search is restarted below the previous PMTU.
+    
+    // Called at transition to ESTABLISHED to start the Path MTU search.
+    static void pcb_pmtu_search_init (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr)
+        
+        Connection *con = pcb->con;
+        uint16_t cur_pmtu = pcb->snd_mss + Ip4TcpHeaderSize;
+        
+        con->m_v.pmtu_probe_low = MinValue(cur_pmtu, Constants::PmtuBaseMtu);
+        con->m_v.pmtu_probe_high = pcb->base_snd_mss + Ip4TcpHeaderSize;
+        con->m_v.pmtu_probe_fails = 0;
+        con->m_v.pmtu_probe_sent = false;
+        con->m_v.pmtu_bh_test = false;
+        pcb_pmtu_set_probe_size(pcb, pcb_pmtu_next_probe_size(pcb, true));
+    }
+    
+    // Determine the size of the next probe, or zero if the search is done.
+    static uint16_t pcb_pmtu_next_probe_size (TcpPcb *pcb, bool first)
+    {
+        uint16_t cur_pmtu = pcb->snd_mss + Ip4TcpHeaderSize;
+        uint16_t high = pcb->con->m_v.pmtu_probe_high;
+        
+        if (high <= cur_pmtu || high - cur_pmtu < Constants::PmtuSearchGranularity) {
+            return 0;
+        }
+        
+        return first ? high : uint16_t(cur_pmtu + (high - cur_pmtu + 1) / 2);
+    }
+    
+    // Set the size of the next probe, zero to stop the search. The PmtuTimer
+    // runs while the search is stopped, it is not restarted if already running.
+    static void pcb_pmtu_set_probe_size (TcpPcb *pcb, uint16_t probe_size)
+    {
+        pcb->con->m_v.pmtu_probe_size = probe_size;
+        
+        if (probe_size == 0) {
+            if (!pcb->tim(PmtuTimer()).isSet()) {
+                pcb->tim(PmtuTimer()).setAfter(Constants::PmtuRaiseTimeTicks);
+            }
+        } else {
+            pcb->tim(PmtuTimer()).unset();
+        }
+        
+        pcb->doDelayedTimerUpdateIfNeeded();
+    }
+    
+    // PmtuTimer handler, restarts the Path MTU search from the current PMTU.
+    static void pcb_pmtu_timer_handler (TcpPcb *pcb)
+    {
+        Connection *con = pcb->con;
+        
+        // Ignore the timer if the connection no longer sends or if the
+        // search has already been restarted.
+        if (con != nullptr && can_output_in_state(pcb->state) &&
+            con->m_v.pmtu_probe_size == 0)
+        {
+            con->m_v.pmtu_probe_high = pcb->base_snd_mss + Ip4TcpHeaderSize;
+            con->m_v.pmtu_probe_fails = 0;
+            pcb_pmtu_set_probe_size(pcb, pcb_pmtu_next_probe_size(pcb, true));
+        }
+        
+        // Delayed timer update is needed by timer expiration.
+        pcb->doDelayedTimerUpdate();
+    }
+    
+    // Determine whether the next segment should be a probe, a regular segment,
+    // or whether sending should wait for the window to open for a probe.
+    static PmtuProbeAction pcb_pmtu_probe_action (TcpPcb *pcb, SeqType rem_wnd)
+    {
+        Connection *con = pcb->con;
+        AIPSTACK_ASSERT(con->m_v.pmtu_probe_size > pcb->snd_mss + Ip4TcpHeaderSize)
+        
+        // Only one probe may be outstanding and we do not probe while
+        // recovering from losses.
+        if (con->m_v.pmtu_probe_sent || pcb->num_dupack != 0 ||
+            pcb->hasFlag(PcbFlags::RTX_ACTIVE|PcbFlags::RECOVER))
+        {
+            return PmtuProbeAction::Regular;
+        }
+        
+        // The probe must be new data, not a retransmission.
+        size_t offset = con->m_v.snd_buf.tot_len - con->m_v.snd_buf_cur.tot_len;
+        if (seq_add(pcb->snd_una, SeqType(offset)) != pcb->snd_nxt) {
+            return PmtuProbeAction::Regular;
+        }
+        
+        // There must be enough data for a full-sized probe.
+        uint16_t probe_mss = con->m_v.pmtu_probe_size - Ip4TcpHeaderSize;
+        if (con->m_v.snd_buf_cur.tot_len < probe_mss) {
+            return PmtuProbeAction::Regular;
+        }
+        
+        // The window must allow the probe followed by enough segments to
+        // trigger fast retransmit if the probe is lost, so that a lost probe
+        // does not result in a retransmission timeout.
+        SeqType full_wnd = MinValue(con->m_v.snd_wnd, con->m_v.cwnd);
+        if (full_wnd < probe_mss + SeqType(Constants::FastRtxDupAcks) * pcb->snd_mss) {
+            return PmtuProbeAction::Regular;
+        }
+        
+        // Send the probe if the remaining window allows it. Otherwise stop
+        // sending to let the window open as data in flight is ACKed, since
+        // with ACK clocking it would rarely open enough for a probe otherwise.
+        return (rem_wnd >= probe_mss) ? PmtuProbeAction::Probe : PmtuProbeAction::Wait;
+    }
+    
+    // Called when an outstanding probe has been ACKed.
+    AIPSTACK_NO_INLINE
+    static void pcb_pmtu_probe_acked (TcpPcb *pcb)
+    {
+        Connection *con = pcb->con;
+        AIPSTACK_ASSERT(con->m_v.pmtu_probe_sent)
+        
+        uint16_t probe_size = con->m_v.pmtu_probe_size;
+        con->m_v.pmtu_probe_sent = false;
+        con->m_v.pmtu_probe_fails = 0;
+        con->m_v.pmtu_probe_low = MaxValue(con->m_v.pmtu_probe_low, probe_size);
+        
+        pcb->tcp->m_stack->stats().tcp_pmtu_probe_acks.inc();
+        
+        // Raise the Path MTU estimate, this will call pcb_pmtu_changed for all
+        // connections to this address (including this one) if it was raised.
+        pcb->tcp->m_stack->handlePathMtuProbeAcked(pcb->remote_addr, probe_size);
+        
+        // If the PMTU could not be raised (e.g. the interface MTU was lowered),
+        // don't continue searching above the current PMTU.
+        uint16_t cur_pmtu = pcb->snd_mss + Ip4TcpHeaderSize;
+        if (cur_pmtu < probe_size) {
+            con->m_v.pmtu_probe_high = cur_pmtu;
+        }
+        
+        pcb_pmtu_set_probe_size(pcb, pcb_pmtu_next_probe_size(pcb, false));
+    }
+    
+    // Called when an outstanding probe is considered lost.
+    AIPSTACK_NO_INLINE
+    static void pcb_pmtu_probe_lost (TcpPcb *pcb)
+    {
+        Connection *con = pcb->con;
+        AIPSTACK_ASSERT(con->m_v.pmtu_probe_sent)
+        
+        con->m_v.pmtu_probe_sent = false;
+        
+        // Retry the same size until PmtuMaxProbes probes have been lost,
+        // then assume that the size is too large.
+        if (++con->m_v.pmtu_probe_fails >= Constants::PmtuMaxProbes) {
+            con->m_v.pmtu_probe_fails = 0;
+            con->m_v.pmtu_probe_high = con->m_v.pmtu_probe_size - 1;
+            pcb_pmtu_set_probe_size(pcb, pcb_pmtu_next_probe_size(pcb, false));
+        }
+    }
+    
+    // Called from pcb_pmtu_changed after snd_mss was changed.
+    static void pcb_pmtu_search_update (TcpPcb *pcb, bool decreased)
+    {
+        Connection *con = pcb->con;
+        uint16_t cur_pmtu = pcb->snd_mss + Ip4TcpHeaderSize;
+        
+        if (decreased) {
+            // The PMTU was lowered (ICMP or black hole detection). Trust that
+            // and stop searching until the PmtuTimer restarts the search, also
+            // forget any confirmation of a larger PMTU.
+            con->m_v.pmtu_probe_low = MinValue(con->m_v.pmtu_probe_low, cur_pmtu);
+            con->m_v.pmtu_probe_high = cur_pmtu;
+            con->m_v.pmtu_probe_sent = false;
+            con->m_v.pmtu_probe_fails = 0;
+            con->m_v.pmtu_bh_test = false;
+            pcb_pmtu_set_probe_size(pcb, 0);
+        } else {
+            // The PMTU was raised (our or another connection's probe, or
+            // expiry of the cache entry). Make sure the search range includes
+            // the new PMTU, and forget an outstanding probe which is no
+            // longer larger than the PMTU.
+            con->m_v.pmtu_probe_high = MaxValue(con->m_v.pmtu_probe_high, cur_pmtu);
+            if (con->m_v.pmtu_probe_sent && con->m_v.pmtu_probe_size <= cur_pmtu) {
+                con->m_v.pmtu_probe_sent = false;
+                con->m_v.pmtu_probe_fails = 0;
+            }
+            if (!con->m_v.pmtu_probe_sent) {
+                pcb_pmtu_set_probe_size(pcb, pcb_pmtu_next_probe_size(pcb, false));
+            }
+        }
+    }
+    
+    // Called on repeated retransmission timeouts to start or end a test for a
+    // Path MTU black hole, which is when packets of the current PMTU are being
+    // dropped without an ICMP Fragmentation Needed message arriving.
+    static void pcb_pmtu_check_black_hole (TcpPcb *pcb)
+    {
+        Connection *con = pcb->con;
+        
+        // If the small segments of the test were lost as well, the losses
+        // are not related to the segment size.
+        if (con->m_v.pmtu_bh_test) {
+            con->m_v.pmtu_bh_test = false;
+            return;
+        }
+        
+        // Test only if the PMTU is not known to work and the retransmission
+        // would be larger than the test segments.
+        uint16_t low_mss = con->m_v.pmtu_probe_low - Ip4TcpHeaderSize;
+        if (pcb->snd_mss <= low_mss || con->m_v.snd_buf.tot_len <= low_mss) {
+            return;
+        }
+        
+        con->m_v.pmtu_bh_test = true;
+    }
+    
+    // Called when data sent during a black hole test has been ACKed.
+    AIPSTACK_NO_INLINE
+    static void pcb_pmtu_black_hole_found (TcpPcb *pcb)
+    {
+        Connection *con = pcb->con;
+        AIPSTACK_ASSERT(con->m_v.pmtu_bh_test)
+        
+        con->m_v.pmtu_bh_test = false;
+        uint16_t old_pmtu = pcb->snd_mss + Ip4TcpHeaderSize;
+        
+        // Lower the Path MTU estimate to the largest value known to work. This
+        // is like an ICMP Fragmentation Needed message and likewise affects all
+        // connections to this address, calling pcb_pmtu_changed for each.
+        pcb->tcp->m_stack->handleIcmpPacketTooBig(
+            pcb->remote_addr, con->m_v.pmtu_probe_low);
+        
+        // If snd_mss was lowered, search between the new and previous PMTU.
+        if (pcb->snd_mss + Ip4TcpHeaderSize < old_pmtu) {
+            pcb->tcp->m_stack->stats().tcp_pmtu_black_holes.inc();
+            
+            con->m_v.pmtu_probe_high = old_pmtu - 1;
+            pcb_pmtu_set_probe_size(pcb, pcb_pmtu_next_probe_size(pcb, false));
+        }
+    }
+    
     // Update the snd_wnd to the given value.
     // NOTE: doDelayedTimerUpdate must be called after return.
     static void pcb_update_snd_wnd (TcpPcb *pcb, SeqType new_snd_wnd)
@@ -1024,6 +1363,8 @@ public:
     static void send_rst (TcpProto *tcp, PcbKey const &key,
                           SeqType seq_num, bool ack, SeqType ack_num)
     {
+        AIPSTACK_TRACE(TcpRstSent, key.local_port, key.remote_addr.data[0], key.remote_port)
+        
         FlagsType flags = Tcp4FlagRst | (ack ? Tcp4FlagAck : 0);
         send_tcp_nodata(tcp, key, seq_num, ack_num, 0, flags, nullptr, nullptr);
     }
@@ -1055,6 +1396,8 @@ private:
     // NOTE: doDelayedTimerUpdate must be called after return.
     static void pcb_set_output_timer_for_retry (TcpPcb *pcb, IpErr err)
     {
+        AIPSTACK_TRACE(TcpTxError, err, pcb->local_port, pcb->remote_port)
+        
         // Set the timer based on the error. Also set the flag OUT_RETRY which
         // allows pcb_set_output_timer_for_output to reset the timer it despite
         // being already set, avoiding undesired delays.
@@ -1069,6 +1412,7 @@ private:
     AIPSTACK_ALWAYS_INLINE
     static IpErr pcb_output_segment (TcpPcb *pcb, PcbOutputHelper &helper,
                                      IpBufRef data, bool fin, SeqType rem_wnd,
+                                     uint16_t seg_mss, size_t seg_max,
                                      SeqType *out_seg_seqlen)
     {
         AIPSTACK_ASSERT(can_output_in_state(pcb->state))
@@ -1077,6 +1421,8 @@ private:
         AIPSTACK_ASSERT(!fin || !snd_open_in_state(pcb->state))
         AIPSTACK_ASSERT(data.tot_len > 0 || fin)
         AIPSTACK_ASSERT(rem_wnd > 0)
+        AIPSTACK_ASSERT(seg_max >= seg_mss)
+        AIPSTACK_ASSERT(SegmentationOffload || seg_max == seg_mss)
         
         size_t rem_data_len = data.tot_len;
         
@@ -1084,9 +1430,9 @@ private:
         // We send the minimum of:
         // - remaining data in the send buffer,
         // - remaining available window,
-        // - maximum segment size.
-        data.tot_len = MinValueU(rem_data_len,
-                                           MinValueU(rem_wnd, pcb->snd_mss));
+        // - maximum segment size (snd_mss or the size of a Path MTU probe),
+        //   or a multiple of that with segmentation offload.
+        data.tot_len = MinValueU(rem_data_len, MinValueU(rem_wnd, seg_max));
         
         // We always send the ACK flag, others may be added below.
         FlagsType seg_flags = Tcp4FlagAck;
@@ -1115,11 +1461,23 @@ private:
         SeqType seq_num = seq_add(pcb->snd_una, SeqType(offset));
         
         // Send the segment.
-        IpErr err = helper.sendSegment(pcb, seq_num, seg_flags, data);
+        size_t data_sent = 0;
+        IpErr err = helper.sendSegment(pcb, seq_num, seg_flags, data, seg_mss, data_sent);
         if (AIPSTACK_UNLIKELY(err != IpErr::SUCCESS)) {
-            return err;
+            // If some segments of a large packet were sent, continue as if just
+            // these were sent; the error will be seen again when sending the rest.
+            if (!SegmentationOffload || data_sent == 0) {
+                return err;
+            }
+            AIPSTACK_ASSERT(data_sent < data.tot_len)
+            data.tot_len = data_sent;
+            seg_flags &= FlagsType(~Tcp4FlagFin);
         }
         
+        // Number of segments actually sent, for statistics.
+        uint32_t num_segs = !SegmentationOffload ? 1 :
+            uint32_t(MaxValue(size_t(1), (data.tot_len + seg_mss - 1) / seg_mss));
+        
         // Calculate the sequence length of the segment and set
         // the FIN_SENT flag if a FIN was sent.
         SeqType seg_seqlen = SeqType(data.tot_len);
@@ -1145,6 +1503,8 @@ private:
         
         // Did we send anything new?
         if (AIPSTACK_LIKELY(seq_lt2(pcb->snd_nxt, seg_endseq))) {
+            pcb->tcp->m_stack->stats().tcp_out_segs.inc(num_segs);
+            
             // Start a round-trip-time measurement if not already started
             // and if we still have a Connection.
             if (!pcb->hasFlag(PcbFlags::RTT_PENDING)) {
@@ -1153,11 +1513,41 @@ private:
             
             // Bump snd_nxt.
             pcb->snd_nxt = seg_endseq;
+        } else {
+            pcb->tcp->m_stack->stats().tcp_retrans_segs.inc(num_segs);
+            
+            // If we are retransmitting data up to the end of an outstanding Path
+            // MTU probe, consider the probe lost. We do not try to distinguish
+            // losses of the probe itself from losses of preceding segments.
+            if (PmtuProbing && AIPSTACK_UNLIKELY(pcb->con->m_v.pmtu_probe_sent) &&
+                seq_lt2(seq_num, pcb->con->m_v.pmtu_probe_end))
+            {
+                pcb_pmtu_probe_lost(pcb);
+            }
         }
         
         return IpErr::SUCCESS;
     }
     
+    // Determine how much data to send in one packet with segmentation offload.
+    // This covers what would otherwise be sent as consecutive segments, but
+    // it is just snd_mss if that is no more than one segment.
+    inline static size_t pcb_output_offload_len (
+        TcpPcb *pcb, size_t rem_data_len, SeqType rem_wnd, size_t data_threshold)
+    {
+        size_t mss = pcb->snd_mss;
+        size_t max_len = (TypeMax<uint16_t>() - 2 * Ip4TcpHeaderSize) / mss * mss;
+        size_t len = MinValueU(max_len, MinValueU(rem_data_len, rem_wnd));
+        
+        // Leave out a final partial segment if it would be delayed.
+        size_t full_len = len - len % mss;
+        if (full_len < len && rem_data_len - full_len <= data_threshold) {
+            len = full_len;
+        }
+        
+        return MaxValue(mss, len);
+    }
+    
     static void pcb_increase_cwnd_acked (TcpPcb *pcb, SeqType acked)
     {
         AIPSTACK_ASSERT(can_output_in_state(pcb->state))
@@ -1216,7 +1606,8 @@ private:
             // things, to optimize sending multiple segments at a time.
         }
         
-        IpErr sendSegment (TcpPcb *pcb, SeqType seq_num, FlagsType seg_flags, IpBufRef data)
+        IpErr sendSegment (TcpPcb *pcb, SeqType seq_num, FlagsType seg_flags,
+                           IpBufRef data, uint16_t seg_mss, size_t &out_data_sent)
         {
             // Reset the TxAllocHelper.
             dgram_alloc.reset(Tcp4Header::Size);
@@ -1255,8 +1646,20 @@ private:
                 dgram_alloc.setNext(&data_node, data.tot_len);
             }
             
-            // Calculate checksum.
-            tcp_header.set(Tcp4Header::Checksum(), chksum.getChksum(data));
+            // A large packet is sent to be split into segments, the TCP checksum
+            // is calculated for each segment then.
+            if (SegmentationOffload && data.tot_len > seg_mss) {
+                return pcb->tcp->m_stack->sendIp4TcpSegmentsFast(
+                    ip_prep, dgram_alloc.getBufRef(), seg_mss, pcb, out_data_sent);
+            }
+            
+            // Calculate checksum, or leave it to the driver if it can do that.
+            if (ip_prep.chksum_offload) {
+                tcp_header.set(Tcp4Header::Checksum(), IpChksumOffload::pseudoHeaderSum(
+                    pcb->local_addr, pcb->remote_addr, Ip4ProtocolTcp, tcp_len));
+            } else {
+                tcp_header.set(Tcp4Header::Checksum(), chksum.getChksum(data));
+            }
             
             // Get the complete datagram reference starting with the TCP header.
             IpBufRef dgram = dgram_alloc.getBufRef();
@@ -1305,7 +1708,7 @@ private:
             // Perform IP level preparation.
             IpErr err = pcb->tcp->m_stack->prepareSendIp4Dgram(
                 *pcb, {TcpProto::TcpTTL, Ip4ProtocolTcp}, dgram_alloc.getPtr(),
-                Constants::TcpIpSendFlags, ip_prep);
+                Constants::TcpIpSendFlags | IpSendFlags::ProtoChksumOffload, ip_prep);
             if (AIPSTACK_UNLIKELY(err != IpErr::SUCCESS)) {
                 return err;
             }
@@ -1380,6 +1783,13 @@ private:
         uint16_t calc_chksum = chksum_accum.getChksum(dgram.hideHeader(Tcp4Header::Size));
         tcp_header.set(Tcp4Header::Checksum(), calc_chksum);
         
+        // Update statistics.
+        IpStackStats &stats = tcp->m_stack->stats();
+        stats.tcp_out_segs.inc();
+        if ((flags & Tcp4FlagRst) != 0) {
+            stats.tcp_out_rsts.inc();
+        }
+        
         // Send the datagram.
         return tcp->m_stack->sendIp4Dgram(key, {TcpProto::TcpTTL, Ip4ProtocolTcp}, dgram,
                                           nullptr, retryReq, Constants::TcpIpSendFlags);
@@ -356,6 +356,22 @@ public:
         setWindowUpdateThreshold(thres);
     }
     
+    /**
+     * Set the transmit priority of the connection.
+     * 
+     * When the interface is congested, connections with a higher priority (a lower
+     * value, 0 being the highest and default) are allowed to send first; see
+     * @ref IpSendRetryRequest::setTxPriority. This is useful to keep interactive
+     * connections responsive while bulk transfers saturate the interface.
+     * May only be called in CONNECTED state.
+     */
+    void setTxPriority (uint8_t priority)
+    {
+        assert_connected();
+        
+        m_v.pcb->setTxPriority(priority);
+    }
+    
     /**
      * Returns the last announced receive window.
      * May only be called in CONNECTED state.
@@ -814,6 +830,13 @@ private:
         RttType srtt;
         OosBuffer ooseq;
         size_t snd_psh_index;
+        SeqType pmtu_probe_end;
+        uint16_t pmtu_probe_low;
+        uint16_t pmtu_probe_high;
+        uint16_t pmtu_probe_size;
+        uint8_t pmtu_probe_fails;
+        bool pmtu_probe_sent;
+        bool pmtu_bh_test;
     };
     
     Vars m_v;
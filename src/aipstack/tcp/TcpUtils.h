@@ -93,6 +93,7 @@ public:
         uint16_t window_size;
         FlagsType flags;
         TcpOptions *opts; // not used for RX (undefined), may be null for TX
+        uint16_t num_segs; // number of coalesced segments for RX, not used for TX
     };
     
     // TCP options flags used in TcpOptions options field.
@@ -47,12 +47,14 @@
 #include <aipstack/infra/Buf.h>
 #include <aipstack/infra/Chksum.h>
 #include <aipstack/infra/SendRetry.h>
+#include <aipstack/infra/TxAllocHelper.h>
 #include <aipstack/proto/Ip4Proto.h>
 #include <aipstack/proto/Udp4Proto.h>
 #include <aipstack/proto/Icmp4Proto.h>
 #include <aipstack/platform/PlatformFacade.h>
 #include <aipstack/ip/IpAddr.h>
 #include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpChksumOffload.h>
 
 namespace AIpStack {
 
@@ -98,6 +100,16 @@ struct UdpTxInfo {
     uint16_t dst_port;
 };
 
+// One datagram of a batch for UdpApi::sendUdpIp4Batch. The data does not need
+// any space for headers. The result of sending is stored into err.
+template <typename Arg>
+struct UdpTxBatchEntry {
+    Ip4Addr remote_addr;
+    uint16_t dst_port;
+    IpBufRef data;
+    IpErr err;
+};
+
 struct UdpAssociationKey {
     Ip4Addr local_addr;
     Ip4Addr remote_addr;
@@ -162,24 +174,191 @@ public:
         udp_header.set(Udp4Header::SrcPort(),  udp_info.src_port);
         udp_header.set(Udp4Header::DstPort(),  udp_info.dst_port);
         udp_header.set(Udp4Header::Length(),   uint16_t(dgram.tot_len));
-        udp_header.set(Udp4Header::Checksum(), 0);
         
-        // Calculate UDP checksum.
-        IpChksumAccumulator chksum_accum;
-        chksum_accum.addWords(&addrs.local_addr.data);
-        chksum_accum.addWords(&addrs.remote_addr.data);
-        chksum_accum.addWord(WrapType<uint16_t>(), Ip4ProtocolUdp);
-        chksum_accum.addWord(WrapType<uint16_t>(), uint16_t(dgram.tot_len));
-        uint16_t checksum = chksum_accum.getChksum(dgram);
-        if (checksum == 0) {
-            checksum = TypeMax<uint16_t>();
-        }
-        udp_header.set(Udp4Header::Checksum(), checksum);
+        // Write the pseudo-header sum, the UDP checksum is completed by the driver
+        // or by the IP layer.
+        udp_header.set(Udp4Header::Checksum(), IpChksumOffload::pseudoHeaderSum(
+            addrs.local_addr, addrs.remote_addr, Ip4ProtocolUdp, uint16_t(dgram.tot_len)));
         
         // Send the datagram.
-        return proto().m_stack->sendIp4Dgram(
-            addrs, {UdpTTL, Ip4ProtocolUdp}, dgram, iface, retryReq, send_flags);
+        proto().m_stack->stats().udp_out_datagrams.inc();
+        return proto().m_stack->sendIp4Dgram(addrs, {UdpTTL, Ip4ProtocolUdp}, dgram,
+            iface, retryReq, send_flags | IpSendFlags::ProtoChksumOffload);
+    }
+
+    // Send a batch of datagrams from the same local address and port. Routing and
+    // the IP header are prepared once for each run of consecutive entries with the
+    // same remote address (IpStack::prepareSendIp4Dgram), and the checksum of the
+    // pseudo-header is also computed once per run. Fragmentation is not supported,
+    // datagrams which do not fit the MTU fail with FRAG_NEEDED.
+    //
+    // The result for each datagram is stored into its err field; errors other than
+    // BUFFER_FULL do not stop the batch. On BUFFER_FULL, sending stops and the index
+    // of the failed entry is returned, so the caller can retry from there (e.g.
+    // after notification via retryReq). Otherwise num_entries is returned.
+    size_t sendUdpIp4Batch (Ip4Addr local_addr, uint16_t src_port,
+                            UdpTxBatchEntry<Arg> *entries, size_t num_entries,
+                            IpSendRetryRequest *retryReq, IpSendFlags send_flags)
+    {
+        TxHelper helper;
+        Ip4Addr prep_addr = Ip4Addr::ZeroAddr();
+        IpErr prep_err = IpErr::SUCCESS;
+        bool prepared = false;
+
+        for (size_t i : LoopRange(num_entries)) {
+            UdpTxBatchEntry<Arg> &entry = entries[i];
+
+            // Prepare if this is the first datagram for this remote address.
+            if (!prepared || entry.remote_addr != prep_addr) {
+                prepared = true;
+                prep_addr = entry.remote_addr;
+                prep_err = helper.prepare(
+                    proto(), {local_addr, prep_addr}, src_port, send_flags);
+            }
+
+            if (AIPSTACK_UNLIKELY(prep_err != IpErr::SUCCESS)) {
+                entry.err = prep_err;
+                continue;
+            }
+
+            entry.err = helper.send(proto(), entry.dst_port, entry.data, retryReq);
+
+            if (AIPSTACK_UNLIKELY(entry.err == IpErr::BUFFER_FULL)) {
+                return i;
+            }
+        }
+
+        return num_entries;
     }
+
+    // Send data as a sequence of datagrams of seg_size bytes each (except that the
+    // last one may be shorter), like UDP segmentation offload. Preparation is done
+    // only once, see sendUdpIp4Batch. The data does not need any space for headers.
+    //
+    // Sending stops at the first error, which is returned. The number of bytes of
+    // data sent successfully (a multiple of seg_size unless all data was sent) is
+    // stored into sent_len, so that after BUFFER_FULL the caller can continue with
+    // the remaining data.
+    IpErr sendUdpIp4Segmented (Ip4Addrs const &addrs, UdpTxInfo<Arg> const &udp_info,
+                               IpBufRef data, size_t seg_size,
+                               IpSendRetryRequest *retryReq, IpSendFlags send_flags,
+                               size_t &sent_len)
+    {
+        AIPSTACK_ASSERT(seg_size > 0)
+        AIPSTACK_ASSERT(seg_size <= MaxUdpDataLenIp4)
+
+        sent_len = 0;
+
+        if (data.tot_len == 0) {
+            return IpErr::SUCCESS;
+        }
+
+        TxHelper helper;
+        IpErr err = helper.prepare(proto(), addrs, udp_info.src_port, send_flags);
+        if (AIPSTACK_UNLIKELY(err != IpErr::SUCCESS)) {
+            return err;
+        }
+
+        while (data.tot_len > 0) {
+            size_t seg_len = MinValue(seg_size, data.tot_len);
+
+            err = helper.send(proto(), udp_info.dst_port, data.subTo(seg_len), retryReq);
+            if (AIPSTACK_UNLIKELY(err != IpErr::SUCCESS)) {
+                return err;
+            }
+
+            data.skipBytes(seg_len);
+            sent_len += seg_len;
+        }
+
+        return IpErr::SUCCESS;
+    }
+
+private:
+    // Sends multiple datagrams with the same addresses and source port. The IP
+    // header and the partial checksum are computed once in prepare. For each
+    // datagram, the UDP header is written into the embedded buffer (just after the
+    // prepared IP header) and the data is linked after it.
+    class TxHelper {
+    public:
+        inline TxHelper ()
+        : m_dgram_alloc(TxAllocHelperUninitialized())
+        {}
+
+        IpErr prepare (IpUdpProto<Arg> &udp, Ip4Addrs const &addrs, uint16_t src_port,
+                       IpSendFlags send_flags)
+        {
+            // Partial checksum of the pseudo-header (without length) and then
+            // also the source port.
+            IpChksumAccumulator chksum_accum;
+            chksum_accum.addWords(&addrs.local_addr.data);
+            chksum_accum.addWords(&addrs.remote_addr.data);
+            chksum_accum.addWord(WrapType<uint16_t>(), Ip4ProtocolUdp);
+            m_pseudo_chksum_state = chksum_accum.getState();
+            chksum_accum.addWord(WrapType<uint16_t>(), src_port);
+            m_partial_chksum_state = chksum_accum.getState();
+
+            m_src_port = src_port;
+
+            return udp.m_stack->prepareSendIp4Dgram(addrs, {UdpTTL, Ip4ProtocolUdp},
+                m_dgram_alloc.getPtr(), send_flags | IpSendFlags::ProtoChksumOffload,
+                m_ip_prep);
+        }
+
+        IpErr send (IpUdpProto<Arg> &udp, uint16_t dst_port, IpBufRef data,
+                    IpSendRetryRequest *retryReq)
+        {
+            AIPSTACK_ASSERT(data.tot_len <= MaxUdpDataLenIp4)
+
+            m_dgram_alloc.reset(Udp4Header::Size);
+
+            // Write the UDP header.
+            uint16_t udp_len = uint16_t(Udp4Header::Size + data.tot_len);
+            auto udp_header = Udp4Header::MakeRef(m_dgram_alloc.getPtr());
+            udp_header.set(Udp4Header::SrcPort(), m_src_port);
+            udp_header.set(Udp4Header::DstPort(), dst_port);
+            udp_header.set(Udp4Header::Length(),  udp_len);
+
+            // Link the data after the UDP header.
+            IpBufNode data_node;
+            if (data.tot_len > 0) {
+                data_node = data.toNode();
+                m_dgram_alloc.setNext(&data_node, data.tot_len);
+            }
+
+            // If the driver completes the checksum, only write the pseudo-header sum.
+            // Otherwise complete the checksum: the length (in the pseudo-header and
+            // in the UDP header), the destination port and the data.
+            if (m_ip_prep.chksum_offload) {
+                IpChksumAccumulator chksum_accum(m_pseudo_chksum_state);
+                chksum_accum.addWord(WrapType<uint16_t>(), udp_len);
+                udp_header.set(Udp4Header::Checksum(), uint16_t(~chksum_accum.getChksum()));
+            } else {
+                IpChksumAccumulator chksum_accum(m_partial_chksum_state);
+                chksum_accum.addWord(WrapType<uint16_t>(), udp_len);
+                chksum_accum.addWord(WrapType<uint16_t>(), udp_len);
+                chksum_accum.addWord(WrapType<uint16_t>(), dst_port);
+                uint16_t checksum = chksum_accum.getChksum(data);
+                if (checksum == 0) {
+                    checksum = TypeMax<uint16_t>();
+                }
+                udp_header.set(Udp4Header::Checksum(), checksum);
+            }
+
+            // Send the datagram.
+            udp.m_stack->stats().udp_out_datagrams.inc();
+            return udp.m_stack->sendIp4DgramFast(
+                m_ip_prep, m_dgram_alloc.getBufRef(), retryReq);
+        }
+
+    private:
+        IpSendPreparedIp4<StackArg> m_ip_prep;
+        IpChksumAccumulator::State m_pseudo_chksum_state;
+        IpChksumAccumulator::State m_partial_chksum_state;
+        uint16_t m_src_port;
+        TxAllocHelper<Udp4Header::Size, IpStack<StackArg>::HeaderBeforeIp4Dgram>
+            m_dgram_alloc;
+    };
 };
 
 template <typename Arg>
@@ -188,7 +367,7 @@ class UdpListener :
 {
     template <typename> friend class IpUdpProto;
     
-    AIPSTACK_USE_TYPES(IpUdpProto<Arg>, (ListenersLinkModel))
+    AIPSTACK_USE_TYPES(IpUdpProto<Arg>, (ListenersLinkModel, ListenerIndex))
 
 public:
     using StackArg = typename Arg::StackArg;
@@ -210,10 +389,18 @@ public:
     void reset ()
     {
         if (m_udp != nullptr) {
-            if (m_udp->m_next_listener == this) {
-                m_udp->m_next_listener = m_udp->m_listeners_list.next(*this);
+            if (m_params.port == 0) {
+                if (m_udp->m_next_any_listener == this) {
+                    m_udp->m_next_any_listener = m_udp->m_listeners_list.next(*this);
+                }
+                m_udp->m_listeners_list.remove(*this);
+            } else {
+                if (m_udp->m_next_port_listener == this) {
+                    m_udp->m_next_port_listener =
+                        m_udp->m_listeners_index.findNext(m_params.port, *this);
+                }
+                m_udp->m_listeners_index.removeEntry(*this);
             }
-            m_udp->m_listeners_list.remove(*this);
             m_udp = nullptr;
         }
     }
@@ -243,8 +430,16 @@ public:
 
         m_udp = &udp.proto();
         m_params = params;
+        m_seq = m_udp->m_next_listener_seq++;
         
-        m_udp->m_listeners_list.prepend(*this);
+        // Listeners for a specific port go to the index, others to the list. The
+        // sequence number is used to dispatch to the most recently started
+        // listeners first, across both.
+        if (m_params.port == 0) {
+            m_udp->m_listeners_list.prepend(*this);
+        } else {
+            m_udp->m_listeners_index.addEntry(*this);
+        }
 
         return IpErr::SUCCESS;
     }
@@ -289,8 +484,10 @@ private:
 private:
     UdpIp4PacketHandler m_handler;
     LinkedListNode<ListenersLinkModel> m_list_node;
+    typename ListenerIndex::Node m_index_node;
     IpUdpProto<Arg> *m_udp;
     UdpListenParams<Arg> m_params;
+    uint64_t m_seq;
 };
 
 template <typename Arg>
@@ -417,6 +614,60 @@ class IpUdpProto :
         UdpListener<Arg>, LinkedListNode<ListenersLinkModel>,
         &UdpListener<Arg>::m_list_node> {};
     
+    // Listeners with a specific port are indexed by the port. Entries with the
+    // same port are ordered by descending sequence number (most recently started
+    // first), which is also the order of the list of listeners for any port.
+    struct ListenerIndexNodeAccessor;
+    struct ListenerIndexKeyFuncs;
+
+    AIPSTACK_MAKE_INSTANCE(ListenerIndex, (UdpIndexService::template Index<
+        ListenerIndexNodeAccessor, uint16_t, ListenerIndexKeyFuncs,
+        ListenersLinkModel, /*Duplicates=*/true>))
+
+    struct ListenerIndexNodeAccessor : public MemberAccessor<
+        UdpListener<Arg>, typename ListenerIndex::Node,
+        &UdpListener<Arg>::m_index_node> {};
+    
+    struct ListenerIndexKey {
+        uint16_t port;
+        uint64_t seq;
+    };
+
+    struct ListenerIndexKeyFuncs {
+        inline static ListenerIndexKey GetKeyOfEntry (UdpListener<Arg> const &lis)
+        {
+            return ListenerIndexKey{lis.m_params.port, lis.m_seq};
+        }
+
+        inline static int CompareKeys (
+            ListenerIndexKey const &key1, ListenerIndexKey const &key2)
+        {
+            if (key1.port != key2.port) {
+                return (key1.port < key2.port) ? -1 : 1;
+            }
+            if (key1.seq != key2.seq) {
+                return (key1.seq > key2.seq) ? -1 : 1;
+            }
+            return 0;
+        }
+
+        // Lookups are by port only.
+        inline static int CompareKeys (uint16_t port1, ListenerIndexKey const &key2)
+        {
+            return (port1 < key2.port) ? -1 : (port1 > key2.port) ? 1 : 0;
+        }
+
+        inline static bool KeysAreEqual (uint16_t port1, ListenerIndexKey const &key2)
+        {
+            return port1 == key2.port;
+        }
+
+        inline static bool KeysAreEqual (ListenerIndexKey const &key1, uint16_t port2)
+        {
+            return key1.port == port2;
+        }
+    };
+    
     struct AssociationIndexNodeAccessor;
     struct AssociationIndexKeyFuncs;
     using AssociationLinkModel = PointerLinkModel<UdpAssociation<Arg>>;
@@ -448,15 +699,19 @@ class IpUdpProto :
 public:
     IpUdpProto (IpProtocolHandlerArgs<StackArg> args) :
         m_stack(args.stack),
-        m_next_listener(nullptr),
+        m_next_any_listener(nullptr),
+        m_next_port_listener(nullptr),
+        m_next_listener_seq(0),
         m_next_ephemeral_port(EphemeralPortFirst)
     {}
 
     ~IpUdpProto ()
     {
         AIPSTACK_ASSERT(m_listeners_list.isEmpty())
+        AIPSTACK_ASSERT(m_listeners_index.isEmpty())
         AIPSTACK_ASSERT(m_associations_index.isEmpty())
-        AIPSTACK_ASSERT(m_next_listener == nullptr)
+        AIPSTACK_ASSERT(m_next_any_listener == nullptr)
+        AIPSTACK_ASSERT(m_next_port_listener == nullptr)
     }
 
     inline UdpApi<Arg> & getApi ()
@@ -468,6 +723,7 @@ public:
     {
         // Check that there is a UDP header.
         if (AIPSTACK_UNLIKELY(!dgram.hasHeader(Udp4Header::Size))) {
+            m_stack->stats().udp_in_errors.inc();
             return;
         }
         auto udp_header = Udp4Header::MakeRef(dgram.getChunkPtr());
@@ -482,6 +738,7 @@ public:
         if (AIPSTACK_UNLIKELY(udp_length < Udp4Header::Size ||
                               udp_length > dgram.tot_len))
         {
+            m_stack->stats().udp_in_errors.inc();
             return;
         }
         
@@ -510,6 +767,7 @@ public:
             if (!checksum_verified) {
                 if (!verifyChecksum(ip_info, udp_header, dgram, udp_info.has_checksum)) {
                     // Bad checksum, calling code should drop the packet.
+                    m_stack->stats().udp_in_errors.inc();
                     return false;
                 }
                 checksum_verified = true;
@@ -545,6 +803,7 @@ public:
             // If the association wants that we don't pass the packet to any listener, then
             // return here.
             if (recv_result == UdpRecvResult::AcceptStop) {
+                m_stack->stats().udp_in_datagrams.inc();
                 return;
             }
 
@@ -557,14 +816,33 @@ public:
             updateCachedInfo();
         } while (false);
         
-        // Look for listeners which match the incoming packet.
-        // NOTE: `lis` must be properly adjusted at the end of each iteration!
-        for (UdpListener<Arg> *lis = m_listeners_list.first(); lis != nullptr;) {
+        // Look for listeners which match the incoming packet. Candidates are the
+        // listeners for the destination port (from the index) and the listeners for
+        // any port (from the list). Both sequences are ordered from the most recently
+        // started listener, and they are merged by the sequence number.
+        // NOTE: `any_lis` and `port_lis` must be properly adjusted in each iteration!
+        UdpListener<Arg> *any_lis = m_listeners_list.first();
+        UdpListener<Arg> *port_lis = nullptr;
+        if (udp_info.dst_port != 0) {
+            port_lis = m_listeners_index.findFirst(udp_info.dst_port);
+        }
+
+        while (any_lis != nullptr || port_lis != nullptr) {
+            // Choose the next listener and advance past it.
+            UdpListener<Arg> *lis;
+            if (port_lis == nullptr ||
+                (any_lis != nullptr && any_lis->m_seq > port_lis->m_seq))
+            {
+                lis = any_lis;
+                any_lis = m_listeners_list.next(*any_lis);
+            } else {
+                lis = port_lis;
+                port_lis = m_listeners_index.findNext(udp_info.dst_port, *port_lis);
+            }
             AIPSTACK_ASSERT(lis->m_udp == this)
             
             // Check if the listener matches, if not skip it.
             if (!lis->incomingPacketMatches(ip_info, udp_info, dst_is_iface_addr)) {
-                lis = m_listeners_list.next(*lis);
                 continue;
             }
 
@@ -573,24 +851,29 @@ public:
                 return;
             }
 
-            // Set the m_next_listener pointer to the next listener on the list (if any).
-            // In case the following callback resets (or destructs) the next listener,
-            // UdpListener::reset() will advance m_next_listener so that we can safely
+            // Set the m_next_*_listener pointers to the next listeners (if any). In
+            // case the following callback resets (or destructs) one of these listeners,
+            // UdpListener::reset() will advance the pointer so that we can safely
             // continue iterating.
-            AIPSTACK_ASSERT(m_next_listener == nullptr)
-            m_next_listener = m_listeners_list.next(*lis);
+            AIPSTACK_ASSERT(m_next_any_listener == nullptr)
+            AIPSTACK_ASSERT(m_next_port_listener == nullptr)
+            m_next_any_listener = any_lis;
+            m_next_port_listener = port_lis;
 
             // Pass the packet to the listener.
             IpBufRef udp_data = dgram.hideHeader(Udp4Header::Size);
             UdpRecvResult recv_result = lis->m_handler(ip_info, udp_info, udp_data);
 
-            // Update `lis` to the next listener (if any) and clear m_next_listener.
-            lis = m_next_listener;
-            m_next_listener = nullptr;
+            // Update the next listeners and clear the m_next_*_listener pointers.
+            any_lis = m_next_any_listener;
+            port_lis = m_next_port_listener;
+            m_next_any_listener = nullptr;
+            m_next_port_listener = nullptr;
 
             // If the listener wants that we don't pass the packet to any further listener,
             // then return here.
             if (recv_result == UdpRecvResult::AcceptStop) {
+                m_stack->stats().udp_in_datagrams.inc();
                 return;
             }
 
@@ -603,17 +886,26 @@ public:
             updateCachedInfo();
         }
 
+        if (accepted) {
+            m_stack->stats().udp_in_datagrams.inc();
+            return;
+        }
+
         // If no association or listener has accepted the datagram and it is for our IP
         // address, we should send an ICMP message.
-        if (!accepted && dst_is_iface_addr) {
+        if (dst_is_iface_addr) {
             if (!verifyChecksumOnDemand()) {
                 // Bad checksum, drop packet.
                 return;
             }
 
+            m_stack->stats().udp_no_ports.inc();
+
             // Send an ICMP Destination Unreachable, Port Unreachable message.
             Ip4DestUnreachMeta du_meta = {Icmp4CodeDestUnreachPortUnreach, Icmp4RestType()};
             m_stack->sendIp4DestUnreach(ip_info, dgram, du_meta);
+        } else {
+            m_stack->stats().udp_no_ports.inc();
         }
     }
 
@@ -635,7 +927,10 @@ private:
 
         has_checksum = (checksum != 0);
 
-        if (has_checksum) {
+        // Skip verification if already done by the driver or the IP layer.
+        if (has_checksum &&
+            (ip_info.rx_flags & IpRxFlags::ProtoChksumVerified) == EnumZero)
+        {
             IpChksumAccumulator chksum_accum;
             chksum_accum.addWords(&ip_info.src_addr.data);
             chksum_accum.addWords(&ip_info.dst_addr.data);
@@ -672,8 +967,11 @@ private:
 private:
     IpStack<StackArg> *m_stack;
     StructureRaiiWrapper<ListenersList> m_listeners_list;
+    StructureRaiiWrapper<typename ListenerIndex::Index> m_listeners_index;
     StructureRaiiWrapper<typename AssociationIndex::Index> m_associations_index;
-    UdpListener<Arg> *m_next_listener;
+    UdpListener<Arg> *m_next_any_listener;
+    UdpListener<Arg> *m_next_port_listener;
+    uint64_t m_next_listener_seq;
     PortNum m_next_ephemeral_port;
 };
 
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_IP_CAPTURE_PCAPNG_H
+#define AIPSTACK_IP_CAPTURE_PCAPNG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/ip/IpCapture.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup ip-stack
+ * @{
+ */
+
+/**
+ * Writes packets from an @ref IpCaptureTap to a file in pcapng format.
+ * 
+ * The file contains a single interface with link type `LINKTYPE_RAW` (packets start
+ * with the IP header) and microsecond timestamps. The direction of each packet is
+ * recorded in the `epb_flags` option.
+ * 
+ * The writer is the consumer of the capture tap. It can either be used directly by
+ * calling @ref writeHeader and then @ref drain periodically, or it can run in a
+ * background thread using @ref start and @ref stop.
+ */
+class IpCapturePcapngWriter :
+    private NonCopyable<IpCapturePcapngWriter>
+{
+public:
+    /**
+     * Construct the writer.
+     * 
+     * @param tap Capture tap to read packets from.
+     * @param file File to write to (opened in binary mode).
+     */
+    IpCapturePcapngWriter (IpCaptureTap *tap, FILE *file) :
+        m_tap(tap),
+        m_file(file),
+        m_running(false)
+    {}
+    
+    /**
+     * Destruct the writer, stopping the background thread if it is running.
+     */
+    ~IpCapturePcapngWriter ()
+    {
+        stop();
+    }
+    
+    /**
+     * Write the section header and interface description blocks.
+     * 
+     * This must be called once before any packets are written.
+     */
+    void writeHeader ()
+    {
+        // Section Header Block.
+        writeU32(0x0A0D0D0A);
+        writeU32(28);
+        writeU32(0x1A2B3C4D);
+        writeU16(1);
+        writeU16(0);
+        writeU32(UINT32_C(0xFFFFFFFF)); // section length unspecified
+        writeU32(UINT32_C(0xFFFFFFFF));
+        writeU32(28);
+        
+        // Interface Description Block.
+        writeU32(1);
+        writeU32(20);
+        writeU16(LinkTypeRaw);
+        writeU16(0);
+        writeU32(uint32_t(m_tap->getSnapLen()));
+        writeU32(20);
+    }
+    
+    /**
+     * Write all packets currently in the capture tap to the file.
+     * 
+     * This must only be called from one thread at a time, and not while the
+     * background thread is running.
+     * 
+     * @return Number of packets written.
+     */
+    size_t drain ()
+    {
+        size_t count = 0;
+        char const *data;
+        while (IpCaptureRecord const *rec = m_tap->peek(&data)) {
+            writePacket(*rec, data);
+            m_tap->consume();
+            count++;
+        }
+        return count;
+    }
+    
+    /**
+     * Start a background thread which writes the header and then drains the capture
+     * tap periodically, flushing the file after each write.
+     * 
+     * @param interval Interval between polls of the capture tap.
+     */
+    void start (std::chrono::milliseconds interval = std::chrono::milliseconds(10))
+    {
+        AIPSTACK_ASSERT(!m_thread.joinable())
+        
+        m_running.store(true, std::memory_order_relaxed);
+        m_thread = std::thread([this, interval] {
+            writeHeader();
+            bool more;
+            do {
+                more = m_running.load(std::memory_order_acquire);
+                if (drain() > 0) {
+                    fflush(m_file);
+                }
+                if (more) {
+                    std::this_thread::sleep_for(interval);
+                }
+            } while (more);
+            fflush(m_file);
+        });
+    }
+    
+    /**
+     * Stop the background thread if it is running.
+     * 
+     * Packets in the capture tap at the time of the call are written before the
+     * thread exits.
+     */
+    void stop ()
+    {
+        if (m_thread.joinable()) {
+            m_running.store(false, std::memory_order_release);
+            m_thread.join();
+        }
+    }
+    
+private:
+    static uint16_t const LinkTypeRaw = 101;
+    static uint16_t const OptEpbFlags = 2;
+    
+    void writePacket (IpCaptureRecord const &rec, char const *data)
+    {
+        uint32_t padded_len = (rec.cap_len + 3) & ~uint32_t(3);
+        uint32_t block_len = 32 + padded_len + 12;
+        uint32_t flags = (rec.dir == IpCaptureDir::Rx) ? 1 : 2;
+        
+        // Enhanced Packet Block.
+        writeU32(6);
+        writeU32(block_len);
+        writeU32(0); // interface ID
+        writeU32(uint32_t(rec.time_us >> 32));
+        writeU32(uint32_t(rec.time_us));
+        writeU32(rec.cap_len);
+        writeU32(rec.orig_len);
+        fwrite(data, 1, rec.cap_len, m_file);
+        static char const padding[3] = {};
+        fwrite(padding, 1, padded_len - rec.cap_len, m_file);
+        writeU16(OptEpbFlags);
+        writeU16(4);
+        writeU32(flags);
+        writeU32(0); // opt_endofopt
+        writeU32(block_len);
+    }
+    
+    // pcapng files are written in host byte order.
+    
+    void writeU16 (uint16_t value)
+    {
+        fwrite(&value, sizeof(value), 1, m_file);
+    }
+    
+    void writeU32 (uint32_t value)
+    {
+        fwrite(&value, sizeof(value), 1, m_file);
+    }
+    
+private:
+    IpCaptureTap *m_tap;
+    FILE *m_file;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+};
+
+/** @} */
+
+}
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_TRACE_FORMAT_H
+#define AIPSTACK_TRACE_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <aipstack/misc/Trace.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup tracing
+ * @{
+ */
+
+/**
+ * Return the name of a trace event.
+ * 
+ * @param event Event number (value of @ref TraceRecord::event).
+ * @return Name of the event, or "Unknown" for an unknown event number.
+ */
+inline char const * TraceEventName (uint16_t event)
+{
+    static char const * const names[] = {
+        "IpRxDrop", "IpTxError", "EthArpMiss", "TcpRxDrop", "TcpRtoFired",
+        "TcpFastRtx", "TcpIdleCwndReset", "TcpTxError", "TcpRstSent", "TcpAbort",
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == size_t(TraceEvent::NumEvents), "");
+
+    return (event < size_t(TraceEvent::NumEvents)) ? names[event] : "Unknown";
+}
+
+/**
+ * Print trace records as text, one record per line.
+ * 
+ * Each line contains the timestamp, event name and the three arguments.
+ * 
+ * @param out Stream to print to.
+ * @param records Pointer to the records (e.g. as obtained by
+ *        @ref TraceRingBuffer::snapshot).
+ * @param num_records Number of records.
+ */
+inline void TraceFormatText (FILE *out, TraceRecord const *records, size_t num_records)
+{
+    for (size_t i = 0; i < num_records; i++) {
+        TraceRecord const &rec = records[i];
+        fprintf(out, "%10" PRIu32 " %-16s %5u 0x%08" PRIx32 " %" PRIu32 "\n",
+                rec.time, TraceEventName(rec.event), unsigned(rec.arg0), rec.arg1,
+                rec.arg2);
+    }
+}
+
+/**
+ * Print trace records as a JSON array of objects.
+ * 
+ * Each object has the members "time", "event", "arg0", "arg1" and "arg2".
+ * 
+ * @param out Stream to print to.
+ * @param records Pointer to the records (e.g. as obtained by
+ *        @ref TraceRingBuffer::snapshot).
+ * @param num_records Number of records.
+ */
+inline void TraceFormatJson (FILE *out, TraceRecord const *records, size_t num_records)
+{
+    fputs("[", out);
+    for (size_t i = 0; i < num_records; i++) {
+        TraceRecord const &rec = records[i];
+        fprintf(out, "%s\n  {\"time\": %" PRIu32 ", \"event\": \"%s\", \"arg0\": %u"
+                ", \"arg1\": %" PRIu32 ", \"arg2\": %" PRIu32 "}",
+                (i == 0) ? "" : ",", rec.time, TraceEventName(rec.event),
+                unsigned(rec.arg0), rec.arg1, rec.arg2);
+    }
+    fputs("\n]\n", out);
+}
+
+/** @} */
+
+}
+
+#endif
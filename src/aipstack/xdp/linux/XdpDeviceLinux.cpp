@@ -0,0 +1,508 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/xdp/linux/XdpDeviceLinux.h>
+
+namespace AIpStack {
+
+// Size of a UMEM frame. In the (default) aligned mode the kernel places
+// received frames after XDP_PACKET_HEADROOM within a frame.
+static std::size_t const XdpFrameSize = 2048;
+
+// While sending is blocked, completions are polled at this interval since
+// they are not signaled through the socket.
+static std::chrono::milliseconds const XdpTxRetryInterval{1};
+
+// Indices shared with the kernel.
+static std::uint32_t xdp_load_index (std::uint32_t const *ptr)
+{
+    std::uint32_t value = *static_cast<std::uint32_t const volatile *>(ptr);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return value;
+}
+
+static void xdp_store_index (std::uint32_t *ptr, std::uint32_t value)
+{
+    std::atomic_thread_fence(std::memory_order_release);
+    *static_cast<std::uint32_t volatile *>(ptr) = value;
+}
+
+static int xdp_bpf (int cmd, union bpf_attr &attr)
+{
+    return int(::syscall(__NR_bpf, cmd, &attr, sizeof(attr)));
+}
+
+static struct bpf_insn xdp_insn (
+    std::uint8_t code, std::uint8_t dst, std::uint8_t src, std::int16_t off,
+    std::int32_t imm)
+{
+    struct bpf_insn insn;
+    std::memset(&insn, 0, sizeof(insn));
+    insn.code = code;
+    insn.dst_reg = dst & 0xF;
+    insn.src_reg = src & 0xF;
+    insn.off = off;
+    insn.imm = imm;
+    return insn;
+}
+
+XdpDeviceLinux::Mapping::Mapping () :
+    ptr(nullptr),
+    size(0)
+{}
+
+XdpDeviceLinux::Mapping::~Mapping ()
+{
+    if (ptr != nullptr) {
+        ::munmap(ptr, size);
+    }
+}
+
+void XdpDeviceLinux::Mapping::map (int fd, std::size_t map_size, long offset)
+{
+    int flags = (fd < 0) ? (MAP_PRIVATE|MAP_ANONYMOUS) : (MAP_SHARED|MAP_POPULATE);
+    void *addr = ::mmap(nullptr, map_size, PROT_READ|PROT_WRITE, flags, fd, offset);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("mmap for AF_XDP failed.");
+    }
+    ptr = static_cast<char *>(addr);
+    size = map_size;
+}
+
+XdpDeviceLinux::XdpDeviceLinux (
+    AIpStack::EventLoop &loop, std::string const &ifname, FrameReceivedHandler handler,
+    TxReadyHandler tx_ready_handler, XdpDeviceLinuxParams const &params)
+:
+    m_handler(handler),
+    m_tx_ready_handler(tx_ready_handler),
+    m_fd_watcher(loop, AIPSTACK_BIND_MEMBER(&XdpDeviceLinux::handleFdEvents, this)),
+    m_kick_timer(loop, AIPSTACK_BIND_MEMBER(&XdpDeviceLinux::kickTimerHandler, this)),
+    m_ring_size(params.ring_size),
+    m_rx_flags(params.trust_rx_chksum ?
+        AIpStack::IpRxFlags::ProtoChksumVerified : AIpStack::IpRxFlags()),
+    m_zero_copy(false),
+    m_tx_pending(false),
+    m_active(true),
+    m_tx_blocked(false)
+{
+    if (m_ring_size == 0 || (m_ring_size & (m_ring_size - 1)) != 0 ||
+        params.frame_count <= m_ring_size)
+    {
+        throw std::runtime_error("Invalid AF_XDP parameters.");
+    }
+    
+    unsigned int ifindex = ::if_nametoindex(ifname.c_str());
+    if (ifindex == 0) {
+        throw std::runtime_error("Network interface not found.");
+    }
+    
+    {
+        AIpStack::FileDescriptorWrapper sock{::socket(AF_INET, SOCK_DGRAM, 0)};
+        if (!sock) {
+            throw std::runtime_error("socket(AF_INET, SOCK_DGRAM) failed.");
+        }
+        
+        struct ifreq ifr;
+        std::memset(&ifr, 0, sizeof(ifr));
+        std::snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ifname.c_str());
+        
+        if (::ioctl(*sock, SIOCGIFMTU, reinterpret_cast<void *>(&ifr)) < 0) {
+            throw std::runtime_error("ioctl(SIOCGIFMTU) failed.");
+        }
+        
+        m_frame_mtu = std::size_t(ifr.ifr_mtu) + AIpStack::EthHeader::Size;
+    }
+    
+    if (m_frame_mtu > XdpFrameSize - XDP_PACKET_HEADROOM) {
+        throw std::runtime_error("Interface MTU too large for AF_XDP frames.");
+    }
+    
+    m_fd = AIpStack::FileDescriptorWrapper{::socket(AF_XDP, SOCK_RAW, 0)};
+    if (!m_fd) {
+        throw std::runtime_error("socket(AF_XDP) failed.");
+    }
+    
+    m_fd.setNonblocking();
+    
+    // Register the UMEM and set up the rings.
+    m_umem.map(-1, params.frame_count * XdpFrameSize, 0);
+    
+    struct xdp_umem_reg umem_reg;
+    std::memset(&umem_reg, 0, sizeof(umem_reg));
+    umem_reg.addr = reinterpret_cast<std::uintptr_t>(m_umem.ptr);
+    umem_reg.len = m_umem.size;
+    umem_reg.chunk_size = XdpFrameSize;
+    
+    if (::setsockopt(*m_fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) < 0) {
+        throw std::runtime_error("setsockopt(XDP_UMEM_REG) failed.");
+    }
+    
+    for (int opt : {XDP_UMEM_FILL_RING, XDP_UMEM_COMPLETION_RING, XDP_RX_RING,
+                    XDP_TX_RING})
+    {
+        if (::setsockopt(*m_fd, SOL_XDP, opt, &m_ring_size, sizeof(m_ring_size)) < 0) {
+            throw std::runtime_error("setsockopt(SOL_XDP) for ring failed.");
+        }
+    }
+    
+    struct xdp_mmap_offsets offsets;
+    socklen_t offsets_len = sizeof(offsets);
+    if (::getsockopt(*m_fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsets_len) < 0) {
+        throw std::runtime_error("getsockopt(XDP_MMAP_OFFSETS) failed.");
+    }
+    
+    auto map_ring = [this](Ring &ring, struct xdp_ring_offset const &ring_offsets,
+                           std::size_t desc_size, long pgoff)
+    {
+        ring.mem.map(*m_fd, ring_offsets.desc + m_ring_size * desc_size, pgoff);
+        ring.producer = reinterpret_cast<std::uint32_t *>(
+            ring.mem.ptr + ring_offsets.producer);
+        ring.consumer = reinterpret_cast<std::uint32_t *>(
+            ring.mem.ptr + ring_offsets.consumer);
+        ring.flags = reinterpret_cast<std::uint32_t *>(ring.mem.ptr + ring_offsets.flags);
+        ring.descs = ring.mem.ptr + ring_offsets.desc;
+        ring.cached_index = 0;
+    };
+    
+    map_ring(m_fill, offsets.fr, sizeof(std::uint64_t), XDP_UMEM_PGOFF_FILL_RING);
+    map_ring(m_comp, offsets.cr, sizeof(std::uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING);
+    map_ring(m_rx, offsets.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+    map_ring(m_tx, offsets.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING);
+    
+    // The first ring_size frames are given to the kernel for receiving, the
+    // rest are used for sending.
+    auto *fill_descs = reinterpret_cast<std::uint64_t *>(m_fill.descs);
+    for (std::uint32_t i = 0; i < m_ring_size; i++) {
+        fill_descs[i] = std::uint64_t(i) * XdpFrameSize;
+    }
+    m_fill.cached_index = m_ring_size;
+    xdp_store_index(m_fill.producer, m_fill.cached_index);
+    
+    m_tx_free.reserve(params.frame_count - m_ring_size);
+    for (std::size_t i = m_ring_size; i < params.frame_count; i++) {
+        m_tx_free.push_back(std::uint64_t(i) * XdpFrameSize);
+    }
+    
+    // Bind to the queue, in zero-copy mode if the driver supports it.
+    struct sockaddr_xdp addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = ifindex;
+    addr.sxdp_queue_id = params.queue_id;
+    addr.sxdp_flags = XDP_USE_NEED_WAKEUP|XDP_ZEROCOPY;
+    
+    if (::bind(*m_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        addr.sxdp_flags = XDP_USE_NEED_WAKEUP|XDP_COPY;
+        if (::bind(*m_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+            throw std::runtime_error("bind(AF_XDP) failed.");
+        }
+    }
+    
+    struct xdp_options options;
+    socklen_t options_len = sizeof(options);
+    if (::getsockopt(*m_fd, SOL_XDP, XDP_OPTIONS, &options, &options_len) == 0) {
+        m_zero_copy = (options.flags & XDP_OPTIONS_ZEROCOPY) != 0;
+    }
+    
+    attach_program(ifindex, params.queue_id);
+    
+    m_fd_watcher.initFd(*m_fd, AIpStack::EventLoopFdEvents::Read);
+}
+
+XdpDeviceLinux::~XdpDeviceLinux ()
+{}
+
+void XdpDeviceLinux::attach_program (unsigned int ifindex, std::uint32_t queue_id)
+{
+    union bpf_attr attr;
+    
+    // Map from queue index to the socket.
+    std::memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(std::uint32_t);
+    attr.value_size = sizeof(std::uint32_t);
+    attr.max_entries = queue_id + 1;
+    
+    m_map_fd = AIpStack::FileDescriptorWrapper{xdp_bpf(BPF_MAP_CREATE, attr)};
+    if (!m_map_fd) {
+        throw std::runtime_error("bpf(BPF_MAP_CREATE) failed.");
+    }
+    
+    std::uint32_t key = queue_id;
+    std::uint32_t value = std::uint32_t(*m_fd);
+    
+    std::memset(&attr, 0, sizeof(attr));
+    attr.map_fd = std::uint32_t(*m_map_fd);
+    attr.key = reinterpret_cast<std::uintptr_t>(&key);
+    attr.value = reinterpret_cast<std::uintptr_t>(&value);
+    attr.flags = BPF_ANY;
+    
+    if (xdp_bpf(BPF_MAP_UPDATE_ELEM, attr) < 0) {
+        throw std::runtime_error("bpf(BPF_MAP_UPDATE_ELEM) failed.");
+    }
+    
+    // return bpf_redirect_map(&map, ctx->rx_queue_index, XDP_PASS);
+    // Frames of queues without a socket are passed to the kernel.
+    struct bpf_insn insns[] = {
+        xdp_insn(BPF_LDX|BPF_MEM|BPF_W, BPF_REG_2, BPF_REG_1,
+                 offsetof(struct xdp_md, rx_queue_index), 0),
+        xdp_insn(BPF_LD|BPF_DW|BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, *m_map_fd),
+        xdp_insn(0, 0, 0, 0, 0),
+        xdp_insn(BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+        xdp_insn(BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        xdp_insn(BPF_JMP|BPF_EXIT, 0, 0, 0, 0),
+    };
+    static char const license[] = "BSD";
+    
+    std::memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = reinterpret_cast<std::uintptr_t>(insns);
+    attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+    attr.license = reinterpret_cast<std::uintptr_t>(license);
+    
+    m_prog_fd = AIpStack::FileDescriptorWrapper{xdp_bpf(BPF_PROG_LOAD, attr)};
+    if (!m_prog_fd) {
+        throw std::runtime_error("bpf(BPF_PROG_LOAD) failed.");
+    }
+    
+    // Attach through a link, so the program is detached when the link is
+    // closed. Try native (driver) mode first, then generic mode.
+    for (std::uint32_t flags : {std::uint32_t(0), std::uint32_t(XDP_FLAGS_SKB_MODE)}) {
+        std::memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = std::uint32_t(*m_prog_fd);
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = flags;
+        
+        m_link_fd = AIpStack::FileDescriptorWrapper{xdp_bpf(BPF_LINK_CREATE, attr)};
+        if (m_link_fd) {
+            return;
+        }
+    }
+    
+    throw std::runtime_error("bpf(BPF_LINK_CREATE) for XDP failed.");
+}
+
+std::size_t XdpDeviceLinux::getMtu () const
+{
+    return m_frame_mtu;
+}
+
+bool XdpDeviceLinux::isZeroCopy () const
+{
+    return m_zero_copy;
+}
+
+AIpStack::IpErr XdpDeviceLinux::sendFrame (AIpStack::IpBufRef frame)
+{
+    if (!m_active) {
+        return AIpStack::IpErr::HW_ERROR;
+    }
+    
+    if (frame.tot_len < AIpStack::EthHeader::Size) {
+        return AIpStack::IpErr::HW_ERROR;
+    }
+    else if (frame.tot_len > m_frame_mtu) {
+        return AIpStack::IpErr::PKT_TOO_LARGE;
+    }
+    
+    // If out of frames or ring space, pass what we have to the kernel now,
+    // which may complete some frames.
+    if (!tx_space_available()) {
+        if (m_tx_pending) {
+            kick_tx();
+        } else {
+            reap_completions();
+        }
+    }
+    
+    if (!tx_space_available()) {
+        // Poll for completions until sending is possible to report that.
+        if (m_tx_ready_handler && !m_tx_blocked) {
+            m_tx_blocked = true;
+            m_kick_timer.setAfter(XdpTxRetryInterval);
+        }
+        return AIpStack::IpErr::BUFFER_FULL;
+    }
+    
+    std::uint64_t umem_addr = m_tx_free.back();
+    m_tx_free.pop_back();
+    
+    std::size_t len = frame.tot_len;
+    frame.takeBytes(len, m_umem.ptr + umem_addr);
+    
+    auto *descs = reinterpret_cast<struct xdp_desc *>(m_tx.descs);
+    struct xdp_desc &desc = descs[m_tx.cached_index & (m_ring_size - 1)];
+    desc.addr = umem_addr;
+    desc.len = std::uint32_t(len);
+    desc.options = 0;
+    m_tx.cached_index++;
+    
+    // Frames are passed to the kernel after the current event loop iteration,
+    // together with any others queued until then.
+    if (!m_tx_pending) {
+        m_tx_pending = true;
+        if (!m_tx_blocked) {
+            m_kick_timer.setAfter(AIpStack::EventLoopDuration::zero());
+        }
+    }
+    
+    return AIpStack::IpErr::SUCCESS;
+}
+
+bool XdpDeviceLinux::tx_space_available ()
+{
+    return !m_tx_free.empty() &&
+        m_tx.cached_index - xdp_load_index(m_tx.consumer) < m_ring_size;
+}
+
+void XdpDeviceLinux::kick_tx ()
+{
+    m_tx_pending = false;
+    
+    xdp_store_index(m_tx.producer, m_tx.cached_index);
+    
+    wake_tx();
+    reap_completions();
+}
+
+void XdpDeviceLinux::wake_tx ()
+{
+    // In copy mode frames are only sent from sendto. Errors here are not
+    // reported, frames which were not sent remain in the ring.
+    if (!m_zero_copy || (xdp_load_index(m_tx.flags) & XDP_RING_NEED_WAKEUP) != 0) {
+        ::sendto(*m_fd, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+    }
+}
+
+void XdpDeviceLinux::reap_completions ()
+{
+    std::uint32_t producer = xdp_load_index(m_comp.producer);
+    auto *descs = reinterpret_cast<std::uint64_t *>(m_comp.descs);
+    
+    while (m_comp.cached_index != producer) {
+        m_tx_free.push_back(descs[m_comp.cached_index & (m_ring_size - 1)]);
+        m_comp.cached_index++;
+    }
+    
+    xdp_store_index(m_comp.consumer, m_comp.cached_index);
+}
+
+void XdpDeviceLinux::kickTimerHandler ()
+{
+    if (!m_active) {
+        return;
+    }
+    
+    if (m_tx_pending) {
+        kick_tx();
+    }
+    
+    if (m_tx_blocked) {
+        // Push frames which the kernel did not send yet and check again.
+        if (m_tx.cached_index != xdp_load_index(m_tx.consumer)) {
+            wake_tx();
+        }
+        reap_completions();
+        
+        if (!tx_space_available()) {
+            m_kick_timer.setAfter(XdpTxRetryInterval);
+            return;
+        }
+        
+        m_tx_blocked = false;
+        m_tx_ready_handler();
+    }
+}
+
+void XdpDeviceLinux::handleFdEvents (AIpStack::EventLoopFdEvents events)
+{
+    AIPSTACK_ASSERT(m_active)
+    
+    if ((events & AIpStack::EventLoopFdEvents::Error) != AIpStack::EnumZero) {
+        std::fprintf(stderr, "XdpDeviceLinux: Error event. Stopping.\n");
+        m_fd_watcher.reset();
+        m_kick_timer.unset();
+        m_active = false;
+        return;
+    }
+    
+    if ((events & AIpStack::EventLoopFdEvents::Read) != AIpStack::EnumZero) {
+        process_rx();
+    }
+}
+
+void XdpDeviceLinux::process_rx ()
+{
+    std::uint32_t producer = xdp_load_index(m_rx.producer);
+    auto *rx_descs = reinterpret_cast<struct xdp_desc *>(m_rx.descs);
+    auto *fill_descs = reinterpret_cast<std::uint64_t *>(m_fill.descs);
+    
+    while (m_rx.cached_index != producer) {
+        struct xdp_desc desc = rx_descs[m_rx.cached_index & (m_ring_size - 1)];
+        m_rx.cached_index++;
+        
+        AIpStack::IpBufNode node{m_umem.ptr + desc.addr, desc.len, nullptr};
+        m_handler(AIpStack::IpBufRef{&node, 0, desc.len}, m_rx_flags);
+        
+        // The frame is no longer used, give it back for receiving. The fill
+        // ring cannot be full since it only holds our receive frames.
+        fill_descs[m_fill.cached_index & (m_ring_size - 1)] =
+            desc.addr & ~std::uint64_t(XdpFrameSize - 1);
+        m_fill.cached_index++;
+    }
+    
+    xdp_store_index(m_rx.consumer, m_rx.cached_index);
+    xdp_store_index(m_fill.producer, m_fill.cached_index);
+    
+    // In zero-copy mode the driver may need to be woken up to use the frames.
+    if ((xdp_load_index(m_fill.flags) & XDP_RING_NEED_WAKEUP) != 0) {
+        ::recvfrom(*m_fd, nullptr, 0, MSG_DONTWAIT, nullptr, nullptr);
+    }
+}
+
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AIPSTACK_XDP_DEVICE_LINUX_H
+#define AIPSTACK_XDP_DEVICE_LINUX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/platform_specific/FileDescriptorWrapper.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/ip/IpStackTypes.h>
+#include <aipstack/event_loop/EventLoop.h>
+
+namespace AIpStack {
+
+struct XdpDeviceLinuxParams {
+    // Queue of the interface to receive from and send to.
+    std::uint32_t queue_id = 0;
+
+    // Number of entries in each ring (a power of two). This many UMEM frames
+    // are used for receiving and the rest for sending.
+    std::uint32_t ring_size = 2048;
+
+    // Number of UMEM frames, must be more than ring_size.
+    std::size_t frame_count = 4096;
+
+    // Report the transport checksums of received frames as verified. XDP gives
+    // no checksum information, so by default the stack verifies checksums in
+    // software. Frames which the local host sends through a veth normally have
+    // only a partial checksum, so this is needed in that case. It must only be
+    // used for such local links where the peer is trusted, never for a
+    // physical NIC.
+    bool trust_rx_chksum = false;
+};
+
+// Ethernet device driver for an existing network interface using an AF_XDP
+// socket. An XDP program which redirects the frames of the queue to the socket
+// is attached to the interface for the lifetime of this object, so only one
+// such device can exist per interface.
+//
+// Frames are received into UMEM frames and passed to the handler without
+// copying; each UMEM frame is given back to the kernel through the fill ring
+// after the handler returns. Transmitted frames are copied into free UMEM
+// frames, passed to the kernel once per event loop iteration, and recycled
+// from the completion ring. Zero-copy mode is used if the driver supports
+// it, otherwise copy mode (this is the case for veth). The XDP program is
+// attached in native mode if possible, otherwise in generic mode.
+//
+// The interface is similar to TapDeviceLinux, so it can be used in its place.
+class XdpDeviceLinux :
+    private AIpStack::NonCopyable<XdpDeviceLinux>
+{
+public:
+    using FrameReceivedHandler =
+        Function<void(AIpStack::IpBufRef frame, AIpStack::IpRxFlags rx_flags)>;
+    using TxReadyHandler = Function<void()>;
+    using Params = XdpDeviceLinuxParams;
+
+    XdpDeviceLinux (AIpStack::EventLoop &loop, std::string const &ifname,
+                    FrameReceivedHandler handler,
+                    TxReadyHandler tx_ready_handler = nullptr,
+                    XdpDeviceLinuxParams const &params = XdpDeviceLinuxParams());
+
+    ~XdpDeviceLinux ();
+
+    std::size_t getMtu () const;
+
+    // Whether the socket is in zero-copy mode (as opposed to copy mode).
+    bool isZeroCopy () const;
+
+    AIpStack::IpErr sendFrame (AIpStack::IpBufRef frame);
+
+private:
+    // Owns a memory mapping (the UMEM or a ring).
+    class Mapping :
+        private AIpStack::NonCopyable<Mapping>
+    {
+    public:
+        Mapping ();
+        ~Mapping ();
+        
+        void map (int fd, std::size_t size, long offset);
+        
+        char *ptr;
+        std::size_t size;
+    };
+
+    // A ring shared with the kernel. We are the producer of the fill and TX
+    // rings and the consumer of the others; the cached index is ours.
+    struct Ring {
+        Mapping mem;
+        std::uint32_t *producer;
+        std::uint32_t *consumer;
+        std::uint32_t *flags;
+        char *descs;
+        std::uint32_t cached_index;
+    };
+
+    void attach_program (unsigned int ifindex, std::uint32_t queue_id);
+
+    void handleFdEvents (AIpStack::EventLoopFdEvents events);
+
+    void kickTimerHandler ();
+
+    void process_rx ();
+
+    void kick_tx ();
+
+    void wake_tx ();
+
+    void reap_completions ();
+
+    bool tx_space_available ();
+
+private:
+    FrameReceivedHandler m_handler;
+    TxReadyHandler m_tx_ready_handler;
+    Mapping m_umem;
+    AIpStack::FileDescriptorWrapper m_fd;
+    Ring m_fill;
+    Ring m_comp;
+    Ring m_rx;
+    Ring m_tx;
+    AIpStack::FileDescriptorWrapper m_map_fd;
+    AIpStack::FileDescriptorWrapper m_prog_fd;
+    AIpStack::FileDescriptorWrapper m_link_fd;
+    AIpStack::EventLoopFdWatcher m_fd_watcher;
+    AIpStack::EventLoopTimer m_kick_timer;
+    std::vector<std::uint64_t> m_tx_free;
+    std::size_t m_frame_mtu;
+    std::uint32_t m_ring_size;
+    AIpStack::IpRxFlags m_rx_flags;
+    bool m_zero_copy;
+    bool m_tx_pending;
+    bool m_active;
+    bool m_tx_blocked;
+};
+
+}
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <deque>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/SimPlatformImpl.h>
+#include <aipstack/eth/EthTxQueue.h>
+
+using namespace AIpStack;
+
+using Platform = PlatformFacade<SimPlatformImpl>;
+using TxQueue = EthTxQueue<SimPlatformImpl>;
+
+static size_t const RingSize = 4000;
+static size_t const MinLimit = 1000;
+static size_t const MaxLimit = 3000;
+
+// Driver which keeps sent frames until they are completed by the test.
+struct TestDriver {
+    IpErr sendFrame (IpBufRef frame)
+    {
+        if (full) {
+            return IpErr::BUFFER_FULL;
+        }
+        
+        // The limit is respected except that a frame can always be sent to
+        // an empty driver.
+        AIPSTACK_ASSERT_FORCE(queue->getInflight() == 0 ||
+                              queue->getInflight() + frame.tot_len <= queue->getLimit())
+        
+        std::vector<char> data(frame.tot_len);
+        frame.takeBytes(frame.tot_len, data.data());
+        frames.push_back(data);
+        return IpErr::SUCCESS;
+    }
+    
+    // Complete up to the given number of frames, checking their contents.
+    void complete (size_t count)
+    {
+        size_t bytes = 0;
+        while (count-- > 0 && !frames.empty()) {
+            std::vector<char> const &data = frames.front();
+            AIPSTACK_ASSERT_FORCE(data.size() == frame_len(next_seq))
+            for (size_t i = 0; i < data.size(); i++) {
+                AIPSTACK_ASSERT_FORCE(data[i] == frame_byte(next_seq, i))
+            }
+            bytes += data.size();
+            next_seq++;
+            frames.pop_front();
+        }
+        queue->txCompleted(bytes);
+    }
+    
+    static size_t frame_len (int seq)
+    {
+        return 60 + size_t(seq * 379) % 900;
+    }
+    
+    static char frame_byte (int seq, size_t i)
+    {
+        return char(seq * 7 + int(i));
+    }
+    
+    TxQueue *queue = nullptr;
+    bool full = false;
+    int next_seq = 0;
+    std::deque<std::vector<char>> frames;
+};
+
+static bool send_one (TxQueue &queue, int seq)
+{
+    std::vector<char> data(TestDriver::frame_len(seq));
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = TestDriver::frame_byte(seq, i);
+    }
+    IpBufNode node{data.data(), data.size(), nullptr};
+    return queue.sendFrame(IpBufRef{&node, 0, data.size()}) == IpErr::SUCCESS;
+}
+
+// Send frames until the queue is full, returns the next sequence number.
+static int fill (TxQueue &queue, int seq)
+{
+    while (send_one(queue, seq)) {
+        seq++;
+    }
+    return seq;
+}
+
+int main ()
+{
+    SimPlatformImpl sim;
+    Platform platform(&sim);
+    
+    TestDriver driver;
+    std::vector<char> ring(RingSize);
+    int ready_calls = 0;
+    
+    EthTxQueueParams params;
+    params.ring_buf = ring.data();
+    params.ring_size = RingSize;
+    params.min_limit = MinLimit;
+    params.max_limit = MaxLimit;
+    params.send_frame = [&driver](IpBufRef frame) { return driver.sendFrame(frame); };
+    params.tx_ready = [&ready_calls]() { ready_calls++; };
+    
+    TxQueue queue(platform, params);
+    driver.queue = &queue;
+    
+    // Frames beyond the limit are queued, until the queue is full.
+    int seq = fill(queue, 0);
+    AIPSTACK_ASSERT_FORCE(queue.getInflight() > 0 && queue.getQueuedFrames() > 0)
+    sim.runUntilIdle();
+    AIPSTACK_ASSERT_FORCE(ready_calls == 0)
+    
+    // Completing frames passes queued frames on, in the next event loop iteration.
+    // The queue wraps around many times.
+    for (int i = 0; i < 200; i++) {
+        driver.complete(1 + size_t(i % 3));
+        AIPSTACK_ASSERT_FORCE(ready_calls <= i + 1)
+        sim.runUntilIdle();
+        seq = fill(queue, seq);
+    }
+    AIPSTACK_ASSERT_FORCE(ready_calls > 0)
+    
+    // If the driver runs out of data while frames are held back, the limit is raised.
+    size_t limit = queue.getLimit();
+    driver.complete(driver.frames.size());
+    AIPSTACK_ASSERT_FORCE(queue.getLimit() > limit || limit == MaxLimit)
+    sim.runUntilIdle();
+    
+    // Frames stay queued while the driver is full, until it is ready again.
+    driver.full = true;
+    driver.complete(driver.frames.size());
+    sim.runUntilIdle();
+    size_t queued = queue.getQueuedFrames();
+    AIPSTACK_ASSERT_FORCE(queued > 0 && driver.frames.empty())
+    driver.full = false;
+    queue.txReady();
+    sim.runUntilIdle();
+    AIPSTACK_ASSERT_FORCE(queue.getQueuedFrames() < queued && !driver.frames.empty())
+    
+    // Drain everything; all frames arrive in order.
+    while (queue.getQueuedFrames() > 0 || !driver.frames.empty()) {
+        driver.complete(1);
+        sim.runUntilIdle();
+    }
+    AIPSTACK_ASSERT_FORCE(driver.next_seq == seq)
+    AIPSTACK_ASSERT_FORCE(queue.getInflight() == 0)
+    
+    // If the limit is not reached for a while, it is lowered to what was used.
+    AIPSTACK_ASSERT_FORCE(queue.getLimit() > MinLimit)
+    for (int i = 0; i < 20; i++) {
+        AIPSTACK_ASSERT_FORCE(send_one(queue, seq++))
+        driver.complete(1);
+    }
+    AIPSTACK_ASSERT_FORCE(queue.getLimit() == MinLimit)
+    
+    // A frame larger than the queue is only passed to the driver directly. When
+    // the driver is full or over the limit, tx_ready is called once it is not.
+    std::vector<char> big(RingSize + 1000, 'x');
+    IpBufNode big_node{big.data(), big.size(), nullptr};
+    IpBufRef big_frame{&big_node, 0, big.size()};
+    int ready_before = ready_calls;
+    
+    driver.full = true;
+    AIPSTACK_ASSERT_FORCE(queue.sendFrame(big_frame) == IpErr::BUFFER_FULL)
+    sim.runUntilIdle();
+    AIPSTACK_ASSERT_FORCE(ready_calls == ready_before)
+    driver.full = false;
+    queue.txReady();
+    sim.runUntilIdle();
+    AIPSTACK_ASSERT_FORCE(ready_calls == ready_before + 1)
+    
+    AIPSTACK_ASSERT_FORCE(send_one(queue, seq++))
+    AIPSTACK_ASSERT_FORCE(queue.sendFrame(big_frame) == IpErr::BUFFER_FULL)
+    sim.runUntilIdle();
+    AIPSTACK_ASSERT_FORCE(ready_calls == ready_before + 1)
+    driver.complete(1);
+    sim.runUntilIdle();
+    AIPSTACK_ASSERT_FORCE(ready_calls == ready_before + 2)
+    
+    AIPSTACK_ASSERT_FORCE(queue.sendFrame(big_frame) == IpErr::SUCCESS)
+    AIPSTACK_ASSERT_FORCE(driver.frames.size() == 1 &&
+                          driver.frames.front().size() == big.size())
+    driver.frames.pop_front();
+    queue.txCompleted(big.size());
+    AIPSTACK_ASSERT_FORCE(queue.getInflight() == 0 && queue.getQueuedFrames() == 0)
+    
+    return 0;
+}
@@ -0,0 +1,542 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/infra/SendRetry.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/SimPlatformImpl.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/udp/IpUdpProto.h>
+#include <aipstack/eth/EthIpIface.h>
+
+using namespace AIpStack;
+
+using Platform = PlatformFacade<SimPlatformImpl>;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::HeaderBeforeIp::Is<EthHeader::Size>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<AvlTreeIndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<
+            IpReassemblyOptions::MaxReassEntrys::Is<2>
+        >
+    >
+>;
+
+using TestProtocolServices = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::PcbIndexService::Is<AvlTreeIndexService>
+    >,
+    IpUdpProtoService<
+        IpUdpProtoOptions::UdpIndexService::Is<AvlTreeIndexService>
+    >
+>;
+
+using TestEthIpIfaceService = EthIpIfaceService<
+    EthIpIfaceOptions::NumArpEntries::Is<4>,
+    EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    EthIpIfaceOptions::TimersStructureService::Is<LinkedHeapService>
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimPlatformImpl, TestProtocolServices> {};
+
+using TestIpStack = IpStack<TestStackArg>;
+
+class TestEthIpIfaceArg : public TestEthIpIfaceService::template Compose<
+    SimPlatformImpl, TestStackArg> {};
+
+using TestEthIpIface = EthIpIface<TestEthIpIfaceArg>;
+
+using TestTcpArg = TestIpStack::GetProtoArg<TcpApi>;
+using TestUdpArg = TestIpStack::GetProtoArg<UdpApi>;
+
+static Ip4Addr const ClientAddr = Ip4Addr::FromBytes(10, 0, 0, 1);
+static Ip4Addr const ServerAddr = Ip4Addr::FromBytes(10, 0, 0, 2);
+static MacAddr const ClientMac = MacAddr::Make(0x02, 0x00, 0x00, 0x00, 0x00, 0x01);
+static MacAddr const ServerMac = MacAddr::Make(0x02, 0x00, 0x00, 0x00, 0x00, 0x02);
+static uint16_t const ServerPort = 80;
+static uint16_t const UdpPort = 5001;
+static size_t const FrameSize = 1514;
+static size_t const BufSize = 32768;
+static uint64_t const Second = uint64_t(Platform::TimeFreq);
+
+// One direction of an Ethernet link with a transmit queue of a fixed number of
+// frames. One frame is taken from the queue every FrameTime and arrives at the
+// receiver after Delay. Sending into a full queue fails with BUFFER_FULL, and
+// when a frame is next taken from the queue the ready handler is called (if
+// enabled), like a driver would call txReady.
+class TestEthLink {
+public:
+    using ReceiveHandler = Function<void(IpBufRef frame)>;
+    using ReadyHandler = Function<void()>;
+
+    static uint64_t const FrameTime = Second / 10000;
+    static uint64_t const Delay = Second / 100;
+
+    TestEthLink (Platform platform, size_t capacity) :
+        notify_ready(true),
+        num_full(0),
+        m_capacity(capacity),
+        m_full(false),
+        m_tx_timer(platform, AIPSTACK_BIND_MEMBER_TN(&TestEthLink::txTimerHandler, this)),
+        m_rx_timer(platform, AIPSTACK_BIND_MEMBER_TN(&TestEthLink::rxTimerHandler, this))
+    {}
+
+    void setReceiveHandler (ReceiveHandler handler)
+    {
+        m_recv_handler = handler;
+    }
+
+    void setReadyHandler (ReadyHandler handler)
+    {
+        m_ready_handler = handler;
+    }
+
+    IpErr pushFrame (IpBufRef frame)
+    {
+        AIPSTACK_ASSERT_FORCE(frame.tot_len <= FrameSize)
+
+        if (m_tx_queue.size() >= m_capacity) {
+            m_full = true;
+            num_full++;
+            return IpErr::BUFFER_FULL;
+        }
+
+        std::vector<char> data(frame.tot_len);
+        frame.takeBytes(frame.tot_len, data.data());
+        m_tx_queue.push_back(std::move(data));
+
+        if (!m_tx_timer.isSet()) {
+            m_tx_timer.setAfter(FrameTime);
+        }
+
+        return IpErr::SUCCESS;
+    }
+
+    bool notify_ready;
+    size_t num_full;
+
+private:
+    struct Frame {
+        Platform::TimeType arrival;
+        std::vector<char> data;
+    };
+
+    void txTimerHandler ()
+    {
+        Platform::TimeType now = m_tx_timer.platform().getTime();
+        m_rx_queue.push_back(Frame{now + Delay, std::move(m_tx_queue.front())});
+        m_tx_queue.pop_front();
+
+        if (!m_rx_timer.isSet()) {
+            m_rx_timer.setAt(m_rx_queue.front().arrival);
+        }
+        if (!m_tx_queue.empty()) {
+            m_tx_timer.setAfter(FrameTime);
+        }
+
+        if (m_full && notify_ready) {
+            m_full = false;
+            m_ready_handler();
+        }
+    }
+
+    void rxTimerHandler ()
+    {
+        Platform::TimeType now = m_rx_timer.platform().getTime();
+
+        while (!m_rx_queue.empty() && m_rx_queue.front().arrival <= now) {
+            Frame frame = std::move(m_rx_queue.front());
+            m_rx_queue.pop_front();
+
+            IpBufNode node{frame.data.data(), frame.data.size(), nullptr};
+            m_recv_handler(IpBufRef{&node, 0, frame.data.size()});
+        }
+
+        if (!m_rx_queue.empty()) {
+            m_rx_timer.setAt(m_rx_queue.front().arrival);
+        }
+    }
+
+private:
+    size_t m_capacity;
+    bool m_full;
+    Platform::Timer m_tx_timer;
+    Platform::Timer m_rx_timer;
+    ReceiveHandler m_recv_handler;
+    ReadyHandler m_ready_handler;
+    std::deque<std::vector<char>> m_tx_queue;
+    std::deque<Frame> m_rx_queue;
+};
+
+// Less than a round trip, so data sent in this time after BUFFER_FULL can only
+// arrive if the sender was resumed by txReady, not by received ACKs or by TCP's
+// own retry timer (OutputRetryFullTicks).
+static uint64_t const BurstTime = 3 * TestEthLink::Delay / 2;
+
+// Ethernet interface which sends through one link and receives from another.
+class TestEthIface {
+public:
+    TestEthIface (Platform platform, TestIpStack *stack, Ip4Addr addr,
+                  MacAddr const &mac_addr, TestEthLink *tx_link, TestEthLink *rx_link) :
+        m_tx_link(tx_link),
+        m_mac_addr(mac_addr),
+        m_eth_iface(platform, stack, EthIfaceDriverParams{
+            /*eth_mtu=*/ FrameSize,
+            /*mac_addr=*/ &m_mac_addr,
+            AIPSTACK_BIND_MEMBER_TN(&TestEthIface::driverSendFrame, this),
+            AIPSTACK_BIND_MEMBER_TN(&TestEthIface::driverGetEthState, this)
+        })
+    {
+        m_eth_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, addr));
+        tx_link->setReadyHandler(AIPSTACK_BIND_MEMBER_TN(&TestEthIface::txReady, this));
+        rx_link->setReceiveHandler(AIPSTACK_BIND_MEMBER_TN(&TestEthIface::recvFrame, this));
+    }
+
+private:
+    IpErr driverSendFrame (IpBufRef frame)
+    {
+        return m_tx_link->pushFrame(frame);
+    }
+
+    EthIfaceState driverGetEthState ()
+    {
+        EthIfaceState state = {};
+        state.link_up = true;
+        return state;
+    }
+
+    void txReady ()
+    {
+        m_eth_iface.txReady();
+    }
+
+    void recvFrame (IpBufRef frame)
+    {
+        m_eth_iface.recvFrame(frame);
+    }
+
+private:
+    TestEthLink *m_tx_link;
+    MacAddr m_mac_addr;
+    TestEthIpIface m_eth_iface;
+};
+
+// A connection using a single ring buffer, which sends a requested amount of
+// data and counts received data.
+class TestConnection : public TcpConnection<TestTcpArg> {
+public:
+    TestConnection () :
+        received(0),
+        m_node{m_buf, BufSize, &m_node},
+        m_to_send(0)
+    {
+        memset(m_buf, 'x', BufSize);
+    }
+
+    void startClient (TestIpStack &stack)
+    {
+        TcpStartConnectionArgs<TestTcpArg> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        args.rcv_wnd = BufSize;
+        IpErr err = startConnection(stack.getProtoApi<TcpApi>(), args);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+        setRecvBuf({&m_node, 0, BufSize});
+        setSendBuf({&m_node, 0, 0});
+    }
+
+    void startServer (TcpListener<TestTcpArg> &listener)
+    {
+        IpErr err = acceptConnection(listener);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+        setRecvBuf({&m_node, 0, BufSize});
+    }
+
+    void send (size_t amount)
+    {
+        m_to_send += amount;
+        queue_data(BufSize - getSendBuf().tot_len);
+    }
+
+    size_t received;
+
+private:
+    void connectionAborted () override
+    {
+        AIPSTACK_ASSERT_FORCE(false)
+    }
+
+    void dataReceived (size_t amount) override
+    {
+        received += amount;
+        extendRecvBuf(amount);
+    }
+
+    void dataSent (size_t amount) override
+    {
+        queue_data(amount);
+    }
+
+    void queue_data (size_t space)
+    {
+        size_t amount = (m_to_send < space) ? m_to_send : space;
+        if (amount > 0) {
+            m_to_send -= amount;
+            extendSendBuf(amount);
+            sendPush();
+        }
+    }
+
+private:
+    char m_buf[BufSize];
+    IpBufNode m_node;
+    size_t m_to_send;
+};
+
+// Sends a requested number of UDP datagrams, as many as it can at once and the
+// rest when notified through its retry request.
+class TestUdpSender final : public IpSendRetryRequest {
+public:
+    static size_t const DgramSize = 1000;
+
+    TestUdpSender (TestIpStack &stack) :
+        num_sent(0),
+        m_udp(stack.getProtoApi<UdpApi>()),
+        m_node{m_buf, DgramSize, nullptr},
+        m_to_send(0)
+    {
+        memset(m_buf, 'u', DgramSize);
+    }
+
+    void send (size_t count)
+    {
+        m_to_send += count;
+        send_more();
+    }
+
+    size_t num_sent;
+
+private:
+    void retrySending () override
+    {
+        send_more();
+    }
+
+    void send_more ()
+    {
+        while (m_to_send > 0) {
+            size_t sent_len;
+            IpErr err = m_udp.sendUdpIp4Segmented({ClientAddr, ServerAddr},
+                {UdpPort, UdpPort}, IpBufRef{&m_node, 0, DgramSize}, DgramSize,
+                this, IpSendFlags(), sent_len);
+            if (err != IpErr::SUCCESS) {
+                AIPSTACK_ASSERT_FORCE(err == IpErr::ARP_QUERY ||
+                                      err == IpErr::BUFFER_FULL)
+                AIPSTACK_ASSERT_FORCE(isActive())
+                return;
+            }
+            m_to_send--;
+            num_sent++;
+        }
+    }
+
+private:
+    UdpApi<TestUdpArg> &m_udp;
+    char m_buf[DgramSize];
+    IpBufNode m_node;
+    size_t m_to_send;
+};
+
+// Counts the UDP datagrams received on a port.
+class TestUdpReceiver {
+public:
+    TestUdpReceiver (TestIpStack &stack) :
+        num_received(0),
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&TestUdpReceiver::packetReceived, this))
+    {
+        UdpListenParams<TestUdpArg> params;
+        params.port = UdpPort;
+        IpErr err = m_listener.startListening(stack.getProtoApi<UdpApi>(), params);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+    }
+
+    size_t num_received;
+
+private:
+    UdpRecvResult packetReceived (IpRxInfoIp4<TestStackArg> const &,
+                                  UdpRxInfo<TestUdpArg> const &, IpBufRef data)
+    {
+        AIPSTACK_ASSERT_FORCE(data.tot_len == TestUdpSender::DgramSize)
+        num_received++;
+        return UdpRecvResult::AcceptStop;
+    }
+
+private:
+    UdpListener<TestUdpArg> m_listener;
+};
+
+// Accepts one connection on the server port.
+class TestServer {
+public:
+    TestServer (TestIpStack &stack) :
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&TestServer::connectionEstablished, this))
+    {
+        TcpListenParams params;
+        params.port = ServerPort;
+        params.max_pcbs = 1;
+        bool ok = m_listener.startListening(stack.getProtoApi<TcpApi>(), params);
+        AIPSTACK_ASSERT_FORCE(ok)
+    }
+
+private:
+    void connectionEstablished ()
+    {
+        connection.startServer(m_listener);
+    }
+
+private:
+    TcpListener<TestTcpArg> m_listener;
+
+public:
+    TestConnection connection;
+};
+
+// A client and a server stack connected with a pair of links whose transmit
+// queues hold a few frames each.
+class TestPair {
+public:
+    static size_t const LinkCapacity = 4;
+
+    TestPair (SimPlatformImpl &sim) :
+        client_link(Platform(&sim), LinkCapacity),
+        server_link(Platform(&sim), LinkCapacity),
+        client_stack(Platform(&sim)),
+        server_stack(Platform(&sim)),
+        m_client_iface(Platform(&sim), &client_stack, ClientAddr, ClientMac,
+                       &client_link, &server_link),
+        m_server_iface(Platform(&sim), &server_stack, ServerAddr, ServerMac,
+                       &server_link, &client_link)
+    {}
+
+public:
+    TestEthLink client_link;
+    TestEthLink server_link;
+    TestIpStack client_stack;
+    TestIpStack server_stack;
+
+private:
+    TestEthIface m_client_iface;
+    TestEthIface m_server_iface;
+};
+
+// A TCP sender which gets BUFFER_FULL resumes when the driver calls txReady,
+// without waiting for ACKs or its retry timer.
+static void test_tcp (bool notify_ready)
+{
+    SimPlatformImpl sim;
+    TestPair pair(sim);
+    pair.client_link.notify_ready = notify_ready;
+
+    TestServer server(pair.server_stack);
+    TestConnection client;
+    client.startClient(pair.client_stack);
+    sim.runFor(Second);
+    AIPSTACK_ASSERT_FORCE(client.isConnected() && server.connection.isConnected())
+
+    // Open the congestion window, so that a burst of a whole send buffer is
+    // allowed but does not fit into the transmit queue. The burst follows as soon
+    // as everything is acknowledged, before the window would be reset for idle.
+    client.send(262144);
+    for (int i = 0; i < 1000 && client.getSendBuf().tot_len > 0; i++) {
+        sim.runFor(Second / 1000);
+    }
+    AIPSTACK_ASSERT_FORCE(server.connection.received == 262144)
+    AIPSTACK_ASSERT_FORCE(client.getSendBuf().tot_len == 0)
+
+    size_t num_full = pair.client_link.num_full;
+    client.send(BufSize);
+    sim.runFor(BurstTime);
+    AIPSTACK_ASSERT_FORCE(pair.client_link.num_full > num_full)
+    AIPSTACK_ASSERT_FORCE((server.connection.received == 262144 + BufSize) == notify_ready)
+}
+
+// A UDP sender which gets BUFFER_FULL resumes when the driver calls txReady; it
+// has no retry timer so without txReady it would stall.
+static void test_udp (bool notify_ready)
+{
+    SimPlatformImpl sim;
+    TestPair pair(sim);
+    pair.client_link.notify_ready = notify_ready;
+
+    TestUdpSender sender(pair.client_stack);
+    TestUdpReceiver receiver(pair.server_stack);
+
+    size_t const count = 100;
+    sender.send(count);
+    sim.runFor(Second);
+    AIPSTACK_ASSERT_FORCE(pair.client_link.num_full > 0)
+    AIPSTACK_ASSERT_FORCE((receiver.num_received == count) == notify_ready)
+    AIPSTACK_ASSERT_FORCE(sender.num_sent == receiver.num_received)
+}
+
+int main ()
+{
+    test_tcp(true);
+    test_tcp(false);
+    test_udp(true);
+    test_udp(false);
+
+    return 0;
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Icmp4Proto.h>
+#include <aipstack/ip/IpCapture.h>
+#include <aipstack/utils/IpCapturePcapng.h>
+
+#include "test_stack.h"
+
+using namespace AIpStack;
+using namespace AIpStackTest;
+
+static Ip4Addr const LocalAddr = Ip4Addr::FromBytes(10, 0, 0, 1);
+static Ip4Addr const RemoteAddr = Ip4Addr::FromBytes(10, 0, 0, 2);
+static Ip4Addr const OtherAddr = Ip4Addr::FromBytes(10, 0, 0, 3);
+
+using UdpApiT = UdpApi<TestUdpArg>;
+
+static uint64_t capture_time = 0;
+
+static uint64_t next_capture_time ()
+{
+    return capture_time += 1000;
+}
+
+// Send a UDP datagram with the given payload length from LocalAddr.
+static void send_udp (TestIpStack &stack, Ip4Addr dst, uint16_t dst_port,
+                      size_t data_len)
+{
+    char buf[UdpApiT::HeaderBeforeUdpData + 64];
+    AIPSTACK_ASSERT_FORCE(data_len <= 64)
+    memset(buf, 'x', sizeof(buf));
+
+    IpBufNode node{buf, sizeof(buf), nullptr};
+    IpErr err = stack.getProtoApi<UdpApi>().sendUdpIp4Packet(
+        {LocalAddr, dst}, {1000, dst_port},
+        IpBufRef{&node, UdpApiT::HeaderBeforeUdpData, data_len},
+        nullptr, nullptr, IpSendFlags());
+    AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+}
+
+// Receive a UDP datagram to a port without a listener, which is answered with an
+// ICMP port unreachable.
+static size_t recv_udp (TestIface &iface, char *pkt, Ip4Addr src, uint16_t dst_port,
+                        size_t data_len)
+{
+    char data[64];
+    AIPSTACK_ASSERT_FORCE(data_len <= sizeof(data))
+    for (size_t i = 0; i < data_len; i++) {
+        data[i] = char(i);
+    }
+
+    size_t len = MakeUdpPacket(pkt, src, LocalAddr, 3000, dst_port, data, data_len);
+    iface.recv(pkt, len);
+    return len;
+}
+
+static void test_rx_tx_snaplen ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, LocalAddr, 24);
+
+    IpCaptureRing<4, 40> ring;
+    ring.setTimeFunc(Function<uint64_t()>(&next_capture_time));
+    capture_time = 0;
+    iface.iface().setCaptureTap(&ring);
+
+    char const *data;
+    AIPSTACK_ASSERT_FORCE(ring.peek(&data) == nullptr)
+
+    // A received packet longer than the snap length is truncated, and the ICMP
+    // reply it triggers is captured as sent.
+    char pkt[100];
+    size_t rx_len = recv_udp(iface, pkt, RemoteAddr, 2000, 40);
+    AIPSTACK_ASSERT_FORCE(rx_len == 68)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 1)
+
+    IpCaptureRecord const *rec = ring.peek(&data);
+    AIPSTACK_ASSERT_FORCE(rec != nullptr)
+    AIPSTACK_ASSERT_FORCE(rec->dir == IpCaptureDir::Rx)
+    AIPSTACK_ASSERT_FORCE(rec->time_us == 1000)
+    AIPSTACK_ASSERT_FORCE(rec->orig_len == 68 && rec->cap_len == 40)
+    AIPSTACK_ASSERT_FORCE(memcmp(data, pkt, 40) == 0)
+    ring.consume();
+
+    rec = ring.peek(&data);
+    AIPSTACK_ASSERT_FORCE(rec != nullptr)
+    AIPSTACK_ASSERT_FORCE(rec->dir == IpCaptureDir::Tx)
+    AIPSTACK_ASSERT_FORCE(rec->time_us == 2000)
+    AIPSTACK_ASSERT_FORCE(rec->orig_len == iface.sentLen(0) && rec->cap_len == 40)
+    AIPSTACK_ASSERT_FORCE(memcmp(data, iface.sentData(0), 40) == 0)
+    AIPSTACK_ASSERT_FORCE(uint8_t(data[9]) == Ip4ProtocolIcmp)
+    ring.consume();
+
+    // A packet shorter than the snap length is captured whole.
+    send_udp(stack, RemoteAddr, 2000, 4);
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 2 && iface.sentLen(1) == 32)
+
+    rec = ring.peek(&data);
+    AIPSTACK_ASSERT_FORCE(rec != nullptr)
+    AIPSTACK_ASSERT_FORCE(rec->dir == IpCaptureDir::Tx)
+    AIPSTACK_ASSERT_FORCE(rec->orig_len == 32 && rec->cap_len == 32)
+    AIPSTACK_ASSERT_FORCE(memcmp(data, iface.sentData(1), 32) == 0)
+    ring.consume();
+    AIPSTACK_ASSERT_FORCE(ring.peek(&data) == nullptr)
+
+    // Packets which do not fit into the ring are dropped and counted.
+    for (int i = 0; i < 6; i++) {
+        send_udp(stack, RemoteAddr, 2000, 4);
+    }
+    AIPSTACK_ASSERT_FORCE(ring.getDropped() == 2)
+    for (int i = 0; i < 4; i++) {
+        AIPSTACK_ASSERT_FORCE(ring.peek(&data) != nullptr)
+        ring.consume();
+    }
+    AIPSTACK_ASSERT_FORCE(ring.peek(&data) == nullptr)
+
+    // Nothing is captured after the tap is detached.
+    iface.iface().setCaptureTap(nullptr);
+    send_udp(stack, RemoteAddr, 2000, 4);
+    AIPSTACK_ASSERT_FORCE(ring.peek(&data) == nullptr)
+}
+
+// Receive one UDP datagram (which triggers an ICMP reply) and send one UDP datagram
+// to OtherAddr port 4000, return the number of packets captured.
+static size_t count_captured (TestIpStack &stack, TestIface &iface, IpCaptureTap &tap,
+                              IpCaptureFilter const &filter, IpCaptureDir *dirs)
+{
+    tap.setFilter(filter);
+
+    char pkt[100];
+    recv_udp(iface, pkt, RemoteAddr, 2000, 8);
+    send_udp(stack, OtherAddr, 4000, 8);
+
+    size_t count = 0;
+    char const *data;
+    while (IpCaptureRecord const *rec = tap.peek(&data)) {
+        dirs[count++] = rec->dir;
+        tap.consume();
+    }
+    return count;
+}
+
+static void test_filter ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, LocalAddr, 24);
+
+    IpCaptureRing<8, 64> ring;
+    iface.iface().setCaptureTap(&ring);
+
+    IpCaptureDir dirs[8];
+    IpCaptureFilter filter;
+
+    // Everything: received UDP, sent ICMP, sent UDP.
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 3)
+    AIPSTACK_ASSERT_FORCE(dirs[0] == IpCaptureDir::Rx && dirs[1] == IpCaptureDir::Tx &&
+                          dirs[2] == IpCaptureDir::Tx)
+
+    // Direction.
+    filter = IpCaptureFilter();
+    filter.tx = false;
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 1)
+    AIPSTACK_ASSERT_FORCE(dirs[0] == IpCaptureDir::Rx)
+
+    filter = IpCaptureFilter();
+    filter.rx = false;
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 2)
+    AIPSTACK_ASSERT_FORCE(dirs[0] == IpCaptureDir::Tx && dirs[1] == IpCaptureDir::Tx)
+
+    // Protocol.
+    filter = IpCaptureFilter();
+    filter.proto = Ip4ProtocolIcmp;
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 1)
+    AIPSTACK_ASSERT_FORCE(dirs[0] == IpCaptureDir::Tx)
+
+    filter.proto = Ip4ProtocolTcp;
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 0)
+
+    // Address, matching either the source or the destination.
+    filter = IpCaptureFilter();
+    filter.addr = OtherAddr;
+    filter.addr_mask = Ip4Addr::PrefixMask(32);
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 1)
+    AIPSTACK_ASSERT_FORCE(dirs[0] == IpCaptureDir::Tx)
+
+    filter.addr = RemoteAddr;
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 2)
+    AIPSTACK_ASSERT_FORCE(dirs[0] == IpCaptureDir::Rx && dirs[1] == IpCaptureDir::Tx)
+
+    filter.addr = Ip4Addr::FromBytes(10, 0, 0, 0);
+    filter.addr_mask = Ip4Addr::PrefixMask(24);
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 3)
+
+    filter.addr = Ip4Addr::FromBytes(10, 0, 1, 0);
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 0)
+
+    // Port, matching either the source or the destination port of UDP and TCP;
+    // the ICMP reply never matches.
+    filter = IpCaptureFilter();
+    filter.port = 3000;
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 1)
+    AIPSTACK_ASSERT_FORCE(dirs[0] == IpCaptureDir::Rx)
+
+    filter.port = 4000;
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 1)
+    AIPSTACK_ASSERT_FORCE(dirs[0] == IpCaptureDir::Tx)
+
+    filter.port = 1000;
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 1)
+    AIPSTACK_ASSERT_FORCE(dirs[0] == IpCaptureDir::Tx)
+
+    // Combined conditions must all match.
+    filter = IpCaptureFilter();
+    filter.rx = false;
+    filter.proto = Ip4ProtocolUdp;
+    filter.addr = RemoteAddr;
+    filter.addr_mask = Ip4Addr::PrefixMask(32);
+    AIPSTACK_ASSERT_FORCE(count_captured(stack, iface, ring, filter, dirs) == 0)
+
+    AIPSTACK_ASSERT_FORCE(ring.getDropped() == 0)
+}
+
+static uint16_t read_u16 (unsigned char const *p)
+{
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t read_u32 (unsigned char const *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Check an Enhanced Packet Block, return the offset after it.
+static size_t check_epb (unsigned char const *out, size_t pos, uint64_t time_us,
+                         uint32_t cap_len, uint32_t orig_len, char const *data,
+                         uint32_t flags)
+{
+    size_t padded_len = (cap_len + 3) / 4 * 4;
+    uint32_t block_len = uint32_t(28 + padded_len + 16);
+
+    AIPSTACK_ASSERT_FORCE(read_u32(out + pos) == 6)
+    AIPSTACK_ASSERT_FORCE(read_u32(out + pos + 4) == block_len)
+    AIPSTACK_ASSERT_FORCE(read_u32(out + pos + 8) == 0)
+    AIPSTACK_ASSERT_FORCE(read_u32(out + pos + 12) == uint32_t(time_us >> 32))
+    AIPSTACK_ASSERT_FORCE(read_u32(out + pos + 16) == uint32_t(time_us))
+    AIPSTACK_ASSERT_FORCE(read_u32(out + pos + 20) == cap_len)
+    AIPSTACK_ASSERT_FORCE(read_u32(out + pos + 24) == orig_len)
+    AIPSTACK_ASSERT_FORCE(memcmp(out + pos + 28, data, cap_len) == 0)
+    for (size_t i = cap_len; i < padded_len; i++) {
+        AIPSTACK_ASSERT_FORCE(out[pos + 28 + i] == 0)
+    }
+
+    size_t opt = pos + 28 + padded_len;
+    AIPSTACK_ASSERT_FORCE(read_u16(out + opt) == 2) // epb_flags
+    AIPSTACK_ASSERT_FORCE(read_u16(out + opt + 2) == 4)
+    AIPSTACK_ASSERT_FORCE(read_u32(out + opt + 4) == flags)
+    AIPSTACK_ASSERT_FORCE(read_u32(out + opt + 8) == 0) // opt_endofopt
+    AIPSTACK_ASSERT_FORCE(read_u32(out + opt + 12) == block_len)
+
+    return pos + block_len;
+}
+
+static void test_pcapng ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, LocalAddr, 24);
+
+    // The snap length is not a multiple of four, so that truncated packets need
+    // padding.
+    IpCaptureRing<4, 41> ring;
+    ring.setTimeFunc(Function<uint64_t()>(&next_capture_time));
+    capture_time = UINT64_C(0x123456789) * 1000;
+    iface.iface().setCaptureTap(&ring);
+
+    char rx_pkt[100];
+    recv_udp(iface, rx_pkt, RemoteAddr, 2000, 30);
+    send_udp(stack, RemoteAddr, 2000, 5);
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 2 && iface.sentLen(1) == 33)
+
+    FILE *file = tmpfile();
+    AIPSTACK_ASSERT_FORCE(file != nullptr)
+    IpCapturePcapngWriter writer(&ring, file);
+    writer.writeHeader();
+    AIPSTACK_ASSERT_FORCE(writer.drain() == 3)
+    AIPSTACK_ASSERT_FORCE(writer.drain() == 0)
+
+    unsigned char out[512];
+    rewind(file);
+    size_t len = fread(out, 1, sizeof(out), file);
+    fclose(file);
+
+    // Section Header Block.
+    AIPSTACK_ASSERT_FORCE(read_u32(out + 0) == 0x0A0D0D0A)
+    AIPSTACK_ASSERT_FORCE(read_u32(out + 4) == 28)
+    AIPSTACK_ASSERT_FORCE(read_u32(out + 8) == 0x1A2B3C4D)
+    AIPSTACK_ASSERT_FORCE(read_u16(out + 12) == 1 && read_u16(out + 14) == 0)
+    AIPSTACK_ASSERT_FORCE(read_u32(out + 16) == UINT32_C(0xFFFFFFFF))
+    AIPSTACK_ASSERT_FORCE(read_u32(out + 20) == UINT32_C(0xFFFFFFFF))
+    AIPSTACK_ASSERT_FORCE(read_u32(out + 24) == 28)
+
+    // Interface Description Block with LINKTYPE_RAW.
+    AIPSTACK_ASSERT_FORCE(read_u32(out + 28) == 1)
+    AIPSTACK_ASSERT_FORCE(read_u32(out + 32) == 20)
+    AIPSTACK_ASSERT_FORCE(read_u16(out + 36) == 101 && read_u16(out + 38) == 0)
+    AIPSTACK_ASSERT_FORCE(read_u32(out + 40) == 41)
+    AIPSTACK_ASSERT_FORCE(read_u32(out + 44) == 20)
+
+    // Received UDP truncated to 41 bytes, the ICMP reply truncated to 41 bytes and
+    // the sent UDP of 33 bytes, all with three bytes of padding.
+    uint64_t time = UINT64_C(0x123456789) * 1000;
+    size_t pos = 48;
+    pos = check_epb(out, pos, time + 1000, 41, 58, rx_pkt, 1);
+    pos = check_epb(out, pos, time + 2000, 41, uint32_t(iface.sentLen(0)),
+                    iface.sentData(0), 2);
+    pos = check_epb(out, pos, time + 3000, 33, 33, iface.sentData(1), 2);
+    AIPSTACK_ASSERT_FORCE(pos == len)
+}
+
+int main ()
+{
+    test_rx_tx_snaplen();
+    test_filter();
+    test_pcapng();
+
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/BinaryTools.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Chksum.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/proto/Udp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpChksumOffload.h>
+
+using namespace AIpStack;
+
+static Ip4Addr const SrcAddr = Ip4Addr::FromBytes(192, 168, 1, 10);
+static Ip4Addr const DstAddr = Ip4Addr::FromBytes(10, 0, 0, 77);
+static size_t const MaxPktLen = 200;
+
+static size_t trans_header_size (uint8_t proto)
+{
+    return (proto == Ip4ProtocolTcp) ? Tcp4Header::Size : Udp4Header::Size;
+}
+
+static size_t chksum_field_offset (uint8_t proto)
+{
+    return (proto == Ip4ProtocolTcp) ? Tcp4Header::getOffset(Tcp4Header::Checksum()) :
+        Udp4Header::getOffset(Udp4Header::Checksum());
+}
+
+// Build an IPv4 packet with a TCP or UDP datagram with data_len bytes of data
+// and the partial checksum in the checksum field.
+static size_t make_packet (char *pkt, uint8_t proto, size_t data_len)
+{
+    size_t trans_len = trans_header_size(proto) + data_len;
+    size_t pkt_len = Ip4Header::Size + trans_len;
+    AIPSTACK_ASSERT_FORCE(pkt_len <= MaxPktLen)
+    
+    ::memset(pkt, 0, pkt_len);
+    
+    auto ip4_header = Ip4Header::MakeRef(pkt);
+    ip4_header.set(Ip4Header::VersionIhlDscpEcn(),
+                   uint16_t(((4 << Ip4VersionShift) | 5) << 8));
+    ip4_header.set(Ip4Header::TotalLen(), uint16_t(pkt_len));
+    ip4_header.set(Ip4Header::TtlProto(), uint16_t((64 << 8) | proto));
+    ip4_header.set(Ip4Header::SrcAddr(), SrcAddr);
+    ip4_header.set(Ip4Header::DstAddr(), DstAddr);
+    
+    char *trans = pkt + Ip4Header::Size;
+    for (size_t i = trans_header_size(proto); i < trans_len; i++) {
+        trans[i] = char(i * 37 + 11);
+    }
+    
+    if (proto == Ip4ProtocolTcp) {
+        auto tcp_header = Tcp4Header::MakeRef(trans);
+        tcp_header.set(Tcp4Header::SrcPort(), 1234);
+        tcp_header.set(Tcp4Header::DstPort(), 80);
+        tcp_header.set(Tcp4Header::OffsetFlags(), uint16_t(5 << TcpOffsetShift));
+    } else {
+        auto udp_header = Udp4Header::MakeRef(trans);
+        udp_header.set(Udp4Header::SrcPort(), 1234);
+        udp_header.set(Udp4Header::DstPort(), 53);
+        udp_header.set(Udp4Header::Length(), uint16_t(trans_len));
+    }
+    
+    WriteBinaryInt<uint16_t, BinaryBigEndian>(
+        IpChksumOffload::pseudoHeaderSum(SrcAddr, DstAddr, proto, uint16_t(trans_len)),
+        trans + chksum_field_offset(proto));
+    
+    return pkt_len;
+}
+
+// Calculate the checksum of the datagram including the pseudo-header, which is
+// zero if the checksum in the packet is correct.
+static uint16_t verify_chksum (char *pkt, size_t pkt_len, uint8_t proto)
+{
+    size_t trans_len = pkt_len - Ip4Header::Size;
+    IpBufNode node{pkt + Ip4Header::Size, trans_len, nullptr};
+    
+    IpChksumAccumulator chksum;
+    chksum.addWords(&SrcAddr.data);
+    chksum.addWords(&DstAddr.data);
+    chksum.addWord(WrapType<uint16_t>(), proto);
+    chksum.addWord(WrapType<uint16_t>(), uint16_t(trans_len));
+    return chksum.getChksum(IpBufRef{&node, 0, trans_len});
+}
+
+static uint16_t get_chksum (char const *pkt, uint8_t proto)
+{
+    return ReadBinaryInt<uint16_t, BinaryBigEndian>(
+        pkt + Ip4Header::Size + chksum_field_offset(proto));
+}
+
+// Complete the checksum of a packet split into two buffers at the given position
+// (after the transport header) and check the result.
+static void test_packet (uint8_t proto, size_t data_len, size_t split)
+{
+    char pkt[MaxPktLen];
+    size_t pkt_len = make_packet(pkt, proto, data_len);
+    AIPSTACK_ASSERT_FORCE(split <= pkt_len)
+    
+    IpBufNode node2{pkt + split, pkt_len - split, nullptr};
+    IpBufNode node1{pkt, split, &node2};
+    IpBufRef pkt_ref{&node1, 0, pkt_len};
+    
+    size_t start;
+    size_t offset;
+    AIPSTACK_ASSERT_FORCE(IpChksumOffload::getChksumPosition(pkt_ref, start, offset))
+    AIPSTACK_ASSERT_FORCE(start == Ip4Header::Size)
+    AIPSTACK_ASSERT_FORCE(offset == chksum_field_offset(proto))
+    
+    AIPSTACK_ASSERT_FORCE(IpChksumOffload::completeChksum(pkt_ref))
+    AIPSTACK_ASSERT_FORCE(verify_chksum(pkt, pkt_len, proto) == 0)
+    AIPSTACK_ASSERT_FORCE(get_chksum(pkt, proto) != 0 || proto != Ip4ProtocolUdp)
+}
+
+// Adjust the last two data bytes of a UDP packet so that its checksum is zero,
+// which must be transmitted as 0xFFFF.
+static void test_udp_zero_chksum ()
+{
+    size_t data_len = 40;
+    char pkt[MaxPktLen];
+    size_t pkt_len = make_packet(pkt, Ip4ProtocolUdp, data_len);
+    
+    // With the last two bytes zero, the ones'-complement sum is ~chksum, adding
+    // chksum to it gives 0xFFFF which makes the checksum zero.
+    char *last = pkt + (pkt_len - 2);
+    ::memset(last, 0, 2);
+    WriteBinaryInt<uint16_t, BinaryBigEndian>(0, pkt + Ip4Header::Size +
+        chksum_field_offset(Ip4ProtocolUdp));
+    uint16_t chksum = verify_chksum(pkt, pkt_len, Ip4ProtocolUdp);
+    WriteBinaryInt<uint16_t, BinaryBigEndian>(chksum, last);
+    
+    // Restore the partial checksum.
+    WriteBinaryInt<uint16_t, BinaryBigEndian>(
+        IpChksumOffload::pseudoHeaderSum(SrcAddr, DstAddr, Ip4ProtocolUdp,
+                                         uint16_t(pkt_len - Ip4Header::Size)),
+        pkt + Ip4Header::Size + chksum_field_offset(Ip4ProtocolUdp));
+    
+    IpBufNode node{pkt, pkt_len, nullptr};
+    AIPSTACK_ASSERT_FORCE(IpChksumOffload::completeChksum(IpBufRef{&node, 0, pkt_len}))
+    AIPSTACK_ASSERT_FORCE(get_chksum(pkt, Ip4ProtocolUdp) == 0xFFFF)
+    AIPSTACK_ASSERT_FORCE(verify_chksum(pkt, pkt_len, Ip4ProtocolUdp) == 0)
+}
+
+int main ()
+{
+    uint8_t const protos[] = {Ip4ProtocolTcp, Ip4ProtocolUdp};
+    size_t const data_lens[] = {0, 1, 2, 7, 100, 151};
+    size_t const split_adds[] = {0, 1, 2, 5};
+    
+    for (uint8_t proto : protos) {
+        size_t hdrs_len = Ip4Header::Size + trans_header_size(proto);
+        for (size_t data_len : data_lens) {
+            for (size_t split_add : split_adds) {
+                size_t split = hdrs_len + split_add;
+                if (split <= hdrs_len + data_len) {
+                    test_packet(proto, data_len, split);
+                }
+            }
+        }
+    }
+    
+    test_udp_zero_chksum();
+    
+    // Other protocols are rejected.
+    char pkt[MaxPktLen];
+    size_t pkt_len = make_packet(pkt, Ip4ProtocolUdp, 10);
+    auto ip4_header = Ip4Header::MakeRef(pkt);
+    ip4_header.set(Ip4Header::TtlProto(), uint16_t((64 << 8) | Ip4ProtocolIcmp));
+    IpBufNode node{pkt, pkt_len, nullptr};
+    size_t start;
+    size_t offset;
+    AIPSTACK_ASSERT_FORCE(!IpChksumOffload::getChksumPosition(
+        IpBufRef{&node, 0, pkt_len}, start, offset))
+    
+    return 0;
+}
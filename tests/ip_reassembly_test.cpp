@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/RxBufHold.h>
+#include <aipstack/infra/Instance.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStats.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/SimPlatformImpl.h>
+
+using namespace AIpStack;
+
+using Platform = PlatformFacade<SimPlatformImpl>;
+
+template <bool Chain>
+using TestReassService = IpReassemblyService<
+    IpReassemblyOptions::MaxReassEntrys::Is<2>,
+    IpReassemblyOptions::MaxReassEntrysPerSource::Is<1>,
+    IpReassemblyOptions::MaxReassSize::Is<3000>,
+    IpReassemblyOptions::ChainFragments::Is<Chain>
+>;
+
+AIPSTACK_MAKE_INSTANCE(CopyReass, (TestReassService<false>::Compose<SimPlatformImpl>))
+AIPSTACK_MAKE_INSTANCE(ChainReass, (TestReassService<true>::Compose<SimPlatformImpl>))
+
+static Ip4Addr const SrcAddr = Ip4Addr::FromBytes(10, 0, 0, 1);
+static Ip4Addr const SrcAddrB = Ip4Addr::FromBytes(10, 0, 0, 3);
+static Ip4Addr const SrcAddrC = Ip4Addr::FromBytes(10, 0, 0, 4);
+static Ip4Addr const DstAddr = Ip4Addr::FromBytes(10, 0, 0, 2);
+static uint8_t const Proto = 17;
+static uint8_t const Ttl = 64;
+static size_t const DgramLen = 2500;
+
+// A received IPv4 fragment in its own buffer, which the reassembly may hold.
+struct TestFrag : public IpRxBufHold {
+    void rxBufReleased () override final
+    {
+        num_released++;
+    }
+    
+    char buf[Ip4MaxHeaderSize + 1000];
+    IpBufNode node;
+    uint16_t offset;
+    uint16_t len;
+    bool more;
+    Ip4Addr src;
+    uint8_t header_len;
+    int num_released = 0;
+};
+
+static void make_frag (TestFrag &frag, uint16_t ident, uint16_t offset, uint16_t len,
+                       bool more, Ip4Addr src = SrcAddr,
+                       uint8_t header_len = Ip4Header::Size)
+{
+    auto hdr = Ip4Header::MakeRef(frag.buf);
+    hdr.set(Ip4Header::VersionIhlDscpEcn(), (4 << 12) | ((header_len / 4) << 8));
+    hdr.set(Ip4Header::TotalLen(), header_len + len);
+    hdr.set(Ip4Header::Ident(), ident);
+    hdr.set(Ip4Header::FlagsOffset(), (more ? Ip4FlagMF : 0) | (offset / 8));
+    hdr.set(Ip4Header::TtlProto(), (uint16_t(Ttl) << 8) | Proto);
+    hdr.set(Ip4Header::HeaderChksum(), 0);
+    hdr.set(Ip4Header::SrcAddr(), src);
+    hdr.set(Ip4Header::DstAddr(), DstAddr);
+    
+    memset(frag.buf + Ip4Header::Size, 0, header_len - Ip4Header::Size);
+    for (uint16_t i = 0; i < len; i++) {
+        frag.buf[header_len + i] = char(uint8_t(offset + i));
+    }
+    
+    frag.node = IpBufNode{frag.buf, header_len + size_t(len), nullptr};
+    frag.offset = offset;
+    frag.len = len;
+    frag.more = more;
+    frag.src = src;
+    frag.header_len = header_len;
+}
+
+template <typename Reass>
+static bool recv_frag (Reass &reass, TestFrag &frag, uint16_t ident, IpBufRef &dgram,
+                       bool with_hold = true, uint8_t *out_header_len = nullptr)
+{
+    uint8_t header_len = frag.header_len;
+    dgram = IpBufRef{&frag.node, header_len, frag.len};
+    bool result = reass.reassembleIp4(ident, frag.src, DstAddr, Proto, Ttl, frag.more,
+                                      frag.offset, frag.buf, header_len, dgram,
+                                      with_hold ? &frag : nullptr);
+    if (out_header_len != nullptr) {
+        *out_header_len = header_len;
+    }
+    return result;
+}
+
+// Check that the IP header of the first fragment precedes the reassembled data.
+static void check_header (IpBufRef dgram, uint8_t header_len, TestFrag const &first)
+{
+    AIPSTACK_ASSERT_FORCE(dgram.offset >= header_len)
+    
+    char header[Ip4MaxHeaderSize];
+    dgram.revealHeaderMust(header_len).takeBytes(header_len, header);
+    AIPSTACK_ASSERT_FORCE(memcmp(header, first.buf, Ip4Header::Size) == 0)
+}
+
+static void check_data (IpBufRef dgram)
+{
+    AIPSTACK_ASSERT_FORCE(dgram.tot_len == DgramLen)
+    
+    for (size_t i = 0; i < DgramLen; i++) {
+        AIPSTACK_ASSERT_FORCE(uint8_t(dgram.takeByte()) == uint8_t(i))
+    }
+}
+
+template <typename Reass, bool Chain>
+static void test_reassembly (SimPlatformImpl &sim)
+{
+    IpStackStats stats;
+    TestFrag last;
+    
+    {
+    Reass reass(Platform(&sim), &stats);
+    IpBufRef dgram;
+    
+    // Out of order with a duplicate, reassembled when the last hole is filled.
+    TestFrag f[3];
+    make_frag(f[0], 1, 0, 1000, true);
+    make_frag(f[1], 1, 1000, 1000, true);
+    make_frag(f[2], 1, 2000, 500, false);
+    
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, f[2], 1, dgram))
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, f[0], 1, dgram))
+    AIPSTACK_ASSERT_FORCE(f[0].isHeld() == Chain && f[2].isHeld() == Chain)
+    
+    TestFrag dup;
+    make_frag(dup, 1, 0, 1000, true);
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, dup, 1, dgram))
+    AIPSTACK_ASSERT_FORCE(!dup.isHeld())
+    
+    uint8_t header_len;
+    AIPSTACK_ASSERT_FORCE(recv_frag(reass, f[1], 1, dgram, true, &header_len))
+    AIPSTACK_ASSERT_FORCE(header_len == Ip4Header::Size)
+    check_header(dgram, header_len, f[0]);
+    if (Chain) {
+        // The data is chained over the fragment buffers, with the header of the
+        // first fragment before it.
+        AIPSTACK_ASSERT_FORCE(dgram.node->ptr == f[0].buf)
+        AIPSTACK_ASSERT_FORCE(dgram.offset == Ip4Header::Size)
+        AIPSTACK_ASSERT_FORCE(f[0].isHeld() && f[1].isHeld() && f[2].isHeld())
+    }
+    check_data(dgram);
+    reass.releaseReassembled();
+    for (auto &frag : f) {
+        AIPSTACK_ASSERT_FORCE(!frag.isHeld() && frag.num_released == (Chain ? 1 : 0))
+    }
+    AIPSTACK_ASSERT_FORCE(stats.ip_reasm_fails.get() == 0)
+    
+    // In chain mode, a partial overlap fails the datagram and releases the held
+    // buffers, and a fragment without a hold is not accepted.
+    if (Chain) {
+        TestFrag g[2];
+        make_frag(g[0], 2, 0, 1000, true);
+        make_frag(g[1], 2, 504, 1000, true);
+        AIPSTACK_ASSERT_FORCE(!recv_frag(reass, g[0], 2, dgram))
+        AIPSTACK_ASSERT_FORCE(!recv_frag(reass, g[1], 2, dgram))
+        AIPSTACK_ASSERT_FORCE(!g[0].isHeld() && !g[1].isHeld())
+        AIPSTACK_ASSERT_FORCE(stats.ip_reasm_fails.get() == 1)
+        
+        TestFrag h;
+        make_frag(h, 3, 0, 1000, true);
+        AIPSTACK_ASSERT_FORCE(!recv_frag(reass, h, 3, dgram, false))
+        AIPSTACK_ASSERT_FORCE(stats.ip_reasm_fails.get() == 2)
+    }
+    
+    // The first fragment has IP options. The chained datagram is preceded by its
+    // full header, the copied one by its base header.
+    TestFrag o[3];
+    make_frag(o[0], 6, 0, 1000, true, SrcAddr, Ip4Header::Size + 8);
+    make_frag(o[1], 6, 1000, 1000, true);
+    make_frag(o[2], 6, 2000, 500, false);
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, o[2], 6, dgram))
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, o[1], 6, dgram))
+    AIPSTACK_ASSERT_FORCE(recv_frag(reass, o[0], 6, dgram, true, &header_len))
+    AIPSTACK_ASSERT_FORCE(header_len == (Chain ? Ip4Header::Size + 8 : Ip4Header::Size))
+    check_header(dgram, header_len, o[0]);
+    check_data(dgram);
+    reass.releaseReassembled();
+    
+    // A source over its quota only replaces its own entry, and when all entries
+    // are in use the least complete one is evicted.
+    uint32_t fails_before_flood = stats.ip_reasm_fails.get();
+    TestFrag a[2], b[3], c[2];
+    make_frag(a[0], 10, 0, 1000, true);
+    make_frag(a[1], 11, 0, 1000, true);
+    make_frag(b[0], 20, 0, 1000, true, SrcAddrB);
+    make_frag(b[1], 20, 1000, 1000, true, SrcAddrB);
+    make_frag(b[2], 20, 2000, 500, false, SrcAddrB);
+    make_frag(c[0], 30, 0, 1000, true, SrcAddrC);
+    make_frag(c[1], 30, 1000, 500, false, SrcAddrC);
+    
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, a[0], 10, dgram))
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, a[1], 11, dgram))
+    AIPSTACK_ASSERT_FORCE(stats.ip_reasm_quota_evictions.get() == 1)
+    AIPSTACK_ASSERT_FORCE(!a[0].isHeld() && a[1].isHeld() == Chain)
+    
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, b[0], 20, dgram))
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, b[1], 20, dgram))
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, c[0], 30, dgram))
+    AIPSTACK_ASSERT_FORCE(stats.ip_reasm_evictions.get() == 1)
+    AIPSTACK_ASSERT_FORCE(!a[1].isHeld() && b[0].isHeld() == Chain)
+    
+    AIPSTACK_ASSERT_FORCE(recv_frag(reass, b[2], 20, dgram))
+    check_data(dgram);
+    reass.releaseReassembled();
+    AIPSTACK_ASSERT_FORCE(recv_frag(reass, c[1], 30, dgram))
+    reass.releaseReassembled();
+    AIPSTACK_ASSERT_FORCE(stats.ip_reasm_fails.get() == fails_before_flood + 2)
+    
+    // Duplicate and overlapping fragments do not make an entry look more complete
+    // than one with more distinct data, so that one is kept when evicting.
+    TestFrag dup_frags[3], d[3], n[3];
+    make_frag(dup_frags[0], 40, 0, 1000, true, SrcAddrB);
+    make_frag(dup_frags[1], 40, 0, 1000, true, SrcAddrB);
+    make_frag(dup_frags[2], 40, 496, 1000, true, SrcAddrB);
+    make_frag(d[0], 50, 0, 1000, true, SrcAddrC);
+    make_frag(d[1], 50, 1000, 1000, true, SrcAddrC);
+    make_frag(d[2], 50, 2000, 500, false, SrcAddrC);
+    make_frag(n[0], 60, 0, 1000, true);
+    make_frag(n[1], 60, 1000, 1000, true);
+    make_frag(n[2], 60, 2000, 500, false);
+    
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, dup_frags[0], 40, dgram))
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, d[0], 50, dgram))
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, d[1], 50, dgram))
+    for (int i = 0; i < 3; i++) {
+        AIPSTACK_ASSERT_FORCE(!recv_frag(reass, dup_frags[1], 40, dgram))
+    }
+    if (!Chain) {
+        // An overlap only counts the 496 new bytes (in chain mode an overlap
+        // would fail the datagram).
+        AIPSTACK_ASSERT_FORCE(!recv_frag(reass, dup_frags[2], 40, dgram))
+    }
+    
+    uint32_t evictions = stats.ip_reasm_evictions.get();
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, n[0], 60, dgram))
+    AIPSTACK_ASSERT_FORCE(stats.ip_reasm_evictions.get() == evictions + 1)
+    AIPSTACK_ASSERT_FORCE(!dup_frags[0].isHeld() && d[0].isHeld() == Chain)
+    
+    AIPSTACK_ASSERT_FORCE(recv_frag(reass, d[2], 50, dgram))
+    check_data(dgram);
+    reass.releaseReassembled();
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, n[1], 60, dgram))
+    AIPSTACK_ASSERT_FORCE(recv_frag(reass, n[2], 60, dgram))
+    check_data(dgram);
+    reass.releaseReassembled();
+    
+    // An incomplete datagram expires and its buffer is released. In chain mode
+    // the timer releases it without any further fragments.
+    uint32_t fails = stats.ip_reasm_fails.get();
+    TestFrag e;
+    make_frag(e, 4, 0, 1000, true);
+    make_frag(last, 5, 0, 1000, true);
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, e, 4, dgram))
+    AIPSTACK_ASSERT_FORCE(e.isHeld() == Chain)
+    // The entry expires after the default MaxReassTimeSeconds (60), less than Ttl.
+    uint64_t expire_ticks = 60 * uint64_t(Platform::TimeFreq);
+    sim.runFor(expire_ticks);
+    AIPSTACK_ASSERT_FORCE(e.isHeld() == Chain)
+    sim.runFor(Platform::TimeFreq);
+    AIPSTACK_ASSERT_FORCE(!e.isHeld() && e.num_released == (Chain ? 1 : 0))
+    AIPSTACK_ASSERT_FORCE(stats.ip_reasm_timeouts.get() == (Chain ? 1 : 0))
+    AIPSTACK_ASSERT_FORCE(!recv_frag(reass, last, 5, dgram))
+    AIPSTACK_ASSERT_FORCE(!e.isHeld() && e.num_released == (Chain ? 1 : 0))
+    AIPSTACK_ASSERT_FORCE(stats.ip_reasm_fails.get() == fails + 1)
+    AIPSTACK_ASSERT_FORCE(stats.ip_reasm_timeouts.get() == 1)
+    AIPSTACK_ASSERT_FORCE(last.isHeld() == Chain)
+    }
+    
+    // The remaining held buffer is released when the reassembly is destructed.
+    AIPSTACK_ASSERT_FORCE(!last.isHeld() && last.num_released == (Chain ? 1 : 0))
+}
+
+int main ()
+{
+    SimPlatformImpl sim;
+    
+    test_reassembly<CopyReass, false>(sim);
+    test_reassembly<ChainReass, true>(sim);
+    
+    return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Chksum.h>
+#include <aipstack/infra/RxBufHold.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStats.h>
+#include <aipstack/ip/IpStackTypes.h>
+#include <aipstack/ip/IpTcpRxCoalescer.h>
+
+using namespace AIpStack;
+
+// The coalescer only uses the interface pointer, so a dummy stack argument
+// is sufficient.
+struct TestArg {};
+
+using Coalescer = IpTcpRxCoalescer<TestArg, 2, 4>;
+using RxInfo = IpRxInfoIp4<TestArg>;
+
+static Ip4Addr const SrcAddr = Ip4Addr::FromBytes(10, 0, 0, 1);
+static Ip4Addr const DstAddr = Ip4Addr::FromBytes(10, 0, 0, 2);
+static uint16_t const SrcPort = 1234;
+static uint16_t const DstPort = 80;
+static uint32_t const StartSeq = 1000;
+static size_t const SegDataLen = 100;
+
+// A received TCP segment in its own buffer, which the coalescer may hold.
+struct TestSeg : public IpRxBufHold {
+    void rxBufReleased () override final
+    {
+        num_released++;
+    }
+    
+    char buf[Tcp4Header::Size + SegDataLen];
+    IpBufNode node;
+    int num_released = 0;
+};
+
+static void make_seg (TestSeg &seg, uint32_t seq, uint16_t flags,
+                      uint16_t src_port = SrcPort, bool bad_chksum = false)
+{
+    auto tcp_header = Tcp4Header::MakeRef(seg.buf);
+    tcp_header.set(Tcp4Header::SrcPort(), src_port);
+    tcp_header.set(Tcp4Header::DstPort(), DstPort);
+    tcp_header.set(Tcp4Header::SeqNum(), seq);
+    tcp_header.set(Tcp4Header::AckNum(), 5000);
+    tcp_header.set(Tcp4Header::OffsetFlags(),
+                   uint16_t((5 << TcpOffsetShift) | flags));
+    tcp_header.set(Tcp4Header::WindowSize(), 8000);
+    tcp_header.set(Tcp4Header::Checksum(), 0);
+    tcp_header.set(Tcp4Header::UrgentPtr(), 0);
+    
+    for (size_t i = 0; i < SegDataLen; i++) {
+        seg.buf[Tcp4Header::Size + i] = char(uint8_t(seq - StartSeq + i));
+    }
+    
+    size_t tcp_len = sizeof(seg.buf);
+    seg.node = IpBufNode{seg.buf, tcp_len, nullptr};
+    
+    IpChksumAccumulator chksum;
+    chksum.addWords(&SrcAddr.data);
+    chksum.addWords(&DstAddr.data);
+    chksum.addWord(WrapType<uint16_t>(), Ip4ProtocolTcp);
+    chksum.addWord(WrapType<uint16_t>(), uint16_t(tcp_len));
+    uint16_t calc_chksum = chksum.getChksum(IpBufRef{&seg.node, 0, tcp_len});
+    tcp_header.set(Tcp4Header::Checksum(), uint16_t(calc_chksum ^ (bad_chksum ? 1 : 0)));
+}
+
+// Records delivered datagrams.
+struct Receiver {
+    void operator() (RxInfo const &ip_info, IpBufRef dgram)
+    {
+        AIPSTACK_ASSERT_FORCE(num_dgrams < MaxDgrams)
+        
+        auto tcp_header = Tcp4Header::MakeRef(dgram.getChunkPtr());
+        Dgram &d = dgrams[num_dgrams++];
+        d.src_port = tcp_header.get(Tcp4Header::SrcPort());
+        d.seq = tcp_header.get(Tcp4Header::SeqNum());
+        d.flags = tcp_header.get(Tcp4Header::OffsetFlags()) & 0xFF;
+        d.data_len = dgram.tot_len - Tcp4Header::Size;
+        d.verified = (ip_info.rx_flags & IpRxFlags::ProtoChksumVerified) != EnumZero;
+        
+        // The data must be contiguous in sequence space.
+        dgram.skipBytes(Tcp4Header::Size);
+        for (size_t i = 0; i < d.data_len; i++) {
+            AIPSTACK_ASSERT_FORCE(uint8_t(dgram.takeByte()) ==
+                                  uint8_t(d.seq - StartSeq + i))
+        }
+    }
+    
+    struct Dgram {
+        uint16_t src_port;
+        uint32_t seq;
+        uint16_t flags;
+        size_t data_len;
+        bool verified;
+    };
+    
+    static int const MaxDgrams = 16;
+    Dgram dgrams[MaxDgrams];
+    int num_dgrams = 0;
+};
+
+static void recv_seg (Coalescer &coalescer, TestSeg &seg, IpStackStats &stats,
+                      Receiver &receiver, bool with_hold = true)
+{
+    RxInfo ip_info;
+    ip_info.src_addr = SrcAddr;
+    ip_info.dst_addr = DstAddr;
+    ip_info.ttl_proto = Ip4TtlProto(64, Ip4ProtocolTcp);
+    ip_info.iface = nullptr;
+    ip_info.header_len = Ip4Header::Size;
+    
+    IpBufRef dgram{&seg.node, 0, seg.node.len};
+    coalescer.recvIp4Dgram(ip_info, dgram, with_hold ? &seg : nullptr, stats,
+        [&](RxInfo const &info, IpBufRef d) { receiver(info, d); });
+}
+
+static void flush (Coalescer &coalescer, Receiver &receiver)
+{
+    coalescer.flushIface(nullptr,
+        [&](RxInfo const &info, IpBufRef d) { receiver(info, d); });
+}
+
+int main ()
+{
+    // Consecutive segments are combined and delivered at the end of the batch,
+    // after which the buffers are released.
+    {
+        IpStackStats stats;
+        Coalescer coalescer;
+        Receiver receiver;
+        TestSeg s[3];
+        for (int i = 0; i < 3; i++) {
+            make_seg(s[i], StartSeq + i * SegDataLen, Tcp4FlagAck);
+            recv_seg(coalescer, s[i], stats, receiver);
+        }
+        AIPSTACK_ASSERT_FORCE(receiver.num_dgrams == 0)
+        
+        flush(coalescer, receiver);
+        AIPSTACK_ASSERT_FORCE(receiver.num_dgrams == 1)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[0].seq == StartSeq)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[0].data_len == 3 * SegDataLen)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[0].verified)
+        AIPSTACK_ASSERT_FORCE(stats.tcp_in_coalesced.get() == 2)
+        for (int i = 0; i < 3; i++) {
+            AIPSTACK_ASSERT_FORCE(s[i].num_released == 1 && !s[i].isHeld())
+        }
+    }
+    
+    // A PSH ends the combined segment and is carried over to it, and a full
+    // combined segment is delivered immediately.
+    {
+        IpStackStats stats;
+        Coalescer coalescer;
+        Receiver receiver;
+        TestSeg s[6];
+        make_seg(s[0], StartSeq, Tcp4FlagAck);
+        make_seg(s[1], StartSeq + SegDataLen, Tcp4FlagAck|Tcp4FlagPsh);
+        recv_seg(coalescer, s[0], stats, receiver);
+        recv_seg(coalescer, s[1], stats, receiver);
+        AIPSTACK_ASSERT_FORCE(receiver.num_dgrams == 1)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[0].data_len == 2 * SegDataLen)
+        AIPSTACK_ASSERT_FORCE((receiver.dgrams[0].flags & Tcp4FlagPsh) != 0)
+        
+        for (int i = 2; i < 6; i++) {
+            make_seg(s[i], StartSeq + i * SegDataLen, Tcp4FlagAck);
+            recv_seg(coalescer, s[i], stats, receiver);
+        }
+        AIPSTACK_ASSERT_FORCE(receiver.num_dgrams == 2)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[1].seq == StartSeq + 2 * SegDataLen)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[1].data_len == 4 * SegDataLen)
+        
+        flush(coalescer, receiver);
+        AIPSTACK_ASSERT_FORCE(receiver.num_dgrams == 2)
+    }
+    
+    // Segments which cannot be coalesced are delivered after the pending
+    // segment of the same flow, without the verified flag.
+    {
+        IpStackStats stats;
+        Coalescer coalescer;
+        Receiver receiver;
+        TestSeg s[5];
+        make_seg(s[0], StartSeq, Tcp4FlagAck);
+        make_seg(s[1], StartSeq + SegDataLen, Tcp4FlagAck, SrcPort, true);
+        make_seg(s[2], StartSeq + 2 * SegDataLen, Tcp4FlagAck);
+        make_seg(s[3], StartSeq + 3 * SegDataLen, Tcp4FlagAck);
+        make_seg(s[4], StartSeq + 4 * SegDataLen, Tcp4FlagAck|Tcp4FlagFin);
+        
+        recv_seg(coalescer, s[0], stats, receiver);
+        recv_seg(coalescer, s[1], stats, receiver);
+        AIPSTACK_ASSERT_FORCE(receiver.num_dgrams == 2)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[0].seq == StartSeq)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[0].verified)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[1].seq == StartSeq + SegDataLen)
+        AIPSTACK_ASSERT_FORCE(!receiver.dgrams[1].verified)
+        
+        recv_seg(coalescer, s[2], stats, receiver, false);
+        recv_seg(coalescer, s[3], stats, receiver);
+        recv_seg(coalescer, s[4], stats, receiver);
+        AIPSTACK_ASSERT_FORCE(receiver.num_dgrams == 5)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[3].seq == StartSeq + 3 * SegDataLen)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[4].seq == StartSeq + 4 * SegDataLen)
+        AIPSTACK_ASSERT_FORCE(stats.tcp_in_coalesced.get() == 0)
+        for (int i = 0; i < 5; i++) {
+            AIPSTACK_ASSERT_FORCE(!s[i].isHeld())
+        }
+    }
+    
+    // A gap in sequence numbers starts a new combined segment, and different
+    // flows are kept separately with the oldest evicted when the table is full.
+    {
+        IpStackStats stats;
+        Coalescer coalescer;
+        Receiver receiver;
+        TestSeg s[4];
+        make_seg(s[0], StartSeq, Tcp4FlagAck);
+        make_seg(s[1], StartSeq + 2 * SegDataLen, Tcp4FlagAck);
+        make_seg(s[2], StartSeq, Tcp4FlagAck, SrcPort + 1);
+        make_seg(s[3], StartSeq, Tcp4FlagAck, SrcPort + 2);
+        
+        recv_seg(coalescer, s[0], stats, receiver);
+        recv_seg(coalescer, s[1], stats, receiver);
+        AIPSTACK_ASSERT_FORCE(receiver.num_dgrams == 1)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[0].seq == StartSeq)
+        
+        recv_seg(coalescer, s[2], stats, receiver);
+        recv_seg(coalescer, s[3], stats, receiver);
+        AIPSTACK_ASSERT_FORCE(receiver.num_dgrams == 2)
+        AIPSTACK_ASSERT_FORCE(receiver.dgrams[1].src_port == SrcPort)
+        
+        flush(coalescer, receiver);
+        AIPSTACK_ASSERT_FORCE(receiver.num_dgrams == 4)
+        for (int i = 0; i < 4; i++) {
+            AIPSTACK_ASSERT_FORCE(!s[i].isHeld())
+        }
+    }
+    
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Chksum.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpTcpSegmenter.h>
+
+using namespace AIpStack;
+
+static Ip4Addr const SrcAddr = Ip4Addr::FromBytes(10, 0, 0, 1);
+static Ip4Addr const DstAddr = Ip4Addr::FromBytes(10, 0, 0, 2);
+static size_t const LinkHdrLen = 14;
+static size_t const TcpOptsLen = 12;
+static size_t const HdrsLen = LinkHdrLen + Ip4Header::Size + Tcp4Header::Size + TcpOptsLen;
+static size_t const DataLen = 5000;
+static uint16_t const Ident = 0xFFFE;
+static uint32_t const SeqNum = 0xFFFFF000;
+static uint16_t const Flags = Tcp4FlagAck|Tcp4FlagPsh|Tcp4FlagFin;
+
+// A large packet with the headers in the first buffer and the data split
+// over two more buffers.
+struct TestPkt {
+    char hdrs[HdrsLen];
+    char data[DataLen];
+    IpBufNode nodes[3];
+    
+    IpBufRef make ()
+    {
+        memset(hdrs, 0xAB, LinkHdrLen);
+        
+        size_t tcp_len = Tcp4Header::Size + TcpOptsLen + DataLen;
+        auto ip4_header = Ip4Header::MakeRef(hdrs + LinkHdrLen);
+        ip4_header.set(Ip4Header::VersionIhlDscpEcn(), uint16_t((4 << 12) | (5 << 8)));
+        ip4_header.set(Ip4Header::TotalLen(), uint16_t(Ip4Header::Size + tcp_len));
+        ip4_header.set(Ip4Header::Ident(), Ident);
+        ip4_header.set(Ip4Header::FlagsOffset(), Ip4FlagDF);
+        ip4_header.set(Ip4Header::TtlProto(), uint16_t((64 << 8) | Ip4ProtocolTcp));
+        ip4_header.set(Ip4Header::HeaderChksum(), 0);
+        ip4_header.set(Ip4Header::SrcAddr(), SrcAddr);
+        ip4_header.set(Ip4Header::DstAddr(), DstAddr);
+        
+        char *tcp_ptr = hdrs + LinkHdrLen + Ip4Header::Size;
+        auto tcp_header = Tcp4Header::MakeRef(tcp_ptr);
+        tcp_header.set(Tcp4Header::SrcPort(), 1234);
+        tcp_header.set(Tcp4Header::DstPort(), 80);
+        tcp_header.set(Tcp4Header::SeqNum(), SeqNum);
+        tcp_header.set(Tcp4Header::AckNum(), 777);
+        tcp_header.set(Tcp4Header::OffsetFlags(), uint16_t(
+            (((Tcp4Header::Size + TcpOptsLen) / 4) << TcpOffsetShift) | Flags));
+        tcp_header.set(Tcp4Header::WindowSize(), 1000);
+        tcp_header.set(Tcp4Header::Checksum(), 0x1234);
+        tcp_header.set(Tcp4Header::UrgentPtr(), 0);
+        for (size_t i = 0; i < TcpOptsLen; i++) {
+            tcp_ptr[Tcp4Header::Size + i] = char(TcpOptionNop);
+        }
+        
+        for (size_t i = 0; i < DataLen; i++) {
+            data[i] = char(i * 7);
+        }
+        
+        nodes[0] = IpBufNode{hdrs, HdrsLen, &nodes[1]};
+        nodes[1] = IpBufNode{data, 1001, &nodes[2]};
+        nodes[2] = IpBufNode{data + 1001, DataLen - 1001, nullptr};
+        
+        return IpBufRef{&nodes[0], 0, HdrsLen + DataLen};
+    }
+};
+
+struct Checker {
+    size_t seg_data_len;
+    size_t segs_per_pkt;
+    size_t fail_at;
+    size_t num_pkts = 0;
+    size_t data_pos = 0;
+    
+    IpErr check (IpBufRef pkt)
+    {
+        if (num_pkts == fail_at) {
+            return IpErr::BUFFER_FULL;
+        }
+        
+        AIPSTACK_ASSERT_FORCE(pkt.tot_len > HdrsLen)
+        size_t pkt_data = pkt.tot_len - HdrsLen;
+        size_t max_pkt_data = seg_data_len * segs_per_pkt;
+        bool last = data_pos + pkt_data == DataLen;
+        AIPSTACK_ASSERT_FORCE(pkt_data == (last ? DataLen - data_pos : max_pkt_data))
+        
+        char hdrs[HdrsLen];
+        IpBufRef rem = pkt;
+        rem.takeBytes(HdrsLen, hdrs);
+        
+        // The link-layer header is copied as is.
+        for (size_t i = 0; i < LinkHdrLen; i++) {
+            AIPSTACK_ASSERT_FORCE(uint8_t(hdrs[i]) == 0xAB)
+        }
+        
+        // Check the IP header.
+        char *ip_ptr = hdrs + LinkHdrLen;
+        auto ip4_header = Ip4Header::MakeRef(ip_ptr);
+        size_t tcp_len = HdrsLen - LinkHdrLen - Ip4Header::Size + pkt_data;
+        AIPSTACK_ASSERT_FORCE(ip4_header.get(Ip4Header::TotalLen()) ==
+                              Ip4Header::Size + tcp_len)
+        AIPSTACK_ASSERT_FORCE(ip4_header.get(Ip4Header::Ident()) ==
+                              uint16_t(Ident + num_pkts * segs_per_pkt))
+        AIPSTACK_ASSERT_FORCE(ip4_header.get(Ip4Header::FlagsOffset()) == Ip4FlagDF)
+        AIPSTACK_ASSERT_FORCE(IpChksum(ip_ptr, Ip4Header::Size) == 0)
+        
+        // Check the TCP header.
+        char *tcp_ptr = ip_ptr + Ip4Header::Size;
+        auto tcp_header = Tcp4Header::MakeRef(tcp_ptr);
+        AIPSTACK_ASSERT_FORCE(tcp_header.get(Tcp4Header::SeqNum()) ==
+                              uint32_t(SeqNum + data_pos))
+        uint16_t flags = tcp_header.get(Tcp4Header::OffsetFlags()) & 0xFFF;
+        AIPSTACK_ASSERT_FORCE(flags == (last ? Flags : Tcp4FlagAck))
+        AIPSTACK_ASSERT_FORCE(tcp_header.get(Tcp4Header::AckNum()) == 777)
+        AIPSTACK_ASSERT_FORCE(uint8_t(tcp_ptr[Tcp4Header::Size]) == TcpOptionNop)
+        
+        // The TCP checksum is valid only for individual segments.
+        if (pkt_data <= seg_data_len) {
+            IpChksumAccumulator chksum;
+            chksum.addWords(&SrcAddr.data);
+            chksum.addWords(&DstAddr.data);
+            chksum.addWord(WrapType<uint16_t>(), Ip4ProtocolTcp);
+            chksum.addWord(WrapType<uint16_t>(), uint16_t(tcp_len));
+            AIPSTACK_ASSERT_FORCE(
+                chksum.getChksum(pkt.hideHeader(LinkHdrLen + Ip4Header::Size)) == 0)
+        }
+        
+        // Check the data.
+        for (size_t i = 0; i < pkt_data; i++) {
+            char ch;
+            rem.takeBytes(1, &ch);
+            AIPSTACK_ASSERT_FORCE(ch == char((data_pos + i) * 7))
+        }
+        
+        num_pkts++;
+        data_pos += pkt_data;
+        
+        return IpErr::SUCCESS;
+    }
+};
+
+static void test_segment (uint16_t seg_data_len, size_t segs_per_pkt, size_t fail_at)
+{
+    TestPkt test_pkt;
+    IpBufRef pkt = test_pkt.make();
+    
+    Checker checker{seg_data_len, segs_per_pkt, fail_at};
+    size_t data_sent;
+    IpErr err = IpTcpSegmenter::segment(pkt, LinkHdrLen, seg_data_len, segs_per_pkt,
+        false, [&](IpBufRef seg_pkt) { return checker.check(seg_pkt); }, data_sent);
+    
+    size_t max_pkt_data = seg_data_len * segs_per_pkt;
+    size_t num_pkts = (DataLen + max_pkt_data - 1) / max_pkt_data;
+    
+    if (fail_at < num_pkts) {
+        AIPSTACK_ASSERT_FORCE(err == IpErr::BUFFER_FULL)
+        AIPSTACK_ASSERT_FORCE(checker.num_pkts == fail_at)
+    } else {
+        AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+        AIPSTACK_ASSERT_FORCE(checker.num_pkts == num_pkts)
+        AIPSTACK_ASSERT_FORCE(checker.data_pos == DataLen)
+    }
+    AIPSTACK_ASSERT_FORCE(data_sent == checker.data_pos)
+}
+
+int main ()
+{
+    size_t const no_fail = size_t(-1);
+    
+    test_segment(1448, 1, no_fail);
+    test_segment(1000, 1, no_fail);
+    test_segment(DataLen, 1, no_fail);
+    test_segment(536, 1, no_fail);
+    test_segment(1448, 2, no_fail);
+    test_segment(536, 4, no_fail);
+    test_segment(1448, 1, 0);
+    test_segment(1448, 1, 2);
+    test_segment(536, 4, 1);
+    
+    return 0;
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/ip/IpLoopbackIface.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/udp/IpUdpProto.h>
+
+#include "test_stack.h"
+
+using namespace AIpStack;
+using namespace AIpStackTest;
+
+static Ip4Addr const IfaceAddr = Ip4Addr::FromBytes(10, 0, 0, 1);
+static Ip4Addr const LoopbackAddr1 = Ip4Addr::FromBytes(127, 0, 0, 1);
+static Ip4Addr const LoopbackAddr2 = Ip4Addr::FromBytes(127, 0, 0, 2);
+static Ip4Addr const LoopbackAddr3 = Ip4Addr::FromBytes(127, 1, 2, 3);
+
+using TestTcpArg = TestIpStack::GetProtoArg<TcpApi>;
+
+using TestLoopbackIface = IpLoopbackIface<TestStackArg>;
+
+static size_t const RingSize = 4 * (TestLoopbackIface::RingOverhead + 1500);
+
+// UDP listener on port 5000 which remembers the last received datagram.
+class TestUdpReceiver {
+public:
+    TestUdpReceiver () :
+        num_received(0),
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&TestUdpReceiver::packetReceived, this))
+    {}
+
+    void listen (TestIpStack &stack)
+    {
+        UdpListenParams<TestUdpArg> params;
+        params.port = 5000;
+        IpErr err = m_listener.startListening(stack.getProtoApi<UdpApi>(), params);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+    }
+
+    int num_received;
+    Ip4Addr src_addr;
+    Ip4Addr dst_addr;
+
+private:
+    UdpRecvResult packetReceived (IpRxInfoIp4<TestStackArg> const &ip_info,
+                                  UdpRxInfo<TestUdpArg> const &, IpBufRef data)
+    {
+        AIPSTACK_ASSERT_FORCE(data.tot_len == 4)
+
+        num_received++;
+        src_addr = ip_info.src_addr;
+        dst_addr = ip_info.dst_addr;
+
+        return UdpRecvResult::AcceptStop;
+    }
+
+private:
+    UdpListener<TestUdpArg> m_listener;
+};
+
+// Send a UDP datagram to the address from the local address selected by the stack.
+static void send_udp (TestIpStack &stack, Ip4Addr dst)
+{
+    IpIface<TestStackArg> *iface;
+    Ip4Addr local_addr;
+    IpErr err = stack.selectLocalIp4Address(dst, iface, local_addr);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+
+    char buf[UdpApi<TestUdpArg>::HeaderBeforeUdpData + 4];
+    IpBufNode node{buf, sizeof(buf), nullptr};
+    err = stack.getProtoApi<UdpApi>().sendUdpIp4Packet(
+        {local_addr, dst}, {1000, 5000},
+        IpBufRef{&node, UdpApi<TestUdpArg>::HeaderBeforeUdpData, 4},
+        nullptr, nullptr, IpSendFlags());
+    AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+}
+
+static void test_local_addrs ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, IfaceAddr, 24);
+
+    char ring[RingSize];
+    TestLoopbackIface loopback(&stack, {ring, RingSize, 1500});
+    IpIface<TestStackArg> &lo = loopback.iface();
+
+    // The whole loopback subnet except its network and broadcast addresses, and
+    // the addresses of the other interfaces.
+    AIPSTACK_ASSERT_FORCE(lo.ip4AddrIsLocalAddr(LoopbackAddr1))
+    AIPSTACK_ASSERT_FORCE(lo.ip4AddrIsLocalAddr(LoopbackAddr2))
+    AIPSTACK_ASSERT_FORCE(lo.ip4AddrIsLocalAddr(LoopbackAddr3))
+    AIPSTACK_ASSERT_FORCE(!lo.ip4AddrIsLocalAddr(Ip4Addr::FromBytes(127, 0, 0, 0)))
+    AIPSTACK_ASSERT_FORCE(!lo.ip4AddrIsLocalAddr(Ip4Addr::FromBytes(127, 255, 255, 255)))
+    AIPSTACK_ASSERT_FORCE(lo.ip4AddrIsLocalAddr(IfaceAddr))
+    AIPSTACK_ASSERT_FORCE(!lo.ip4AddrIsLocalAddr(Ip4Addr::FromBytes(10, 0, 0, 2)))
+
+    // Other interfaces only have their own address.
+    AIPSTACK_ASSERT_FORCE(iface.iface().ip4AddrIsLocalAddr(IfaceAddr))
+    AIPSTACK_ASSERT_FORCE(!iface.iface().ip4AddrIsLocalAddr(LoopbackAddr2))
+}
+
+static void test_udp ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, IfaceAddr, 24);
+
+    char ring[RingSize];
+    TestLoopbackIface loopback(&stack, {ring, RingSize, 1500});
+
+    TestUdpReceiver receiver;
+    receiver.listen(stack);
+
+    // Datagrams to any loopback address and to the address of the other interface
+    // are passed back through the loopback interface.
+    Ip4Addr const dst_addrs[] = {LoopbackAddr1, LoopbackAddr2, LoopbackAddr3, IfaceAddr};
+    int count = 0;
+    for (Ip4Addr dst_addr : dst_addrs) {
+        send_udp(stack, dst_addr);
+        AIPSTACK_ASSERT_FORCE(receiver.num_received == count)
+        sim.runFor(1);
+        count++;
+        AIPSTACK_ASSERT_FORCE(receiver.num_received == count)
+        AIPSTACK_ASSERT_FORCE(receiver.dst_addr == dst_addr)
+        AIPSTACK_ASSERT_FORCE(receiver.src_addr == dst_addr)
+    }
+
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 0)
+    AIPSTACK_ASSERT_FORCE(loopback.iface().getStats().in_delivers.get() == 4)
+}
+
+class TestTcpClient : public TcpConnection<TestTcpArg> {
+public:
+    bool established = false;
+    bool aborted = false;
+
+private:
+    void connectionAborted () override
+    {
+        aborted = true;
+    }
+
+    void connectionEstablished () override
+    {
+        established = true;
+    }
+
+    void dataReceived (size_t) override {}
+
+    void dataSent (size_t) override {}
+};
+
+class TestTcpServer {
+public:
+    TestTcpServer () :
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&TestTcpServer::connectionEstablished, this))
+    {}
+
+    void listen (TestIpStack &stack)
+    {
+        TcpListenParams params;
+        params.port = 80;
+        params.max_pcbs = 2;
+        bool ok = m_listener.startListening(stack.getProtoApi<TcpApi>(), params);
+        AIPSTACK_ASSERT_FORCE(ok)
+    }
+
+    TestTcpClient con;
+
+private:
+    void connectionEstablished ()
+    {
+        AIPSTACK_ASSERT_FORCE(con.isInit())
+        IpErr err = con.acceptConnection(m_listener);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+    }
+
+private:
+    TcpListener<TestTcpArg> m_listener;
+};
+
+static void test_tcp ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, IfaceAddr, 24);
+
+    char ring[RingSize];
+    TestLoopbackIface loopback(&stack, {ring, RingSize, 1500});
+
+    TestTcpServer server;
+    server.listen(stack);
+
+    // A connection to a loopback address other than the interface address.
+    TestTcpClient client;
+    TcpStartConnectionArgs<TestTcpArg> args;
+    args.addr = LoopbackAddr2;
+    args.port = 80;
+    IpErr err = client.startConnection(stack.getProtoApi<TcpApi>(), args);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+
+    sim.runFor(Platform::TimeFreq);
+    AIPSTACK_ASSERT_FORCE(client.established && !client.aborted)
+    AIPSTACK_ASSERT_FORCE(client.getLocalIp4Addr() == LoopbackAddr2)
+    AIPSTACK_ASSERT_FORCE(server.con.getLocalIp4Addr() == LoopbackAddr2)
+    AIPSTACK_ASSERT_FORCE(!server.con.isInit() && !server.con.aborted)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 0)
+}
+
+int main ()
+{
+    test_local_addrs();
+    test_udp();
+    test_tcp();
+
+    return 0;
+}
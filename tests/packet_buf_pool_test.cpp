@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/RxBufHold.h>
+#include <aipstack/infra/PacketBufPool.h>
+
+using namespace AIpStack;
+
+static size_t const NumBufs = 3;
+static size_t const Headroom = 14;
+static size_t const DataSize = 1500;
+
+int main ()
+{
+    size_t const line = IpPacketBufPool::CacheLineSize;
+
+    // Unaligned memory, the pool must still fit all buffers.
+    static char mem[IpPacketBufPool::getMemSize(NumBufs, Headroom, DataSize) + 1];
+
+    IpPacketBufPoolParams params;
+    params.mem = mem + 1;
+    params.mem_size = sizeof(mem) - 1;
+    params.headroom = Headroom;
+    params.data_size = DataSize;
+
+    IpPacketBufPool pool(params);
+    AIPSTACK_ASSERT_FORCE(pool.getNumBufs() == NumBufs)
+    AIPSTACK_ASSERT_FORCE(pool.getNumFree() == NumBufs)
+    AIPSTACK_ASSERT_FORCE(pool.getHeadroom() == line)
+
+    IpPacketBuf *bufs[NumBufs];
+    for (size_t i = 0; i < NumBufs; i++) {
+        bufs[i] = pool.alloc();
+        AIPSTACK_ASSERT_FORCE(bufs[i] != nullptr)
+        AIPSTACK_ASSERT_FORCE(bufs[i]->getRefCount() == 1)
+        AIPSTACK_ASSERT_FORCE(uintptr_t(bufs[i]->getBuffer()) % line == 0)
+        AIPSTACK_ASSERT_FORCE(uintptr_t(bufs[i]->getData()) % line == 0)
+        AIPSTACK_ASSERT_FORCE(bufs[i]->getData() - bufs[i]->getBuffer() == line)
+        if (i > 0) {
+            AIPSTACK_ASSERT_FORCE(bufs[i]->getBuffer() >= bufs[i - 1]->getData() + DataSize)
+        }
+    }
+    AIPSTACK_ASSERT_FORCE(pool.alloc() == nullptr)
+
+    // The reference reaches the whole buffer and the headroom can be revealed.
+    IpBufRef ref = bufs[0]->getRef(100);
+    AIPSTACK_ASSERT_FORCE(ref.getChunkPtr() == bufs[0]->getData())
+    AIPSTACK_ASSERT_FORCE(ref.tot_len == 100)
+    AIPSTACK_ASSERT_FORCE(ref.revealHeaderMust(line).getChunkPtr() == bufs[0]->getBuffer())
+
+    // Additional references keep the buffer.
+    bufs[0]->incRef();
+    bufs[0]->decRef();
+    AIPSTACK_ASSERT_FORCE(pool.getNumFree() == 0)
+    bufs[0]->decRef();
+    AIPSTACK_ASSERT_FORCE(pool.getNumFree() == 1)
+
+    // A hold keeps the buffer after the last reference, until released.
+    IpRxBufHold *hold = bufs[1]->rxHold();
+    hold->take();
+    bufs[1]->decRef();
+    AIPSTACK_ASSERT_FORCE(bufs[1]->isHeld() && pool.getNumFree() == 1)
+    hold->release();
+    AIPSTACK_ASSERT_FORCE(pool.getNumFree() == 2)
+
+    // Releasing the hold with references remaining keeps the buffer.
+    hold = bufs[2]->rxHold();
+    hold->take();
+    hold->release();
+    AIPSTACK_ASSERT_FORCE(pool.getNumFree() == 2)
+    bufs[2]->decRef();
+    AIPSTACK_ASSERT_FORCE(pool.getNumFree() == NumBufs)
+
+    // Freed buffers are reused.
+    IpPacketBuf *buf = pool.alloc();
+    AIPSTACK_ASSERT_FORCE(buf == bufs[2] && buf->getRefCount() == 1)
+    buf->decRef();
+
+    return 0;
+}
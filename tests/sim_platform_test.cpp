@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/SimPlatformImpl.h>
+
+using namespace AIpStack;
+
+using Platform = PlatformFacade<SimPlatformImpl>;
+
+struct TestTimer {
+    TestTimer (Platform platform_arg, uint64_t *log_arg, size_t *log_len_arg, int id_arg) :
+        platform(platform_arg),
+        timer(platform_arg.ref(), [this]() { handle(); }),
+        log(log_arg), log_len(log_len_arg), id(id_arg)
+    {}
+
+    void handle ()
+    {
+        AIPSTACK_ASSERT_FORCE(!timer.isSet())
+        log[(*log_len)++] = uint64_t(id) * 1000000 + platform.getTime();
+    }
+
+    Platform platform;
+    Platform::Timer timer;
+    uint64_t *log;
+    size_t *log_len;
+    int id;
+};
+
+int main ()
+{
+    SimPlatformImpl sim(100);
+    Platform platform(&sim);
+
+    uint64_t log[16];
+    size_t log_len = 0;
+
+    TestTimer t1(platform, log, &log_len, 1);
+    TestTimer t2(platform, log, &log_len, 2);
+    TestTimer t3(platform, log, &log_len, 3);
+
+    // Equal times are dispatched in the order set, past times at the current time.
+    t1.timer.setAt(200);
+    t2.timer.setAt(150);
+    t3.timer.setAt(200);
+    t2.timer.setAt(90);
+    AIPSTACK_ASSERT_FORCE(t2.timer.getSetTime() == 90)
+
+    SimPlatformImpl::TimeType next_time;
+    AIPSTACK_ASSERT_FORCE(sim.getNextTime(next_time) && next_time == 100)
+
+    sim.runUntil(180);
+    AIPSTACK_ASSERT_FORCE(log_len == 1 && log[0] == 2000100)
+    AIPSTACK_ASSERT_FORCE(platform.getTime() == 180)
+
+    sim.runFor(20);
+    AIPSTACK_ASSERT_FORCE(log_len == 3)
+    AIPSTACK_ASSERT_FORCE(log[1] == 1000200 && log[2] == 3000200)
+    AIPSTACK_ASSERT_FORCE(platform.getEventTime() == 200)
+
+    // Unset timers are not dispatched, and time jumps without any timers.
+    t1.timer.setAt(300);
+    t1.timer.unset();
+    AIPSTACK_ASSERT_FORCE(sim.runUntilIdle())
+    AIPSTACK_ASSERT_FORCE(log_len == 3 && platform.getTime() == 200)
+
+    sim.runUntil(1000000);
+    AIPSTACK_ASSERT_FORCE(platform.getTime() == 1000000)
+
+    // A handler may destruct its own timer and stop the run.
+    {
+        struct SelfDestruct {
+            SimPlatformImpl *sim;
+            Platform::Timer *timer;
+        } sd = {&sim, nullptr};
+
+        sd.timer = new Platform::Timer(platform.ref(), [&sd]() {
+            delete sd.timer;
+            sd.timer = nullptr;
+            sd.sim->stop();
+        });
+        sd.timer->setAt(1000010);
+        t1.timer.setAt(1000020);
+
+        sim.runUntil(2000000);
+        AIPSTACK_ASSERT_FORCE(sd.timer == nullptr)
+        AIPSTACK_ASSERT_FORCE(platform.getTime() == 1000010)
+        AIPSTACK_ASSERT_FORCE(log_len == 3)
+
+        AIPSTACK_ASSERT_FORCE(sim.step())
+        AIPSTACK_ASSERT_FORCE(log_len == 4 && log[3] == 1000000 + 1000020)
+        AIPSTACK_ASSERT_FORCE(!sim.step())
+    }
+
+    AIPSTACK_ASSERT_FORCE(sim.getNumDispatched() == 5)
+
+    return 0;
+}
@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <deque>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/infra/SendRetry.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/SimPlatformImpl.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpDriverIface.h>
+#include <aipstack/ip/IpIfaceDriverParams.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+
+using namespace AIpStack;
+
+using Platform = PlatformFacade<SimPlatformImpl>;
+
+// The Path MTU cache entries outlive the PMTU raise timer, so that the PMTU is
+// only raised by probes.
+using TestIpStackService = IpStackService<
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuTimeoutMinutes::Is<60>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<AvlTreeIndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<
+            IpReassemblyOptions::MaxReassEntrys::Is<2>
+        >
+    >
+>;
+
+using TestProtocolServices = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::PcbIndexService::Is<AvlTreeIndexService>,
+        IpTcpProtoOptions::PmtuProbing::Is<true>
+    >
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimPlatformImpl, TestProtocolServices> {};
+
+using TestIpStack = IpStack<TestStackArg>;
+
+using TestTcpArg = TestIpStack::GetProtoArg<TcpApi>;
+
+static Ip4Addr const ClientAddr = Ip4Addr::FromBytes(10, 0, 0, 1);
+static Ip4Addr const ServerAddr = Ip4Addr::FromBytes(10, 0, 0, 2);
+static uint16_t const ServerPort = 80;
+static size_t const Mtu = 1500;
+static size_t const BufSize = 32768;
+static uint64_t const Second = uint64_t(Platform::TimeFreq);
+
+// One direction of a link with a fixed delay. Packets larger than the black hole
+// size (if set) are silently dropped, as are all packets while the link is down.
+class TestLink {
+public:
+    using ReceiveHandler = Function<void(IpBufRef pkt)>;
+
+    TestLink (Platform platform) :
+        black_hole_size(0),
+        down(false),
+        max_delivered(0),
+        m_timer(platform, AIPSTACK_BIND_MEMBER_TN(&TestLink::timerHandler, this))
+    {}
+
+    void setReceiveHandler (ReceiveHandler handler)
+    {
+        m_handler = handler;
+    }
+
+    void send (IpBufRef pkt)
+    {
+        if (down || (black_hole_size != 0 && pkt.tot_len > black_hole_size)) {
+            return;
+        }
+
+        Packet packet{m_timer.platform().getTime() + Second / 100,
+                      std::vector<char>(pkt.tot_len)};
+        pkt.takeBytes(pkt.tot_len, packet.data.data());
+        m_queue.push_back(packet);
+
+        if (!m_timer.isSet()) {
+            m_timer.setAt(m_queue.front().arrival);
+        }
+    }
+
+    size_t black_hole_size;
+    bool down;
+    size_t max_delivered;
+
+private:
+    struct Packet {
+        Platform::TimeType arrival;
+        std::vector<char> data;
+    };
+
+    void timerHandler ()
+    {
+        Platform::TimeType now = m_timer.platform().getTime();
+
+        while (!m_queue.empty() && m_queue.front().arrival <= now) {
+            Packet packet = m_queue.front();
+            m_queue.pop_front();
+
+            if (packet.data.size() > max_delivered) {
+                max_delivered = packet.data.size();
+            }
+
+            IpBufNode node{packet.data.data(), packet.data.size(), nullptr};
+            m_handler(IpBufRef{&node, 0, packet.data.size()});
+        }
+
+        if (!m_queue.empty()) {
+            m_timer.setAt(m_queue.front().arrival);
+        }
+    }
+
+private:
+    Platform::Timer m_timer;
+    ReceiveHandler m_handler;
+    std::deque<Packet> m_queue;
+};
+
+// Interface which sends through one link and receives from another.
+class TestLinkIface {
+public:
+    TestLinkIface (TestIpStack *stack, Ip4Addr addr, TestLink *tx_link, TestLink *rx_link) :
+        m_tx_link(tx_link),
+        m_driver_iface(stack, IpIfaceDriverParams{
+            /*ip_mtu=*/ Mtu,
+            /*hw_type=*/ IpHwType::Undefined,
+            /*hw_iface=*/ nullptr,
+            AIPSTACK_BIND_MEMBER_TN(&TestLinkIface::driverSendIp4Packet, this),
+            AIPSTACK_BIND_MEMBER_TN(&TestLinkIface::driverGetState, this)
+        })
+    {
+        m_driver_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, addr));
+        rx_link->setReceiveHandler(AIPSTACK_BIND_MEMBER_TN(&TestLinkIface::recv, this));
+    }
+
+private:
+    IpErr driverSendIp4Packet (IpBufRef pkt, Ip4Addr, IpSendRetryRequest *)
+    {
+        m_tx_link->send(pkt);
+        return IpErr::SUCCESS;
+    }
+
+    IpIfaceDriverState driverGetState ()
+    {
+        return IpIfaceDriverState();
+    }
+
+    void recv (IpBufRef pkt)
+    {
+        m_driver_iface.recvIp4Packet(pkt);
+    }
+
+private:
+    TestLink *m_tx_link;
+    IpDriverIface<TestStackArg> m_driver_iface;
+};
+
+// A connection using a single ring buffer, which sends a requested amount of
+// data and counts received data.
+class TestConnection : public TcpConnection<TestTcpArg> {
+public:
+    TestConnection () :
+        received(0),
+        m_node{m_buf, BufSize, &m_node},
+        m_to_send(0)
+    {
+        memset(m_buf, 'x', BufSize);
+    }
+
+    void startClient (TestIpStack &stack)
+    {
+        TcpStartConnectionArgs<TestTcpArg> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        args.rcv_wnd = BufSize;
+        IpErr err = startConnection(stack.getProtoApi<TcpApi>(), args);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+        setRecvBuf({&m_node, 0, BufSize});
+        setSendBuf({&m_node, 0, 0});
+    }
+
+    void startServer (TcpListener<TestTcpArg> &listener)
+    {
+        IpErr err = acceptConnection(listener);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+        setRecvBuf({&m_node, 0, BufSize});
+    }
+
+    void send (size_t amount)
+    {
+        m_to_send += amount;
+        queue_data(BufSize - getSendBuf().tot_len);
+    }
+
+    size_t received;
+
+private:
+    void connectionAborted () override
+    {
+        AIPSTACK_ASSERT_FORCE(false)
+    }
+
+    void dataReceived (size_t amount) override
+    {
+        received += amount;
+        extendRecvBuf(amount);
+    }
+
+    void dataSent (size_t amount) override
+    {
+        queue_data(amount);
+    }
+
+    void queue_data (size_t space)
+    {
+        size_t amount = (m_to_send < space) ? m_to_send : space;
+        if (amount > 0) {
+            m_to_send -= amount;
+            extendSendBuf(amount);
+            sendPush();
+        }
+    }
+
+private:
+    char m_buf[BufSize];
+    IpBufNode m_node;
+    size_t m_to_send;
+};
+
+// A client and a server stack connected with a pair of links, with a connection
+// from the client to the server.
+class TestPair {
+public:
+    TestPair (SimPlatformImpl &sim) :
+        m_sim(sim),
+        client_link(Platform(&sim)),
+        server_link(Platform(&sim)),
+        client_stack(Platform(&sim)),
+        server_stack(Platform(&sim)),
+        m_client_iface(&client_stack, ClientAddr, &client_link, &server_link),
+        m_server_iface(&server_stack, ServerAddr, &server_link, &client_link),
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&TestPair::connectionEstablished, this))
+    {
+        TcpListenParams params;
+        params.port = ServerPort;
+        params.max_pcbs = 1;
+        bool ok = m_listener.startListening(server_stack.getProtoApi<TcpApi>(), params);
+        AIPSTACK_ASSERT_FORCE(ok)
+
+        client.startClient(client_stack);
+        sim.runFor(Second);
+        AIPSTACK_ASSERT_FORCE(client.isConnected() && server.isConnected())
+    }
+
+    // Send data from the client and return the size of the largest packet which
+    // arrived at the server.
+    size_t transfer (size_t amount, uint64_t time)
+    {
+        size_t received = server.received;
+        client_link.max_delivered = 0;
+        client.send(amount);
+        m_sim.runFor(time);
+        AIPSTACK_ASSERT_FORCE(server.received == received + amount)
+        return client_link.max_delivered;
+    }
+
+    IpStackStats stats () const
+    {
+        return client_stack.getStats();
+    }
+
+private:
+    void connectionEstablished ()
+    {
+        server.startServer(m_listener);
+    }
+
+private:
+    SimPlatformImpl &m_sim;
+
+public:
+    TestLink client_link;
+    TestLink server_link;
+    TestIpStack client_stack;
+    TestIpStack server_stack;
+
+private:
+    TestLinkIface m_client_iface;
+    TestLinkIface m_server_iface;
+    TcpListener<TestTcpArg> m_listener;
+
+public:
+    TestConnection client;
+    TestConnection server;
+};
+
+// An ICMP decrease stops the search until the PMTU raise timer restarts it,
+// then a probe of the full size succeeds and raises the MSS.
+static void test_icmp_decrease_and_raise ()
+{
+    SimPlatformImpl sim;
+    TestPair pair(sim);
+    AIPSTACK_ASSERT_FORCE(pair.transfer(65536, 5 * Second) == Mtu)
+
+    AIPSTACK_ASSERT_FORCE(pair.client_stack.handleIcmpPacketTooBig(ServerAddr, 1000))
+    AIPSTACK_ASSERT_FORCE(pair.transfer(262144, 10 * Second) == 1000)
+    AIPSTACK_ASSERT_FORCE(pair.stats().tcp_pmtu_probes.get() == 0)
+
+    sim.runFor(600 * Second);
+    AIPSTACK_ASSERT_FORCE(pair.transfer(262144, 10 * Second) == Mtu)
+    AIPSTACK_ASSERT_FORCE(pair.stats().tcp_pmtu_probes.get() == 1)
+    AIPSTACK_ASSERT_FORCE(pair.stats().tcp_pmtu_probe_acks.get() == 1)
+}
+
+// Lost probes narrow the search range, which converges below the real PMTU.
+static void test_probe_lost ()
+{
+    SimPlatformImpl sim;
+    TestPair pair(sim);
+
+    AIPSTACK_ASSERT_FORCE(pair.client_stack.handleIcmpPacketTooBig(ServerAddr, 1000))
+    pair.client_link.black_hole_size = 1300;
+    sim.runFor(600 * Second);
+    pair.transfer(1048576, 30 * Second);
+
+    size_t size = pair.transfer(262144, 10 * Second);
+    AIPSTACK_ASSERT_FORCE(size <= 1300 && size > 1300 - 32)
+    uint32_t probes = pair.stats().tcp_pmtu_probes.get();
+    uint32_t acks = pair.stats().tcp_pmtu_probe_acks.get();
+    AIPSTACK_ASSERT_FORCE(acks >= 1 && probes >= acks + 3)
+    AIPSTACK_ASSERT_FORCE(pair.stats().tcp_pmtu_black_holes.get() == 0)
+}
+
+// Repeated timeouts with full-size segments lost while smaller ones get through
+// are detected as a black hole, and the search then finds the real PMTU.
+static void test_black_hole ()
+{
+    SimPlatformImpl sim;
+    TestPair pair(sim);
+
+    pair.client_link.black_hole_size = 1300;
+    pair.transfer(1048576, 30 * Second);
+    AIPSTACK_ASSERT_FORCE(pair.stats().tcp_pmtu_black_holes.get() == 1)
+
+    size_t size = pair.transfer(262144, 10 * Second);
+    AIPSTACK_ASSERT_FORCE(size <= 1300 && size > 1300 - 32)
+}
+
+// Timeouts where small segments are lost as well are not a black hole.
+static void test_outage ()
+{
+    SimPlatformImpl sim;
+    TestPair pair(sim);
+
+    pair.client_link.down = true;
+    pair.client.send(65536);
+    sim.runFor(60 * Second);
+    AIPSTACK_ASSERT_FORCE(pair.server.received == 0)
+    AIPSTACK_ASSERT_FORCE(pair.stats().tcp_pmtu_black_holes.get() == 0)
+}
+
+int main ()
+{
+    test_icmp_decrease_and_raise();
+    test_probe_lost();
+    test_black_hole();
+    test_outage();
+
+    return 0;
+}
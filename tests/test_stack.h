@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// An IpStack on the simulated platform with an interface whose sent packets are
+// kept for inspection and through which packets can be injected, shared by the
+// tests which exercise the stack as a whole.
+
+#ifndef AIPSTACK_TEST_STACK_H
+#define AIPSTACK_TEST_STACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/infra/Chksum.h>
+#include <aipstack/infra/SendRetry.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Udp4Proto.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/SimPlatformImpl.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpDriverIface.h>
+#include <aipstack/ip/IpIfaceDriverParams.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/udp/IpUdpProto.h>
+
+namespace AIpStackTest {
+
+using namespace AIpStack;
+
+using Platform = PlatformFacade<SimPlatformImpl>;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<AvlTreeIndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<
+            IpReassemblyOptions::MaxReassEntrys::Is<2>,
+            IpReassemblyOptions::MaxReassSize::Is<3000>
+        >
+    >
+>;
+
+using TestProtocolServices = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::PcbIndexService::Is<AvlTreeIndexService>
+    >,
+    IpUdpProtoService<
+        IpUdpProtoOptions::UdpIndexService::Is<AvlTreeIndexService>
+    >
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimPlatformImpl, TestProtocolServices> {};
+
+using TestIpStack = IpStack<TestStackArg>;
+
+using TestUdpArg = TestIpStack::GetProtoArg<UdpApi>;
+
+// Interface with a fixed address. Sent packets are copied into an array; with a
+// send limit, packets beyond it fail with BUFFER_FULL.
+class TestIface {
+public:
+    static size_t const MaxPackets = 32;
+    static size_t const MaxPacketSize = 1600;
+
+    TestIface (TestIpStack *stack, Ip4Addr addr, uint8_t prefix, size_t mtu = 1500) :
+        m_num_sent(0),
+        m_send_limit(MaxPackets),
+        m_driver_iface(stack, IpIfaceDriverParams{
+            /*ip_mtu=*/ mtu,
+            /*hw_type=*/ IpHwType::Undefined,
+            /*hw_iface=*/ nullptr,
+            AIPSTACK_BIND_MEMBER_TN(&TestIface::driverSendIp4Packet, this),
+            AIPSTACK_BIND_MEMBER_TN(&TestIface::driverGetState, this)
+        })
+    {
+        AIPSTACK_ASSERT_FORCE(mtu <= MaxPacketSize)
+
+        iface().setIp4Addr(IpIfaceIp4AddrSetting(prefix, addr));
+    }
+
+    inline IpIface<TestStackArg> & iface ()
+    {
+        return m_driver_iface.iface();
+    }
+
+    void recv (char const *data, size_t len)
+    {
+        IpBufNode node{const_cast<char *>(data), len, nullptr};
+        m_driver_iface.recvIp4Packet(IpBufRef{&node, 0, len});
+    }
+
+    void setSendLimit (size_t limit)
+    {
+        AIPSTACK_ASSERT_FORCE(limit <= MaxPackets)
+
+        m_send_limit = limit;
+    }
+
+    // Allow more packets to be sent and notify the senders which got BUFFER_FULL.
+    void raiseSendLimit (size_t limit)
+    {
+        setSendLimit(limit);
+        m_retry_list.dispatchRequests();
+    }
+
+    inline size_t numSent () const
+    {
+        return m_num_sent;
+    }
+
+    inline char const * sentData (size_t i) const
+    {
+        AIPSTACK_ASSERT_FORCE(i < m_num_sent)
+
+        return m_packets[i];
+    }
+
+    inline size_t sentLen (size_t i) const
+    {
+        AIPSTACK_ASSERT_FORCE(i < m_num_sent)
+
+        return m_lengths[i];
+    }
+
+    void clearSent ()
+    {
+        m_num_sent = 0;
+    }
+
+private:
+    IpErr driverSendIp4Packet (IpBufRef pkt, Ip4Addr, IpSendRetryRequest *retryReq)
+    {
+        if (m_num_sent >= m_send_limit) {
+            m_retry_list.addRequest(retryReq);
+            return IpErr::BUFFER_FULL;
+        }
+        AIPSTACK_ASSERT_FORCE(pkt.tot_len <= MaxPacketSize)
+
+        m_lengths[m_num_sent] = pkt.tot_len;
+        pkt.takeBytes(pkt.tot_len, m_packets[m_num_sent]);
+        m_num_sent++;
+
+        return IpErr::SUCCESS;
+    }
+
+    IpIfaceDriverState driverGetState ()
+    {
+        return IpIfaceDriverState();
+    }
+
+private:
+    char m_packets[MaxPackets][MaxPacketSize];
+    size_t m_lengths[MaxPackets];
+    size_t m_num_sent;
+    size_t m_send_limit;
+    IpSendRetryList m_retry_list;
+    IpDriverIface<TestStackArg> m_driver_iface;
+};
+
+// Write an IPv4 header for a packet of the given total length.
+inline void WriteIp4Header (char *buf, size_t len, uint8_t proto, Ip4Addr src,
+                            Ip4Addr dst, uint16_t flags_offset = 0)
+{
+    auto hdr = Ip4Header::MakeRef(buf);
+    hdr.set(Ip4Header::VersionIhlDscpEcn(), (4 << 12) | (5 << 8));
+    hdr.set(Ip4Header::TotalLen(), uint16_t(len));
+    hdr.set(Ip4Header::Ident(), 0);
+    hdr.set(Ip4Header::FlagsOffset(), flags_offset);
+    hdr.set(Ip4Header::TtlProto(), (uint16_t(64) << 8) | proto);
+    hdr.set(Ip4Header::HeaderChksum(), 0);
+    hdr.set(Ip4Header::SrcAddr(), src);
+    hdr.set(Ip4Header::DstAddr(), dst);
+    hdr.set(Ip4Header::HeaderChksum(), IpChksum(buf, Ip4Header::Size));
+}
+
+// Build a UDP datagram without a checksum, return the packet length.
+inline size_t MakeUdpPacket (char *buf, Ip4Addr src, Ip4Addr dst, uint16_t src_port,
+                             uint16_t dst_port, char const *data, size_t data_len)
+{
+    size_t len = Ip4Header::Size + Udp4Header::Size + data_len;
+    WriteIp4Header(buf, len, Ip4ProtocolUdp, src, dst);
+
+    auto udp = Udp4Header::MakeRef(buf + Ip4Header::Size);
+    udp.set(Udp4Header::SrcPort(), src_port);
+    udp.set(Udp4Header::DstPort(), dst_port);
+    udp.set(Udp4Header::Length(), uint16_t(Udp4Header::Size + data_len));
+    udp.set(Udp4Header::Checksum(), 0);
+    memcpy(buf + Ip4Header::Size + Udp4Header::Size, data, data_len);
+
+    return len;
+}
+
+}
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Tracing is enabled here, with each record timestamped by a counter.
+static unsigned int trace_time_counter = 0;
+#define AIPSTACK_CONFIG_ENABLE_TRACE 1
+#define AIPSTACK_CONFIG_TRACE_TIME() (++trace_time_counter)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Trace.h>
+#include <aipstack/utils/TraceFormat.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+
+#include "test_stack.h"
+
+using namespace AIpStack;
+using namespace AIpStackTest;
+
+static Ip4Addr const LocalAddr = Ip4Addr::FromBytes(10, 0, 0, 1);
+static Ip4Addr const RemoteAddr = Ip4Addr::FromBytes(10, 0, 0, 2);
+static Ip4Addr const OffLinkAddr = Ip4Addr::FromBytes(192, 168, 1, 1);
+
+// Format records with the given function and compare the output.
+static void check_format (void (*format) (FILE *, TraceRecord const *, size_t),
+                          TraceRecord const *records, size_t num, char const *expected)
+{
+    FILE *file = tmpfile();
+    AIPSTACK_ASSERT_FORCE(file != nullptr)
+    format(file, records, num);
+
+    char out[2048];
+    rewind(file);
+    size_t len = fread(out, 1, sizeof(out) - 1, file);
+    out[len] = '\0';
+    fclose(file);
+
+    AIPSTACK_ASSERT_FORCE(strcmp(out, expected) == 0)
+}
+
+static void test_ring ()
+{
+    // Only the most recent records are kept when the ring wraps around.
+    TraceRingBuffer<4> ring;
+    TraceRecord out[8];
+    AIPSTACK_ASSERT_FORCE(ring.snapshot(out, 8) == 0)
+
+    for (uint32_t i = 0; i < 6; i++) {
+        ring.record(TraceEvent::TcpRtoFired, uint16_t(i), i * 10, i * 100);
+    }
+    AIPSTACK_ASSERT_FORCE(ring.writeCount() == 6)
+
+    // The oldest slot of a full ring is not included since the writer could be
+    // overwriting it.
+    size_t num = ring.snapshot(out, 8);
+    AIPSTACK_ASSERT_FORCE(num == 3)
+    for (size_t i = 0; i < num; i++) {
+        AIPSTACK_ASSERT_FORCE(out[i].event == uint16_t(TraceEvent::TcpRtoFired))
+        AIPSTACK_ASSERT_FORCE(out[i].arg0 == 3 + i && out[i].arg2 == (3 + i) * 100)
+    }
+
+    // At most max_records of the newest records.
+    num = ring.snapshot(out, 2);
+    AIPSTACK_ASSERT_FORCE(num == 2 && out[0].arg0 == 4 && out[1].arg0 == 5)
+
+    AIPSTACK_ASSERT_FORCE(strcmp(TraceEventName(uint16_t(TraceEvent::NumEvents)),
+                                 "Unknown") == 0)
+}
+
+static void test_stack_probes ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, LocalAddr, 24);
+
+    TraceRing &ring = TraceThreadRing();
+    uint32_t start_count = ring.writeCount();
+    trace_time_counter = 0;
+
+    char pkt[200];
+    char const data[4] = {1, 2, 3, 4};
+
+    // Too short for an IPv4 header.
+    iface.recv(pkt, 10);
+
+    // Bad IPv4 header checksum.
+    size_t len = MakeUdpPacket(pkt, RemoteAddr, LocalAddr, 1000, 2000, data, 4);
+    pkt[10] ^= 1;
+    iface.recv(pkt, len);
+
+    // No handler for protocol 99.
+    WriteIp4Header(pkt, Ip4Header::Size + 8, 99, RemoteAddr, LocalAddr);
+    iface.recv(pkt, Ip4Header::Size + 8);
+
+    // A TCP segment with a bad checksum.
+    len = Ip4Header::Size + Tcp4Header::Size;
+    WriteIp4Header(pkt, len, Ip4ProtocolTcp, RemoteAddr, LocalAddr);
+    auto tcp = Tcp4Header::MakeRef(pkt + Ip4Header::Size);
+    memset(pkt + Ip4Header::Size, 0, Tcp4Header::Size);
+    tcp.set(Tcp4Header::SrcPort(), 1000);
+    tcp.set(Tcp4Header::DstPort(), 80);
+    tcp.set(Tcp4Header::OffsetFlags(), uint16_t(5) << TcpOffsetShift);
+    tcp.set(Tcp4Header::Checksum(), 0x1234);
+    iface.recv(pkt, len);
+
+    // Sending to an address without a route.
+    char buf[UdpApi<TestUdpArg>::HeaderBeforeUdpData + 4];
+    IpBufNode node{buf, sizeof(buf), nullptr};
+    IpErr err = stack.getProtoApi<UdpApi>().sendUdpIp4Packet(
+        {LocalAddr, OffLinkAddr}, {1000, 2000},
+        IpBufRef{&node, UdpApi<TestUdpArg>::HeaderBeforeUdpData, 4},
+        nullptr, nullptr, IpSendFlags());
+    AIPSTACK_ASSERT_FORCE(err == IpErr::NO_IP_ROUTE)
+
+    AIPSTACK_ASSERT_FORCE(ring.writeCount() - start_count == 5)
+
+    TraceRecord records[5];
+    AIPSTACK_ASSERT_FORCE(ring.snapshot(records, 5) == 5)
+
+    check_format(&TraceFormatText, records, 5,
+        "         1 IpRxDrop             0 0x00000000 0\n"
+        "         2 IpRxDrop             2 0x0a000002 167772161\n"
+        "         3 IpRxDrop             4 0x0a000002 167772161\n"
+        "         4 TcpRxDrop            2 0x0a000002 20\n"
+        "         5 IpTxError            5 0xc0a80101 12\n");
+
+    check_format(&TraceFormatJson, records, 2,
+        "[\n"
+        "  {\"time\": 1, \"event\": \"IpRxDrop\", \"arg0\": 0, \"arg1\": 0, \"arg2\": 0},\n"
+        "  {\"time\": 2, \"event\": \"IpRxDrop\", \"arg0\": 2, \"arg1\": 167772162, "
+        "\"arg2\": 167772161}\n"
+        "]\n");
+
+    check_format(&TraceFormatJson, records, 0, "[\n]\n");
+}
+
+int main ()
+{
+    test_ring();
+    test_stack_probes();
+
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/infra/SendRetry.h>
+#include <aipstack/infra/TxScheduler.h>
+
+using namespace AIpStack;
+
+static size_t const PktLen = 500;
+
+// Simulates a driver transmit queue with room for a number of packets, recording
+// which sender sent each packet.
+class TestDriver {
+public:
+    TestDriver (IpTxScheduler *sched, int capacity) :
+        m_sched(sched),
+        m_free(capacity),
+        m_capacity(capacity)
+    {}
+    
+    bool send (IpSendRetryRequest *req, int id)
+    {
+        if (!m_sched->admit(req, PktLen)) {
+            return false;
+        }
+        if (m_free == 0) {
+            m_sched->driverFull(req);
+            return false;
+        }
+        m_free--;
+        log.push_back(id);
+        return true;
+    }
+    
+    // Transmit everything queued and notify the scheduler.
+    void drain ()
+    {
+        m_free = m_capacity;
+        m_sched->dispatch();
+    }
+    
+    std::vector<int> log;
+    
+private:
+    IpTxScheduler *m_sched;
+    int m_free;
+    int m_capacity;
+};
+
+// Sends packets as long as it is allowed to, and again when notified.
+class TestSender final : public IpSendRetryRequest {
+public:
+    TestSender (TestDriver *driver, int id, int num_pkts, uint8_t priority) :
+        remaining(num_pkts),
+        notified(0),
+        m_driver(driver),
+        m_id(id)
+    {
+        setTxPriority(priority);
+    }
+    
+    void pump ()
+    {
+        while (remaining > 0 && m_driver->send(this, m_id)) {
+            remaining--;
+        }
+    }
+    
+    int remaining;
+    int notified;
+    
+private:
+    void retrySending () override
+    {
+        notified++;
+        pump();
+    }
+    
+    TestDriver *m_driver;
+    int m_id;
+};
+
+static void test_round_robin ()
+{
+    IpTxScheduler sched(2 * PktLen);
+    TestDriver driver(&sched, 4);
+    
+    TestSender s0(&driver, 0, 40, 0);
+    TestSender s1(&driver, 1, 20, 0);
+    TestSender s2(&driver, 2, 20, 0);
+    
+    // The first sender fills the queue, the others are then refused.
+    s0.pump();
+    AIPSTACK_ASSERT_FORCE(driver.log.size() == 4)
+    s1.pump();
+    s2.pump();
+    AIPSTACK_ASSERT_FORCE(driver.log.size() == 4)
+    
+    // Packets without a send-retry request are not held back by the scheduler.
+    AIPSTACK_ASSERT_FORCE(sched.admit(nullptr, PktLen))
+    
+    for (int i = 0; i < 100 && (s0.remaining + s1.remaining + s2.remaining) > 0; i++) {
+        driver.drain();
+    }
+    AIPSTACK_ASSERT_FORCE(s0.remaining == 0 && s1.remaining == 0 && s2.remaining == 0)
+    
+    // While all senders had data, none got ahead by more than two turns.
+    int counts[3] = {};
+    for (size_t i = 4; i < driver.log.size(); i++) {
+        counts[driver.log[i]]++;
+        if (counts[1] < 20 && counts[2] < 20) {
+            for (int a = 0; a < 3; a++) {
+                for (int b = 0; b < 3; b++) {
+                    AIPSTACK_ASSERT_FORCE(counts[a] - counts[b] <= 4)
+                }
+            }
+        }
+    }
+    
+    // After everyone is served the interface is no longer congested.
+    driver.drain();
+    AIPSTACK_ASSERT_FORCE(sched.admit(&s0, PktLen))
+}
+
+static void test_priority ()
+{
+    IpTxScheduler sched(2 * PktLen);
+    TestDriver driver(&sched, 4);
+    
+    TestSender bulk(&driver, 0, 20, 1);
+    TestSender interactive(&driver, 1, 3, 0);
+    
+    bulk.pump();
+    interactive.pump();
+    AIPSTACK_ASSERT_FORCE(interactive.remaining == 3)
+    
+    // The interactive sender is served first, for more than one turn if needed.
+    driver.drain();
+    AIPSTACK_ASSERT_FORCE(interactive.remaining == 0)
+    AIPSTACK_ASSERT_FORCE(driver.log[4] == 1 && driver.log[5] == 1 && driver.log[6] == 1)
+    AIPSTACK_ASSERT_FORCE(driver.log[7] == 0)
+}
+
+static void test_notify_only ()
+{
+    // With a zero quantum, senders are only notified, in order of priority.
+    IpTxScheduler sched;
+    TestDriver driver(&sched, 2);
+    
+    TestSender low(&driver, 0, 10, 3);
+    TestSender high(&driver, 1, 10, 0);
+    TestSender beyond(&driver, 2, 10, 200);
+    
+    low.pump();
+    beyond.pump();
+    high.pump();
+    AIPSTACK_ASSERT_FORCE(low.isActive() && high.isActive() && beyond.isActive())
+    AIPSTACK_ASSERT_FORCE(sched.admit(&low, PktLen))
+    
+    driver.drain();
+    AIPSTACK_ASSERT_FORCE(high.notified == 1 && high.remaining == 8)
+    AIPSTACK_ASSERT_FORCE(low.notified == 1 && beyond.notified == 1)
+    AIPSTACK_ASSERT_FORCE(low.isActive() && beyond.isActive() && high.isActive())
+}
+
+int main ()
+{
+    test_round_robin();
+    test_priority();
+    test_notify_only();
+    
+    return 0;
+}
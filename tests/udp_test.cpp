@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2017 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/infra/Chksum.h>
+#include <aipstack/infra/SendRetry.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Udp4Proto.h>
+#include <aipstack/proto/Icmp4Proto.h>
+#include <aipstack/udp/IpUdpProto.h>
+
+#include "test_stack.h"
+
+using namespace AIpStack;
+using namespace AIpStackTest;
+
+static Ip4Addr const LocalAddr = Ip4Addr::FromBytes(10, 0, 0, 1);
+static Ip4Addr const RemoteAddr = Ip4Addr::FromBytes(10, 0, 0, 2);
+static Ip4Addr const RemoteAddr2 = Ip4Addr::FromBytes(10, 0, 0, 3);
+static Ip4Addr const OffLinkAddr = Ip4Addr::FromBytes(192, 168, 1, 1);
+
+// Listener which records the order of calls into a shared log and optionally
+// resets itself or another listener from the callback.
+class TestListener {
+public:
+    TestListener (char id, char *log) :
+        m_id(id),
+        m_log(log),
+        m_result(UdpRecvResult::AcceptContinue),
+        m_reset_self(false),
+        m_reset_other(nullptr),
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&TestListener::packetReceived, this))
+    {}
+
+    void listen (TestIpStack &stack, uint16_t port)
+    {
+        UdpListenParams<TestUdpArg> params;
+        params.port = port;
+        IpErr err = m_listener.startListening(stack.getProtoApi<UdpApi>(), params);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+    }
+
+    void setResult (UdpRecvResult result)
+    {
+        m_result = result;
+    }
+
+    void setResetSelf ()
+    {
+        m_reset_self = true;
+    }
+
+    void setResetOther (TestListener *other)
+    {
+        m_reset_other = other;
+    }
+
+    inline bool isListening () const
+    {
+        return m_listener.isListening();
+    }
+
+private:
+    UdpRecvResult packetReceived (IpRxInfoIp4<TestStackArg> const &ip_info,
+                                  UdpRxInfo<TestUdpArg> const &udp_info, IpBufRef data)
+    {
+        AIPSTACK_ASSERT_FORCE(ip_info.src_addr == RemoteAddr)
+        AIPSTACK_ASSERT_FORCE(udp_info.src_port == 3000)
+        AIPSTACK_ASSERT_FORCE(data.tot_len == 4)
+
+        size_t len = strlen(m_log);
+        m_log[len] = m_id;
+        m_log[len + 1] = '\0';
+
+        if (m_reset_self) {
+            m_listener.reset();
+        }
+        if (m_reset_other != nullptr) {
+            m_reset_other->m_listener.reset();
+        }
+
+        return m_result;
+    }
+
+private:
+    char m_id;
+    char *m_log;
+    UdpRecvResult m_result;
+    bool m_reset_self;
+    TestListener *m_reset_other;
+    UdpListener<TestUdpArg> m_listener;
+};
+
+class TestAssociation {
+public:
+    TestAssociation (char *log, UdpRecvResult result) :
+        m_log(log),
+        m_result(result),
+        m_assoc(AIPSTACK_BIND_MEMBER_TN(&TestAssociation::packetReceived, this))
+    {}
+
+    void associate (TestIpStack &stack, uint16_t local_port)
+    {
+        UdpAssociationParams<TestUdpArg> params;
+        params.key = {LocalAddr, RemoteAddr, local_port, 3000};
+        IpErr err = m_assoc.associate(stack.getProtoApi<UdpApi>(), params);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+    }
+
+private:
+    UdpRecvResult packetReceived (IpRxInfoIp4<TestStackArg> const &,
+                                  UdpRxInfo<TestUdpArg> const &, IpBufRef)
+    {
+        size_t len = strlen(m_log);
+        m_log[len] = 'A';
+        m_log[len + 1] = '\0';
+
+        return m_result;
+    }
+
+private:
+    char *m_log;
+    UdpRecvResult m_result;
+    UdpAssociation<TestUdpArg> m_assoc;
+};
+
+// Receive a datagram with four bytes of data and return the listener log.
+static char const * recv_udp (TestIface &iface, uint16_t dst_port, char *log)
+{
+    log[0] = '\0';
+
+    char pkt[64];
+    char const data[4] = {1, 2, 3, 4};
+    size_t len = MakeUdpPacket(pkt, RemoteAddr, LocalAddr, 3000, dst_port, data, 4);
+    iface.recv(pkt, len);
+
+    return log;
+}
+
+static void test_listener_order ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, LocalAddr, 24);
+
+    char log[16];
+
+    // Listeners for any port and for specific ports are interleaved, each gets the
+    // datagram in reverse order of starting to listen.
+    TestListener a('a', log), b('b', log), c('c', log), d('d', log), e('e', log);
+    a.listen(stack, 0);
+    b.listen(stack, 2000);
+    c.listen(stack, 0);
+    d.listen(stack, 2000);
+    e.listen(stack, 2001);
+
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2000, log), "dcba") == 0)
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2001, log), "eca") == 0)
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2002, log), "ca") == 0)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 0)
+
+    // A listener started later goes first even if it is for any port.
+    TestListener f('f', log);
+    f.listen(stack, 0);
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2000, log), "fdcba") == 0)
+}
+
+static void test_accept_stop ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, LocalAddr, 24);
+
+    char log[16];
+
+    TestListener a('a', log), b('b', log), c('c', log), d('d', log);
+    a.listen(stack, 0);
+    b.listen(stack, 2000);
+    c.listen(stack, 0);
+    d.listen(stack, 2000);
+
+    // Listeners after the one returning AcceptStop are not called, in both the
+    // per-port and the any-port sequence.
+    c.setResult(UdpRecvResult::AcceptStop);
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2000, log), "dc") == 0)
+
+    c.setResult(UdpRecvResult::AcceptContinue);
+    d.setResult(UdpRecvResult::AcceptStop);
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2000, log), "d") == 0)
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2001, log), "ca") == 0)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 0)
+
+    // If all listeners reject the datagram, a port unreachable is sent.
+    a.setResult(UdpRecvResult::Reject);
+    b.setResult(UdpRecvResult::Reject);
+    c.setResult(UdpRecvResult::Reject);
+    d.setResult(UdpRecvResult::Reject);
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2000, log), "dcba") == 0)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 1)
+    AIPSTACK_ASSERT_FORCE(uint8_t(iface.sentData(0)[9]) == Ip4ProtocolIcmp)
+    iface.clearSent();
+
+    // An association returning AcceptStop takes the datagram before any listener,
+    // one returning AcceptContinue passes it on.
+    TestAssociation assoc_stop(log, UdpRecvResult::AcceptStop);
+    assoc_stop.associate(stack, 2000);
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2000, log), "A") == 0)
+
+    TestAssociation assoc_cont(log, UdpRecvResult::AcceptContinue);
+    assoc_cont.associate(stack, 2001);
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2001, log), "Aca") == 0)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 0)
+}
+
+static void test_reset_in_callback ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, LocalAddr, 24);
+
+    char log[16];
+
+    TestListener a('a', log), b('b', log), c('c', log), d('d', log), e('e', log);
+    a.listen(stack, 0);
+    b.listen(stack, 2000);
+    c.listen(stack, 0);
+    d.listen(stack, 2000);
+    e.listen(stack, 2000);
+
+    // A listener removing itself during its callback; the following listeners in
+    // both sequences still get the datagram.
+    e.setResetSelf();
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2000, log), "edcba") == 0)
+    AIPSTACK_ASSERT_FORCE(!e.isListening())
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2000, log), "dcba") == 0)
+
+    // Removing the next listeners in the port and the any-port sequence.
+    d.setResetOther(&b);
+    c.setResetOther(&a);
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2000, log), "dc") == 0)
+    AIPSTACK_ASSERT_FORCE(!a.isListening() && !b.isListening())
+
+    // Removing the only remaining listener of a sequence, then itself.
+    d.setResetOther(nullptr);
+    d.setResetSelf();
+    c.setResetSelf();
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2000, log), "dc") == 0)
+    AIPSTACK_ASSERT_FORCE(!c.isListening() && !d.isListening())
+
+    // No listeners are left so the datagram is answered with port unreachable.
+    AIPSTACK_ASSERT_FORCE(strcmp(recv_udp(iface, 2000, log), "") == 0)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 1)
+}
+
+class TestRetryRequest : public IpSendRetryRequest {
+public:
+    int num_retries = 0;
+
+private:
+    void retrySending () override
+    {
+        num_retries++;
+    }
+};
+
+// Check that a sent packet is a UDP datagram from LocalAddr port 1000 with a valid
+// checksum and the given destination and data.
+static void check_sent_udp (TestIface &iface, size_t i, Ip4Addr dst, uint16_t dst_port,
+                            char const *data, size_t data_len)
+{
+    size_t udp_len = Udp4Header::Size + data_len;
+    AIPSTACK_ASSERT_FORCE(iface.sentLen(i) == Ip4Header::Size + udp_len)
+
+    char const *pkt = iface.sentData(i);
+    auto ip4_header = Ip4Header::MakeVal(pkt);
+    AIPSTACK_ASSERT_FORCE(ip4_header.get(Ip4Header::SrcAddr()) == LocalAddr)
+    AIPSTACK_ASSERT_FORCE(ip4_header.get(Ip4Header::DstAddr()) == dst)
+    AIPSTACK_ASSERT_FORCE(ip4_header.get(Ip4Header::TotalLen()) == iface.sentLen(i))
+    AIPSTACK_ASSERT_FORCE(IpChksum(pkt, Ip4Header::Size) == 0)
+
+    char const *udp = pkt + Ip4Header::Size;
+    auto udp_header = Udp4Header::MakeVal(udp);
+    AIPSTACK_ASSERT_FORCE(udp_header.get(Udp4Header::SrcPort()) == 1000)
+    AIPSTACK_ASSERT_FORCE(udp_header.get(Udp4Header::DstPort()) == dst_port)
+    AIPSTACK_ASSERT_FORCE(udp_header.get(Udp4Header::Length()) == udp_len)
+    AIPSTACK_ASSERT_FORCE(memcmp(udp + Udp4Header::Size, data, data_len) == 0)
+
+    IpChksumAccumulator accum;
+    accum.addWords(&LocalAddr.data);
+    accum.addWords(&dst.data);
+    accum.addWord(WrapType<uint16_t>(), Ip4ProtocolUdp);
+    accum.addWord(WrapType<uint16_t>(), uint16_t(udp_len));
+    IpBufNode node{const_cast<char *>(udp), udp_len, nullptr};
+    AIPSTACK_ASSERT_FORCE(accum.getChksum(IpBufRef{&node, 0, udp_len}) == 0)
+}
+
+static void test_batch_buffer_full ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, LocalAddr, 24);
+    UdpApi<TestUdpArg> &udp = stack.getProtoApi<UdpApi>();
+
+    char data[6][8];
+    IpBufNode nodes[6];
+    UdpTxBatchEntry<TestUdpArg> entries[6];
+    Ip4Addr const addrs[6] =
+        {RemoteAddr, OffLinkAddr, RemoteAddr, RemoteAddr2, RemoteAddr2, RemoteAddr};
+
+    for (size_t i = 0; i < 6; i++) {
+        memset(data[i], int('a' + i), sizeof(data[i]));
+        size_t len = 1 + i;
+        nodes[i] = IpBufNode{data[i], sizeof(data[i]), nullptr};
+        entries[i] = {addrs[i], uint16_t(2000 + i), IpBufRef{&nodes[i], 0, len},
+                      IpErr::ADDR_IN_USE};
+    }
+
+    // Room for three packets: the entry without a route fails without stopping the
+    // batch and the fourth sent packet (entry 4) gets BUFFER_FULL.
+    iface.setSendLimit(3);
+    TestRetryRequest retry;
+    size_t num_done = udp.sendUdpIp4Batch(
+        LocalAddr, 1000, entries, 6, &retry, IpSendFlags());
+    AIPSTACK_ASSERT_FORCE(num_done == 4)
+
+    AIPSTACK_ASSERT_FORCE(entries[0].err == IpErr::SUCCESS)
+    AIPSTACK_ASSERT_FORCE(entries[1].err == IpErr::NO_IP_ROUTE)
+    AIPSTACK_ASSERT_FORCE(entries[2].err == IpErr::SUCCESS)
+    AIPSTACK_ASSERT_FORCE(entries[3].err == IpErr::SUCCESS)
+    AIPSTACK_ASSERT_FORCE(entries[4].err == IpErr::BUFFER_FULL)
+    AIPSTACK_ASSERT_FORCE(entries[5].err == IpErr::ADDR_IN_USE)
+
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 3)
+    check_sent_udp(iface, 0, RemoteAddr, 2000, data[0], 1);
+    check_sent_udp(iface, 1, RemoteAddr, 2002, data[2], 3);
+    check_sent_udp(iface, 2, RemoteAddr2, 2003, data[3], 4);
+
+    // After the retry notification, the rest of the batch is sent.
+    AIPSTACK_ASSERT_FORCE(retry.isActive() && retry.num_retries == 0)
+    iface.raiseSendLimit(8);
+    AIPSTACK_ASSERT_FORCE(!retry.isActive() && retry.num_retries == 1)
+
+    num_done = udp.sendUdpIp4Batch(
+        LocalAddr, 1000, entries + 4, 2, &retry, IpSendFlags());
+    AIPSTACK_ASSERT_FORCE(num_done == 2)
+    AIPSTACK_ASSERT_FORCE(entries[4].err == IpErr::SUCCESS)
+    AIPSTACK_ASSERT_FORCE(entries[5].err == IpErr::SUCCESS)
+
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 5)
+    check_sent_udp(iface, 3, RemoteAddr2, 2004, data[4], 5);
+    check_sent_udp(iface, 4, RemoteAddr, 2005, data[5], 6);
+
+    // BUFFER_FULL on the first entry.
+    iface.clearSent();
+    iface.setSendLimit(0);
+    num_done = udp.sendUdpIp4Batch(LocalAddr, 1000, entries, 6, nullptr, IpSendFlags());
+    AIPSTACK_ASSERT_FORCE(num_done == 0 && entries[0].err == IpErr::BUFFER_FULL)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 0)
+}
+
+static void test_segmented ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, LocalAddr, 24);
+    UdpApi<TestUdpArg> &udp = stack.getProtoApi<UdpApi>();
+
+    // 25 bytes of data in two buffer nodes, so that segments cross the node
+    // boundary.
+    char data[25];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = char(i);
+    }
+    IpBufNode node2{data + 11, 14, nullptr};
+    IpBufNode node1{data, 11, &node2};
+    IpBufRef buf{&node1, 0, sizeof(data)};
+
+    // Full segments of 8 bytes and a last short one.
+    size_t sent_len = 1;
+    IpErr err = udp.sendUdpIp4Segmented({LocalAddr, RemoteAddr}, {1000, 2000}, buf, 8,
+                                        nullptr, IpSendFlags(), sent_len);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS && sent_len == 25)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 4)
+    check_sent_udp(iface, 0, RemoteAddr, 2000, data, 8);
+    check_sent_udp(iface, 1, RemoteAddr, 2000, data + 8, 8);
+    check_sent_udp(iface, 2, RemoteAddr, 2000, data + 16, 8);
+    check_sent_udp(iface, 3, RemoteAddr, 2000, data + 24, 1);
+
+    // Data which is a multiple of the segment size has no short segment.
+    iface.clearSent();
+    err = udp.sendUdpIp4Segmented({LocalAddr, RemoteAddr}, {1000, 2000}, buf.subTo(20),
+                                  10, nullptr, IpSendFlags(), sent_len);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS && sent_len == 20)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 2)
+    check_sent_udp(iface, 0, RemoteAddr, 2000, data, 10);
+    check_sent_udp(iface, 1, RemoteAddr, 2000, data + 10, 10);
+
+    // Data not larger than the segment size is sent as one datagram.
+    iface.clearSent();
+    err = udp.sendUdpIp4Segmented({LocalAddr, RemoteAddr}, {1000, 2000}, buf, 100,
+                                  nullptr, IpSendFlags(), sent_len);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS && sent_len == 25)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 1)
+    check_sent_udp(iface, 0, RemoteAddr, 2000, data, 25);
+
+    // No data, nothing is sent.
+    iface.clearSent();
+    err = udp.sendUdpIp4Segmented({LocalAddr, RemoteAddr}, {1000, 2000}, buf.subTo(0),
+                                  8, nullptr, IpSendFlags(), sent_len);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS && sent_len == 0)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 0)
+
+    // BUFFER_FULL partway through stops sending; sent_len tells where to continue
+    // after the retry notification.
+    iface.setSendLimit(2);
+    TestRetryRequest retry;
+    err = udp.sendUdpIp4Segmented({LocalAddr, RemoteAddr}, {1000, 2000}, buf, 8,
+                                  &retry, IpSendFlags(), sent_len);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::BUFFER_FULL && sent_len == 16)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 2)
+    check_sent_udp(iface, 0, RemoteAddr, 2000, data, 8);
+    check_sent_udp(iface, 1, RemoteAddr, 2000, data + 8, 8);
+
+    iface.raiseSendLimit(8);
+    AIPSTACK_ASSERT_FORCE(retry.num_retries == 1)
+
+    IpBufRef rest = buf;
+    rest.skipBytes(sent_len);
+    err = udp.sendUdpIp4Segmented({LocalAddr, RemoteAddr}, {1000, 2000}, rest, 8,
+                                  &retry, IpSendFlags(), sent_len);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS && sent_len == 9)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 4)
+    check_sent_udp(iface, 2, RemoteAddr, 2000, data + 16, 8);
+    check_sent_udp(iface, 3, RemoteAddr, 2000, data + 24, 1);
+
+    // An error in preparing the send is returned before anything is sent.
+    iface.clearSent();
+    sent_len = 1;
+    err = udp.sendUdpIp4Segmented({LocalAddr, OffLinkAddr}, {1000, 2000}, buf, 8,
+                                  nullptr, IpSendFlags(), sent_len);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::NO_IP_ROUTE && sent_len == 0)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 0)
+
+    // Segments which do not fit the MTU fail with FRAG_NEEDED.
+    Ip4Addr const small_local = Ip4Addr::FromBytes(10, 0, 1, 1);
+    Ip4Addr const small_remote = Ip4Addr::FromBytes(10, 0, 1, 2);
+    TestIface small_iface(&stack, small_local, 24, TestIpStack::MinMTU);
+    size_t max_seg = TestIpStack::MinMTU - Ip4Header::Size - Udp4Header::Size;
+
+    char big_data[300];
+    memset(big_data, 'x', sizeof(big_data));
+    IpBufNode big_node{big_data, sizeof(big_data), nullptr};
+    IpBufRef big_buf{&big_node, 0, sizeof(big_data)};
+
+    err = udp.sendUdpIp4Segmented({small_local, small_remote}, {1000, 2000}, big_buf,
+                                  max_seg + 1, nullptr, IpSendFlags(), sent_len);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::FRAG_NEEDED && sent_len == 0)
+    AIPSTACK_ASSERT_FORCE(small_iface.numSent() == 0)
+
+    err = udp.sendUdpIp4Segmented({small_local, small_remote}, {1000, 2000}, big_buf,
+                                  max_seg, nullptr, IpSendFlags(), sent_len);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS && sent_len == sizeof(big_data))
+    AIPSTACK_ASSERT_FORCE(small_iface.numSent() == 2)
+    AIPSTACK_ASSERT_FORCE(small_iface.sentLen(0) == TestIpStack::MinMTU)
+    AIPSTACK_ASSERT_FORCE(small_iface.sentLen(1) ==
+        Ip4Header::Size + Udp4Header::Size + sizeof(big_data) - max_seg)
+}
+
+// Write the two fragments of a UDP datagram with 40 bytes of data to port 2000, the
+// first with the UDP header and 16 bytes of data.
+static void make_udp_frags (char *frag1, size_t *len1, char *frag2, size_t *len2)
+{
+    *len1 = Ip4Header::Size + Udp4Header::Size + 16;
+    WriteIp4Header(frag1, *len1, Ip4ProtocolUdp, RemoteAddr, LocalAddr, Ip4FlagMF);
+    auto udp = Udp4Header::MakeRef(frag1 + Ip4Header::Size);
+    udp.set(Udp4Header::SrcPort(), 3000);
+    udp.set(Udp4Header::DstPort(), 2000);
+    udp.set(Udp4Header::Length(), Udp4Header::Size + 40);
+    udp.set(Udp4Header::Checksum(), 0);
+    memset(frag1 + Ip4Header::Size + Udp4Header::Size, 'a', 16);
+
+    *len2 = Ip4Header::Size + 24;
+    WriteIp4Header(frag2, *len2, Ip4ProtocolUdp, RemoteAddr, LocalAddr,
+                   (Udp4Header::Size + 16) / 8);
+    memset(frag2 + Ip4Header::Size, 'b', 24);
+}
+
+static void test_reassembled_port_unreach ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface iface(&stack, LocalAddr, 24);
+
+    // The port unreachable for a reassembled datagram quotes the IP header of the
+    // first fragment and the UDP header.
+    char frag1[64], frag2[64];
+    size_t len1, len2;
+    make_udp_frags(frag1, &len1, frag2, &len2);
+    iface.recv(frag2, len2);
+    iface.recv(frag1, len1);
+    AIPSTACK_ASSERT_FORCE(stack.stats().ip_reasm_oks.get() == 1)
+    AIPSTACK_ASSERT_FORCE(iface.numSent() == 1)
+
+    size_t quote_len = Ip4Header::Size + Udp4Header::Size;
+    AIPSTACK_ASSERT_FORCE(iface.sentLen(0) ==
+                          Ip4Header::Size + Icmp4Header::Size + quote_len)
+    char const *icmp = iface.sentData(0) + Ip4Header::Size;
+    auto icmp_header = Icmp4Header::MakeVal(icmp);
+    AIPSTACK_ASSERT_FORCE(icmp_header.get(Icmp4Header::Type()) == Icmp4TypeDestUnreach)
+    AIPSTACK_ASSERT_FORCE(icmp_header.get(Icmp4Header::Code()) ==
+                          Icmp4CodeDestUnreachPortUnreach)
+    AIPSTACK_ASSERT_FORCE(memcmp(icmp + Icmp4Header::Size, frag1, quote_len) == 0)
+}
+
+// Listener which removes the interface that the datagram was received on.
+class IfaceRemovingListener {
+public:
+    IfaceRemovingListener (TestIface *iface) :
+        m_iface(iface),
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&IfaceRemovingListener::packetReceived, this))
+    {}
+
+    void listen (TestIpStack &stack)
+    {
+        UdpListenParams<TestUdpArg> params;
+        params.port = 2000;
+        IpErr err = m_listener.startListening(stack.getProtoApi<UdpApi>(), params);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::SUCCESS)
+    }
+
+    inline bool ifaceRemoved () const
+    {
+        return m_iface == nullptr;
+    }
+
+private:
+    UdpRecvResult packetReceived (IpRxInfoIp4<TestStackArg> const &,
+                                  UdpRxInfo<TestUdpArg> const &, IpBufRef data)
+    {
+        AIPSTACK_ASSERT_FORCE(data.tot_len == 40)
+
+        delete m_iface;
+        m_iface = nullptr;
+
+        return UdpRecvResult::AcceptStop;
+    }
+
+private:
+    TestIface *m_iface;
+    UdpListener<TestUdpArg> m_listener;
+};
+
+static void test_reassembled_iface_removed ()
+{
+    SimPlatformImpl sim;
+    TestIpStack stack{Platform(&sim)};
+    TestIface *iface = new TestIface(&stack, LocalAddr, 24);
+
+    IfaceRemovingListener listener(iface);
+    listener.listen(stack);
+
+    // The interface is removed while the reassembled datagram is delivered, then
+    // the reassembly is released through the stack.
+    char frag1[64], frag2[64];
+    size_t len1, len2;
+    make_udp_frags(frag1, &len1, frag2, &len2);
+    iface->recv(frag1, len1);
+    AIPSTACK_ASSERT_FORCE(!listener.ifaceRemoved())
+    iface->recv(frag2, len2);
+    AIPSTACK_ASSERT_FORCE(listener.ifaceRemoved())
+    AIPSTACK_ASSERT_FORCE(stack.stats().ip_reasm_oks.get() == 1)
+}
+
+int main ()
+{
+    test_listener_order();
+    test_accept_stop();
+    test_reset_in_callback();
+    test_batch_buffer_full();
+    test_segmented();
+    test_reassembled_port_unreach();
+    test_reassembled_iface_removed();
+
+    return 0;
+}